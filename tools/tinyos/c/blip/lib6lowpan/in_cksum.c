@@ -20,8 +20,8 @@
  *
  */
 /* in_cksum.c
- * 4.4-Lite-2 Internet checksum routine, modified to take a vector of
- * pointers/lengths giving the pieces to be checksummed.
+ * Internet checksum routine, taking a vector of pointers/lengths giving
+ * the pieces to be checksummed; the pieces may have any length.
  *
  * $Id: in_cksum.c,v 1.3 2009/08/20 17:03:05 sdhsdh Exp $
  */
@@ -58,139 +58,193 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "in_cksum.h"
 #include "lib6lowpan.h"
 #include "nwbyte.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE {l_util.l = sum; sum = l_util.s[0] + l_util.s[1]; ADDCARRY(sum);}
+/*
+ * The sum is taken over 16-bit words in host byte order and only turned
+ * into network byte order at the end (RFC 1071, section 2(B)): this lets
+ * us read whole machine words, unaligned, with memcpy.  A buffer starting
+ * at an odd offset of the message pairs its bytes the other way round;
+ * its partial sum is byte-swapped before it is added (section 2(C)).
+ *
+ * 64-bit hosts add 32-bit words into a 64-bit accumulator, x86 adds 16
+ * or 32 bytes at a time into vector lanes first.  Other targets, motes
+ * in particular, add 16-bit words into 32 bits and fold often enough.
+ */
+#if defined(__SIZEOF_POINTER__) && __SIZEOF_POINTER__ >= 8
+typedef uint64_t cksum_acc_t;
+#else
+typedef uint32_t cksum_acc_t;
+#endif
 
-int
-in_cksum(const struct ip_iovec *vec) {
-#if 1
-  /* This will break horribly if the length of any but the last ip_iovec is odd! */
+static uint16_t cksum_fold(cksum_acc_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
 
-  uint32_t sum = 0;
-  uint16_t cur = 0;
-  int i;
-  uint8_t *w;
- 
-  for (; vec != NULL;  vec = vec->iov_next) {
-    if (vec->iov_len == 0)
-      continue;
-   
-    w = vec->iov_base;
-    for (i = 0; i < vec->iov_len; i++) {
-      if (i % 2 == 0) {
-        cur |= ((uint16_t)w[i]) << 8;
-        if (i + 1 == vec->iov_len) {
-          goto finish;
-        }
-      } else {
-        cur |= w[i];
-      finish:
-        sum += cur;
-        cur = 0;
-      }
+#if defined(__AVX2__) || defined(__SSE2__)
+/* vector part of cksum_add, leaves the tail of less than a vector */
+static cksum_acc_t cksum_add_simd(cksum_acc_t sum, const uint8_t **buf, size_t *len) {
+  uint32_t lanes[8];
+  int i, n = 0;
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  /* every round adds at most 2 * 0xffff to a 32-bit lane */
+  for (; *len >= 32; *buf += 32, *len -= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)*buf);
+    acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+    acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+    if (++n == 0x7fff) {
+      _mm256_storeu_si256((__m256i *)lanes, acc);
+      for (i = 0; i < 8; i++)
+        sum += lanes[i];
+      acc = zero;
+      n = 0;
     }
   }
-  while (sum > 0xffff) {
-    sum = (sum & 0xffff) + (sum >> 16);
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  for (i = 0; i < 8; i++)
+    sum += lanes[i];
+#else
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for (; *len >= 16; *buf += 16, *len -= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)*buf);
+    acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+    acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+    if (++n == 0x7fff) {
+      _mm_storeu_si128((__m128i *)lanes, acc);
+      for (i = 0; i < 4; i++)
+        sum += lanes[i];
+      acc = zero;
+      n = 0;
+    }
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  for (i = 0; i < 4; i++)
+    sum += lanes[i];
+#endif
+  return sum;
+}
+#endif
+
+/* host byte order sum of buf as if it started at an even offset */
+static uint16_t cksum_add(const uint8_t *buf, size_t len) {
+  cksum_acc_t sum = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+  if (len >= 64)
+    sum = cksum_add_simd(sum, &buf, &len);
+#endif
+
+#if defined(__SIZEOF_POINTER__) && __SIZEOF_POINTER__ >= 8
+  while (len >= 16) {
+    uint32_t w[4];
+    memcpy(w, buf, sizeof(w));
+    sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+    buf += 16;
+    len -= 16;
+  }
+  while (len >= 4) {
+    uint32_t w;
+    memcpy(&w, buf, sizeof(w));
+    sum += w;
+    buf += 4;
+    len -= 4;
   }
-  return ~((uint16_t)sum);
 #else
-	register const uint16_t *w;
-	register uint32_t sum = 0;
-	register uint32_t mlen = 0;
-	int byte_swapped = 0;
-
-	union {
-		uint8_t	c[2];
-		uint16_t	s;
-	} s_util;
-	union {
-		uint16_t s[2];
-		uint32_t	l;
-	} l_util;
-
-	for (; vec != NULL; vec = vec->iov_next) {
-
-		if (vec->iov_len == 0)
-			continue;
-		w = (const uint16_t *)vec->iov_base;
-		if (mlen == -1) {
-			/*
-			 * The first byte of this chunk is the continuation
-			 * of a word spanning between this chunk and the
-			 * last chunk.
-			 *
-			 * s_util.c[0] is already saved when scanning previous
-			 * chunk.
-			 */
-			s_util.c[1] = *(const uint8_t *)w;
-			sum += s_util.s;
-			w = (const uint16_t *)((const uint8_t *)w + 1);
-			mlen = vec->iov_len - 1;
-		} else
-			mlen = vec->iov_len;
-		/*
-		 * Force to even boundary.
-		 */
-		if ((1 & (int) w) && (mlen > 0)) {
-			REDUCE;
-			sum <<= 8;
-			s_util.c[0] = *(const uint8_t *)w;
-			w = (const uint16_t *)((const uint8_t *)w + 1);
-			mlen--;
-			byte_swapped = 1;
-		}
-		/*
-		 * Unroll the loop to make overhead from
-		 * branches &c small.
-		 */
-		while ((mlen -= 32) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-			sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-			w += 16;
-		}
-		mlen += 32;
-		while ((mlen -= 8) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			w += 4;
-		}
-		mlen += 8;
-		if (mlen == 0 && byte_swapped == 0)
-			continue;
-		REDUCE;
-		while ((mlen -= 2) >= 0) {
-			sum += *w++;
-		}
-		if (byte_swapped) {
-			REDUCE;
-			sum <<= 8;
-			byte_swapped = 0;
-			if (mlen == -1) {
-				s_util.c[1] = *(const uint8_t *)w;
-				sum += s_util.s;
-				mlen = 0;
-			} else
-				mlen = -1;
-		} else if (mlen == -1)
-			s_util.c[0] = *(const uint8_t *)w;
-	}
-	if (mlen == -1) {
-		/* The last mbuf has odd # of bytes. Follow the
-		   standard (the odd byte may be shifted left by 8 bits
-		   or not as determined by endian-ness of the machine) */
-		s_util.c[1] = 0;
-		sum += s_util.s;
-	}
-	REDUCE;
-	return (~sum & 0xffff);
+  while (len >= 2) {
+    uint16_t w;
+    size_t n = len / 2;
+    /* fold before 0x10000 words can overflow the accumulator */
+    if (n > 0x7fff)
+      n = 0x7fff;
+    len -= n * 2;
+    for (; n > 0; n--) {
+      memcpy(&w, buf, sizeof(w));
+      sum += w;
+      buf += 2;
+    }
+    sum = cksum_fold(sum);
+  }
 #endif
+  while (len >= 2) {
+    uint16_t w;
+    memcpy(&w, buf, sizeof(w));
+    sum += w;
+    buf += 2;
+    len -= 2;
+  }
+  if (len) {
+    /* the odd byte is the first of a word padded with zero */
+    uint16_t w = 0;
+    memcpy(&w, buf, 1);
+    sum += w;
+  }
+  return cksum_fold(sum);
+}
+
+/* sum of the buffers in host byte order, not complemented */
+static uint16_t cksum_vec(const struct ip_iovec *vec) {
+  uint32_t sum = 0;
+  int odd = 0;
+
+  for (; vec != NULL; vec = vec->iov_next) {
+    uint16_t part;
+    if (vec->iov_len == 0)
+      continue;
+    part = cksum_add(vec->iov_base, vec->iov_len);
+    if (odd)
+      part = (part << 8) | (part >> 8);
+    sum += part;
+    odd ^= vec->iov_len & 1;
+  }
+  return cksum_fold(sum);
+}
+
+/* host byte order word to the value of the same bytes in network order */
+static uint16_t cksum_to_network(uint16_t sum) {
+  uint8_t b[2];
+  memcpy(b, &sum, sizeof(b));
+  return ((uint16_t)b[0] << 8) | b[1];
+}
+
+int
+in_cksum(const struct ip_iovec *vec) {
+  return (uint16_t)~cksum_to_network(cksum_vec(vec));
+}
+
+uint16_t in_cksum_update(uint16_t cksum, uint16_t old_word, uint16_t new_word) {
+  /* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m') */
+  uint32_t sum = (uint16_t)~cksum;
+  sum += (uint16_t)~old_word;
+  sum += new_word;
+  return ~cksum_fold(sum);
+}
+
+uint16_t in_cksum_update_buf(uint16_t cksum, const void *old_data,
+                             const void *new_data, size_t len) {
+  const uint8_t *o = old_data, *n = new_data;
+  size_t i;
+  for (i = 0; i + 1 < len; i += 2) {
+    cksum = in_cksum_update(cksum,
+                            ((uint16_t)o[i] << 8) | o[i + 1],
+                            ((uint16_t)n[i] << 8) | n[i + 1]);
+  }
+  if (i < len)
+    cksum = in_cksum_update(cksum, (uint16_t)o[i] << 8, (uint16_t)n[i] << 8);
+  return cksum;
 }
 
 /* SDH : Added to allow for friendly message checksumming */
@@ -32,7 +32,20 @@
 #include "iovec.h"
 #include "ip.h"
 
+/* the complemented one's complement sum of the buffers of vec, as a
+   host byte order value; buffers may have any length and alignment */
 int in_cksum(const struct ip_iovec *vec);
+
+/* RFC 1624 incremental update of cksum (host byte order, as returned by
+   in_cksum) when the 16-bit word old_word of the message becomes
+   new_word (both the host byte order values of network order words) */
+uint16_t in_cksum_update(uint16_t cksum, uint16_t old_word, uint16_t new_word);
+
+/* the same for the len bytes at an even offset of the message, e.g. an
+   address rewritten by a NAT-like header rewrite */
+uint16_t in_cksum_update_buf(uint16_t cksum, const void *old_data,
+                             const void *new_data, size_t len);
+
 uint16_t msg_cksum(const struct ip6_hdr *iph, 
                    struct ip_iovec *data,
                    uint8_t nxt_hdr);
@@ -22,71 +22,312 @@
 #ifndef NO_IP_MALLOC
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "ip_malloc.h"
 
-uint8_t heap[IP_MALLOC_HEAP_SIZE];
+#if IP_MALLOC_HEAP_SIZE > 0x8000
+#error "IP_MALLOC_HEAP_SIZE: blocks are addressed by 16 bit offsets"
+#elif IP_MALLOC_HEAP_SIZE < 64
+#error "IP_MALLOC_HEAP_SIZE: too small"
+#endif
+
+#if IP_MALLOC_ALIGN == 4
+#define ALIGN_SHIFT 2
+#elif IP_MALLOC_ALIGN == 8
+#define ALIGN_SHIFT 3
+#elif IP_MALLOC_ALIGN == 16
+#define ALIGN_SHIFT 4
+#else
+#error "IP_MALLOC_ALIGN must be 4, 8 or 16"
+#endif
+
+/*
+ * A block starts with its boundary tag: its size, tag included, and in
+ * the low bits the alignment leaves free whether it and the block in
+ * front of it are free. A free block has the offsets of its list
+ * neighbours behind the tag and a copy of its size in its last two
+ * bytes, which is where the next block looks when it is merged.
+ *
+ * Blocks are addressed by their offset into the heap; the first one
+ * starts at TAG_LEN before an aligned address so that the payloads are
+ * aligned, offset 0 is never a block and ends the lists. A zero sized
+ * block which is never free marks the end of the heap.
+ */
+#define TAG_LEN         2
+#define BLOCK_FREE      0x1
+#define BLOCK_PREV_FREE 0x2
+#define BLOCK_FLAGS     (IP_MALLOC_ALIGN - 1)
+#define BLOCK_MIN       (IP_MALLOC_ALIGN > 8 ? IP_MALLOC_ALIGN : 8)
+
+#define FIRST_BLOCK     (IP_MALLOC_ALIGN - TAG_LEN)
+#define HEAP_END        (FIRST_BLOCK + \
+                         ((IP_MALLOC_HEAP_SIZE - IP_MALLOC_ALIGN) & ~BLOCK_FLAGS))
+
+#define TAG(b)          (*(uint16_t *)(heap + (b)))
+#define SIZE(b)         (TAG(b) & ~BLOCK_FLAGS)
+#define NEXT_LINK(b)    (*(uint16_t *)(heap + (b) + 2))
+#define PREV_LINK(b)    (*(uint16_t *)(heap + (b) + 4))
+#define FOOTER(b)       (*(uint16_t *)(heap + (b) + SIZE(b) - 2))
+
+/*
+ * Size classes: the first level is the power of two a block size falls
+ * in, the second splits that into SL_COUNT equal parts. Blocks smaller
+ * than SMALL_SIZE all go to first level 0, one second level list per
+ * aligned size.
+ */
+#define SL_BITS         2
+#define SL_COUNT        (1 << SL_BITS)
+#define FL_SHIFT        (SL_BITS + ALIGN_SHIFT)
+#define SMALL_SIZE      (1 << FL_SHIFT)
+
+#if IP_MALLOC_HEAP_SIZE <= 0x80
+#define HEAP_BITS 8
+#elif IP_MALLOC_HEAP_SIZE <= 0x100
+#define HEAP_BITS 9
+#elif IP_MALLOC_HEAP_SIZE <= 0x200
+#define HEAP_BITS 10
+#elif IP_MALLOC_HEAP_SIZE <= 0x400
+#define HEAP_BITS 11
+#elif IP_MALLOC_HEAP_SIZE <= 0x800
+#define HEAP_BITS 12
+#elif IP_MALLOC_HEAP_SIZE <= 0x1000
+#define HEAP_BITS 13
+#elif IP_MALLOC_HEAP_SIZE <= 0x2000
+#define HEAP_BITS 14
+#elif IP_MALLOC_HEAP_SIZE <= 0x4000
+#define HEAP_BITS 15
+#else
+#define HEAP_BITS 16
+#endif
+#define FL_COUNT        (HEAP_BITS - FL_SHIFT)
+
+static uint8_t heap[IP_MALLOC_HEAP_SIZE] __attribute__((aligned(IP_MALLOC_ALIGN)));
+
+static uint16_t fl_bitmap;
+static uint8_t sl_bitmap[FL_COUNT];
+static uint16_t free_lists[FL_COUNT][SL_COUNT];
+
+static uint16_t free_bytes, high_water, failures;
+
+/* index of the highest and lowest bit set, x may not be 0 */
+static uint8_t ip_malloc_fls(uint16_t x) {
+#ifdef __GNUC__
+  return (sizeof(unsigned int) * 8 - 1) - __builtin_clz(x);
+#else
+  uint8_t bit = 0;
+  while (x >>= 1)
+    bit++;
+  return bit;
+#endif
+}
+
+static uint8_t ip_malloc_ffs(uint16_t x) {
+#ifdef __GNUC__
+  return __builtin_ctz(x);
+#else
+  uint8_t bit = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+static void mapping(uint16_t size, uint8_t *fl, uint8_t *sl) {
+  if (size < SMALL_SIZE) {
+    *fl = 0;
+    *sl = size >> ALIGN_SHIFT;
+  } else {
+    uint8_t bit = ip_malloc_fls(size);
+    *fl = bit - FL_SHIFT + 1;
+    *sl = (size >> (bit - SL_BITS)) & (SL_COUNT - 1);
+  }
+}
+
+static void insert_block(uint16_t b) {
+  uint8_t fl, sl;
+  uint16_t head;
+
+  mapping(SIZE(b), &fl, &sl);
+  head = free_lists[fl][sl];
+  NEXT_LINK(b) = head;
+  PREV_LINK(b) = 0;
+  if (head)
+    PREV_LINK(head) = b;
+  free_lists[fl][sl] = b;
+  fl_bitmap |= 1 << fl;
+  sl_bitmap[fl] |= 1 << sl;
+}
+
+static void remove_block(uint16_t b) {
+  uint8_t fl, sl;
+  uint16_t next = NEXT_LINK(b), prev = PREV_LINK(b);
+
+  if (next)
+    PREV_LINK(next) = prev;
+  if (prev) {
+    NEXT_LINK(prev) = next;
+    return;
+  }
+  mapping(SIZE(b), &fl, &sl);
+  free_lists[fl][sl] = next;
+  if (!next) {
+    sl_bitmap[fl] &= ~(1 << sl);
+    if (!sl_bitmap[fl])
+      fl_bitmap &= ~(1 << fl);
+  }
+}
+
+/* a free block of at least size bytes, 0 if there is none */
+static uint16_t find_block(uint16_t size) {
+  uint8_t fl, sl, exact_fl, exact_sl;
+  uint16_t map, b;
+
+  /* all blocks of the class above the one size is in are big enough */
+  mapping(size, &exact_fl, &exact_sl);
+  if (size >= SMALL_SIZE)
+    mapping(size + (1 << (ip_malloc_fls(size) - SL_BITS)) - 1, &fl, &sl);
+  else
+    mapping(size, &fl, &sl);
+
+  if (fl < FL_COUNT) {
+    map = sl_bitmap[fl] & (0xff << sl);
+    if (!map) {
+      map = fl_bitmap & (0xffff << (fl + 1));
+      if (map) {
+        fl = ip_malloc_ffs(map);
+        map = sl_bitmap[fl];
+      }
+    }
+    if (map)
+      return free_lists[fl][ip_malloc_ffs(map)];
+  }
+
+  /* rather than fail look through the class of size itself; only on a
+     nearly full heap */
+  for (b = free_lists[exact_fl][exact_sl]; b; b = NEXT_LINK(b)) {
+    if (SIZE(b) >= size)
+      return b;
+  }
+  return 0;
+}
 
 void ip_malloc_init() {
-  bndrt_t *b = (bndrt_t *)heap;
-  *b = IP_MALLOC_HEAP_SIZE  & IP_MALLOC_LEN;
+  uint16_t size = HEAP_END - FIRST_BLOCK;
+
+  fl_bitmap = 0;
+  memset(sl_bitmap, 0, sizeof(sl_bitmap));
+  memset(free_lists, 0, sizeof(free_lists));
+
+  TAG(FIRST_BLOCK) = size | BLOCK_FREE;
+  FOOTER(FIRST_BLOCK) = size;
+  TAG(HEAP_END) = BLOCK_PREV_FREE;
+  insert_block(FIRST_BLOCK);
+
+  free_bytes = size;
+  high_water = 0;
+  failures = 0;
 }
 
 void *ip_malloc(uint16_t sz) {
-  bndrt_t *cur = (bndrt_t *)heap;
+  uint16_t size, b, rest;
+  void *ptr = NULL;
 
-  sz += sizeof(bndrt_t) * 2;
-  sz += (sz % IP_MALLOC_ALIGN);
+  if (sz > HEAP_END - FIRST_BLOCK - TAG_LEN)
+    goto done;
+  size = (sz + TAG_LEN + BLOCK_FLAGS) & ~BLOCK_FLAGS;
+  if (size < BLOCK_MIN)
+    size = BLOCK_MIN;
 
-  while (((*cur & IP_MALLOC_LEN) < sz || (*cur & IP_MALLOC_INUSE) != 0)
-         && (uint8_t *)cur - heap < IP_MALLOC_HEAP_SIZE) {
-    cur = (bndrt_t *)(((uint8_t *)cur) + ((*cur) & IP_MALLOC_LEN));
-  }
+  b = find_block(size);
+  if (!b)
+    goto done;
+  remove_block(b);
 
-  if ((uint8_t *)cur < heap + IP_MALLOC_HEAP_SIZE) {
-    uint16_t oldsize = *cur & IP_MALLOC_LEN;
-    bndrt_t *next;
-    sz -= sizeof(bndrt_t);
-    next = ((bndrt_t *)(((uint8_t *)cur) + sz));
+  /* the block in front of a free one is never free */
+  rest = SIZE(b) - size;
+  if (rest >= BLOCK_MIN) {
+    TAG(b) = size;
+    TAG(b + size) = rest | BLOCK_FREE;
+    FOOTER(b + size) = rest;
+    insert_block(b + size);
+  } else {
+    size = SIZE(b);
+    TAG(b) = size;
+    TAG(b + size) &= ~BLOCK_PREV_FREE;
+  }
 
-    *cur = (sz & IP_MALLOC_LEN) | IP_MALLOC_INUSE;
-    *next = (oldsize - sz) & IP_MALLOC_LEN;
+  free_bytes -= size;
+  if (HEAP_END - FIRST_BLOCK - free_bytes > high_water)
+    high_water = HEAP_END - FIRST_BLOCK - free_bytes;
+  ptr = heap + b + TAG_LEN;
 
-    return cur + 1;
-  } else return NULL;
+ done:
+  if (!ptr)
+    failures++;
+#if defined(PC) && defined(IP_MALLOC_TRACE)
+  fprintf(stderr, "ip_malloc %u %p\n", sz, ptr);
+#endif
+  return ptr;
 }
 
 void ip_free(void *ptr) {
-  bndrt_t *prev = NULL, *cur, *next = NULL;
-  cur = (bndrt_t *)heap;
+  uint16_t b, size;
 
-  while (cur + 1 != ptr && (uint8_t *)cur - heap < IP_MALLOC_HEAP_SIZE) {
-    prev = cur;
-    cur = (bndrt_t *)(((uint8_t *)cur) + ((*cur) & IP_MALLOC_LEN));
-  }
-  if (cur + 1 == ptr) {
-    next = (bndrt_t *)((*cur & IP_MALLOC_LEN) + ((uint8_t *)cur));
+#if defined(PC) && defined(IP_MALLOC_TRACE)
+  fprintf(stderr, "ip_free %p\n", ptr);
+#endif
+  /* ignore what cannot have come from ip_malloc, and double frees */
+  if ((uint8_t *)ptr < heap + FIRST_BLOCK + TAG_LEN ||
+      (uint8_t *)ptr >= heap + HEAP_END)
+    return;
+  b = (uint8_t *)ptr - heap - TAG_LEN;
+  if ((b & BLOCK_FLAGS) != FIRST_BLOCK || (TAG(b) & BLOCK_FREE))
+    return;
 
-    *cur &= ~IP_MALLOC_INUSE;
-    if ((((uint8_t *)next) - heap) < IP_MALLOC_HEAP_SIZE &&
-        (*next & IP_MALLOC_INUSE) == 0) {
-      *cur = (*cur & IP_MALLOC_LEN) + (*next & IP_MALLOC_LEN);
-    }
-    if (prev != NULL && (*prev & IP_MALLOC_INUSE) == 0) {
-      *prev = (*prev & IP_MALLOC_LEN) + (*cur & IP_MALLOC_LEN);
-    }
+  size = SIZE(b);
+  free_bytes += size;
+
+  if (TAG(b) & BLOCK_PREV_FREE) {
+    b -= *(uint16_t *)(heap + b - 2);
+    remove_block(b);
+    size += SIZE(b);
+  }
+  if (TAG(b + size) & BLOCK_FREE) {
+    remove_block(b + size);
+    size += SIZE(b + size);
   }
+
+  TAG(b) = size | BLOCK_FREE;
+  FOOTER(b) = size;
+  TAG(b + size) |= BLOCK_PREV_FREE;
+  insert_block(b);
 }
 
 uint16_t ip_malloc_freespace() {
-  uint16_t ret = 0;
-  bndrt_t *cur = (bndrt_t *)heap;
+  return free_bytes;
+}
 
-  while ((uint8_t *)cur - heap < IP_MALLOC_HEAP_SIZE) {
-    if ((*cur & IP_MALLOC_INUSE) == 0)
-      ret += *cur & IP_MALLOC_LEN;
-    cur = (bndrt_t *)(((uint8_t *)cur) + ((*cur) & IP_MALLOC_LEN));
+void ip_malloc_stats(struct ip_malloc_stats *stats) {
+  uint16_t b, largest = 0;
+  uint8_t fl, sl;
+
+  stats->heap_size = HEAP_END - FIRST_BLOCK;
+  stats->free = free_bytes;
+  stats->high_water = high_water;
+  stats->failures = failures;
+  stats->free_blocks = 0;
+  for (fl = 0; fl < FL_COUNT; fl++) {
+    for (sl = 0; sl < SL_COUNT; sl++) {
+      for (b = free_lists[fl][sl]; b; b = NEXT_LINK(b)) {
+        stats->free_blocks++;
+        if (SIZE(b) > largest)
+          largest = SIZE(b);
+      }
+    }
   }
-  return ret;
+  stats->largest_free = largest ? largest - TAG_LEN : 0;
 }
 
 #ifdef PC
@@ -103,17 +344,20 @@ void dump_heap() {
 }
 
 void ip_print_heap() {
-  bndrt_t *cur = (bndrt_t *)heap;
-  while (((uint8_t *)cur)  - heap < IP_MALLOC_HEAP_SIZE) {
+  uint16_t b = FIRST_BLOCK;
+  int prev_free = 0;
+  while (b < HEAP_END) {
     printf ("heap region start: %p length: %i used: %i\n",
-            cur, (*cur & IP_MALLOC_LEN), (*cur & IP_MALLOC_INUSE) >> 15);
-    if ((*cur & IP_MALLOC_LEN) == 0) {
-      printf("ERROR: zero length cell detected!\n");
+            heap + b, SIZE(b), !(TAG(b) & BLOCK_FREE));
+    if (SIZE(b) == 0 || b + SIZE(b) > HEAP_END ||
+        !(TAG(b) & BLOCK_PREV_FREE) != !prev_free ||
+        (prev_free && (TAG(b) & BLOCK_FREE))) {
+      printf("ERROR: corrupt boundary tag detected!\n");
       dump_heap();
       exit(1);
     }
-    cur = (bndrt_t *)(((uint8_t *)cur) + ((*cur) & IP_MALLOC_LEN));
-
+    prev_free = TAG(b) & BLOCK_FREE;
+    b += SIZE(b);
   }
 }
 #endif
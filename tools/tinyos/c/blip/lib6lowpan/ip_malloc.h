@@ -25,21 +25,43 @@
 
 #include <stdint.h>
 
-// align on this number of byte boundarie#s
-#define IP_MALLOC_ALIGN   2
-#define IP_MALLOC_LEN     0x0fff
-#define IP_MALLOC_FLAGS   0x7000
-#define IP_MALLOC_INUSE   0x8000
+/*
+ * Allocator for a fixed heap of IP_MALLOC_HEAP_SIZE bytes, a two level
+ * segregated fit (TLSF): free blocks are kept in lists by size class
+ * and found through two bitmaps, so ip_malloc and ip_free take the
+ * same time no matter what the heap looks like. Blocks carry a two
+ * byte boundary tag, free blocks are merged with their neighbours.
+ *
+ * Both constants may be overridden on the command line; the heap may
+ * be at most 32 KB since blocks are addressed by 16 bit offsets.
+ */
+
+#ifndef IP_MALLOC_HEAP_SIZE
 #define IP_MALLOC_HEAP_SIZE 1500
+#endif
+
+/* of the pointers handed out, a power of two of at least 4 */
+#ifndef IP_MALLOC_ALIGN
+#define IP_MALLOC_ALIGN   4
+#endif
 
-extern uint8_t heap[IP_MALLOC_HEAP_SIZE];
-typedef uint16_t bndrt_t;
+struct ip_malloc_stats {
+  uint16_t heap_size;     /* bytes in blocks, boundary tags included */
+  uint16_t free;          /* of those in free blocks */
+  uint16_t largest_free;  /* biggest request which would succeed now */
+  uint16_t free_blocks;
+  uint16_t high_water;    /* most bytes ever in use */
+  uint16_t failures;      /* ip_malloc calls which returned NULL */
+};
 
 void ip_malloc_init();
 void *ip_malloc(uint16_t sz);
 void ip_free(void *ptr);
 uint16_t ip_malloc_freespace();
 
+/* largest_free over free is a measure of fragmentation */
+void ip_malloc_stats(struct ip_malloc_stats *stats);
+
 #ifdef PC
 void ip_print_heap();
 #endif
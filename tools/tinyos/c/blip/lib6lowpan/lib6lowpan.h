@@ -57,6 +57,7 @@ struct lowpan_reconstruct {
   uint16_t r_bytes_rcvd;     /* how many bytes from the packet we have
                               received so far */
   uint8_t  r_timeout;
+  uint8_t  r_fix_cksum;      /* recompute the UDP checksum once complete */
   uint16_t *r_app_len;
   uint8_t  *r_transport_header;
   struct ip6_metadata       r_meta;
@@ -178,10 +179,28 @@ int lowpan_frag_get(uint8_t *frag, size_t len,
                     struct ieee154_frame_addr *frame,
                     struct lowpan_ctx *ctx);
 
+/*
+ *  reassembly of incoming packets.
+ *
+ *  lowpan_recon_start sets up recon with the first frame received of
+ *  a packet, lowpan_recon_add adds the frames which follow.  The
+ *  fragments may come in any order; the buffer is sized to the
+ *  datagram with a bitmap of the 8-octet units received so far at its
+ *  end (past r_size), and the headers are decompressed when the FRAG1
+ *  fragment comes in.  A frame without fragment headers is a whole
+ *  packet by itself and is only passed to lowpan_recon_start.
+ *
+ *  Both return 0 when the fragment was added, 1 if it was a duplicate
+ *  of one already received, and < 0 if it was not valid; in that case
+ *  the reconstruction should be given up.  The packet is complete once
+ *  r_bytes_rcvd == r_size; the IPv6 payload length, elided transport
+ *  lengths and checksum have been filled in by then.
+ */
 int lowpan_recon_start(struct ieee154_frame_addr *frame_addr,
                        struct lowpan_reconstruct *recon,
                        uint8_t *pkt, size_t len);
-int lowpan_recon_add(struct lowpan_reconstruct *recon,
+int lowpan_recon_add(struct ieee154_frame_addr *frame_addr,
+                     struct lowpan_reconstruct *recon,
                      uint8_t *pkt, size_t len);
 
 enum {
@@ -9,81 +9,75 @@
 #include "nwbyte.h"
 #include "ip_malloc.h"
 #include "iovec.h"
+#include "in_cksum.h"
 #include "ieee154_header.h"
 
-int lowpan_recon_start(struct ieee154_frame_addr *frame_addr,
-                       struct lowpan_reconstruct *recon,
-                       uint8_t *pkt,
-                       size_t len) {
-  uint8_t *unpack_point;
-  struct packed_lowmsg msg;
-  uint8_t recalculate_checksum = 0;
-  int ret;
-  uint16_t unpacked_len = 0;
-
-  msg.data = pkt;
-  msg.len  = len;
-  msg.headers = getHeaderBitmap(&msg);
-  if (msg.headers == LOWMSG_NALP) return -1;
+/*
+ * Fragments are placed in the reassembly buffer at their offset as they
+ * come in.  Which 8-octet units of the datagram are there already is
+ * kept in a bitmap past the end of the datagram in the same buffer, so
+ * that duplicates and overlapping fragments can be told apart from new
+ * ones.
+ */
+#define RECON_UNITS(size)   (((size) + 7) / 8)
+#define RECON_MAP_LEN(size) ((RECON_UNITS(size) + 7) / 8)
+
+static uint8_t *recon_map(struct lowpan_reconstruct *recon) {
+  return recon->r_buf + recon->r_size;
+}
 
-  /* remove the 6lowpan frag headers from the payload */
-  unpack_point = getLowpanPayload(&msg);
-  len -= (unpack_point - pkt);
+/* how many of the units first .. last - 1 have been received */
+static uint16_t recon_count(uint8_t *map, uint16_t first, uint16_t last) {
+  uint16_t n = 0;
+  for (; first < last; first++)
+    if (map[first / 8] & (1 << (first % 8)))
+      n++;
+  return n;
+}
 
-  if (len <= 0) {
-    return -4;
-  }
+static void recon_mark(uint8_t *map, uint16_t first, uint16_t last) {
+  for (; first < last; first++)
+    map[first / 8] |= 1 << (first % 8);
+}
 
-  /* set up the reconstruction, or just fill in the packet length */
-  if (hasFrag1Header(&msg)) {
-    getFragDgramTag(&msg, &recon->r_tag);
-    getFragDgramSize(&msg, &recon->r_size);
-  } else {
-    recon->r_size = LIB6LOWPAN_MAX_LEN + LOWPAN_LINK_MTU;
-  }
-  recon->r_buf = ip_malloc(recon->r_size);
-  if (!recon->r_buf) return -2;
-  memset(recon->r_buf, 0, recon->r_size);
-  recon->r_app_len = NULL;
+/* decompresses the first fragment, or an unfragmented packet, into the
+   start of the buffer; at most limit bytes are written */
+static int recon_unpack(struct ieee154_frame_addr *frame_addr,
+                        struct lowpan_reconstruct *recon,
+                        uint8_t *buf, size_t len, uint16_t limit,
+                        uint16_t *unpacked_len) {
+  uint16_t r_size = recon->r_size;
+  int ret;
 
-  if (len < 1) {
-    ip_free(recon->r_buf);
-    return -5;
-  }
-  if (*unpack_point == LOWPAN_IPV6_PATTERN) {
+  if (*buf == LOWPAN_IPV6_PATTERN) {
     /* uncompressed header... no need to un-hc */
-    unpack_point++; len--;
+    buf++; len--;
     if (len < sizeof(struct ip6_hdr)) {
       // Uncompressed packet must be at least the size of the ipv6 header
-      ip_free(recon->r_buf);
       return -7;
     }
-    if (len > recon->r_size) {
-      ip_free(recon->r_buf);
+    if (len > limit) {
       return -6;
     }
-    memcpy(recon->r_buf, unpack_point, len);
-    unpacked_len = len;
-  } else {
-    /* unpack the first fragment */
-    ret = lowpan_unpack_headers(recon,
-                                frame_addr,
-                                &unpack_point,
-                                &len,
-                                &recalculate_checksum,
-                                &unpacked_len);
-    if (ret < 0) {
-      ip_free(recon->r_buf);
-      return -3;
-    }
+    memcpy(recon->r_buf, buf, len);
+    *unpacked_len = len;
+    return 0;
   }
 
-  if (!hasFrag1Header(&msg)) {
-    recon->r_size = unpacked_len;
-  }
-  recon->r_bytes_rcvd = unpacked_len;
-  ((struct ip6_hdr *)(recon->r_buf))->ip6_plen =
-    htons(recon->r_size - sizeof(struct ip6_hdr));
+  /* lowpan_unpack_headers fills the buffer up to r_size */
+  recon->r_size = limit;
+  ret = lowpan_unpack_headers(recon, frame_addr, &buf, &len,
+                              &recon->r_fix_cksum, unpacked_len);
+  recon->r_size = r_size;
+  return (ret < 0) ? -3 : 0;
+}
+
+/* fills in the fields left out by the compression once all of the
+   packet is there */
+static void recon_finish(struct lowpan_reconstruct *recon) {
+  struct ip6_hdr *hdr = (struct ip6_hdr *) recon->r_buf;
+
+  hdr->ip6_plen = htons(recon->r_size - sizeof(struct ip6_hdr));
   /* fill in any elided app data length fields */
   if (recon->r_app_len) {
     *recon->r_app_len =
@@ -94,59 +88,166 @@ int lowpan_recon_start(struct ieee154_frame_addr *frame_addr,
    * addresses. If so, we probably need to recalculate checksums because when
    * the checksum was originally calculated the full source or destination
    * address may not have been known. In that case, the checksum will fail
-   * at the packet's destination.
+   * at the packet's destination.  This has to wait for the last fragment,
+   * the checksum covers all of the payload.
    */
-  if (recalculate_checksum) {
-    struct ip6_hdr *hdr = (struct ip6_hdr *) recon->r_buf;
+  /* Right now only handle the only header being UDP */
+  if (recon->r_fix_cksum && recon->r_app_len && hdr->ip6_nxt == IANA_UDP) {
+    struct ip_iovec v[2];
+    struct udp_hdr *udph;
+
+    udph = (struct udp_hdr *) recon->r_transport_header;
+    udph->chksum = 0;
+
+    v[0].iov_base = (uint8_t *) udph;
+    v[0].iov_len  = sizeof(struct udp_hdr);
+    v[0].iov_next = v+1;
+    v[1].iov_base = (uint8_t*) (udph + 1);
+    v[1].iov_len  = ntohs(*recon->r_app_len) - sizeof(struct udp_hdr);
+    v[1].iov_next = NULL;
+
+    udph->chksum = htons(msg_cksum(hdr, v, IANA_UDP));
+  }
+}
 
-    /* Right now only handle the only header being UDP */
-    if (hdr->ip6_nxt == IANA_UDP) {
-      struct ip_iovec v[2];
-      struct udp_hdr *udph;
+int lowpan_recon_start(struct ieee154_frame_addr *frame_addr,
+                       struct lowpan_reconstruct *recon,
+                       uint8_t *pkt,
+                       size_t len) {
+  uint8_t *unpack_point;
+  struct packed_lowmsg msg;
+  uint16_t unpacked_len = 0;
+  int ret;
 
-      udph = (struct udp_hdr *) recon->r_transport_header;
-      udph->chksum = 0;
+  msg.data = pkt;
+  msg.len  = len;
+  msg.headers = getHeaderBitmap(&msg);
+  if (msg.headers == LOWMSG_NALP) return -1;
+
+  /* remove the 6lowpan frag headers from the payload */
+  unpack_point = getLowpanPayload(&msg);
+  if ((size_t)(unpack_point - pkt) >= len) {
+    return -4;
+  }
 
-      v[0].iov_base = (uint8_t *) udph;
-      v[0].iov_len  = sizeof(struct udp_hdr);
-      v[0].iov_next = v+1;
-      v[1].iov_base = (uint8_t*) (udph + 1);
-      v[1].iov_len  = ntohs(*recon->r_app_len) - sizeof(struct udp_hdr);
-      v[1].iov_next = NULL;
+  recon->r_app_len = NULL;
+  recon->r_transport_header = NULL;
+  recon->r_fix_cksum = 0;
+  recon->r_bytes_rcvd = 0;
 
-      udph->chksum = htons(msg_cksum(hdr, v, IANA_UDP));
+  if (hasFrag1Header(&msg) || hasFragNHeader(&msg)) {
+    /* set up the reconstruction; the fragment itself is added below */
+    getFragDgramTag(&msg, &recon->r_tag);
+    getFragDgramSize(&msg, &recon->r_size);
+    if (recon->r_size < sizeof(struct ip6_hdr)) return -5;
+    recon->r_buf = ip_malloc(recon->r_size + RECON_MAP_LEN(recon->r_size));
+    if (!recon->r_buf) return -2;
+    memset(recon_map(recon), 0, RECON_MAP_LEN(recon->r_size));
+
+    ret = lowpan_recon_add(frame_addr, recon, pkt, len);
+    if (ret != 0) {
+      ip_free(recon->r_buf);
+      recon->r_buf = NULL;
+      return (ret < 0) ? ret : -8;
     }
+    return 0;
+  }
 
+  /* no fragment header, just fill in the packet length */
+  len -= (unpack_point - pkt);
+  recon->r_size = LIB6LOWPAN_MAX_LEN + LOWPAN_LINK_MTU;
+  recon->r_buf = ip_malloc(recon->r_size);
+  if (!recon->r_buf) return -2;
+
+  ret = recon_unpack(frame_addr, recon, unpack_point, len,
+                     recon->r_size, &unpacked_len);
+  if (ret < 0) {
+    ip_free(recon->r_buf);
+    recon->r_buf = NULL;
+    return ret;
   }
+  recon->r_size = unpacked_len;
+  recon->r_bytes_rcvd = unpacked_len;
+  recon_finish(recon);
 
   /* done, updated all the fields */
   /* reconstruction is complete if r_bytes_rcvd == r_size */
   return 0;
 }
 
-int lowpan_recon_add(struct lowpan_reconstruct *recon,
+int lowpan_recon_add(struct ieee154_frame_addr *frame_addr,
+                     struct lowpan_reconstruct *recon,
                      uint8_t *pkt, size_t len) {
   struct packed_lowmsg msg;
-  uint8_t *buf;
+  uint8_t *buf, *map = recon_map(recon);
+  uint16_t size, offset, first, last, received;
+  uint8_t units;
+  int ret;
 
   msg.data = pkt;
   msg.len  = len;
   msg.headers = getHeaderBitmap(&msg);
   if (msg.headers == LOWMSG_NALP) return -1;
 
-  if (!hasFragNHeader(&msg)) {
+  if (!hasFrag1Header(&msg) && !hasFragNHeader(&msg)) {
     return -2;
   }
 
   buf = getLowpanPayload(&msg);
+  if ((size_t)(buf - pkt) >= len) return -4;
   len -= (buf - pkt);
 
-  if (recon->r_size < recon->r_bytes_rcvd + len) return -3;
+  /* all fragments carry the size of the datagram, which has to agree */
+  getFragDgramSize(&msg, &size);
+  if (size != recon->r_size) return -5;
+
+  if (hasFrag1Header(&msg)) {
+    /* the headers are only decompressed once; a FRAG1 we have seen is
+       a duplicate */
+    if (recon_count(map, 0, 1)) return 1;
+
+    /* the headers may not run into a fragment already received */
+    for (last = 1; last < RECON_UNITS(recon->r_size); last++)
+      if (recon_count(map, last, last + 1))
+        break;
+    offset = (last * 8 < recon->r_size) ? last * 8 : recon->r_size;
+
+    ret = recon_unpack(frame_addr, recon, buf, len, offset, &size);
+    if (ret < 0) return ret;
+    offset = 0;
+    len = size;
+  } else {
+    getFragDgramOffset(&msg, &units);
+    offset = units * 8;
+    /* the first eight octets belong to FRAG1 */
+    if (offset == 0) return -6;
+    if (offset + len > recon->r_size) return -3;
+  }
+
+  /* only the last fragment may end inside a unit */
+  if (len % 8 && offset + len != recon->r_size) return -7;
+
+  first = offset / 8;
+  last = RECON_UNITS(offset + len);
+  received = recon_count(map, first, last);
+  if (received == last - first) {
+    /* a retransmission of a fragment already received */
+    return 1;
+  } else if (received) {
+    /* overlaps with a fragment of a different size or offset: RFC 4944
+       says to discard the datagram */
+    return -8;
+  }
 
-  /* just need to copy the new payload in and return */
-  memcpy(recon->r_buf + recon->r_bytes_rcvd, buf, len);
+  if (offset) {
+    memcpy(recon->r_buf + offset, buf, len);
+  }
+  recon_mark(map, first, last);
   recon->r_bytes_rcvd += len;
 
+  if (recon->r_bytes_rcvd == recon->r_size) {
+    recon_finish(recon);
+  }
   return 0;
 }
 
@@ -0,0 +1,204 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef UNIT_TESTING
+#include <stdio.h>
+#endif
+
+#include "lib6lowpan.h"
+#include "iovec.h"
+#include "in_cksum.h"
+
+/* the byte at a time version in_cksum replaced; right as long as only
+   the last buffer has an odd length */
+int old_in_cksum(const struct ip_iovec *vec) {
+  uint32_t sum = 0;
+  uint16_t cur = 0;
+  int i;
+  uint8_t *w;
+
+  for (; vec != NULL;  vec = vec->iov_next) {
+    if (vec->iov_len == 0)
+      continue;
+
+    w = vec->iov_base;
+    for (i = 0; i < vec->iov_len; i++) {
+      if (i % 2 == 0) {
+        cur |= ((uint16_t)w[i]) << 8;
+        if (i + 1 == vec->iov_len) {
+          goto finish;
+        }
+      } else {
+        cur |= w[i];
+      finish:
+        sum += cur;
+        cur = 0;
+      }
+    }
+  }
+  while (sum > 0xffff) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return (uint16_t)~((uint16_t)sum);
+}
+
+/* RFC 1071 over one flat buffer */
+uint16_t flat_cksum(const uint8_t *buf, int len) {
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i + 1 < len; i += 2)
+    sum += ((uint16_t)buf[i] << 8) | buf[i + 1];
+  if (i < len)
+    sum += (uint16_t)buf[i] << 8;
+  while (sum > 0xffff)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+#define MAX_VEC 16
+uint8_t data[1 << 18];
+struct ip_iovec v[MAX_VEC];
+
+/* splits data[offset .. offset + len) into count buffers, even lengths
+   only if even is set */
+void split(int offset, int len, int count, int even) {
+  int i, used = 0;
+  for (i = 0; i < count; i++) {
+    int n = (i == count - 1) ? len - used : rand() % (len - used + 1);
+    if (even && i < count - 1)
+      n &= ~1;
+    v[i].iov_base = data + offset + used;
+    v[i].iov_len = n;
+    v[i].iov_next = (i < count - 1) ? &v[i + 1] : NULL;
+    used += n;
+  }
+}
+
+int main() {
+  int success = 0, total = 0;
+  int i, j;
+
+  srand(1);
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = rand();
+
+  /* test 1: the example of RFC 1071, section 3 */
+  {
+    uint8_t ex[] = {0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7};
+    total++;
+    v[0].iov_base = ex;
+    v[0].iov_len = sizeof(ex);
+    v[0].iov_next = NULL;
+    if (in_cksum(v) == (uint16_t)~0xddf2)
+      success++;
+    else
+      printf("FAIL: test 1: 0x%x\n", in_cksum(v));
+  }
+
+  /* test 2: same results as before for even buffer lengths */
+  {
+    int ok = 1;
+    total++;
+    for (i = 0; i < 2000 && ok; i++) {
+      int len = rand() % 1500, count = 1 + rand() % MAX_VEC;
+      split(rand() % 64, len, count, 1);
+      if (in_cksum(v) != old_in_cksum(v)) {
+        printf("FAIL: test 2: len %i count %i: 0x%x != 0x%x\n",
+               len, count, in_cksum(v), old_in_cksum(v));
+        ok = 0;
+      }
+    }
+    success += ok;
+  }
+
+  /* test 3: any buffer length and alignment gives the flat checksum */
+  {
+    int ok = 1;
+    total++;
+    for (i = 0; i < 2000 && ok; i++) {
+      int offset = rand() % 64, len = rand() % 1500, count = 1 + rand() % MAX_VEC;
+      split(offset, len, count, 0);
+      if (in_cksum(v) != flat_cksum(data + offset, len)) {
+        printf("FAIL: test 3: offset %i len %i count %i\n", offset, len, count);
+        ok = 0;
+      }
+    }
+    success += ok;
+  }
+
+  /* test 4: long buffers, the sums have to be folded on the way */
+  {
+    int ok = 1;
+    total++;
+    memset(data + 4096, 0xff, 1 << 17);
+    for (i = 0; i < 4 && ok; i++) {
+      int offset = i * 4095, len = sizeof(data) - offset - i;
+      split(offset, len, 1 + i, 0);
+      if (in_cksum(v) != flat_cksum(data + offset, len)) {
+        printf("FAIL: test 4: offset %i len %i\n", offset, len);
+        ok = 0;
+      }
+    }
+    success += ok;
+  }
+
+  /* test 5: a message with its checksum filled in sums to zero */
+  {
+    struct ip6_hdr iph;
+    uint8_t udp[64];
+    struct ip_iovec payload[2];
+    uint16_t cksum;
+    total++;
+    memset(&iph, 0, sizeof(iph));
+    memcpy(iph.ip6_src.s6_addr, data, 16);
+    memcpy(iph.ip6_dst.s6_addr, data + 16, 16);
+    memcpy(udp, data + 32, sizeof(udp));
+    udp[6] = udp[7] = 0;
+    payload[0].iov_base = udp;
+    payload[0].iov_len = 13;
+    payload[0].iov_next = &payload[1];
+    payload[1].iov_base = udp + 13;
+    payload[1].iov_len = sizeof(udp) - 13;
+    payload[1].iov_next = NULL;
+    cksum = msg_cksum(&iph, payload, IANA_UDP);
+    udp[6] = cksum >> 8;
+    udp[7] = cksum;
+    if (msg_cksum(&iph, payload, IANA_UDP) == 0)
+      success++;
+    else
+      printf("FAIL: test 5: 0x%x\n", msg_cksum(&iph, payload, IANA_UDP));
+  }
+
+  /* test 6: the example of RFC 1624, section 4 */
+  {
+    total++;
+    if (in_cksum_update(0xdd2f, 0x5555, 0x3285) == 0x0000)
+      success++;
+    else
+      printf("FAIL: test 6: 0x%x\n", in_cksum_update(0xdd2f, 0x5555, 0x3285));
+  }
+
+  /* test 7: incremental updates of rewritten addresses */
+  {
+    int ok = 1;
+    total++;
+    for (i = 0; i < 1000 && ok; i++) {
+      int len = 40 + rand() % 1200, at = (rand() % (len - 16)) & ~1;
+      uint8_t old[16];
+      uint16_t cksum;
+      split(0, len, 1, 0);
+      cksum = in_cksum(v);
+      memcpy(old, data + at, 16);
+      for (j = 0; j < 16; j++)
+        data[at + j] = rand();
+      if (in_cksum_update_buf(cksum, old, data + at, 16) != in_cksum(v)) {
+        printf("FAIL: test 7: len %i at %i\n", len, at);
+        ok = 0;
+      }
+    }
+    success += ok;
+  }
+
+  printf("%s: %i/%i tests succeeded\n", __FILE__, success, total);
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef UNIT_TESTING
+#include <stdio.h>
+#endif
+
+#include "ip_malloc.h"
+
+#define MAX_LIVE 64
+
+struct live {
+  uint8_t *ptr;
+  uint16_t len;
+  uint8_t fill;
+} live[MAX_LIVE];
+
+/* every live block still holds its pattern and none overlap */
+int check_live() {
+  int i, j, k;
+  for (i = 0; i < MAX_LIVE; i++) {
+    if (!live[i].ptr)
+      continue;
+    if (((uintptr_t)live[i].ptr) % IP_MALLOC_ALIGN)
+      return 0;
+    for (k = 0; k < live[i].len; k++)
+      if (live[i].ptr[k] != live[i].fill)
+        return 0;
+    for (j = i + 1; j < MAX_LIVE; j++) {
+      if (!live[j].ptr)
+        continue;
+      if (live[i].ptr < live[j].ptr + live[j].len &&
+          live[j].ptr < live[i].ptr + live[i].len)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+int main() {
+  int success = 0, total = 0;
+  struct ip_malloc_stats stats, empty;
+  int i;
+
+  ip_malloc_init();
+  ip_malloc_stats(&empty);
+
+  /* test 1: a fresh heap is one free block */
+  {
+    total++;
+    if (empty.free == empty.heap_size && empty.free_blocks == 1 &&
+        empty.heap_size > IP_MALLOC_HEAP_SIZE - 2 * IP_MALLOC_ALIGN &&
+        empty.largest_free == empty.heap_size - 2 &&
+        ip_malloc_freespace() == empty.free)
+      success++;
+    else
+      printf("FAIL: test 1: %u free of %u\n", empty.free, empty.heap_size);
+  }
+
+  /* test 2: all of it can be had at once, and then nothing more */
+  {
+    void *p, *q;
+    total++;
+    p = ip_malloc(empty.largest_free);
+    q = ip_malloc(1);
+    ip_malloc_stats(&stats);
+    if (p && !q && stats.free == 0 && stats.failures == 1)
+      success++;
+    else
+      printf("FAIL: test 2: %p %p\n", p, q);
+    ip_free(p);
+  }
+
+  /* test 3: requests which do not fit fail, also those which would
+     overflow a 16 bit size */
+  {
+    total++;
+    if (!ip_malloc(empty.largest_free + 1) && !ip_malloc(0xffff) &&
+        !ip_malloc(0xfffe))
+      success++;
+    else
+      printf("FAIL: test 3\n");
+  }
+
+  /* test 4: neighbours are merged again whatever order they are freed in */
+  {
+    void *p[8];
+    int order[][8] = {{0, 1, 2, 3, 4, 5, 6, 7},
+                      {7, 6, 5, 4, 3, 2, 1, 0},
+                      {1, 3, 5, 7, 0, 2, 4, 6},
+                      {3, 4, 2, 5, 1, 6, 0, 7}};
+    int o, ok = 1;
+    total++;
+    for (o = 0; o < 4; o++) {
+      for (i = 0; i < 8; i++)
+        p[i] = ip_malloc(100 + i * 7);
+      for (i = 0; i < 8; i++)
+        ip_free(p[order[o][i]]);
+      ip_malloc_stats(&stats);
+      if (stats.free_blocks != 1 || stats.free != empty.free) {
+        printf("FAIL: test 4: order %i: %u blocks\n", o, stats.free_blocks);
+        ok = 0;
+      }
+    }
+    success += ok;
+  }
+
+  /* test 5: frees of pointers ip_malloc did not hand out, and double
+     frees, are ignored */
+  {
+    uint8_t *p, *q;
+    uint16_t freespace;
+    total++;
+    p = ip_malloc(40);
+    q = ip_malloc(40);
+    ip_free(p);
+    freespace = ip_malloc_freespace();
+    ip_free(p);
+    ip_free(q + 1);
+    ip_free(&stats);
+    ip_free(NULL);
+    ip_malloc_stats(&stats);
+    if (ip_malloc_freespace() == freespace && stats.free_blocks == 2)
+      success++;
+    else
+      printf("FAIL: test 5\n");
+    ip_malloc_init();
+  }
+
+  /* test 6: random allocations and frees keep the blocks apart and
+     their contents intact; in the end the heap is whole again */
+  {
+    int ok = 1, step;
+    uint16_t in_use = 0;
+    total++;
+    srand(1);
+    memset(live, 0, sizeof(live));
+    ip_malloc_init();
+    for (step = 0; step < 200000 && ok; step++) {
+      i = rand() % MAX_LIVE;
+      if (live[i].ptr) {
+        ip_free(live[i].ptr);
+        live[i].ptr = NULL;
+      } else {
+        live[i].len = (rand() % 4) ? rand() % 128 : rand() % 1300;
+        live[i].fill = rand();
+        live[i].ptr = ip_malloc(live[i].len);
+        if (live[i].ptr)
+          memset(live[i].ptr, live[i].fill, live[i].len);
+      }
+      if (step % 97 == 0 && !check_live()) {
+        printf("FAIL: test 6: step %i\n", step);
+        ok = 0;
+      }
+    }
+    ip_malloc_stats(&stats);
+    for (i = 0; i < MAX_LIVE; i++)
+      if (live[i].ptr)
+        in_use++;
+    if (ok && (stats.high_water == 0 || stats.high_water > stats.heap_size ||
+               stats.free_blocks == 0 || in_use == 0)) {
+      printf("FAIL: test 6: stats\n");
+      ok = 0;
+    }
+    for (i = 0; i < MAX_LIVE; i++)
+      ip_free(live[i].ptr);
+    ip_malloc_stats(&stats);
+    if (ok && (stats.free != empty.free || stats.free_blocks != 1)) {
+      printf("FAIL: test 6: %u free in %u blocks\n", stats.free,
+             stats.free_blocks);
+      ok = 0;
+    }
+    success += ok;
+  }
+
+  /* test 7: a block as large as the largest free one is found even if
+     it is in the same size class as the request */
+  {
+    void *p[4];
+    total++;
+    ip_malloc_init();
+    p[0] = ip_malloc(300);
+    p[1] = ip_malloc(20);
+    p[2] = ip_malloc(700);
+    p[3] = ip_malloc(20);
+    ip_free(p[2]);
+    ip_malloc_stats(&stats);
+    if (stats.largest_free >= 700 && ip_malloc(stats.largest_free))
+      success++;
+    else
+      printf("FAIL: test 7: largest %u\n", stats.largest_free);
+    ip_malloc_init();
+  }
+
+  printf("%s: %i/%i tests succeeded\n", __FILE__, success, total);
+  return 0;
+}
@@ -153,7 +153,7 @@ int run_tests() {
       if (recon.r_buf == NULL) {
         lowpan_recon_start(&result_fr, &recon, rp, rv - (rp - buf));
       } else {
-        lowpan_recon_add(&recon, rp, rv - (rp - buf));
+        lowpan_recon_add(&result_fr, &recon, rp, rv - (rp - buf));
       }
       memset(buf, 0, sizeof(buf));
     }
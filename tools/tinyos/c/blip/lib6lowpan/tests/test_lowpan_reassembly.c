@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef UNIT_TESTING
+#include <stdio.h>
+#endif
+
+#include "lib6lowpan.h"
+#include "ieee154_header.h"
+#include "ip_malloc.h"
+#include "in_cksum.h"
+
+int ieee154_parse(char *in, ieee154_addr_t *out);
+
+#define FRAME_LEN  102
+#define MAX_FRAMES 24
+
+struct ieee154_frame_addr frame;
+uint8_t pkt[1280];
+int pkt_len;
+
+uint8_t frames[MAX_FRAMES][FRAME_LEN];
+int frame_lens[MAX_FRAMES];
+int n_frames;
+
+/* a link-local UDP packet with len bytes of payload, cut into frames */
+int make_frames(int len, uint16_t tag) {
+  struct ip6_hdr *iph = (struct ip6_hdr *)pkt;
+  struct udp_hdr udp;
+  struct ip6_packet packet;
+  struct lowpan_ctx ctx;
+  struct ip_iovec v;
+  int i, rv;
+
+  memset(&frame, 0, sizeof(frame));
+  ieee154_parse("1", &frame.ieee_src);
+  ieee154_parse("2", &frame.ieee_dst);
+  frame.ieee_dstpan = htole16(0x22);
+
+  pkt_len = sizeof(struct ip6_hdr) + sizeof(struct udp_hdr) + len;
+  memset(iph, 0, sizeof(struct ip6_hdr));
+  iph->ip6_vfc = IPV6_VERSION;
+  iph->ip6_nxt = IANA_UDP;
+  iph->ip6_hlim = 64;
+  iph->ip6_plen = htons(pkt_len - sizeof(struct ip6_hdr));
+  inet_pton6("fe80::ff:fe00:1", &iph->ip6_src);
+  inet_pton6("fe80::ff:fe00:2", &iph->ip6_dst);
+  for (i = 0; i < len; i++)
+    pkt[sizeof(struct ip6_hdr) + sizeof(struct udp_hdr) + i] = rand();
+
+  udp.srcport = htons(1234);
+  udp.dstport = htons(7000);
+  udp.len = iph->ip6_plen;
+  udp.chksum = 0;
+  memcpy(pkt + sizeof(struct ip6_hdr), &udp, sizeof(udp));
+  v.iov_base = pkt + sizeof(struct ip6_hdr);
+  v.iov_len = pkt_len - sizeof(struct ip6_hdr);
+  v.iov_next = NULL;
+  udp.chksum = htons(msg_cksum(iph, &v, IANA_UDP));
+  memcpy(pkt + sizeof(struct ip6_hdr), &udp, sizeof(udp));
+
+  memcpy(&packet.ip6_hdr, iph, sizeof(struct ip6_hdr));
+  packet.ip6_data = &v;
+  ctx.tag = tag;
+  ctx.offset = 0;
+  n_frames = 0;
+  while ((rv = lowpan_frag_get(frames[n_frames], FRAME_LEN,
+                               &packet, &frame, &ctx)) > 0) {
+    frames[n_frames][0] = rv - 1;
+    frame_lens[n_frames] = rv;
+    if (++n_frames == MAX_FRAMES)
+      return -1;
+  }
+  return (rv < 0) ? -1 : n_frames;
+}
+
+/* hands frame i to the reconstruction, which is started if need be */
+int recv_frame(struct lowpan_reconstruct *recon, uint8_t *data, size_t len) {
+  struct ieee154_frame_addr rframe;
+  uint8_t *buf = data;
+
+  if (unpack_ieee154_hdr(&buf, &len, &rframe) < 0)
+    return -100;
+  if (recon->r_buf == NULL)
+    return lowpan_recon_start(&rframe, recon, buf, len);
+  return lowpan_recon_add(&rframe, recon, buf, len);
+}
+
+int complete(struct lowpan_reconstruct *recon) {
+  return recon->r_buf && recon->r_bytes_rcvd == recon->r_size;
+}
+
+int same_packet(struct lowpan_reconstruct *recon) {
+  return complete(recon) && recon->r_size == pkt_len &&
+    memcmp(recon->r_buf, pkt, pkt_len) == 0;
+}
+
+void recon_free(struct lowpan_reconstruct *recon) {
+  ip_free(recon->r_buf);
+  recon->r_buf = NULL;
+}
+
+/* delivers all frames in the order given */
+int recv_order(struct lowpan_reconstruct *recon, int *order) {
+  int i, rv;
+  for (i = 0; i < n_frames; i++) {
+    if ((rv = recv_frame(recon, frames[order[i]], frame_lens[order[i]])) != 0)
+      return rv;
+  }
+  return 0;
+}
+
+int main() {
+  int success = 0, total = 0;
+  struct lowpan_reconstruct recon;
+  uint16_t heap_free;
+  int order[MAX_FRAMES];
+  int i;
+
+  srand(1);
+  ip_malloc_init();
+  heap_free = ip_malloc_freespace();
+  memset(&recon, 0, sizeof(recon));
+
+  /* test 1: a packet which fits a frame, and a fragmented one sent in
+     order */
+  {
+    int ok = 1, len;
+    total++;
+    for (len = 10; len <= 1000 && ok; len += 330) {
+      make_frames(len, 1);
+      for (i = 0; i < n_frames; i++)
+        order[i] = i;
+      if (recv_order(&recon, order) != 0 || !same_packet(&recon)) {
+        printf("FAIL: test 1: %i bytes in %i frames\n", pkt_len, n_frames);
+        ok = 0;
+      }
+      recon_free(&recon);
+    }
+    success += ok;
+  }
+
+  /* test 2: the fragments are sent backwards, FRAG1 last */
+  {
+    total++;
+    make_frames(600, 2);
+    for (i = 0; i < n_frames; i++)
+      order[i] = n_frames - 1 - i;
+    if (recv_order(&recon, order) == 0 && same_packet(&recon))
+      success++;
+    else
+      printf("FAIL: test 2\n");
+    recon_free(&recon);
+  }
+
+  /* test 3: duplicates are reported and do not complete the packet
+     before the last fragment is in */
+  {
+    int ok = 1;
+    total++;
+    make_frames(600, 3);
+    for (i = 0; i < n_frames - 1 && ok; i++) {
+      if (recv_frame(&recon, frames[i], frame_lens[i]) != 0)
+        ok = 0;
+    }
+    for (i = 0; i < n_frames - 1 && ok; i++) {
+      if (recv_frame(&recon, frames[i], frame_lens[i]) != 1 || complete(&recon))
+        ok = 0;
+    }
+    if (ok && (recv_frame(&recon, frames[n_frames - 1],
+                          frame_lens[n_frames - 1]) != 0 ||
+               !same_packet(&recon)))
+      ok = 0;
+    success += ok;
+    if (!ok)
+      printf("FAIL: test 3: frame %i\n", i);
+    recon_free(&recon);
+  }
+
+  /* test 4: fragments which overlap one already received but are not
+     the same, or which disagree about the size of the datagram, are
+     refused */
+  {
+    uint8_t bad[FRAME_LEN];
+    int ok = 1, hdr;
+    total++;
+    make_frames(600, 4);
+    /* the FRAGN header follows the 802.15.4 header */
+    for (hdr = 1; hdr < frame_lens[1]; hdr++)
+      if ((frames[1][hdr] >> 3) == LOWPAN_FRAGN_PATTERN)
+        break;
+    recv_frame(&recon, frames[0], frame_lens[0]);
+    recv_frame(&recon, frames[1], frame_lens[1]);
+
+    memcpy(bad, frames[1], frame_lens[1]);
+    bad[hdr + 4]++;
+    if (recv_frame(&recon, bad, frame_lens[1]) >= 0)
+      ok = 0;
+    memcpy(bad, frames[2], frame_lens[2]);
+    bad[hdr + 4]--;
+    if (recv_frame(&recon, bad, frame_lens[2]) >= 0)
+      ok = 0;
+    memcpy(bad, frames[2], frame_lens[2]);
+    bad[hdr + 1]++;
+    if (recv_frame(&recon, bad, frame_lens[2]) >= 0)
+      ok = 0;
+    /* the first eight octets are FRAG1's */
+    memcpy(bad, frames[2], frame_lens[2]);
+    bad[hdr + 4] = 0;
+    if (recv_frame(&recon, bad, frame_lens[2]) >= 0)
+      ok = 0;
+    if (complete(&recon) || recon.r_bytes_rcvd != frame_lens[1] - hdr - 5 +
+        (frames[1][hdr + 4] * 8))
+      ok = 0;
+    success += ok;
+    if (!ok)
+      printf("FAIL: test 4\n");
+    recon_free(&recon);
+  }
+
+  /* test 5: frames cut short anywhere are refused without reading past
+     their end, and leave nothing allocated */
+  {
+    int ok = 1, f, len;
+    uint8_t *copy;
+    total++;
+    make_frames(300, 5);
+    for (f = 0; f < n_frames && ok; f++) {
+      for (len = 1; len < frame_lens[f] && ok; len++) {
+        copy = malloc(len);
+        memcpy(copy, frames[f], len);
+        copy[0] = len - 1;
+        memset(&recon, 0, sizeof(recon));
+        if (recv_frame(&recon, copy, len) == 0 && complete(&recon))
+          ok = 0;
+        recon_free(&recon);
+        free(copy);
+      }
+    }
+    if (ok && ip_malloc_freespace() != heap_free)
+      ok = 0;
+    success += ok;
+    if (!ok)
+      printf("FAIL: test 5: frame %i, %i bytes\n", f, len);
+  }
+
+  /* test 6: a lossy link.  The sender keeps sending all fragments of a
+     packet again until it is through; on the way fragments are lost,
+     duplicated and reordered.  The packet has to come out whole, and
+     only once every fragment has arrived. */
+  {
+    int ok = 1, round, tries, sent, seen[MAX_FRAMES], n_seen, rv;
+    total++;
+    for (round = 0; round < 2000 && ok; round++) {
+      make_frames(rand() % 1100, round);
+      memset(seen, 0, sizeof(seen));
+      memset(&recon, 0, sizeof(recon));
+      n_seen = 0;
+      for (tries = 0; tries < 100 && !complete(&recon) && ok; tries++) {
+        for (i = 0; i < n_frames; i++)
+          order[i] = i;
+        for (i = n_frames - 1; i > 0; i--) {
+          int j = rand() % (i + 1), t = order[i];
+          order[i] = order[j];
+          order[j] = t;
+        }
+        for (sent = 0; sent < n_frames && !complete(&recon); sent++) {
+          int f = order[sent], copies = 1;
+          if (rand() % 10 < 3)
+            copies = 0;
+          else if (rand() % 10 == 0)
+            copies = 2;
+          while (copies-- && !complete(&recon)) {
+            rv = recv_frame(&recon, frames[f], frame_lens[f]);
+            if (rv != (seen[f] ? 1 : 0)) {
+              printf("FAIL: test 6: round %i: frame %i gave %i\n",
+                     round, f, rv);
+              ok = 0;
+            }
+            if (!seen[f]++)
+              n_seen++;
+            if (complete(&recon) && n_seen != n_frames) {
+              printf("FAIL: test 6: round %i: complete with %i/%i frames\n",
+                     round, n_seen, n_frames);
+              ok = 0;
+            }
+          }
+        }
+      }
+      if (ok && !same_packet(&recon)) {
+        printf("FAIL: test 6: round %i: %i bytes in %i frames\n",
+               round, pkt_len, n_frames);
+        ok = 0;
+      }
+      recon_free(&recon);
+    }
+    if (ok && ip_malloc_freespace() != heap_free) {
+      printf("FAIL: test 6: %u bytes leaked\n",
+             heap_free - ip_malloc_freespace());
+      ok = 0;
+    }
+    success += ok;
+  }
+
+  printf("%s: %i/%i tests succeeded\n", __FILE__, success, total);
+  return 0;
+}
@@ -0,0 +1,573 @@
+/*
+ * Header compression benchmark: runs packets through lowpan_frag_get
+ * (compress and fragment) and lowpan_recon_start/lowpan_recon_add
+ * (reassemble and decompress) in a loop, and reports the throughput
+ * for each header class.
+ *
+ * The synthetic classes cover the main IPHC/NHC paths, each with a
+ * packet that fits in one frame and one that is fragmented. Traces
+ * given on the command line are replayed as classes of their own; both
+ * the input of compress (source, destination, IPv6 packet in hex) and
+ * the input of decompress (one frame in hex per line) are understood.
+ *
+ * Every packet is checked to come out of the loop unchanged once
+ * before it is timed.
+ *
+ * usage: bench [-n rounds] [-c corpus_dir] [trace ...]
+ *   -n  times each packet is sent through the loop (default 20000)
+ *   -c  write the frames of all classes there, as seeds for fuzz
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib6lowpan-includes.h"
+#include "../ieee154_header.h"
+#include "../lib6lowpan.h"
+#include "../ip_malloc.h"
+#include "../in_cksum.h"
+
+int ieee154_parse(char *in, ieee154_addr_t *out);
+
+#define FRAME_LEN  128
+#define MAX_FRAMES 24
+#define MAX_PKTS   64
+#define MAX_CLASSES 64
+/* packets compressed before the batch is decompressed */
+#define BATCH      32
+
+struct bench_pkt {
+  struct ieee154_frame_addr frame;
+  int len;
+  uint8_t data[1280];
+};
+
+struct bench_class {
+  char name[32];
+  int n_pkts;
+  struct bench_pkt *pkts;
+  unsigned long packets, bytes, frames, air_bytes, errors;
+  double compress_ns, decompress_ns;
+};
+
+struct bench_class classes[MAX_CLASSES];
+int n_classes;
+
+uint8_t frames[BATCH][MAX_FRAMES][FRAME_LEN];
+int frame_lens[BATCH][MAX_FRAMES];
+int frame_counts[BATCH];
+
+/* context 0 is aaaa::/64 */
+int lowpan_extern_read_context(struct in6_addr *addr, int context) {
+  memset(addr->s6_addr, 0, 8);
+  addr->s6_addr16[0] = htons(0xaaaa);
+  return 64;
+}
+
+int lowpan_extern_match_context(struct in6_addr *addr, UNUSED uint8_t *ctx_id) {
+  if (addr->s6_addr16[0] == htons(0xaaaa) && addr->s6_addr16[1] == 0 &&
+      addr->s6_addr16[2] == 0 && addr->s6_addr16[3] == 0) {
+    *ctx_id = 0;
+    return 64;
+  }
+  return 0;
+}
+
+double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct bench_class *add_class(const char *name) {
+  struct bench_class *c;
+  if (n_classes == MAX_CLASSES) {
+    fprintf(stderr, "too many classes\n");
+    exit(1);
+  }
+  c = &classes[n_classes++];
+  memset(c, 0, sizeof(*c));
+  snprintf(c->name, sizeof(c->name), "%s", name);
+  c->pkts = calloc(MAX_PKTS, sizeof(struct bench_pkt));
+  return c;
+}
+
+/* compresses and fragments one packet into frames[slot], returns the
+   number of frames or -1 */
+int send_pkt(struct bench_pkt *p, int slot, uint16_t tag) {
+  struct ip6_packet pkt;
+  struct ip_iovec v;
+  struct lowpan_ctx ctx;
+  int rv, n = 0;
+
+  memcpy(&pkt.ip6_hdr, p->data, sizeof(struct ip6_hdr));
+  v.iov_base = p->data + sizeof(struct ip6_hdr);
+  v.iov_len = p->len - sizeof(struct ip6_hdr);
+  v.iov_next = NULL;
+  pkt.ip6_data = &v;
+  ctx.tag = tag;
+  ctx.offset = 0;
+
+  while ((rv = lowpan_frag_get(frames[slot][n], FRAME_LEN,
+                               &pkt, &p->frame, &ctx)) > 0) {
+    frames[slot][n][0] = rv - 1;
+    frame_lens[slot][n] = rv;
+    if (++n == MAX_FRAMES)
+      return -1;
+  }
+  if (rv < 0)
+    return -1;
+  frame_counts[slot] = n;
+  return n;
+}
+
+/* reassembles and decompresses the frames in frames[slot]; the caller
+   frees recon->r_buf */
+int recv_pkt(int slot, struct lowpan_reconstruct *recon) {
+  struct ieee154_frame_addr frame;
+  uint8_t *buf;
+  size_t len;
+  int i, rv;
+
+  for (i = 0; i < frame_counts[slot]; i++) {
+    buf = frames[slot][i];
+    len = frame_lens[slot][i];
+    if (unpack_ieee154_hdr(&buf, &len, &frame) < 0)
+      rv = -1;
+    else if (i == 0)
+      rv = lowpan_recon_start(&frame, recon, buf, len);
+    else
+      rv = lowpan_recon_add(&frame, recon, buf, len);
+    if (rv < 0) {
+      if (i > 0)
+        ip_free(recon->r_buf);
+      return -1;
+    }
+  }
+  if (recon->r_bytes_rcvd != recon->r_size) {
+    ip_free(recon->r_buf);
+    return -1;
+  }
+  return recon->r_size;
+}
+
+/* one trip through the loop which has to give back the same packet */
+int check_pkt(struct bench_pkt *p) {
+  struct lowpan_reconstruct recon;
+  int len, ok;
+
+  if (send_pkt(p, 0, 0) < 0)
+    return 0;
+  if ((len = recv_pkt(0, &recon)) < 0)
+    return 0;
+  ok = (len == p->len) && memcmp(recon.r_buf, p->data, len) == 0;
+  ip_free(recon.r_buf);
+  return ok;
+}
+
+void run_class(struct bench_class *c, int rounds) {
+  struct lowpan_reconstruct recon;
+  int round, i, j, batch;
+  double t0, t1, t2;
+
+  if (!c->n_pkts)
+    return;
+  for (i = 0; i < c->n_pkts; i++) {
+    if (!check_pkt(&c->pkts[i])) {
+      fprintf(stderr, "%s: packet %i does not survive the round trip\n",
+              c->name, i);
+      c->errors++;
+    }
+  }
+  if (c->errors)
+    return;
+
+  for (round = 0; round < rounds; round += batch) {
+    batch = (rounds - round < BATCH) ? rounds - round : BATCH;
+
+    t0 = now_ns();
+    for (i = 0; i < batch; i++) {
+      if (send_pkt(&c->pkts[(round + i) % c->n_pkts], i, round + i) < 0)
+        c->errors++;
+    }
+    t1 = now_ns();
+    for (i = 0; i < batch; i++) {
+      if (recv_pkt(i, &recon) < 0) {
+        c->errors++;
+        continue;
+      }
+      ip_free(recon.r_buf);
+    }
+    t2 = now_ns();
+
+    c->compress_ns += t1 - t0;
+    c->decompress_ns += t2 - t1;
+    for (i = 0; i < batch; i++) {
+      c->packets++;
+      c->bytes += c->pkts[(round + i) % c->n_pkts].len;
+      c->frames += frame_counts[i];
+      for (j = 0; j < frame_counts[i]; j++)
+        c->air_bytes += frame_lens[i][j];
+    }
+  }
+}
+
+void report() {
+  struct bench_class *c;
+  double secs;
+  int i;
+
+  printf("%-20s %6s %6s %6s %10s %8s %9s %9s\n", "class", "bytes", "air",
+         "frames", "pkts/s", "MB/s", "comp ns", "decomp ns");
+  for (i = 0; i < n_classes; i++) {
+    c = &classes[i];
+    if (c->errors || !c->packets) {
+      printf("%-20s %s\n", c->name, c->errors ? "failed" : "no packets");
+      continue;
+    }
+    secs = (c->compress_ns + c->decompress_ns) / 1e9;
+    printf("%-20s %6lu %6lu %6.1f %10.0f %8.2f %9.0f %9.0f\n", c->name,
+           c->bytes / c->packets, c->air_bytes / c->packets,
+           (double)c->frames / c->packets,
+           c->packets / secs, c->bytes / secs / 1e6,
+           c->compress_ns / c->packets, c->decompress_ns / c->packets);
+  }
+}
+
+/* synthetic packets */
+
+enum {
+  SRC_LL,      /* link local, IID from the 802.15.4 address */
+  SRC_CTX,     /* in the prefix of context 0 */
+  SRC_GLOBAL,  /* no context, carried inline */
+};
+
+void set_addr(struct in6_addr *addr, int kind, uint16_t node) {
+  memset(addr, 0, sizeof(*addr));
+  switch (kind) {
+  case SRC_LL:
+    addr->s6_addr16[0] = htons(0xfe80);
+    addr->s6_addr16[5] = htons(0x00ff);
+    addr->s6_addr16[6] = htons(0xfe00);
+    addr->s6_addr16[7] = htons(node);
+    break;
+  case SRC_CTX:
+    addr->s6_addr16[0] = htons(0xaaaa);
+    addr->s6_addr16[7] = htons(node);
+    break;
+  case SRC_GLOBAL:
+    addr->s6_addr16[0] = htons(0x2001);
+    addr->s6_addr16[1] = htons(0x0db8);
+    addr->s6_addr16[4] = htons(0x0212);
+    addr->s6_addr16[5] = htons(0x7400);
+    addr->s6_addr16[6] = htons(0x0001);
+    addr->s6_addr16[7] = htons(node);
+    break;
+  }
+}
+
+void make_synthetic(const char *name, int kind, int mcast, uint8_t nxt,
+                    int hbh, int payload) {
+  struct bench_class *c;
+  struct bench_pkt *p;
+  struct ip6_hdr *iph;
+  struct in6_addr addr;
+  struct ip_iovec v;
+  uint8_t *data;
+  int hdr_len, i;
+  char full_name[32];
+
+  snprintf(full_name, sizeof(full_name), "%s/%i", name, payload);
+  c = add_class(full_name);
+  p = &c->pkts[0];
+  c->n_pkts = 1;
+
+  p->frame.ieee_src.ieee_mode = IEEE154_ADDR_SHORT;
+  p->frame.ieee_src.i_saddr = htole16(1);
+  p->frame.ieee_dst.ieee_mode = IEEE154_ADDR_SHORT;
+  p->frame.ieee_dst.i_saddr = htole16(mcast ? 0xffff : 2);
+  p->frame.ieee_dstpan = htole16(0x22);
+
+  iph = (struct ip6_hdr *)p->data;
+  iph->ip6_vfc = IPV6_VERSION;
+  iph->ip6_nxt = hbh ? IPV6_HOP : nxt;
+  iph->ip6_hlim = 64;
+  set_addr(&addr, kind, 1);
+  memcpy(&iph->ip6_src, &addr, sizeof(addr));
+  if (mcast) {
+    memset(&addr, 0, sizeof(addr));
+    addr.s6_addr16[0] = htons(0xff02);
+    addr.s6_addr16[7] = htons(0x001a);
+  } else {
+    set_addr(&addr, kind, 2);
+  }
+  memcpy(&iph->ip6_dst, &addr, sizeof(addr));
+  data = p->data + sizeof(struct ip6_hdr);
+
+  if (hbh) {
+    /* an RPL option, just fits without padding */
+    data[0] = nxt;
+    data[1] = 0;
+    data[2] = 0x63;
+    data[3] = 4;
+    data[4] = 0;
+    data[5] = 0x1e;
+    data[6] = 0x01;
+    data[7] = 0x00;
+    data += 8;
+  }
+
+  switch (nxt) {
+  case IANA_UDP:
+    hdr_len = sizeof(struct udp_hdr);
+    ((struct udp_hdr *)data)->srcport = htons(0xf0b1);
+    ((struct udp_hdr *)data)->dstport = htons(0xf0b2);
+    ((struct udp_hdr *)data)->len = htons(hdr_len + payload);
+    break;
+  case IANA_ICMP:
+    hdr_len = 8;
+    data[0] = ICMP_TYPE_ECHO_REQUEST;
+    break;
+  default:
+    /* TCP, left alone by the NHC */
+    hdr_len = 20;
+    data[0] = 0x04;
+    data[2] = 0x00;
+    data[3] = 0x50;
+    data[12] = 0x50;
+    data[13] = 0x18;
+    break;
+  }
+  for (i = 0; i < payload; i++)
+    data[hdr_len + i] = i;
+  p->len = (data - p->data) + hdr_len + payload;
+  iph->ip6_plen = htons(p->len - sizeof(struct ip6_hdr));
+
+  /* decompression recalculates the checksum after stateful address
+     compression, so it had better be right */
+  if (nxt == IANA_UDP) {
+    v.iov_base = data;
+    v.iov_len = hdr_len + payload;
+    v.iov_next = NULL;
+    ((struct udp_hdr *)data)->chksum = htons(msg_cksum(iph, &v, IANA_UDP));
+  }
+}
+
+void make_synthetic_classes() {
+  int sizes[] = {32, 600}, i;
+
+  for (i = 0; i < 2; i++) {
+    make_synthetic("ll-udp", SRC_LL, 0, IANA_UDP, 0, sizes[i]);
+    make_synthetic("ll-icmp", SRC_LL, 0, IANA_ICMP, 0, sizes[i]);
+    make_synthetic("ctx-udp", SRC_CTX, 0, IANA_UDP, 0, sizes[i]);
+    make_synthetic("mcast-udp", SRC_LL, 1, IANA_UDP, 0, sizes[i]);
+    make_synthetic("hbh-udp", SRC_LL, 0, IANA_UDP, 1, sizes[i]);
+    make_synthetic("global-tcp", SRC_GLOBAL, 0, IANA_TCP, 0, sizes[i]);
+  }
+}
+
+/* traces */
+
+/* reads one line of hex into buf, -1 at the end of the file */
+int read_hex_line(FILE *fp, uint8_t *buf, int len) {
+  int c, n = 0, nibbles = 0;
+  memset(buf, 0, len);
+  while ((c = getc(fp)) != EOF && c != '\n') {
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+      c = c - 'a' + 10;
+    else if (c >= '0' && c <= '9')
+      c = c - '0';
+    else
+      continue;
+    if (n == len)
+      continue;
+    if (nibbles++ % 2 == 0) {
+      buf[n] = c << 4;
+    } else {
+      buf[n++] |= c;
+    }
+  }
+  if (c == EOF && nibbles == 0)
+    return -1;
+  return n;
+}
+
+int read_line(FILE *fp, char *buf, int len) {
+  if (!fgets(buf, len, fp))
+    return -1;
+  buf[strcspn(buf, "\r\n")] = '\0';
+  return 0;
+}
+
+/* compress input: source, destination and the packet */
+void load_uncompressed(struct bench_class *c, FILE *fp) {
+  struct bench_pkt *p = &c->pkts[0];
+  char line[256];
+  int rv;
+
+  if (read_line(fp, line, sizeof(line)) < 0)
+    return;
+  ieee154_parse(line, &p->frame.ieee_src);
+  if (read_line(fp, line, sizeof(line)) < 0)
+    return;
+  ieee154_parse(line, &p->frame.ieee_dst);
+  p->frame.ieee_dstpan = htole16(0x22);
+
+  /* the packet may be spread over several lines */
+  while ((rv = read_hex_line(fp, p->data + p->len,
+                             sizeof(p->data) - p->len)) >= 0)
+    p->len += rv;
+  if (p->len >= sizeof(struct ip6_hdr)) {
+    ((struct ip6_hdr *)p->data)->ip6_plen =
+      htons(p->len - sizeof(struct ip6_hdr));
+    c->n_pkts = 1;
+  }
+}
+
+/* decompress input: a frame per line, packets made up of fragments are
+   reassembled */
+void load_frames(struct bench_class *c, FILE *fp) {
+  struct ieee154_frame_addr frame;
+  struct lowpan_reconstruct recon;
+  uint8_t buf[FRAME_LEN], *cur;
+  size_t len;
+  int rv, started = 0;
+
+  memset(&recon, 0, sizeof(recon));
+  while ((rv = read_hex_line(fp, buf, sizeof(buf))) >= 0) {
+    if (rv == 0)
+      continue;
+    cur = buf;
+    len = rv;
+    if (unpack_ieee154_hdr(&cur, &len, &frame) < 0)
+      continue;
+    if (!started) {
+      if (lowpan_recon_start(&frame, &recon, cur, len) < 0)
+        continue;
+      started = 1;
+      c->pkts[c->n_pkts].frame = frame;
+    } else if (lowpan_recon_add(&frame, &recon, cur, len) < 0) {
+      continue;
+    }
+    if (recon.r_bytes_rcvd == recon.r_size) {
+      if (recon.r_size <= sizeof(c->pkts[0].data) && c->n_pkts < MAX_PKTS) {
+        memcpy(c->pkts[c->n_pkts].data, recon.r_buf, recon.r_size);
+        c->pkts[c->n_pkts++].len = recon.r_size;
+      }
+      ip_free(recon.r_buf);
+      started = 0;
+    }
+  }
+  if (started)
+    ip_free(recon.r_buf);
+}
+
+void load_trace(const char *path) {
+  struct bench_class *c;
+  const char *name = strrchr(path, '/');
+  char line[256], *endp;
+  FILE *fp;
+  int i;
+
+  if (!(fp = fopen(path, "r"))) {
+    perror(path);
+    exit(1);
+  }
+  c = add_class(name ? name + 1 : path);
+
+  /* the address lines of compress input are a short address in 0x
+     notation or a long one with colons */
+  if (read_line(fp, line, sizeof(line)) < 0) {
+    fclose(fp);
+    return;
+  }
+  strtol(line, &endp, 16);
+  rewind(fp);
+  if (strncmp(line, "0x", 2) == 0 || *endp == ':')
+    load_uncompressed(c, fp);
+  else
+    load_frames(c, fp);
+  fclose(fp);
+
+  /* recorded packets may be broken in ways the library does not
+     preserve, those are left out */
+  for (i = 0; i < c->n_pkts; i++) {
+    if (!check_pkt(&c->pkts[i])) {
+      fprintf(stderr, "%s: skipping packet %i, it does not survive the "
+              "round trip\n", path, i);
+      c->pkts[i--] = c->pkts[--c->n_pkts];
+    }
+  }
+  if (!c->n_pkts)
+    fprintf(stderr, "%s: no packets\n", path);
+}
+
+void write_corpus(const char *dir) {
+  char path[1024];
+  FILE *fp;
+  int i, j, k;
+
+  for (i = 0; i < n_classes; i++) {
+    for (j = 0; j < classes[i].n_pkts; j++) {
+      if (send_pkt(&classes[i].pkts[j], 0, j) < 0)
+        continue;
+      /* all frames of a packet in one input, as fuzz reads them */
+      snprintf(path, sizeof(path), "%.900s/%.31s-%i", dir, classes[i].name, j);
+      for (k = 0; path[k]; k++)
+        if (path[k] == '/' && k > strlen(dir))
+          path[k] = '_';
+      if (!(fp = fopen(path, "w"))) {
+        perror(path);
+        exit(1);
+      }
+      for (k = 0; k < frame_counts[0]; k++)
+        fwrite(frames[0][k], 1, frame_lens[0][k], fp);
+      fclose(fp);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int rounds = 20000, opt, i;
+  char *corpus = NULL;
+
+  while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+    switch (opt) {
+    case 'n':
+      rounds = atoi(optarg);
+      break;
+    case 'c':
+      corpus = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n rounds] [-c corpus_dir] [trace ...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  ip_malloc_init();
+  make_synthetic_classes();
+  for (i = optind; i < argc; i++)
+    load_trace(argv[i]);
+
+  if (corpus) {
+    write_corpus(corpus);
+    return 0;
+  }
+
+  for (i = 0; i < n_classes; i++)
+    run_class(&classes[i], rounds);
+  report();
+
+  for (i = 0; i < n_classes; i++)
+    if (classes[i].errors)
+      return 1;
+  return 0;
+}
@@ -78,7 +78,7 @@ int main(int argc, char **argv) {
       rv = lowpan_recon_start(&frame_address, &recon,
                               frame_prt, frame_len);
     } else {
-      rv = lowpan_recon_add(&recon, frame_prt, frame_len);
+      rv = lowpan_recon_add(&frame_address, &recon, frame_prt, frame_len);
     }
 
     printf("[%i] %i %i\n", rv, recon.r_size, recon.r_bytes_rcvd);
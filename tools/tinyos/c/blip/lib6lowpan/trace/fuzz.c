@@ -0,0 +1,187 @@
+/*
+ * libFuzzer entry point for the receive path of lib6lowpan.
+ *
+ * An input is a sequence of 802.15.4 frames as they come off the radio,
+ * each starting with its length byte. The frames are handed to
+ * lowpan_recon_start/lowpan_recon_add like the decompress tool does;
+ * every frame is copied to a buffer of its own size first so that the
+ * sanitizers see reads past its end.
+ *
+ * A packet which gets reassembled is then sent through lowpan_frag_get
+ * and back twice. The first trip may normalize it (padding, elided
+ * lengths), the second one has to give back the same packet.
+ *
+ * The library has to be built with the same instrumentation, see the
+ * fuzz target in Makefile.am:
+ *
+ *   make fuzz CC=clang
+ *   ./bench -c corpus packet.trace uncompressed.trace
+ *   ./fuzz corpus
+ *
+ * Built with -DFUZZ_STANDALONE it reads the inputs from the files given
+ * on the command line instead, to replay crashes without libFuzzer.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib6lowpan-includes.h"
+#include "../ieee154_header.h"
+#include "../lib6lowpan.h"
+#include "../ip_malloc.h"
+
+#define FRAME_LEN  128
+#define MAX_FRAMES 24
+
+uint8_t pkt_buf[IP_MALLOC_HEAP_SIZE];
+uint8_t trip_buf[IP_MALLOC_HEAP_SIZE];
+
+/* context 0 is aaaa::/64, as in bench */
+int lowpan_extern_read_context(struct in6_addr *addr, int context) {
+  memset(addr->s6_addr, 0, 8);
+  addr->s6_addr16[0] = htons(0xaaaa);
+  return 64;
+}
+
+int lowpan_extern_match_context(struct in6_addr *addr, UNUSED uint8_t *ctx_id) {
+  if (addr->s6_addr16[0] == htons(0xaaaa) && addr->s6_addr16[1] == 0 &&
+      addr->s6_addr16[2] == 0 && addr->s6_addr16[3] == 0) {
+    *ctx_id = 0;
+    return 64;
+  }
+  return 0;
+}
+
+/* feeds one frame to the reconstruction, returns the length of the
+   packet once it is complete, 0 while it is not and -1 on errors */
+static int recv_frame(struct lowpan_reconstruct *recon, int *started,
+                      struct ieee154_frame_addr *frame,
+                      const uint8_t *data, size_t len) {
+  uint8_t *copy = malloc(len ? len : 1), *buf = copy;
+  int rv;
+
+  memcpy(copy, data, len);
+  if (unpack_ieee154_hdr(&buf, &len, frame) < 0) {
+    rv = -1;
+  } else if (!*started) {
+    rv = lowpan_recon_start(frame, recon, buf, len);
+    if (rv == 0)
+      *started = 1;
+  } else {
+    rv = lowpan_recon_add(frame, recon, buf, len);
+  }
+  free(copy);
+
+  if (rv < 0)
+    return -1;
+  if (*started && recon->r_bytes_rcvd == recon->r_size)
+    return recon->r_size;
+  return 0;
+}
+
+/* compresses buf and decompresses it again into out, returns the
+   length or -1 */
+static int round_trip(struct ieee154_frame_addr *frame,
+                      uint8_t *buf, int len, uint8_t *out) {
+  static uint8_t frames[MAX_FRAMES][FRAME_LEN];
+  struct lowpan_reconstruct recon;
+  struct ieee154_frame_addr rframe;
+  struct lowpan_ctx ctx;
+  struct ip6_packet pkt;
+  struct ip_iovec v;
+  int lens[MAX_FRAMES], n = 0, i, rv, started = 0;
+
+  if (len < sizeof(struct ip6_hdr))
+    return -1;
+  memcpy(&pkt.ip6_hdr, buf, sizeof(struct ip6_hdr));
+  v.iov_base = buf + sizeof(struct ip6_hdr);
+  v.iov_len = len - sizeof(struct ip6_hdr);
+  v.iov_next = NULL;
+  pkt.ip6_data = &v;
+  ctx.tag = 0;
+  ctx.offset = 0;
+
+  while ((rv = lowpan_frag_get(frames[n], FRAME_LEN, &pkt, frame, &ctx)) > 0) {
+    frames[n][0] = rv - 1;
+    lens[n] = rv;
+    if (++n == MAX_FRAMES)
+      return -1;
+  }
+  if (rv < 0)
+    return -1;
+
+  memset(&recon, 0, sizeof(recon));
+  for (i = 0; i < n; i++) {
+    rv = recv_frame(&recon, &started, &rframe, frames[i], lens[i]);
+    if (rv != 0)
+      break;
+  }
+  if (rv > 0)
+    memcpy(out, recon.r_buf, rv);
+  if (started)
+    ip_free(recon.r_buf);
+  return (rv > 0) ? rv : -1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct lowpan_reconstruct recon;
+  struct ieee154_frame_addr frame, first_frame;
+  int started = 0, was_started, len = -1, trip_len;
+  size_t frame_len;
+
+  ip_malloc_init();
+  memset(&recon, 0, sizeof(recon));
+
+  while (size > 0) {
+    frame_len = (size_t)data[0] + 1;
+    if (frame_len > size)
+      frame_len = size;
+    was_started = started;
+    len = recv_frame(&recon, &started, &frame, data, frame_len);
+    if (!was_started && started)
+      first_frame = frame;
+    data += frame_len;
+    size -= frame_len;
+    if (len != 0)
+      break;
+  }
+  if (len > 0)
+    memcpy(pkt_buf, recon.r_buf, len);
+  if (started)
+    ip_free(recon.r_buf);
+  if (len <= 0)
+    return 0;
+
+  len = round_trip(&first_frame, pkt_buf, len, pkt_buf);
+  if (len < 0)
+    return 0;
+  trip_len = round_trip(&first_frame, pkt_buf, len, trip_buf);
+  if (trip_len != len || memcmp(pkt_buf, trip_buf, len) != 0) {
+    fprintf(stderr, "packet changed on the way through (%i -> %i bytes)\n",
+            len, trip_len);
+    abort();
+  }
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv) {
+  static uint8_t buf[1 << 16];
+  size_t len;
+  FILE *fp;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!(fp = fopen(argv[i], "rb"))) {
+      perror(argv[i]);
+      return 1;
+    }
+    len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    LLVMFuzzerTestOneInput(buf, len);
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Replays sequences of ip_malloc/ip_free calls and reports how long the
+ * calls take, how many allocations fail and how fragmented the heap
+ * gets.
+ *
+ * Sequences are recorded by building lib6lowpan with -DIP_MALLOC_TRACE,
+ * which logs every call to stderr:
+ *
+ *   ip_malloc <size> <pointer>
+ *   ip_free <pointer>
+ *
+ * Other lines are skipped, so the whole stderr of a tool will do.
+ * Without a trace a synthetic one is made up: datagrams being
+ * reassembled, mostly single frame ones and now and then a large one,
+ * each with a small packet structure, freed in random order.
+ *
+ * usage: malloc_bench [-n calls] [-w trace] [trace ...]
+ *   -n  length of the synthetic sequence (default 1000000)
+ *   -w  write the synthetic sequence out instead of replaying it
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ip_malloc.h"
+
+#define MAX_LIVE 256
+/* datagrams in reassembly at a time in the synthetic sequence */
+#define MAX_DGRAMS 8
+
+enum {
+  OP_MALLOC,
+  OP_FREE,
+};
+
+struct op {
+  uint8_t type;
+  uint16_t size;    /* OP_MALLOC */
+  uint16_t slot;    /* the allocation, recorded pointers mapped to slots */
+};
+
+struct trace {
+  struct op *ops;
+  int n_ops, max_ops;
+};
+
+double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void add_op(struct trace *t, uint8_t type, uint16_t size, uint16_t slot) {
+  if (t->n_ops == t->max_ops) {
+    t->max_ops = t->max_ops ? t->max_ops * 2 : 4096;
+    t->ops = realloc(t->ops, t->max_ops * sizeof(struct op));
+  }
+  t->ops[t->n_ops].type = type;
+  t->ops[t->n_ops].size = size;
+  t->ops[t->n_ops].slot = slot;
+  t->n_ops++;
+}
+
+/* slot of a recorded pointer, a new one if alloc is set */
+int find_slot(char (*ptrs)[32], const char *ptr, int alloc) {
+  int i;
+  for (i = 0; i < MAX_LIVE; i++) {
+    if (alloc ? ptrs[i][0] == '\0' : strcmp(ptrs[i], ptr) == 0) {
+      if (alloc)
+        snprintf(ptrs[i], sizeof(ptrs[i]), "%s", ptr);
+      return i;
+    }
+  }
+  return -1;
+}
+
+void load_trace(struct trace *t, const char *path) {
+  static char ptrs[MAX_LIVE][32];
+  char line[256], ptr[32];
+  unsigned size;
+  int slot;
+  FILE *fp;
+
+  if (!(fp = fopen(path, "r"))) {
+    perror(path);
+    exit(1);
+  }
+  memset(ptrs, 0, sizeof(ptrs));
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "ip_malloc %u %31s", &size, ptr) == 2) {
+      /* failed calls are replayed too, they might not fail this time */
+      if (strcmp(ptr, "(nil)") == 0 || strcmp(ptr, "0x0") == 0)
+        strcpy(ptr, "failed");
+      if ((slot = find_slot(ptrs, ptr, 1)) < 0) {
+        fprintf(stderr, "%s: more than %i blocks in use\n", path, MAX_LIVE);
+        exit(1);
+      }
+      add_op(t, OP_MALLOC, size, slot);
+      if (strcmp(ptr, "failed") == 0) {
+        /* nothing frees those */
+        ptrs[slot][0] = '\0';
+        add_op(t, OP_FREE, 0, slot);
+      }
+    } else if (sscanf(line, "ip_free %31s", ptr) == 1) {
+      if ((slot = find_slot(ptrs, ptr, 0)) < 0)
+        continue;
+      ptrs[slot][0] = '\0';
+      add_op(t, OP_FREE, 0, slot);
+    }
+  }
+  fclose(fp);
+}
+
+/* reassembly buffers: four in five datagrams fit a frame (up to 102
+   bytes of reconstructed packet), the rest up to the IPv6 minimum MTU;
+   each comes with a 48 byte packet structure that lives a bit longer */
+void make_trace(struct trace *t, int n) {
+  int live[MAX_LIVE], n_live = 0, i, slot = 0;
+  uint8_t used[MAX_LIVE];
+
+  srand(1);
+  memset(used, 0, sizeof(used));
+  while (t->n_ops < n) {
+    if (n_live > 0 && (n_live >= 2 * MAX_DGRAMS || rand() % 2)) {
+      i = rand() % n_live;
+      add_op(t, OP_FREE, 0, live[i]);
+      used[live[i]] = 0;
+      live[i] = live[--n_live];
+      continue;
+    }
+    for (i = 0; i < 2; i++) {
+      while (used[slot])
+        slot = (slot + 1) % MAX_LIVE;
+      used[slot] = 1;
+      live[n_live++] = slot;
+      if (i == 0)
+        add_op(t, OP_MALLOC, (rand() % 5) ? 40 + rand() % 63 :
+               103 + rand() % 1178, slot);
+      else
+        add_op(t, OP_MALLOC, 48, slot);
+    }
+  }
+}
+
+void write_trace(struct trace *t, const char *path) {
+  FILE *fp = fopen(path, "w");
+  int i;
+
+  if (!fp) {
+    perror(path);
+    exit(1);
+  }
+  /* the slots make up the pointers */
+  for (i = 0; i < t->n_ops; i++) {
+    if (t->ops[i].type == OP_MALLOC)
+      fprintf(fp, "ip_malloc %u 0x%x\n", t->ops[i].size, t->ops[i].slot + 1);
+    else
+      fprintf(fp, "ip_free 0x%x\n", t->ops[i].slot + 1);
+  }
+  fclose(fp);
+}
+
+void replay(const char *name, struct trace *t) {
+  static void *ptrs[MAX_LIVE];
+  struct ip_malloc_stats stats;
+  unsigned long mallocs = 0, failures = 0, frag_samples = 0;
+  static unsigned long call_ns[4096];
+  double start, t0 = 0, t1, elapsed = 0, frag = 0;
+  unsigned long below = 0;
+  int i, pass, p99;
+  struct op *op;
+
+  /* timed as a whole first, then call by call for the 99th percentile */
+  memset(call_ns, 0, sizeof(call_ns));
+  for (pass = 0; pass < 2; pass++) {
+    ip_malloc_init();
+    memset(ptrs, 0, sizeof(ptrs));
+    start = now_ns();
+    for (i = 0; i < t->n_ops; i++) {
+      op = &t->ops[i];
+      if (pass)
+        t0 = now_ns();
+      if (op->type == OP_MALLOC) {
+        ptrs[op->slot] = ip_malloc(op->size);
+      } else {
+        ip_free(ptrs[op->slot]);
+        ptrs[op->slot] = NULL;
+      }
+      if (pass) {
+        t1 = now_ns();
+        call_ns[(t1 - t0 < 4095) ? (int)(t1 - t0) : 4095]++;
+      }
+    }
+    if (!pass)
+      elapsed = now_ns() - start;
+  }
+
+  /* once more for the fragmentation when calls fail */
+  ip_malloc_init();
+  memset(ptrs, 0, sizeof(ptrs));
+  for (i = 0; i < t->n_ops; i++) {
+    op = &t->ops[i];
+    if (op->type == OP_MALLOC) {
+      mallocs++;
+      if (!(ptrs[op->slot] = ip_malloc(op->size))) {
+        failures++;
+        ip_malloc_stats(&stats);
+        if (stats.free) {
+          frag += 1 - (double)(stats.largest_free + 2) / stats.free;
+          frag_samples++;
+        }
+      }
+    } else {
+      ip_free(ptrs[op->slot]);
+      ptrs[op->slot] = NULL;
+    }
+  }
+  ip_malloc_stats(&stats);
+
+  for (p99 = 0; p99 < 4095; p99++) {
+    below += call_ns[p99];
+    if (below >= t->n_ops * 0.99)
+      break;
+  }
+
+  printf("%-24s %9i %8.1f %8i %8lu %6.2f%% %7.1f%% %6u\n", name, t->n_ops,
+         elapsed / t->n_ops, p99, failures,
+         mallocs ? 100.0 * failures / mallocs : 0.0,
+         frag_samples ? 100.0 * frag / frag_samples : 0.0,
+         stats.high_water);
+}
+
+int main(int argc, char **argv) {
+  struct trace t;
+  char *out = NULL;
+  int n = 1000000, opt, i;
+
+  while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = atoi(optarg);
+      break;
+    case 'w':
+      out = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n calls] [-w trace] [trace ...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  if (out) {
+    memset(&t, 0, sizeof(t));
+    make_trace(&t, n);
+    write_trace(&t, out);
+    return 0;
+  }
+
+  printf("heap %i bytes, aligned to %i\n", IP_MALLOC_HEAP_SIZE,
+         IP_MALLOC_ALIGN);
+  printf("%-24s %9s %8s %8s %8s %7s %8s %6s\n", "trace", "calls", "ns/call",
+         "p99 ns", "failed", "", "frag", "peak");
+  if (optind == argc) {
+    memset(&t, 0, sizeof(t));
+    make_trace(&t, n);
+    replay("synthetic", &t);
+  }
+  for (i = optind; i < argc; i++) {
+    memset(&t, 0, sizeof(t));
+    load_trace(&t, argv[i]);
+    replay(argv[i], &t);
+    free(t.ops);
+  }
+  return 0;
+}
@@ -50,6 +50,12 @@ uint32_t circ_get_seqno(void *buf) {
   return b->head_seqno;
 }
 
+/* how many bytes the buffer can hold */
+int circ_get_window(void *buf) {
+  struct circ_buf *b = (struct circ_buf *)buf;
+  return b->data_len;
+}
+
 void circ_set_seqno(void *buf, uint32_t seqno) {
   struct circ_buf *b = (struct circ_buf *)buf;
   b->head_seqno = seqno;
@@ -109,6 +115,27 @@ int circ_buf_read(void *buf, uint32_t sseqno,
   return rc;
 }
 
+int circ_buf_iov(void *buf, uint32_t sseqno, int len,
+                 struct ip_iovec *iov) {
+  struct circ_buf *b = (struct circ_buf *)buf;
+  uint8_t *readptr;
+  int r_len;
+
+  get_ptr_off_1(b, sseqno, len, &readptr, &r_len);
+  iov[0].iov_base = readptr;
+  iov[0].iov_len = r_len;
+  iov[0].iov_next = NULL;
+
+  if (r_len != len) {
+    iov[0].iov_next = &iov[1];
+    iov[1].iov_base = b->data_start;
+    iov[1].iov_len = min(len - r_len, b->data_head - b->data_start);
+    iov[1].iov_next = NULL;
+    r_len += iov[1].iov_len;
+  }
+  return r_len;
+}
+
 int circ_buf_write(char *buf, uint32_t sseqno,
                    uint8_t *data, int len) {
   struct circ_buf *b = (struct circ_buf *)buf;
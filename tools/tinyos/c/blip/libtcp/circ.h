@@ -35,6 +35,14 @@ int circ_buf_read(void *buf, uint32_t sseqno,
                   uint8_t *data, int len);
 
 
+/* point iov at len bytes of the buffer from sseqno instead of copying
+   them out.  iov must have room for two entries; the second is
+   chained on when the data wraps around the end of the buffer.
+   Returns the number of bytes covered. */
+struct ip_iovec;
+int circ_buf_iov(void *buf, uint32_t sseqno, int len,
+                 struct ip_iovec *iov);
+
 int circ_shorten_head(void *buf, uint32_t seqno);
 
 /* read from the head of the buffer, moving the data pointer forward */
@@ -45,4 +53,6 @@ void circ_buf_dump(void *buf);
 uint32_t circ_get_seqno(void *buf);
 void circ_set_seqno(void *buf, uint32_t seqno);
 
+int circ_get_window(void *buf);
+
 #endif
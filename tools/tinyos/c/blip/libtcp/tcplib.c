@@ -29,7 +29,11 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#ifdef PC
+#include <time.h>
+#endif
 #include "lib6lowpan/ip_malloc.h"
 #include "lib6lowpan/in_cksum.h"
 #include "lib6lowpan/6lowpan.h"
@@ -39,9 +43,24 @@
 #include "libtcp/circ.h"
 
 static struct tcplib_sock *conns = NULL;
+/* bound sockets, hashed by their local port and remote endpoint */
+static struct tcplib_sock *conn_hash[TCPLIB_HASH_SIZE];
 
 #define ONE_SEGMENT(X)  ((X)->mss)
 
+/* sequence number comparisons which survive wrapping */
+#define SEQ_LT(X,Y)   ((int32_t)((X) - (Y)) < 0)
+#define SEQ_LEQ(X,Y)  ((int32_t)((X) - (Y)) <= 0)
+#define SEQ_GT(X,Y)   ((int32_t)((X) - (Y)) > 0)
+#define SEQ_GEQ(X,Y)  ((int32_t)((X) - (Y)) >= 0)
+
+enum {
+  TCP_OPT_END       = 0,
+  TCP_OPT_NOP       = 1,
+  TCP_OPT_SACK_PERM = 4,
+  TCP_OPT_SACK      = 5,
+};
+
 #ifdef PC
 uint16_t alloc_local_port() {
   return (time(NULL) & 0xffff) | 0x8000;
@@ -98,20 +117,70 @@ void print_headers(struct ip6_hdr *iph, struct tcp_hdr *tcph) {
 #define printf(FMT, args ...) ;
 #endif
 
+/* sockets without a remote endpoint (listening ones) are hashed with
+   a remote port of zero and no address */
+static uint8_t conn_hashfn(uint16_t lport, uint16_t rport, uint8_t *raddr) {
+  uint16_t h = lport ^ rport;
+  if (raddr != NULL)
+    h ^= ((raddr[12] ^ raddr[14]) << 8) | (raddr[13] ^ raddr[15]);
+  h ^= h >> 8;
+  return h & (TCPLIB_HASH_SIZE - 1);
+}
+
+/* file the socket under its current endpoints; this has to be called
+   whenever they change */
+static void conn_rehash(struct tcplib_sock *sock) {
+  struct tcplib_sock **iter;
+  uint8_t h;
+
+  for (h = 0; h < TCPLIB_HASH_SIZE; h++) {
+    for (iter = &conn_hash[h]; *iter != NULL; iter = &(*iter)->hnext) {
+      if (*iter == sock) {
+        *iter = sock->hnext;
+        goto unhashed;
+      }
+    }
+  }
+ unhashed:
+  sock->hnext = NULL;
+  if (sock->l_ep.sin6_port == 0)
+    return;
+
+  if (sock->r_ep.sin6_port == 0)
+    h = conn_hashfn(sock->l_ep.sin6_port, 0, NULL);
+  else
+    h = conn_hashfn(sock->l_ep.sin6_port, sock->r_ep.sin6_port,
+                    sock->r_ep.sin6_addr.s6_addr);
+  sock->hnext = conn_hash[h];
+  conn_hash[h] = sock;
+}
+
+static int conn_match(struct tcplib_sock *iter, struct ip6_hdr *iph,
+                      struct tcp_hdr *tcph) {
+  return ((memcmp(iph->ip6_dst.s6_addr, iter->l_ep.sin6_addr.s6_addr, 16) == 0) ||
+          isInaddrAny(&iter->l_ep.sin6_addr)) &&
+    tcph->dstport == iter->l_ep.sin6_port &&
+    (iter->r_ep.sin6_port == 0 ||
+     (memcmp(&iph->ip6_src, &iter->r_ep.sin6_addr, 16) == 0 &&
+      tcph->srcport == iter->r_ep.sin6_port));
+}
+
 static struct tcplib_sock *conn_lookup(struct ip6_hdr *iph, 
                                        struct tcp_hdr *tcph) {
   struct tcplib_sock *iter;
   //printf("looking up conns: %p %p\n", iph, tcph);
   // print_headers(iph, tcph);
-  for (iter = conns; iter != NULL; iter = iter->next) {
-    // print_conn(iter);
-    printf("conn lport: %i\n", ntohs(iter->l_ep.sin6_port));
-    if (((memcmp(iph->ip6_dst.s6_addr, iter->l_ep.sin6_addr.s6_addr, 16) == 0) ||
-         isInaddrAny(&iter->l_ep.sin6_addr)) &&
-        tcph->dstport == iter->l_ep.sin6_port &&
-        (iter->r_ep.sin6_port == 0 ||
-         (memcmp(&iph->ip6_src, &iter->r_ep.sin6_addr, 16) == 0 &&
-          tcph->srcport == iter->r_ep.sin6_port)))
+
+  /* a connection to this endpoint first, then a socket listening on
+     the port */
+  iter = conn_hash[conn_hashfn(tcph->dstport, tcph->srcport, iph->ip6_src.s6_addr)];
+  for (; iter != NULL; iter = iter->hnext) {
+    if (iter->r_ep.sin6_port != 0 && conn_match(iter, iph, tcph))
+      return iter;
+  }
+  iter = conn_hash[conn_hashfn(tcph->dstport, 0, NULL)];
+  for (; iter != NULL; iter = iter->hnext) {
+    if (iter->r_ep.sin6_port == 0 && conn_match(iter, iph, tcph))
       return iter;
   }
   return NULL;
@@ -168,7 +237,9 @@ static void __tcplib_send(struct tcplib_sock *sock,
 
   tcph->srcport = sock->l_ep.sin6_port;
   tcph->dstport = sock->r_ep.sin6_port;
-  tcph->offset = sizeof(struct tcp_hdr) * 4;
+  /* unless the caller put in options */
+  if (tcph->offset == 0)
+    tcph->offset = sizeof(struct tcp_hdr) * 4;
   tcph->window = htons(sock->my_wind);
   tcph->chksum = 0;
   tcph->urgent = 0;
@@ -177,12 +248,30 @@ static void __tcplib_send(struct tcplib_sock *sock,
 }
 
 static void tcplib_send_ack(struct tcplib_sock *sock, int fin_seqno, uint8_t flags) {
-  struct ip6_packet *msg = get_ipmsg(0);
+  struct ip6_packet *msg;
+  int optlen = 0;
+
+#if TCPLIB_SACK_BLOCKS > 0
+  /* offer to take SACK options in a SYN; in a SYN-ACK only if the SYN
+     did */
+  if ((flags & TCP_FLAG_SYN) &&
+      (!(flags & TCP_FLAG_ACK) || (sock->cc_flags & TCP_CC_SACK)))
+    optlen = 4;
+#endif
+  msg = get_ipmsg(optlen);
   printf("sending ACK\n");
       
   if (msg != NULL) {
     struct tcp_hdr *tcp_rep = (struct tcp_hdr *)(msg + 1);
     tcp_rep->flags = flags;
+    if (optlen) {
+      uint8_t *opt = (uint8_t *)(tcp_rep + 1);
+      opt[0] = TCP_OPT_NOP;
+      opt[1] = TCP_OPT_NOP;
+      opt[2] = TCP_OPT_SACK_PERM;
+      opt[3] = 2;
+      tcp_rep->offset = (sizeof(struct tcp_hdr) + optlen) * 4;
+    }
 
 
     tcp_rep->seqno = htonl(sock->seqno);
@@ -223,50 +312,219 @@ static void tcplib_send_rst(struct ip6_hdr *iph, struct tcp_hdr *tcph) {
   }  
 }
 
-/* send all the data in the tx buffer, starting at sseqno */
-static int tcplib_output(struct tcplib_sock *sock, uint32_t sseqno) {
+/* send len bytes of the tx buffer, starting at sseqno, as one segment.
+ * The payload is not copied: the packet's iovec chain points into the
+ * tx buffer, which stays put until the segment is ACKed.
+ */
+static int tcplib_output_seg(struct tcplib_sock *sock, uint32_t sseqno,
+                             int seg_size) {
+  struct ip6_packet *msg = get_ipmsg(0);
+  struct ip_iovec data[2];
+  struct tcp_hdr *tcph;
+  int len;
+  if (msg == NULL) return -1;
+  tcph = (struct tcp_hdr *)(msg + 1);
+
+  tcph->flags = TCP_FLAG_ACK;
+  tcph->seqno = htonl(sseqno);
+  tcph->ackno = htonl(sock->ackno);
+
+  printf("tcplib_output: seqno: %u ackno: %u len: %i headno: %u\n",
+         ntohl(tcph->seqno), ntohl(tcph->ackno), seg_size,
+         circ_get_seqno(sock->tx_buf));
+
+  len = circ_buf_iov(sock->tx_buf, sseqno, seg_size, data);
+  if (seg_size != len) {
+    printf("WARN: circ could not read!\n");
+  }
+  msg->ip6_data->iov_next = data;
+  msg->ip6_hdr.ip6_plen = htons(sizeof(struct tcp_hdr) + len);
+  __tcplib_send(sock, msg);
+  ip_free(msg);
+  return 0;
+}
+
+/* send the data in the tx buffer which has not been sent yet */
+static int tcplib_output(struct tcplib_sock *sock) {
   // the output size is the minimum of the advertised window and the
   // conjestion window.  of course, if we have less data we send even
   // less.
-  int seg_size = min(sock->seqno - sseqno, sock->r_wind);
+  uint32_t una = circ_get_seqno(sock->tx_buf);
+  uint16_t wnd = min(sock->cwnd, sock->r_wind);
+  int seg_size;
   printf("r_wind: %i\n", sock->r_wind);
-  seg_size = min(seg_size, sock->cwnd);
-  while (seg_size > 0 && sock->seqno > sseqno) {
-    // printf("sending seg_size: %i\n", seg_size);
-    struct ip6_packet *msg = get_ipmsg(seg_size);
-    struct tcp_hdr *tcph;
-    uint8_t *data;
-    if (msg == NULL) return -1;
-    tcph = (struct tcp_hdr *)(msg + 1);
-    data = (uint8_t *)(tcph + 1);
-
-    tcph->flags = TCP_FLAG_ACK;
-    tcph->seqno = htonl(sseqno);
-    tcph->ackno = htonl(sock->ackno);
-
-    printf("tcplib_output: seqno: %u ackno: %u len: %i headno: %u\n",
-           ntohl(tcph->seqno), ntohl(tcph->ackno), seg_size,
-           circ_get_seqno(sock->tx_buf));
-
-    if (seg_size != circ_buf_read(sock->tx_buf, sseqno, data, seg_size)) {
-      printf("WARN: circ could not read!\n");
+
+  while (SEQ_LT(sock->snd_nxt, sock->seqno) &&
+         SEQ_LT(sock->snd_nxt, una + wnd)) {
+    seg_size = min(sock->seqno - sock->snd_nxt, sock->mss);
+    seg_size = min(seg_size, una + wnd - sock->snd_nxt);
+    // don't send a runt just because the window is not a multiple of
+    // the segment size; the next ACK will open it
+    if (seg_size < sock->mss && seg_size < sock->seqno - sock->snd_nxt &&
+        sock->snd_nxt != una)
+      break;
+    if (tcplib_output_seg(sock, sock->snd_nxt, seg_size) < 0)
+      return -1;
+    sock->snd_nxt += seg_size;
+  }
+  if (sock->snd_nxt != una && sock->timer.retx == 0)
+    sock->timer.retx = TCPLIB_RTO;
+  return 0;
+}
+
+/* resend one segment from sseqno, but not past end */
+static void tcplib_retransmit(struct tcplib_sock *sock, uint32_t sseqno,
+                              uint32_t end) {
+  int seg_size = min(end - sseqno, sock->mss);
+  printf("retransmitting [%u, %u]\n", sseqno, sseqno + seg_size);
+  tcplib_output_seg(sock, sseqno, seg_size);
+#if TCPLIB_SACK_BLOCKS > 0
+  if (SEQ_GT(sseqno + seg_size, sock->rtx_nxt))
+    sock->rtx_nxt = sseqno + seg_size;
+#endif
+}
+
+/* find an option in the header of a segment */
+static uint8_t *tcp_find_opt(struct tcp_hdr *tcph, uint8_t kind) {
+  uint8_t *opt = (uint8_t *)(tcph + 1);
+  uint8_t *end = ((uint8_t *)tcph) + (tcph->offset / 4);
+
+  while (opt < end && *opt != TCP_OPT_END) {
+    if (*opt == TCP_OPT_NOP) {
+      opt++;
+      continue;
     }
-    __tcplib_send(sock, msg);
-    ip_free(msg);
+    if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+      break;
+    if (*opt == kind)
+      return opt;
+    opt += opt[1];
+  }
+  return NULL;
+}
+
+#if TCPLIB_SACK_BLOCKS > 0
+static uint32_t get_seqno(uint8_t *buf) {
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+    ((uint32_t)buf[2] << 8) | buf[3];
+}
 
-    sseqno += seg_size;
-    seg_size = min(sock->seqno - sseqno, sock->mss);
+/* forget the blocks the cumulative ACK has reached */
+static void sack_trim(struct tcplib_sock *sock, uint32_t una) {
+  int i, n = 0;
+  for (i = 0; i < TCPLIB_SACK_BLOCKS; i++) {
+    if (sock->sack[i].start == sock->sack[i].end ||
+        SEQ_LEQ(sock->sack[i].end, una))
+      continue;
+    if (SEQ_LT(sock->sack[i].start, una))
+      sock->sack[i].start = una;
+    sock->sack[n++] = sock->sack[i];
+  }
+  for (; n < TCPLIB_SACK_BLOCKS; n++)
+    sock->sack[n].start = sock->sack[n].end = 0;
+}
+
+/* add a block to the scoreboard, merging it with those it touches.
+   If there is no room left, the highest block is dropped; the low
+   ones are where the retransmissions are needed first. */
+static void sack_insert(struct tcplib_sock *sock, uint32_t start, uint32_t end) {
+  int i, j, n;
+
+  for (n = 0; n < TCPLIB_SACK_BLOCKS &&
+         sock->sack[n].start != sock->sack[n].end; n++);
+
+  for (i = 0; i < n; i++) {
+    if (SEQ_LEQ(start, sock->sack[i].end) && SEQ_LEQ(sock->sack[i].start, end)) {
+      if (SEQ_LT(sock->sack[i].start, start))
+        start = sock->sack[i].start;
+      if (SEQ_GT(sock->sack[i].end, end))
+        end = sock->sack[i].end;
+      for (j = i; j < n - 1; j++)
+        sock->sack[j] = sock->sack[j + 1];
+      n--;
+      sock->sack[n].start = sock->sack[n].end = 0;
+      i--;
+    }
+  }
+
+  for (i = 0; i < n && SEQ_LT(sock->sack[i].start, start); i++);
+  if (i == TCPLIB_SACK_BLOCKS)
+    return;
+  if (n == TCPLIB_SACK_BLOCKS)
+    n--;
+  for (j = n; j > i; j--)
+    sock->sack[j] = sock->sack[j - 1];
+  sock->sack[i].start = start;
+  sock->sack[i].end = end;
+}
+
+/* take the SACK blocks of an ACK into the scoreboard */
+static void sack_process(struct tcplib_sock *sock, struct tcp_hdr *tcph) {
+  uint8_t *opt = tcp_find_opt(tcph, TCP_OPT_SACK), *block;
+  uint32_t una = circ_get_seqno(sock->tx_buf), start, end;
+
+  if (opt == NULL)
+    return;
+  for (block = opt + 2; block + 8 <= opt + opt[1]; block += 8) {
+    start = get_seqno(block);
+    end = get_seqno(block + 4);
+    if (SEQ_LT(start, end) && SEQ_GT(end, una) &&
+        SEQ_LEQ(end, sock->snd_nxt))
+      sack_insert(sock, SEQ_LT(start, una) ? una : start, end);
+  }
+}
+
+/* the first hole at or after *start with a SACKed block above it */
+static int sack_next_hole(struct tcplib_sock *sock, uint32_t *start,
+                          uint32_t *end) {
+  int i;
+  for (i = 0; i < TCPLIB_SACK_BLOCKS &&
+         sock->sack[i].start != sock->sack[i].end; i++) {
+    if (SEQ_LT(*start, sock->sack[i].start)) {
+      *end = sock->sack[i].start;
+      return 1;
+    }
+    if (SEQ_LT(*start, sock->sack[i].end))
+      *start = sock->sack[i].end;
   }
   return 0;
 }
+#endif
+
+/* in fast recovery, resend the first segment the other end is missing.
+ * Without SACK that is the one at the cumulative ACK; with SACK it is
+ * the first hole not resent yet in this recovery.
+ *
+ * Returns 0 if there was nothing to resend.
+ */
+static int tcplib_retransmit_hole(struct tcplib_sock *sock) {
+  uint32_t start = circ_get_seqno(sock->tx_buf), end = sock->snd_nxt;
+
+#if TCPLIB_SACK_BLOCKS > 0
+  if (sock->cc_flags & TCP_CC_SACK) {
+    uint32_t hole = start;
+    if (SEQ_GT(sock->rtx_nxt, hole))
+      hole = sock->rtx_nxt;
+    if (sack_next_hole(sock, &hole, &end))
+      start = hole;
+    else if (hole != start)
+      return 0;
+  }
+#endif
+  if (!SEQ_LT(start, end))
+    return 0;
+  tcplib_retransmit(sock, start, end);
+  return 1;
+}
 
 int tcplib_init_sock(struct tcplib_sock *sock) {
-  memset(sock, 0, sizeof(struct tcplib_sock) - sizeof(struct tcplib_sock *));
+  memset(sock, 0, offsetof(struct tcplib_sock, hnext));
   sock->mss = 200;
   sock->my_wind = 200;
   sock->cwnd = ONE_SEGMENT(sock);
   sock->ssthresh = 0xffff;
   conn_add_once(sock);
+  conn_rehash(sock);
   return 0;
 }
 
@@ -288,13 +546,117 @@ static int receive_data(struct tcplib_sock *sock, struct tcp_hdr *tcph, int len)
   return payload_len;
 }
 
+/* half of the data in flight */
 static void reset_ssthresh(struct tcplib_sock *conn) {
-  uint16_t new_ssthresh = min(conn->cwnd, conn->r_wind) / 2;
+  uint16_t new_ssthresh = min(conn->snd_nxt - circ_get_seqno(conn->tx_buf),
+                              0xffff) / 2;
   if (new_ssthresh < 2 * ONE_SEGMENT(conn))
     new_ssthresh = 2 * ONE_SEGMENT(conn);
   conn->ssthresh = new_ssthresh;
 }
 
+static void grow_cwnd(struct tcplib_sock *conn, uint16_t incr) {
+  if (conn->cwnd < 0xffff - incr)
+    conn->cwnd += incr;
+  else
+    conn->cwnd = 0xffff;
+}
+
+/* send side processing of an incoming segment: the ACK number and
+ * SACK blocks move the window along, and duplicate ACKs start a
+ * NewReno fast retransmit (RFC 6582).  Whatever can be sent after that
+ * is.
+ */
+static void tcplib_process_ack(struct tcplib_sock *sock, struct tcp_hdr *tcph,
+                               int payload_len) {
+  uint32_t una = circ_get_seqno(sock->tx_buf);
+  uint32_t hdr_ackno = ntohl(tcph->ackno);
+  uint32_t acked;
+
+  if (!(tcph->flags & TCP_FLAG_ACK))
+    return;
+#if TCPLIB_SACK_BLOCKS > 0
+  if (sock->cc_flags & TCP_CC_SACK)
+    sack_process(sock, tcph);
+#endif
+
+  if (SEQ_GT(hdr_ackno, una) && SEQ_LEQ(hdr_ackno, sock->seqno)) {
+    // new data is being ACKed
+    acked = hdr_ackno - una;
+    // truncates the ack buffer
+    circ_shorten_head(sock->tx_buf, hdr_ackno);
+    // after a timeout, ACKs for the first transmission may still come in
+    if (SEQ_GT(hdr_ackno, sock->snd_nxt))
+      sock->snd_nxt = hdr_ackno;
+#if TCPLIB_SACK_BLOCKS > 0
+    sack_trim(sock, hdr_ackno);
+#endif
+    // reset the duplicate ack counter
+    UNSET_ACK_COUNT(sock->flags);
+    sock->retxcnt = 0;
+
+    if (sock->cc_flags & TCP_CC_RECOVERY) {
+      if (SEQ_GEQ(hdr_ackno, sock->recover)) {
+        // everything outstanding when the loss was detected has
+        // arrived: deflate the window and leave fast recovery
+        sock->cwnd = min(sock->ssthresh,
+                         sock->snd_nxt - hdr_ackno + ONE_SEGMENT(sock));
+        sock->cc_flags &= ~TCP_CC_RECOVERY;
+      } else {
+        // a partial ACK: the next segment was lost as well
+        tcplib_retransmit_hole(sock);
+        sock->cwnd = (acked < sock->cwnd) ? sock->cwnd - acked : 0;
+        if (acked >= ONE_SEGMENT(sock) || sock->cwnd < ONE_SEGMENT(sock))
+          grow_cwnd(sock, ONE_SEGMENT(sock));
+        sock->timer.retx = TCPLIB_RTO;
+      }
+    } else if (sock->cwnd <= sock->ssthresh) {
+      // in slow start; increase the cwnd by one segment
+      grow_cwnd(sock, ONE_SEGMENT(sock));
+    } else {
+      // in congestion avoidance
+      grow_cwnd(sock, (ONE_SEGMENT(sock) * ONE_SEGMENT(sock)) / sock->cwnd);
+    }
+
+    // restart the retransmission timer for what is still out
+    sock->timer.retx = (sock->snd_nxt != hdr_ackno) ? TCPLIB_RTO : 0;
+
+    if (sock->seqno == hdr_ackno) {
+      tcplib_extern_acked(sock);
+    }
+  } else if (hdr_ackno == una && SEQ_GT(sock->snd_nxt, una) &&
+             payload_len == 0 &&
+             !(tcph->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN))) {
+    // this is a duplicate ACK: the other end got a segment after one
+    // that is missing
+    if (GET_ACK_COUNT(sock->flags) < (TCP_DUPACKS >> TCP_DUPACKS_OFF))
+      INCR_ACK_COUNT(sock->flags);
+
+    if (sock->cc_flags & TCP_CC_RECOVERY) {
+      // each one means a segment has left the network.  With SACK
+      // that room goes to the next hole, otherwise to new data.
+      if (!((sock->cc_flags & TCP_CC_SACK) && tcplib_retransmit_hole(sock)))
+        grow_cwnd(sock, ONE_SEGMENT(sock));
+    } else if (GET_ACK_COUNT(sock->flags) == TCPLIB_DUPACK_THRESH &&
+               SEQ_GEQ(una, sock->recover)) {
+      printf("detected multiple duplicate ACKs-- doing fast retransmit [%u, %u]\n",
+             una, sock->snd_nxt);
+      // we are going to reset ssthresh and retransmit the data.
+      reset_ssthresh(sock);
+      sock->recover = sock->snd_nxt;
+      sock->cc_flags |= TCP_CC_RECOVERY;
+#if TCPLIB_SACK_BLOCKS > 0
+      sock->rtx_nxt = una;
+#endif
+      tcplib_retransmit(sock, una, sock->snd_nxt);
+      sock->cwnd = sock->ssthresh + TCPLIB_DUPACK_THRESH * ONE_SEGMENT(sock);
+      sock->timer.retx = TCPLIB_RTO;
+    }
+  }
+
+  tcplib_output(sock);
+}
+
 int tcplib_process(struct ip6_hdr *iph, void *payload) {
   int rc = 0;
   struct tcp_hdr *tcph;
@@ -307,6 +669,8 @@ int tcplib_process(struct ip6_hdr *iph, void *payload) {
 
   tcph = (struct tcp_hdr *)payload;
   payload_len = len - sizeof(struct ip6_hdr) - (tcph->offset / 4);
+  if (tcph->offset / 4 < sizeof(struct tcp_hdr) || payload_len < 0)
+    return -1;
 
   /* if there's no local */
   this_conn = conn_lookup(iph, tcph);
@@ -373,6 +737,10 @@ int tcplib_process(struct ip6_hdr *iph, void *payload) {
         // send the ACK this_conn
         this_conn->state = TCP_ESTABLISHED;
         this_conn->ackno = hdr_seqno + 1;
+#if TCPLIB_SACK_BLOCKS > 0
+        if (tcp_find_opt(tcph, TCP_OPT_SACK_PERM) != NULL)
+          this_conn->cc_flags |= TCP_CC_SACK;
+#endif
         connect_done = 1;
         // skip the LISTEN processing
         // this will also generate an ACK
@@ -412,10 +780,16 @@ int tcplib_process(struct ip6_hdr *iph, void *payload) {
           }
           memcpy(&new_sock->l_ep.sin6_addr, &iph->ip6_dst, 16);
           new_sock->l_ep.sin6_port = tcph->dstport;
+          conn_rehash(new_sock);
 
           new_sock->ackno = hdr_seqno + 1;
           circ_buf_init(new_sock->tx_buf, new_sock->tx_buf_len,
                         0xcafebabe + 1);
+          new_sock->cc_flags = 0;
+#if TCPLIB_SACK_BLOCKS > 0
+          if (tcp_find_opt(tcph, TCP_OPT_SACK_PERM) != NULL)
+            new_sock->cc_flags |= TCP_CC_SACK;
+#endif
         } else {
           /* recieved a SYN retransmission. */
           new_sock = this_conn;
@@ -426,6 +800,8 @@ int tcplib_process(struct ip6_hdr *iph, void *payload) {
           new_sock->state = TCP_SYN_RCVD;
           tcplib_send_ack(new_sock, 0, TCP_FLAG_ACK | TCP_FLAG_SYN);
           new_sock->seqno++;
+          new_sock->snd_nxt = new_sock->seqno;
+          new_sock->recover = new_sock->seqno - 1;
         } else {
           memset(&this_conn->r_ep, 0, sizeof(struct sockaddr_in6));
         }
@@ -447,10 +823,9 @@ int tcplib_process(struct ip6_hdr *iph, void *payload) {
       /* ack any data in this packet */
       if (this_conn->state == TCP_ESTABLISHED || this_conn->state == TCP_FIN_WAIT_1) {
         if (payload_len > 0) {
-          if ((this_conn->flags & TCP_ACKPENDING) == TCP_ACKPENDING) {
-            // printf("Incr would overflow\n");
-          }
-          this_conn->flags ++;
+          // don't let the count run into the duplicate ACK counter
+          if ((this_conn->flags & TCP_ACKPENDING) != TCP_ACKPENDING)
+            this_conn->flags ++;
         }
 
 
@@ -460,52 +835,7 @@ int tcplib_process(struct ip6_hdr *iph, void *payload) {
 
 
         // send side recieve sequence check and congestion window updates.
-        if (hdr_ackno > circ_get_seqno(this_conn->tx_buf)) {
-          // new data is being ACKed
-          // or we haven't sent anything new
-          if (this_conn->cwnd <= this_conn->ssthresh) {
-            // in slow start; increase the cwnd by one segment
-            this_conn->cwnd += ONE_SEGMENT(this_conn);
-            // printf("in slow start\n");
-          } else {
-            // in congestion avoidance
-            this_conn->cwnd += (ONE_SEGMENT(this_conn) * ONE_SEGMENT(this_conn)) / this_conn->cwnd;
-            // printf("in congestion avoidence\n");
-          }
-          // printf("ACK new data: cwnd: %i ssthresh: %i\n", this_conn->cwnd, this_conn->ssthresh);
-          // reset the duplicate ack counter
-          UNSET_ACK_COUNT(this_conn->flags);
-          // truncates the ack buffer 
-          circ_shorten_head(this_conn->tx_buf, hdr_ackno);
-          // printf("ack_count: %i\n", GET_ACK_COUNT(this_conn->flags));
-
-          if (this_conn->seqno == hdr_ackno) {
-            tcplib_extern_acked(this_conn);
-          }
-        } else if (this_conn->seqno > circ_get_seqno(this_conn->tx_buf)) {
-          // this is a duplicate ACK
-          //  - increase the counter of the number of duplicate ACKs
-          //  - if we get to three duplicate ACK's, start resending at
-          //    the ACK number because this probably means we lost a segment
-
-          INCR_ACK_COUNT(this_conn->flags);
-          // printf("ack_count: %i\n", GET_ACK_COUNT(this_conn->flags));
-          // printf("dup ack count: %i\n", GET_ACK_COUNT(this_conn->flags));
-          // a "dup ack count" of 2 is really 3 total acks because we start with zero
-          if (GET_ACK_COUNT(this_conn->flags) == 2) {
-            UNSET_ACK_COUNT(this_conn->flags);
-            printf("detected multiple duplicate ACKs-- doing fast retransmit [%u, %u]\n",
-                   circ_get_seqno(this_conn->tx_buf),
-                   this_conn->seqno);
-
-            // this is our detection of a "duplicate ack" event.
-            // we are going to reset ssthresh and retransmit the data.
-            reset_ssthresh(this_conn);
-            tcplib_output(this_conn, circ_get_seqno(this_conn->tx_buf));
-            this_conn->timer.retx = 6;
-            
-          }
-        }
+        tcplib_process_ack(this_conn, tcph, payload_len);
 
         if (hdr_seqno != this_conn->ackno) {
           printf("==> received forward segment\n");
@@ -576,6 +906,7 @@ int tcplib_bind(struct tcplib_sock *sock,
     return -1;
   
   memcpy(&sock->l_ep, addr, sizeof(struct sockaddr_in6));
+  conn_rehash(sock);
   /* passive open */
   sock->state = TCP_LISTEN;
   return 0;
@@ -604,32 +935,44 @@ int tcplib_connect(struct tcplib_sock *sock,
 
   sock->ackno = 0;
   sock->seqno = 0xcafebabe;
+  sock->cc_flags = 0;
   memcpy(&sock->r_ep, serv_addr, sizeof(struct sockaddr_in6));
+  conn_rehash(sock);
   tcplib_send_ack(sock, 0, TCP_FLAG_SYN);
   sock->state = TCP_SYN_SENT;
   sock->seqno++;
+  sock->snd_nxt = sock->seqno;
+  sock->recover = sock->seqno - 1;
   sock->timer.retx = 6;
 
   return 0;
 }
 
 
-int tcplib_send(struct tcplib_sock *sock, void *data, int len) {
+int tcplib_send_iov(struct tcplib_sock *sock, struct ip_iovec *iov) {
+  uint32_t seqno = sock->seqno;
+  int len = iov_len(iov);
+
   /* have enough tx buffer left? */
   if (sock->state != TCP_ESTABLISHED)
     return -1;
-  if (sock->seqno - circ_get_seqno(sock->tx_buf) + len > sock->tx_buf_len) // circ_get_window(sock->tx_buf))
-    return -1;
-  if (circ_buf_write(sock->tx_buf, sock->seqno, data, len) < 0)
+  if (sock->seqno - circ_get_seqno(sock->tx_buf) + len > circ_get_window(sock->tx_buf))
     return -1;
+  for (; iov != NULL; iov = iov->iov_next) {
+    if (circ_buf_write(sock->tx_buf, seqno, iov->iov_base, iov->iov_len) < 0)
+      return -1;
+    seqno += iov->iov_len;
+  }
 
-  sock->seqno += len;
+  sock->seqno = seqno;
   // printf("tcplib_output from send\n");
   // tcplib_output(sock, sock->seqno - len);
 
   // this will let multiple calls to send() get combined into a single packet
-  // the data will be sent out next time the timer fires
-  sock->timer.retx = 1;
+  // the data will be sent out next time the timer fires.  While data is
+  // in flight the ACKs coming back send it instead.
+  if (sock->snd_nxt == circ_get_seqno(sock->tx_buf))
+    sock->timer.retx = 1;
   
   // 3 seconds
   //if (sock->timer.retx == 0)
@@ -638,26 +981,47 @@ int tcplib_send(struct tcplib_sock *sock, void *data, int len) {
   return 0;
 }
 
+int tcplib_send(struct tcplib_sock *sock, void *data, int len) {
+  struct ip_iovec v;
+  v.iov_base = data;
+  v.iov_len = len;
+  v.iov_next = NULL;
+  return tcplib_send_iov(sock, &v);
+}
+
 void tcplib_retx_expire(struct tcplib_sock *sock) {
   // printf("retransmission timer expired!\n");
   sock->retxcnt++;
   switch (sock->state) {
   case TCP_ESTABLISHED:
-    if (circ_get_seqno(sock->tx_buf) != sock->seqno) {
+    if (circ_get_seqno(sock->tx_buf) != sock->snd_nxt) {
       printf("retransmitting [%u, %u]\n", circ_get_seqno(sock->tx_buf),
-             sock->seqno);
+             sock->snd_nxt);
       reset_ssthresh(sock);
-      // restart slow start
+      // restart slow start from the first byte not ACKed, and don't
+      // fast retransmit anything sent before this
       sock->cwnd = ONE_SEGMENT(sock);
+      sock->recover = sock->snd_nxt;
+      sock->snd_nxt = circ_get_seqno(sock->tx_buf);
+      sock->cc_flags &= ~TCP_CC_RECOVERY;
+      UNSET_ACK_COUNT(sock->flags);
+#if TCPLIB_SACK_BLOCKS > 0
+      memset(sock->sack, 0, sizeof(sock->sack));
+#endif
       // printf("tcplib_output from timer\n");
-      tcplib_output(sock, circ_get_seqno(sock->tx_buf));
-      sock->timer.retx = 6;
+      tcplib_output(sock);
+      sock->timer.retx = TCPLIB_RTO;
     } else {
+      // new data from tcplib_send
       sock->retxcnt--;
+      tcplib_output(sock);
     }
     break;
   case TCP_SYN_SENT:
+    // the SYN has the sequence number before the first data byte
+    sock->seqno--;
     tcplib_send_ack(sock, 0, TCP_FLAG_SYN);
+    sock->seqno++;
     sock->timer.retx = 6;
     break;
   case TCP_LAST_ACK:
@@ -700,6 +1064,7 @@ int tcplib_abort(struct tcplib_sock *sock) {
     tcplib_send_ack(sock, 0, TCP_FLAG_RST);
     memset(&sock->l_ep, 0, sizeof(struct sockaddr_in6));
     memset(&sock->r_ep, 0, sizeof(struct sockaddr_in6));
+    conn_rehash(sock);
     sock->state = TCP_CLOSED;
   }
   return 0;
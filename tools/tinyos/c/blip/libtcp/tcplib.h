@@ -60,18 +60,42 @@ enum {
   TCP_ACKSENT     = 0x80,
 };
 
+/* congestion control state, in cc_flags */
+enum {
+  /* in NewReno fast recovery until recover is acked */
+  TCP_CC_RECOVERY = 0x1,
+  /* the other end agreed to send SACK options */
+  TCP_CC_SACK     = 0x2,
+};
+
 enum {
   /* how many timer tics to stay in TIME_WAIT */
   TCPLIB_TIMEWAIT_LEN = 1,
   TCPLIB_2MSL = 4,
   /* how many un-acked retransmissions before we give up the connection */
   TCPLIB_GIVEUP = 6,
+  /* retransmission timeout, in timer tics */
+  TCPLIB_RTO = 6,
+  /* duplicate ACKs which start a fast retransmit */
+  TCPLIB_DUPACK_THRESH = 3,
 };
 
 #define GET_ACK_COUNT(X)    (((X) & TCP_DUPACKS) >> TCP_DUPACKS_OFF)
 #define UNSET_ACK_COUNT(X)  ((X) &= ~TCP_DUPACKS)
 #define INCR_ACK_COUNT(X)   ((X) += 1 << TCP_DUPACKS_OFF)
 
+/* number of SACK blocks remembered for each socket; 0 leaves SACK
+   out.  Every block takes eight bytes of RAM per socket. */
+#ifndef TCPLIB_SACK_BLOCKS
+#define TCPLIB_SACK_BLOCKS 2
+#endif
+
+/* buckets in the table used to look up the socket for a segment;
+   a power of two */
+#ifndef TCPLIB_HASH_SIZE
+#define TCPLIB_HASH_SIZE 8
+#endif
+
 struct tcplib_sock {
   uint8_t flags;
   
@@ -109,10 +133,30 @@ struct tcplib_sock {
   /* retransmission counter */
   uint16_t retxcnt;
 
-  /* this needs to be at the end so
+  /* the next new sequence number to send; everything up to seqno
+     has been written to tx_buf */
+  uint32_t snd_nxt;
+  /* fast recovery ends once this is acked */
+  uint32_t recover;
+  uint8_t cc_flags;
+
+#if TCPLIB_SACK_BLOCKS > 0
+  /* the scoreboard: blocks the other end has reported received above
+     the cumulative ACK, sorted and not overlapping.  Empty blocks
+     have start == end. */
+  struct {
+    uint32_t start;
+    uint32_t end;
+  } sack[TCPLIB_SACK_BLOCKS];
+  /* holes below this have been retransmitted in this recovery */
+  uint32_t rtx_nxt;
+#endif
+
+  /* these need to be at the end so
      we can call init() on a socket
      without blowing away the linked
-     list */
+     lists */
+  struct tcplib_sock *hnext;
   struct tcplib_sock *next;
 };
 
@@ -179,6 +223,15 @@ int tcplib_connect(struct tcplib_sock *sock,
 int tcplib_send(struct tcplib_sock *sock,
                  void *data, int len);
 
+/* send the data in an iovec chain, which is copied straight into the
+ * socket's tx buffer.  All of it is taken or none.
+ *
+ * returns: 0 on success, -1 if there is not enough room in the tx
+ * buffer or the socket is not connected.
+ */
+int tcplib_send_iov(struct tcplib_sock *sock,
+                    struct ip_iovec *iov);
+
 int tcplib_close(struct tcplib_sock *sock);
 
 /* abort a connection 
@@ -0,0 +1,363 @@
+/*
+ * Pushes a stream through tcplib over a simulated lossy link and
+ * reports the goodput, to see how the congestion control copes.
+ *
+ * The link has a fixed delay and rate in each direction and a short
+ * drop tail queue, and loses packets at random.  A tcplib socket sends
+ * a pattern to one of three receivers:
+ *
+ *   tcplib  another tcplib socket, as on a mote
+ *   host    a receiver which buffers out of order data, as a host
+ *           stack would, but does not do SACK
+ *   sack    the same with SACK
+ *
+ * Every byte is checked on its way out.  For each loss rate the mean
+ * goodput over a number of runs is printed, along with how many bytes
+ * were sent for each byte of the stream.
+ *
+ * usage: test_loss [stream bytes] [runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* tcplib talks a lot */
+#define printf(...)
+#include "tcplib.h"
+/* tcplib.c calls out to these, they are defined below */
+void tcplib_extern_recv(struct tcplib_sock *sock, void *data, int len);
+void tcplib_extern_connectdone(struct tcplib_sock *sock, int error);
+void tcplib_extern_acked(struct tcplib_sock *sock);
+void tcplib_extern_closed(struct tcplib_sock *sock);
+void tcplib_extern_closedone(struct tcplib_sock *sock);
+#include "tcplib.c"
+#include "circ.c"
+#undef printf
+
+#define LINK_DELAY   30     /* ms */
+#define LINK_RATE    50     /* bits per ms */
+#define LINK_QUEUE   16
+#define PKT_MAX      320
+#define TX_BUF_LEN   1100
+#define HOST_WIND    4096
+#define TIMER_PERIOD 500    /* ms, tcplib_timer_process */
+#define GIVEUP       600000 /* ms */
+
+enum {
+  RECV_TCPLIB,
+  RECV_HOST,
+  RECV_SACK,
+};
+
+struct pkt {
+  long at;
+  int len;
+  uint8_t data[PKT_MAX];
+};
+
+struct link {
+  struct pkt q[LINK_QUEUE];
+  int head, n;
+  long free_at;
+} links[2];                     /* 0 is client to receiver */
+
+struct sockaddr_in6 client_addr, recv_addr;
+struct tcplib_sock client, server;
+uint8_t client_buf[TX_BUF_LEN], server_buf[TX_BUF_LEN];
+
+long now;
+double loss;
+int receiver;
+uint32_t stream_len, written, delivered, sent;
+int corrupt;
+
+struct {
+  uint32_t irs, rcv_nxt;
+  int sack_ok;
+  uint8_t got[HOST_WIND];
+  uint8_t buf[HOST_WIND];
+} host;
+
+uint8_t pattern(uint32_t i) {
+  return i ^ (i >> 8) ^ 0x5a;
+}
+
+void link_send(int dir, void *data, int len) {
+  struct link *l = &links[dir];
+  struct pkt *p;
+  long depart;
+
+  if (l->n == LINK_QUEUE || len > PKT_MAX)
+    return;
+  depart = (l->free_at > now ? l->free_at : now) +
+    (len * 8 + LINK_RATE - 1) / LINK_RATE;
+  l->free_at = depart;
+  if (rand() < loss * RAND_MAX)
+    return;
+  p = &l->q[(l->head + l->n++) % LINK_QUEUE];
+  p->at = depart + LINK_DELAY;
+  p->len = len;
+  memcpy(p->data, data, len);
+}
+
+void deliver(uint8_t *data, int len) {
+  int i;
+  for (i = 0; i < len; i++) {
+    if (data[i] != pattern(delivered + i))
+      corrupt = 1;
+  }
+  delivered += len;
+}
+
+void tcplib_send_out(struct ip6_packet *msg, struct tcp_hdr *tcph) {
+  uint8_t buf[PKT_MAX];
+  struct ip6_hdr *iph = (struct ip6_hdr *)buf;
+  struct ip_iovec *v;
+  int len = sizeof(struct ip6_hdr), dir;
+
+  dir = memcmp(&msg->ip6_hdr.ip6_dst, &recv_addr.sin6_addr, 16) != 0;
+  memcpy(buf, &msg->ip6_hdr, sizeof(struct ip6_hdr));
+  memcpy(&iph->ip6_src, dir ? &recv_addr.sin6_addr : &client_addr.sin6_addr, 16);
+  for (v = msg->ip6_data; v != NULL; v = v->iov_next) {
+    if (len + v->iov_len > PKT_MAX)
+      return;
+    memcpy(buf + len, v->iov_base, v->iov_len);
+    len += v->iov_len;
+  }
+  if (dir == 0)
+    sent += ntohs(iph->ip6_plen) - tcph->offset / 4;
+  link_send(dir, buf, len);
+}
+
+struct tcplib_sock *tcplib_accept(struct tcplib_sock *conn,
+                                  struct sockaddr_in6 *from) {
+  conn->tx_buf = server_buf;
+  conn->tx_buf_len = sizeof(server_buf);
+  return conn;
+}
+
+void tcplib_extern_recv(struct tcplib_sock *sock, void *data, int len) {
+  if (sock == &server)
+    deliver(data, len);
+}
+
+void tcplib_extern_connectdone(struct tcplib_sock *sock, int error) {}
+void tcplib_extern_acked(struct tcplib_sock *sock) {}
+void tcplib_extern_closed(struct tcplib_sock *sock) {}
+void tcplib_extern_closedone(struct tcplib_sock *sock) {}
+
+/* the host receiver's ACK, with SACK blocks for what it holds out of
+   order; the block with the segment just in goes first */
+void host_ack(uint8_t flags, uint32_t seg_seqno) {
+  uint8_t buf[sizeof(struct ip6_hdr) + sizeof(struct tcp_hdr) + 28];
+  struct ip6_hdr *iph = (struct ip6_hdr *)buf;
+  struct tcp_hdr *tcph = (struct tcp_hdr *)(iph + 1);
+  uint8_t *opt = (uint8_t *)(tcph + 1);
+  uint32_t blocks[3][2], start, end;
+  int n = 0, optlen = 0, i, b;
+
+  if (flags & TCP_FLAG_SYN) {
+    if (host.sack_ok) {
+      opt[0] = TCP_OPT_NOP;
+      opt[1] = TCP_OPT_NOP;
+      opt[2] = TCP_OPT_SACK_PERM;
+      opt[3] = 2;
+      optlen = 4;
+    }
+  } else if (host.sack_ok) {
+    for (start = host.rcv_nxt; SEQ_LT(start, host.rcv_nxt + HOST_WIND) && n < 3;) {
+      if (!host.got[start % HOST_WIND]) {
+        start++;
+        continue;
+      }
+      for (end = start; SEQ_LT(end, host.rcv_nxt + HOST_WIND) &&
+             host.got[end % HOST_WIND]; end++);
+      i = n++;
+      if (SEQ_GEQ(seg_seqno, start) && SEQ_LT(seg_seqno, end)) {
+        for (; i > 0; i--) {
+          blocks[i][0] = blocks[i - 1][0];
+          blocks[i][1] = blocks[i - 1][1];
+        }
+      }
+      blocks[i][0] = start;
+      blocks[i][1] = end;
+      start = end;
+    }
+    if (n > 0) {
+      opt[0] = TCP_OPT_NOP;
+      opt[1] = TCP_OPT_NOP;
+      opt[2] = TCP_OPT_SACK;
+      opt[3] = 2 + 8 * n;
+      for (i = 0; i < n; i++) {
+        for (b = 0; b < 2; b++) {
+          uint32_t s = htonl(blocks[i][b]);
+          memcpy(opt + 4 + 8 * i + 4 * b, &s, 4);
+        }
+      }
+      optlen = 4 + 8 * n;
+    }
+  }
+
+  memset(buf, 0, sizeof(struct ip6_hdr) + sizeof(struct tcp_hdr));
+  iph->ip6_vfc = IPV6_VERSION;
+  iph->ip6_nxt = IANA_TCP;
+  iph->ip6_plen = htons(sizeof(struct tcp_hdr) + optlen);
+  memcpy(&iph->ip6_src, &recv_addr.sin6_addr, 16);
+  memcpy(&iph->ip6_dst, &client_addr.sin6_addr, 16);
+  tcph->srcport = recv_addr.sin6_port;
+  tcph->dstport = client.l_ep.sin6_port;
+  tcph->seqno = htonl(1000 + !(flags & TCP_FLAG_SYN));
+  tcph->ackno = htonl(host.rcv_nxt);
+  tcph->offset = (sizeof(struct tcp_hdr) + optlen) * 4;
+  tcph->flags = flags;
+  tcph->window = htons(HOST_WIND);
+  link_send(1, buf, sizeof(struct ip6_hdr) + sizeof(struct tcp_hdr) + optlen);
+}
+
+void host_input(struct ip6_hdr *iph, struct tcp_hdr *tcph) {
+  uint8_t *data = ((uint8_t *)tcph) + tcph->offset / 4;
+  int len = ntohs(iph->ip6_plen) - tcph->offset / 4, i;
+  uint32_t seqno = ntohl(tcph->seqno);
+
+  if (tcph->flags & TCP_FLAG_SYN) {
+    host.irs = seqno;
+    host.rcv_nxt = seqno + 1;
+    host.sack_ok = receiver == RECV_SACK &&
+      tcp_find_opt(tcph, TCP_OPT_SACK_PERM) != NULL;
+    memset(host.got, 0, sizeof(host.got));
+    host_ack(TCP_FLAG_SYN | TCP_FLAG_ACK, 0);
+    return;
+  }
+  if (len <= 0)
+    return;
+
+  for (i = 0; i < len; i++) {
+    uint32_t b = seqno + i;
+    if (SEQ_GEQ(b, host.rcv_nxt) && SEQ_LT(b, host.rcv_nxt + HOST_WIND)) {
+      host.got[b % HOST_WIND] = 1;
+      host.buf[b % HOST_WIND] = data[i];
+    }
+  }
+  while (host.got[host.rcv_nxt % HOST_WIND]) {
+    host.got[host.rcv_nxt % HOST_WIND] = 0;
+    deliver(&host.buf[host.rcv_nxt % HOST_WIND], 1);
+    host.rcv_nxt++;
+  }
+  host_ack(TCP_FLAG_ACK, seqno);
+}
+
+void link_deliver(int dir) {
+  struct link *l = &links[dir];
+  struct pkt *p;
+  struct ip6_hdr *iph;
+
+  while (l->n > 0 && l->q[l->head].at <= now) {
+    p = &l->q[l->head];
+    l->head = (l->head + 1) % LINK_QUEUE;
+    l->n--;
+    iph = (struct ip6_hdr *)p->data;
+    if (dir == 0 && receiver != RECV_TCPLIB)
+      host_input(iph, (struct tcp_hdr *)(iph + 1));
+    else
+      tcplib_process(iph, iph + 1);
+  }
+}
+
+/* returns the time in ms it took to get the stream through */
+long run() {
+  uint8_t chunk[100];
+  struct ip_iovec v[2];
+  int len, i;
+
+  tcplib_abort(&client);
+  tcplib_abort(&server);
+  ip_malloc_init();
+  memset(links, 0, sizeof(links));
+  now = 0;
+  written = delivered = sent = 0;
+  corrupt = 0;
+
+  tcplib_init_sock(&client);
+  client.tx_buf = client_buf;
+  client.tx_buf_len = sizeof(client_buf);
+  if (receiver == RECV_TCPLIB) {
+    tcplib_init_sock(&server);
+    tcplib_bind(&server, &recv_addr);
+    server.my_wind = HOST_WIND;
+  }
+  tcplib_connect(&client, &recv_addr);
+
+  for (now = 1; now < GIVEUP && delivered < stream_len && !corrupt; now++) {
+    link_deliver(0);
+    link_deliver(1);
+    if (now % TIMER_PERIOD == 0)
+      tcplib_timer_process();
+
+    while (client.state == TCP_ESTABLISHED && written < stream_len) {
+      len = stream_len - written < sizeof(chunk) ? stream_len - written : sizeof(chunk);
+      for (i = 0; i < len; i++)
+        chunk[i] = pattern(written + i);
+      /* every other write goes in two pieces */
+      if (written % 200) {
+        v[0].iov_base = chunk;
+        v[0].iov_len = len / 3;
+        v[0].iov_next = &v[1];
+        v[1].iov_base = chunk + len / 3;
+        v[1].iov_len = len - len / 3;
+        v[1].iov_next = NULL;
+        if (tcplib_send_iov(&client, v) < 0)
+          break;
+      } else if (tcplib_send(&client, chunk, len) < 0) {
+        break;
+      }
+      written += len;
+    }
+  }
+  return now;
+}
+
+int main(int argc, char **argv) {
+  const char *names[] = {"tcplib", "host", "sack"};
+  double rates[] = {0, 0.05, 0.1, 0.2};
+  int runs = 10, r, i, failed;
+  double goodput, overhead;
+  long t;
+
+  stream_len = argc > 1 ? atoi(argv[1]) : 20000;
+  if (argc > 2)
+    runs = atoi(argv[2]);
+
+  inet_pton6("fe80::1", &client_addr.sin6_addr);
+  inet_pton6("fe80::2", &recv_addr.sin6_addr);
+  recv_addr.sin6_port = htons(7);
+
+  printf("%u bytes, %i ms and %i kbit/s each way, %i runs\n", stream_len,
+         LINK_DELAY, LINK_RATE, runs);
+  printf("%-8s %5s %14s %12s %7s\n", "receiver", "loss", "goodput kbit/s",
+         "sent/stream", "failed");
+  for (receiver = RECV_TCPLIB; receiver <= RECV_SACK; receiver++) {
+    for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+      loss = rates[r];
+      goodput = overhead = 0;
+      failed = 0;
+      for (i = 0; i < runs; i++) {
+        srand(i + 1);
+        t = run();
+        if (corrupt || delivered < stream_len) {
+          failed++;
+          continue;
+        }
+        goodput += (double)stream_len * 8 / t;
+        overhead += (double)sent / stream_len;
+      }
+      if (failed < runs) {
+        goodput /= runs - failed;
+        overhead /= runs - failed;
+      }
+      printf("%-8s %4.0f%% %14.2f %12.2f %7i\n", names[receiver], loss * 100,
+             goodput, overhead, failed);
+    }
+  }
+  return 0;
+}
@@ -60,6 +60,8 @@ static void usage(char *name) {
 
 motecom_conn_t mcs_conn;
 
+#define PKT_BATCH 8
+
 
 int
 main(int argc, char **argv) {
@@ -67,9 +69,10 @@ main(int argc, char **argv) {
   char *prog_name, *p;
   struct sockaddr_am *am_l,         *am_r;
   struct sockaddr_am  am_local_addr, am_remote_addr;
-  socklen_t slen;
+  struct sockaddr_am  am_src[PKT_BATCH];
+  struct mn_mmsghdr   msgs[PKT_BATCH];
   char    buff[256];
-  uint8_t pkt[1024];
+  uint8_t pkt[PKT_BATCH][MN_MAX_PACKET];
 
   prog_name = basename(argv[0]);
 
@@ -122,21 +125,33 @@ main(int argc, char **argv) {
     exit(1);
   }
 
+  /*
+   * take whatever packets are there, up to PKT_BATCH at a time
+   */
   for (;;) {
-    int len, i;
+    int n, len, i, j;
 
-    slen = sizeof(*am_r);
-    len = mn_recvfrom(fd, &pkt, 1024, 0, (SA *) am_r, &slen);
-    if (len == 0)
+    for (j = 0; j < PKT_BATCH; j++) {
+      msgs[j].msg_buf     = pkt[j];
+      msgs[j].msg_buflen  = sizeof(pkt[j]);
+      msgs[j].msg_name    = (SA *) &am_src[j];
+      msgs[j].msg_namelen = sizeof(am_src[j]);
+    }
+    n = mn_recvmmsg(fd, msgs, PKT_BATCH, 0);
+    if (n == 0)
       exit(0);
-    if (len < 0) {
-      fprintf(stderr, "%s: mn_recvfrom: %s (%d)\n", prog_name, strerror(errno), errno);
+    if (n < 0) {
+      fprintf(stderr, "%s: mn_recvmmsg: %s (%d)\n", prog_name, strerror(errno), errno);
       exit(1);
     }
-    printf("%04x:%02x (%d) (l: %d): ", ntohs(am_r->sam_addr), am_r->sam_type, am_r->sam_type, len);
-    for (i = 0; i < len; i++)
-      printf("%02x ", pkt[i]);
-    putchar('\n');
+    for (j = 0; j < n; j++) {
+      am_r = &am_src[j];
+      len  = msgs[j].msg_len;
+      printf("%04x:%02x (%d) (l: %d): ", ntohs(am_r->sam_addr), am_r->sam_type, am_r->sam_type, len);
+      for (i = 0; i < len; i++)
+	printf("%02x ", pkt[j][i]);
+      putchar('\n');
+    }
     fflush(stdout);
   }
 }
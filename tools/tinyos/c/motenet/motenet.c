@@ -57,8 +57,10 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -97,7 +99,7 @@ typedef struct {
 } fd_mcs_t;
 
 
-#define MAX_FD_MCS 5
+#define MAX_FD_MCS 32
 
 static fd_mcs_t mn_fd_mcs[MAX_FD_MCS];		/* init's to NULL */
 
@@ -507,8 +509,12 @@ mn_socket(motecom_conn_t *mcs, int domain, int type, int protocol) {
 
     case MCS_SERIAL:
       errno = 0;
+      /*
+       * always non-blocking underneath, am_next_packet waits on the fd
+       * itself when the socket is blocking.
+       */
       mcs->serial_src = open_serial_source(mcs->dev, platform_baud_rate(mcs->baud),
-					   0, __mn_serial_msg);
+					   1, __mn_serial_msg);
       if (mcs->serial_src == NULL) {
 	if (errno == 0)
 	  errno = EINVAL;
@@ -526,22 +532,33 @@ mn_socket(motecom_conn_t *mcs, int domain, int type, int protocol) {
   slot->mcs = mcs;
   mcs->family = domain;
   mcs->socktype = type;
+  mcs->nonblock = 0;
+  mcs->rx_pos = mcs->rx_used = 0;
   return fd;
 }
 
 
-static motecom_conn_t *
-find_mcs(int fd) {
+static fd_mcs_t *
+find_slot(int fd) {
   int i;
 
   for (i = 0; i < MAX_FD_MCS; i++) {
-    if (mn_fd_mcs[i].fd == fd)
-      return mn_fd_mcs[i].mcs;
+    if (mn_fd_mcs[i].mcs && mn_fd_mcs[i].fd == fd)
+      return &mn_fd_mcs[i];
   }
   return NULL;
 }
 
 
+static motecom_conn_t *
+find_mcs(int fd) {
+  fd_mcs_t *slot;
+
+  slot = find_slot(fd);
+  return (slot ? slot->mcs : NULL);
+}
+
+
 int
 mn_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
   motecom_conn_t *mcs;
@@ -601,13 +618,18 @@ mn_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 int
 mn_close(int sockfd) {
   int ret;
+  fd_mcs_t *slot;
   motecom_conn_t *mcs;
 
-  mcs = find_mcs(sockfd);
-  if (!mcs) {
+  slot = find_slot(sockfd);
+  if (!slot) {
     errno = EINVAL;
     return -1;
   }
+  mcs = slot->mcs;
+  slot->mcs = NULL;			/* give the slot back */
+  slot->fd  = -1;
+  mcs->rx_pos = mcs->rx_used = 0;
   if (mcs->ai) {
     freeaddrinfo(mcs->ai);
     mcs->ai = NULL;
@@ -633,26 +655,66 @@ mn_close(int sockfd) {
 }
 
 
-static ssize_t
-am_send_packet(motecom_conn_t *mcs, struct sockaddr_am *am_dest,
-	       const void *buf, size_t len) {
-  void *packet;
-  int out_len, i;
-  am_hdr_t *amh;			/* am header in packet */
-  struct sockaddr_am *aml;		/* our local information */
+/*
+ * mn_set_nonblock: switch a socket between blocking and non-blocking
+ *
+ * input: sockfd	socket file descriptor (from mn_socket)
+ *	  nonblock	non-zero, receives return -1 (EAGAIN) instead of
+ *			waiting when no packet is there.
+ *
+ * MSG_DONTWAIT does the same for a single receive.  Sends still wait
+ * until the packet has been handed to the gateway or serial port.
+ *
+ * sockfd can be handed to poll/select.  Packets are buffered above the
+ * fd though, so once it polls readable keep receiving until EAGAIN
+ * before waiting on it again.
+ */
 
-  packet = malloc(len + AM_HDR_LEN);
-  if (!packet) {
-    errno = ENOMEM;
+int
+mn_set_nonblock(int sockfd, int nonblock) {
+  motecom_conn_t *mcs;
+  int fl;
+
+  mcs = find_mcs(sockfd);
+  if (!mcs) {
+    errno = EINVAL;
     return -1;
   }
+  if (mcs->mc_src == MCS_DIRECT) {
+    fl = fcntl(sockfd, F_GETFL);
+    if (fl < 0)
+      return -1;
+    fl = (nonblock ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK));
+    if (fcntl(sockfd, F_SETFL, fl) < 0)
+      return -1;
+  }
+  mcs->nonblock = (nonblock != 0);
+  return 0;
+}
+
+
+/*
+ * build the AM packet for a send in packet (MN_MAX_PACKET bytes).
+ *
+ * RAW is assumed to be properly constructed.  DGRAM needs the header
+ * put on the front.
+ *
+ * returns:	length of the packet, -1 (errno set) if it can't be sent.
+ */
+
+static int
+am_build_packet(motecom_conn_t *mcs, struct sockaddr_am *am_dest,
+		const void *buf, size_t len, uint8_t *packet) {
+  int out_len, i;
+  am_hdr_t *amh;			/* am header in packet */
+  struct sockaddr_am *aml;		/* our local information */
 
-  /*
-   * Add a header if needed....   RAW is assumed to be properly constructed.
-   * DGRAM needs the header put on the front.
-   */
   switch(mcs->socktype) {
     case SOCK_RAW:
+      if (len > MN_MAX_PACKET) {
+	errno = EMSGSIZE;
+	return -1;
+      }
       memcpy(packet, buf, len);
       out_len = len;
       break;
@@ -660,10 +722,13 @@ am_send_packet(motecom_conn_t *mcs, struct sockaddr_am *am_dest,
     case SOCK_DGRAM:
       if (!am_dest || am_dest->sam_family != AF_AM) {
 	errno = EINVAL;
-	free(packet);
 	return -1;
       }
-      amh = packet;
+      if (len > MN_MAX_PACKET - AM_HDR_LEN) {
+	errno = EMSGSIZE;
+	return -1;
+      }
+      amh = (am_hdr_t *) packet;
       aml = &mcs->am_local;
       if (mn_debug && aml->sam_type == 0)
 	fprintf(stderr, "*** warning: send with local_type set to 0\n");
@@ -679,29 +744,100 @@ am_send_packet(motecom_conn_t *mcs, struct sockaddr_am *am_dest,
 
     default:
       errno = EINVAL;
-      free(packet);
       return -1;
   }
 
   if (mn_debug) {
-    amh = packet;
+    amh = (am_hdr_t *) packet;
     fprintf(stderr, "%04x:%d (%02x) (l: %d): ", ntohs(amh->am_dest),
 	    amh->am_type, amh->am_type, out_len);
     for (i = 0; i < out_len; i++)
-      fprintf(stderr, "%02x ", ((uint8_t *) packet)[i]);
+      fprintf(stderr, "%02x ", packet[i]);
     fprintf(stderr, "\n");
   }
+  return out_len;
+}
 
-  switch(mcs->mc_src) {
-    case MCS_SERVER: write_sf_packet(mcs->sock_fd, packet, out_len);      break;
-    case MCS_SERIAL: write_serial_packet(mcs->serial_src, packet, out_len); break;
-    default:
-      errno = EINVAL;
-      free(packet);
+
+static int
+sf_write(int fd, const uint8_t *buf, int len) {
+  int n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
       return -1;
+    buf += n;
+    len -= n;
   }
-  free(packet);
-  return out_len;
+  return 0;
+}
+
+
+/*
+ * send a batch of packets to the AM lower layer
+ *
+ * Server (sf) packets are gathered, length prefixed, in one buffer and
+ * go out with a single write.  Serial packets are queued so that a node
+ * speaking the window protocol gets them back to back, and the acks are
+ * waited for once at the end (see queue_serial_packet).
+ *
+ * msg_name of each message is the destination, NULL for the connected
+ * remote.  msg_len is set to the packet length, header included, as
+ * mn_send returns it.
+ *
+ * returns:	number of packets sent, -1 (errno set) if none were.
+ */
+
+static int
+am_send_batch(motecom_conn_t *mcs, struct mn_mmsghdr *msgvec, unsigned int vlen) {
+  uint8_t out[MC_RX_SIZE];
+  int out_used, out_msgs, sent, len;
+  unsigned int i;
+  struct sockaddr_am *dst;
+
+  if (mcs->mc_src != MCS_SERVER && mcs->mc_src != MCS_SERIAL) {
+    errno = EINVAL;
+    return -1;
+  }
+  out_used = out_msgs = sent = 0;
+  for (i = 0; i < vlen; i++) {
+    if (msgvec[i].msg_name)
+      dst = (struct sockaddr_am *) msgvec[i].msg_name;
+    else
+      dst = &mcs->am_remote;
+
+    if (mcs->mc_src == MCS_SERVER) {
+      if (out_used + 1 + MN_MAX_PACKET > sizeof(out)) {
+	if (sf_write(mcs->sock_fd, out, out_used) < 0)
+	  break;
+	sent += out_msgs;
+	out_used = out_msgs = 0;
+      }
+      len = am_build_packet(mcs, dst, msgvec[i].msg_buf, msgvec[i].msg_buflen,
+			    &out[out_used + 1]);
+      if (len < 0)
+	break;
+      out[out_used] = len;
+      out_used += len + 1;
+      out_msgs++;
+    } else {
+      len = am_build_packet(mcs, dst, msgvec[i].msg_buf, msgvec[i].msg_buflen,
+			    out);
+      if (len < 0 || queue_serial_packet(mcs->serial_src, out, len) < 0)
+	break;
+      sent++;
+    }
+    msgvec[i].msg_len = len;
+  }
+
+  if (out_used && sf_write(mcs->sock_fd, out, out_used) == 0)
+    sent += out_msgs;
+  if (mcs->mc_src == MCS_SERIAL && sent)
+    flush_serial_packets(mcs->serial_src);
+  return (sent ? sent : -1);
 }
 
 
@@ -709,8 +845,7 @@ ssize_t
 mn_sendto(int sockfd, const void *buf, size_t len, int flags,
 	      const struct sockaddr *dest_addr, socklen_t addrlen){
   motecom_conn_t *mcs;
-  int out_len;
-  struct sockaddr_am *dst;
+  struct mn_mmsghdr msg;
 
   mcs = find_mcs(sockfd);
   if (!mcs || !buf || !len) {
@@ -721,104 +856,262 @@ mn_sendto(int sockfd, const void *buf, size_t len, int flags,
   if (mcs->mc_src == MCS_DIRECT)
     return send(sockfd, buf, len, flags);
 
-  if (dest_addr)
-    dst = (struct sockaddr_am *) dest_addr;
-  else
-    dst = &mcs->am_remote;
-  out_len = am_send_packet(mcs, dst, buf, len);
-  return out_len;
+  msg.msg_buf     = (void *) buf;
+  msg.msg_buflen  = len;
+  msg.msg_name    = (struct sockaddr *) dest_addr;
+  msg.msg_namelen = addrlen;
+  if (am_send_batch(mcs, &msg, 1) < 0)
+    return -1;
+  return msg.msg_len;
 }
 
 
 ssize_t
 mn_send(int sockfd, const void *buf, size_t len, int flags) {
+  return mn_sendto(sockfd, buf, len, flags, NULL, 0);
+}
+
+
+/*
+ * mn_sendmmsg: send a batch of packets
+ *
+ * input: sockfd	socket file descriptor to send on
+ *	  msgvec	vlen messages, see struct mn_mmsghdr.  msg_name
+ *			is the destination, NULL for the connected remote.
+ *	  vlen		number of messages in msgvec
+ *	  flags		flags for send (see sendmmsg(2)), only used by DIRECT
+ *
+ * msg_len of each message sent is filled in with what mn_send would
+ * have returned for it.  Sending stops at the first message that fails.
+ *
+ * returns:	number of messages sent, -1 (errno set) if none were.
+ */
+
+int
+mn_sendmmsg(int sockfd, struct mn_mmsghdr *msgvec, unsigned int vlen,
+	    int flags) {
   motecom_conn_t *mcs;
-  int out_len;
+  unsigned int i;
+  ssize_t n;
 
   mcs = find_mcs(sockfd);
-  if (!mcs || !buf || !len) {
+  if (!mcs || !msgvec) {
     errno = EINVAL;
     return -1;
   }
+  if (vlen == 0)
+    return 0;
 
-  if (mcs->mc_src == MCS_DIRECT)
-    return send(sockfd, buf, len, flags);
+  if (mcs->mc_src != MCS_DIRECT)
+    return am_send_batch(mcs, msgvec, vlen);
 
-  out_len = am_send_packet(mcs, &mcs->am_remote, buf, len);
-  return out_len;
+  for (i = 0; i < vlen; i++) {
+    n = sendto(sockfd, msgvec[i].msg_buf, msgvec[i].msg_buflen, flags,
+	       msgvec[i].msg_name, msgvec[i].msg_namelen);
+    if (n < 0)
+      break;
+    msgvec[i].msg_len = n;
+  }
+  return (i ? i : -1);
 }
 
 
 /*
- * receive an AM packet with filtering from AM lower layer
+ * input filtering (dest address, group, type) of an AM packet.
+ *
+ * Done on the packet where the lower layer left it, packets we don't
+ * want are never copied.
  *
- * Receive an AM packet from either the server or serial with
- * input filtering (dest address, group, type).
+ * returns:	1 if the socket wants the packet, 0 if not.
  */
 
-static void *
-am_recv_packet(motecom_conn_t *mcs, int *len) {
-  uint8_t *packet;
+static int
+am_accept(motecom_conn_t *mcs, uint8_t *packet, int len) {
   am_hdr_t *amh;			/* am header in packet */
   struct sockaddr_am *aml;		/* our local information */
 
-  if (mcs == NULL || len == NULL)
-    return NULL;
+  /*
+   * SOCK_RAW returns raw protocol information, which is the
+   * uninterpreted data. No address checks, or type checks, etc. are
+   * done.
+   */
+  if (mcs->socktype == SOCK_RAW)
+    return 1;
+
+  if (len < AM_HDR_LEN)
+    return 0;
+
+  amh = (am_hdr_t *) packet;
+  aml = &mcs->am_local;
+
+  /* ignore encaps we don't understand. */
+  if (amh->am_encap != AM_ENCAP_BASIC &&
+      amh->am_encap != AM_ENCAP_LEN16)
+    return 0;
+
+  /*
+   * accept bcast, we're set for any, or its pointed at us
+   * otherwise kick to next packet.
+   */
+  if ((amh->am_dest  != AM_ADDR_BCAST) &&
+      (aml->sam_addr != AM_ADDR_ANY)   &&
+      (aml->sam_addr != amh->am_dest))
+    return 0;
+
+  if ((aml->sam_grp != AM_GRP_ANY) &&
+      (aml->sam_grp != amh->am_grp))
+    return 0;
+
+  if ((aml->sam_type != AM_TYPE_ANY) &&
+      (aml->sam_type != amh->am_type))
+    return 0;
+
+  return 1;
+}
+
+
+/*
+ * wait for fd to become readable.
+ *
+ * returns:	0 readable, -1 on errors or with EAGAIN if dontwait and
+ *		there is nothing to read.
+ */
 
+static int
+am_wait(int fd, int dontwait) {
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
   do {
-    switch (mcs->mc_src) {
-      case MCS_SERVER:	packet = read_sf_packet(mcs->sock_fd, len);      break;
-      case MCS_SERIAL:	packet = read_serial_packet(mcs->serial_src, len); break;
-      default: return NULL;
-    }
+    n = poll(&pfd, 1, (dontwait ? 0 : -1));
+  } while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return -1;
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (!(pfd.revents & POLLIN)) {	/* hangup or error, no data */
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
 
-    if (packet == NULL)
-      return NULL;
 
-    /*
-     * SOCK_RAW returns raw protocol information, which is the
-     * uninterpreted data. No address checks, or type checks, etc. are
-     * done.
-     */
-    if (mcs->socktype == SOCK_RAW)
-      return packet;
+/*
+ * receive an AM packet with filtering from AM lower layer
+ *
+ * Finds the next packet from either the server or serial that passes
+ * am_accept.  The packet stays where the lower layer put it, *packet
+ * points at it until the next call.
+ *
+ * Server packets are parsed straight out of rx_buf, one read brings in
+ * as many as the kernel has buffered.  Serial packets are copied into
+ * rx_buf by serialsource, no allocation either way.
+ *
+ * returns:	1 packet found, 0 end of file, -1 on errors (EAGAIN if
+ *		dontwait and no packet is there).
+ */
 
-    amh = (am_hdr_t *) packet;
-    aml = &mcs->am_local;
+static int
+am_next_packet(motecom_conn_t *mcs, int dontwait, uint8_t **packet, int *len) {
+  int n;
 
-    /* ignore encaps we don't understand. */
-    if (amh->am_encap != AM_ENCAP_BASIC &&
-	amh->am_encap != AM_ENCAP_LEN16) {
-      free(packet);
-      continue;
+  for (;;) {
+    switch (mcs->mc_src) {
+      case MCS_SERVER:
+	if (mcs->rx_pos < mcs->rx_used &&
+	    mcs->rx_pos + 1 + mcs->rx_buf[mcs->rx_pos] <= mcs->rx_used) {
+	  *len = mcs->rx_buf[mcs->rx_pos];
+	  *packet = &mcs->rx_buf[mcs->rx_pos + 1];
+	  mcs->rx_pos += *len + 1;
+	  break;
+	}
+
+	/* partial packet (if any) to the front, then read some more */
+	mcs->rx_used -= mcs->rx_pos;
+	memmove(mcs->rx_buf, &mcs->rx_buf[mcs->rx_pos], mcs->rx_used);
+	mcs->rx_pos = 0;
+	if (am_wait(mcs->sock_fd, dontwait) < 0)
+	  return -1;
+	n = read(mcs->sock_fd, &mcs->rx_buf[mcs->rx_used],
+		 MC_RX_SIZE - mcs->rx_used);
+	if (n < 0 && errno != EINTR)
+	  return -1;
+	if (n == 0)
+	  return 0;
+	if (n > 0)
+	  mcs->rx_used += n;
+	continue;
+
+      case MCS_SERIAL:
+	if (read_serial_packet_into(mcs->serial_src, mcs->rx_buf,
+				    MC_RX_SIZE, len) < 0) {
+	  if (am_wait(serial_source_fd(mcs->serial_src), dontwait) < 0)
+	    return -1;
+	  continue;
+	}
+	*packet = mcs->rx_buf;
+	break;
+
+      default:
+	errno = EINVAL;
+	return -1;
     }
+    if (am_accept(mcs, *packet, *len))
+      return 1;
+  }
+}
 
-    /*
-     * accept bcast, we're set for any, or its pointed at us
-     * otherwise kick to next packet.
-     */
-    if ((amh->am_dest  != AM_ADDR_BCAST) &&
-	(aml->sam_addr != AM_ADDR_ANY)   &&
-	(aml->sam_addr != amh->am_dest)) {
-      free(packet);
-      continue;
-    }
 
-    if ((aml->sam_grp != AM_GRP_ANY) &&
-	(aml->sam_grp != amh->am_grp)) {
-      free(packet);
-      continue;
-    }
+/*
+ * hand an accepted packet to the caller
+ *
+ * RAW gets the whole packet, DGRAM just the payload.  Whatever doesn't
+ * fit into len is lost.  src_addr/addrlen as for mn_recvfrom.
+ */
 
-    if ((aml->sam_type != AM_TYPE_ANY) &&
-	(aml->sam_type != amh->am_type)) {
-      free(packet);
-      continue;
+static ssize_t
+am_copy_out(motecom_conn_t *mcs, uint8_t *packet, int in_len,
+	    void *buf, size_t len,
+	    struct sockaddr *src_addr, socklen_t *addrlen) {
+  am_hdr_t *amh;
+  struct sockaddr_am *ama, am_addr;
+
+  /*
+   * if src_addr non-NULL (requested), return the src of this packet.
+   */
+  if (src_addr != NULL && addrlen != NULL) {
+    amh = (am_hdr_t *) packet;
+    ama = &am_addr;
+    memset(ama, 0, sizeof(*ama));
+    ama->sam_family = AF_AM;
+    if (in_len >= AM_HDR_LEN) {
+      ama->sam_addr = amh->am_src;	/* net order */
+      ama->sam_grp  = amh->am_grp;
+      ama->sam_type = amh->am_type;
     }
-    break;				/* accept the packet */
-  } while (1);
+    if (*addrlen > sizeof(*ama))	/* see recvfrom(2) */
+      *addrlen = sizeof(*ama);
+    memcpy(src_addr, ama, *addrlen);	/* copy over as much as we can. */
+    *addrlen = sizeof(*ama);		/* see recvfrom(2) */
+  }
 
-  return packet;
+  /*
+   * if DGRAM strip off the header and just return the data,
+   * RAW returns the full packet.
+   */
+  if (mcs->socktype == SOCK_DGRAM) {
+    packet += AM_HDR_LEN;
+    in_len -= AM_HDR_LEN;
+  }
+  if (len < in_len)
+    in_len = len;
+  memcpy(buf, packet, in_len);
+  return in_len;
 }
 
 
@@ -829,59 +1122,21 @@ am_recv_packet(motecom_conn_t *mcs, int *len) {
  *			must be registered in the fd_mcs database (via mn_socket)
  *	  buf		buffer to receive into.
  *	  len		max size of buf
- *	  flags		flags for receive (see recvfrom(2)),  currently not implemented
+ *	  flags		flags for receive (see recvfrom(2)), only
+ *			MSG_DONTWAIT is implemented
  *
  * Receive a motenet packet into the buffer pointed to by BUF.  LEN indicates
  * the maximum size of the buffer BUF.  If the packet data coming in is too
  * large to fit into buf, the receive will still occuur upto the maximum size
  * LEN.  Any remaining packet data will be lost.
+ *
+ * Returns the number of bytes received, 0 when the other end has closed
+ * and -1 on errors (EAGAIN if non-blocking and no packet is there).
  */
 
 ssize_t
 mn_recv(int sockfd, void *buf, size_t len, int flags) {
-  motecom_conn_t *mcs;
-  uint8_t *packet;
-  int in_len;
-
-  mcs = find_mcs(sockfd);
-  if (!mcs || !buf || !len) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  /*
-   * DIRECT uses built in filtering dependent on socktype.
-   * In other words, let the kernel do it.
-   */
-  if (mcs->mc_src == MCS_DIRECT)
-    return recv(sockfd, buf, len, flags);
-
-  if (mcs->socktype != SOCK_DGRAM && mcs->socktype != SOCK_RAW) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  packet = am_recv_packet(mcs, &in_len);
-  if (packet == NULL)
-    return 0;
-
-  if (mcs->socktype == SOCK_RAW) {    /* if RAW, return full packet */
-    if (len < in_len)
-      in_len = len;
-    memcpy(buf, packet, in_len);
-    free(packet);
-    return in_len;
-  }
-
-  /*
-   * strip off the header and just return the data
-   */
-  in_len -= AM_HDR_LEN;
-  if (len < in_len)
-    in_len = len;
-  memcpy(buf, packet + AM_HDR_LEN, in_len);
-  free(packet);
-  return in_len;
+  return mn_recvfrom(sockfd, buf, len, flags, NULL, NULL);
 }
 
 
@@ -892,7 +1147,8 @@ mn_recv(int sockfd, void *buf, size_t len, int flags) {
  *			must be registered in the fd_mcs database (via mn_socket)
  *	  buf		buffer to receive into.
  *	  len		max size of buf
- *	  flags		flags for receive (see recvfrom(2)),  currently not implemented
+ *	  flags		flags for receive (see recvfrom(2)), only
+ *			MSG_DONTWAIT is implemented
  *	  src_addr	pointer to a sockaddr structure, used to fill in the
  *			if provided.  NULL says do not use.
  *	  addrlen	pointer to the size of the src_addr structure.  On input
@@ -911,16 +1167,16 @@ mn_recv(int sockfd, void *buf, size_t len, int flags) {
  * will fit will be written.  Any additional data will be lost.  ADDRLEN will
  * be updated on return to indicate the size of the data area needed to contain
  * the full address.
+ *
+ * Returns as mn_recv.
  */
 
 ssize_t
 mn_recvfrom(int sockfd, void *buf, size_t len, int flags,
 	 struct sockaddr *src_addr, socklen_t *addrlen) {
   motecom_conn_t *mcs;
-  void *packet;
-  int in_len;
-  am_hdr_t *amh;
-  struct sockaddr_am *ama, am_addr;
+  uint8_t *packet;
+  int in_len, n;
 
   mcs = find_mcs(sockfd);
   if (!mcs || !buf || !len) {
@@ -940,42 +1196,75 @@ mn_recvfrom(int sockfd, void *buf, size_t len, int flags,
     return -1;
   }
 
-  packet = am_recv_packet(mcs, &in_len); /* has dest filtering */
-  if (packet == NULL)
-    return 0;
+  n = am_next_packet(mcs, (mcs->nonblock || (flags & MSG_DONTWAIT)),
+		     &packet, &in_len);	/* has dest filtering */
+  if (n <= 0)
+    return n;
+  return am_copy_out(mcs, packet, in_len, buf, len, src_addr, addrlen);
+}
 
-  /*
-   * if src_addr non-NULL (requested), return the src of this packet.
-   */
-  amh = packet;
-  ama = &am_addr;
-  ama->sam_family = AF_AM;
-  ama->sam_addr   = amh->am_src;	/* net order */
-  ama->sam_grp    = amh->am_grp;
-  ama->sam_type   = amh->am_type;
 
-  if (src_addr != NULL && addrlen != NULL) {
-    if (*addrlen > sizeof(*ama))	/* see recvfrom(2) */
-      *addrlen = sizeof(*ama);
-    memcpy(src_addr, ama, *addrlen);	/* copy over as much as we can. */
-    *addrlen = sizeof(*ama);		/* see recvfrom(2) */
-  }
+/*
+ * mn_recvmmsg: receive a batch of packets
+ *
+ * input: sockfd	socket file descriptor to receive on
+ *	  msgvec	vlen messages to fill in, see struct mn_mmsghdr.
+ *			msg_name gets the source if non-NULL.
+ *	  vlen		number of messages in msgvec
+ *	  flags		as for mn_recvfrom
+ *
+ * Waits for the first packet unless the socket is non-blocking or
+ * MSG_DONTWAIT is given, then takes whatever else can be had without
+ * waiting, up to vlen packets (recvmmsg(2) with MSG_WAITFORONE).  Each
+ * packet is copied once, straight from the lower layer's buffer into
+ * msg_buf.  msg_len is set as mn_recvfrom would return it.
+ *
+ * returns:	number of packets received, 0 when the other end has
+ *		closed and -1 on errors (EAGAIN if non-blocking and no
+ *		packet is there).
+ */
+
+int
+mn_recvmmsg(int sockfd, struct mn_mmsghdr *msgvec, unsigned int vlen,
+	    int flags) {
+  motecom_conn_t *mcs;
+  struct mn_mmsghdr *m;
+  uint8_t *packet;
+  int in_len;
+  unsigned int i;
+  ssize_t n;
 
-  if (mcs->socktype == SOCK_RAW) {    /* if RAW, return full packet */
-    if (len < in_len)
-      in_len = len;
-    memcpy(buf, packet, in_len);
-    free(packet);
-    return in_len;
+  mcs = find_mcs(sockfd);
+  if (!mcs || !msgvec) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (mcs->mc_src != MCS_DIRECT &&
+      mcs->socktype != SOCK_DGRAM && mcs->socktype != SOCK_RAW) {
+    errno = EINVAL;
+    return -1;
   }
 
-  /*
-   * strip off the header and just return the data
-   */
-  in_len -= AM_HDR_LEN;
-  if (len < in_len)
-    in_len = len;
-  memcpy(buf, packet + AM_HDR_LEN, in_len);
-  free(packet);
-  return in_len;
+  n = 0;
+  for (i = 0; i < vlen; i++, flags |= MSG_DONTWAIT) {
+    m = &msgvec[i];
+    if (mcs->mc_src == MCS_DIRECT)
+      n = recvfrom(sockfd, m->msg_buf, m->msg_buflen, flags, m->msg_name,
+		   (m->msg_name ? &m->msg_namelen : NULL));
+    else {
+      n = am_next_packet(mcs, (mcs->nonblock || (flags & MSG_DONTWAIT)),
+			 &packet, &in_len);
+      if (n == 0)			/* end of file */
+	break;
+      if (n > 0)
+	n = am_copy_out(mcs, packet, in_len, m->msg_buf, m->msg_buflen,
+			m->msg_name, &m->msg_namelen);
+    }
+    if (n < 0)
+      break;
+    m->msg_len = n;
+  }
+  if (i == 0 && n < 0)
+    return -1;
+  return i;
 }
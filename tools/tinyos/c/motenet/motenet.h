@@ -113,6 +113,20 @@ struct sockaddr_am {
 #define MC_BAUD_SIZE 16
 #define MC_CONN_SIZE 80
 
+/*
+ * AM packets travel with a one byte length (sf protocol), so this is
+ * the largest packet (header included) we can send or receive.
+ */
+#define MN_MAX_PACKET	255
+
+/*
+ * Receive buffer for server (sf) connections.  A single read pulls in
+ * as many length prefixed packets as the kernel has, they are then
+ * filtered and handed out in place.  Serial connections read each
+ * packet into it.
+ */
+#define MC_RX_SIZE	2048
+
 typedef struct {
   mcs_enum_t mc_src;
   struct addrinfo *ai;			/* gw/server addr */
@@ -125,9 +139,29 @@ typedef struct {
   int                sock_fd;		/* fd for direct/server socket */
   int                family;
   enum __socket_type socktype;
+  int                nonblock;		/* see mn_set_nonblock */
+  int                rx_pos, rx_used;	/* server, unconsumed part of rx_buf */
+  uint8_t            rx_buf[MC_RX_SIZE];
 } motecom_conn_t;
 
 
+/*
+ * One message of a mn_recvmmsg/mn_sendmmsg batch.
+ *
+ * msg_buf/msg_buflen is the caller's buffer.  msg_name, if non-NULL,
+ * gets the source of a received packet (see mn_recvfrom), or gives the
+ * destination of one sent (see mn_sendto).  msg_len is set to the
+ * number of bytes received or sent.
+ */
+struct mn_mmsghdr {
+  void            *msg_buf;
+  size_t           msg_buflen;
+  struct sockaddr *msg_name;
+  socklen_t        msg_namelen;
+  size_t           msg_len;
+};
+
+
 int   mn_debug_set(int val);
 int   mn_debug_get();
 
@@ -146,6 +180,12 @@ ssize_t mn_recv(int sockfd, void *buf, size_t len, int flags);
 ssize_t mn_recvfrom(int sockfd, void *buf, size_t len, int flags,
 		    struct sockaddr *src_addr, socklen_t *addrlen);
 
+int   mn_set_nonblock(int sockfd, int nonblock);
+int   mn_recvmmsg(int sockfd, struct mn_mmsghdr *msgvec, unsigned int vlen,
+		  int flags);
+int   mn_sendmmsg(int sockfd, struct mn_mmsghdr *msgvec, unsigned int vlen,
+		  int flags);
+
 #ifdef __cplusplus
 //}
 #endif
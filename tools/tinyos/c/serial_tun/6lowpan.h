@@ -93,6 +93,8 @@
 
 #include <sys/types.h>
 
+#include "timer_wheel.h"
+
 typedef uint8_t u_int8_t;
 typedef uint16_t u_int16_t;
 typedef uint32_t u_int32_t;
@@ -139,6 +141,12 @@ typedef struct __attribute__ ((__packed__)) _ip_6_addr_t {
 #define FRAG_TIMEOUT 60
 // 60 seconds
 #define FRAG_FREE -1
+#define FRAG_UNITS (LOWPAN_MTU / 8)
+// fragment offsets and sizes are in units of 8 bytes
+#define FRAG_HASH_SIZE 256
+// buckets of the reassembly table, a power of two
+#define FRAG_MAX_DGRAMS 1024
+// datagrams reassembled at the same time, about 1.4 KB each
 
 #define LOWPAN_APP_DATA_LEN 1517
 //#define LOWPAN_HEADER_LEN 49
@@ -203,12 +211,6 @@ enum {
     HC2_UDP_LEN_INLINE = 0
 };
 
-typedef struct _frag_info_t {
-    uint8_t offset;
-    uint8_t len;
-    struct _frag_info_t *next;
-} frag_info_t;
-
 /*
  * sending - application provides app_data and clears app_data_dealloc
  *         - a pointer to app_data is returned in sendDone to do deallocation
@@ -230,12 +232,15 @@ typedef struct _lowpan_pkt_t {
     /* fragmentation */
     uint8_t frag_state;
     uint16_t dgram_tag; // network byte order
-    uint16_t dgram_size; // host byte order
-    time_t frag_timeout; // fragment reassembly times out at tv_sec */
+    uint16_t dgram_size; // network byte order
     union {
 	uint8_t frag_offset; // sending - offset where next fragment starts
-	frag_info_t *frag_list; // sorted by offset in decreasing order
+	uint16_t frag_received; // receiving - bytes received so far
     };
+    /* receiving - 8-byte units received and units a fragment started at */
+    uint32_t frag_units[(FRAG_UNITS + 31) / 32];
+    uint32_t frag_starts[(FRAG_UNITS + 31) / 32];
+    tw_timer_t frag_timer; // reassembly timeout
     /* IP addresses */
     ip6_addr_t ip_src_addr; /* needed for ND and usefull elsewhere */ 
     ip6_addr_t ip_dst_addr; /* both IP addresses filled in by ipv6*_input */
@@ -248,7 +253,7 @@ typedef struct _lowpan_pkt_t {
 			    * contains mesh header entries if available
 			    */
     uint8_t nd_state;
-    struct _lowpan_pkt_t *next;
+    struct _lowpan_pkt_t *next; // next in the reassembly table bucket
 } lowpan_pkt_t;
 
 /* /\* fragment reassembly buffer *\/ */
@@ -361,18 +366,43 @@ enum {
 };
 
 
+enum {
+    ICMP_TYPE_ROUTER_SOLICITATION   = 133,
+    ICMP_TYPE_ROUTER_ADVERTISEMENT  = 134,
+    ICMP_TYPE_NEIGHBOR_SOLICITATION = 135,
+    ICMP_TYPE_NEIGHBOR_ADVERTISEMENT = 136,
+    ICMP_TYPE_RPL_CONTROL           = 155,
+
+    ND_OPT_SOURCE_LINKADDR = 1,
+    ND_OPT_TARGET_LINKADDR = 2,
+
+    RPL_CODE_DAO = 0x02,
+    RPL_DAO_D_FLAG = 0x40,
+    RPL_OPT_PAD1 = 0,
+    RPL_OPT_TARGET = 5,
+    RPL_OPT_TRANSIT = 6
+};
+
 // from uip-1.0/uip/uip-neighbor.c
 #define NEIGHBOR_MAX_TIME 128
+// seconds an entry lives without being refreshed by traffic, ND or RPL
 
 #ifndef NEIGHBOR_ENTRIES
-#define NEIGHBOR_ENTRIES 8
+#define NEIGHBOR_ENTRIES 1024
 #endif
+#define NEIGHBOR_HASH_SIZE 256
+// buckets of the neighbor cache, a power of two
 
+/*
+ * maps an IPv6 address (prefix_len 128) or a prefix learned from a RPL
+ * DAO to the 802.15.4 address frames for it are sent to
+ */
 struct neighbor_entry {
   ip6_addr_t ip_addr;
+  uint8_t prefix_len;
   struct hw_addr hw_addr;
-  uint8_t time;
+  tw_timer_t timer; // expiry
+  struct neighbor_entry *next; // next in the hash bucket or prefix list
 };
-struct neighbor_entry neighbor_entries[NEIGHBOR_ENTRIES];
 
 #endif /* __6LOWPAN_H__ */
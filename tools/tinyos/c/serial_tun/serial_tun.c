@@ -42,6 +42,8 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <signal.h>
+#include <time.h>
 
 #include <stdarg.h>
 
@@ -49,6 +51,7 @@
 #include "serialsource.h"
 #include "serialpacket.h"
 #include "6lowpan.h"
+#include "timer_wheel.h"
 
 #define min(a,b) ( (a>b) ? b : a )
 #define max(a,b) ( (a>b) ? a : b )
@@ -67,7 +70,36 @@ static char *msgs[] = {
 };
 
 /* global variables */
-lowpan_pkt_t *fragments = NULL; /* fragment reassembly of received frames */
+/* fragment reassembly of received frames, hashed by addresses, tag, size */
+lowpan_pkt_t *fragments[FRAG_HASH_SIZE];
+timer_wheel_t timers; /* ticks are seconds */
+
+struct {
+    unsigned long in_progress; /* datagrams being reassembled */
+    unsigned long max_in_progress;
+    unsigned long started;
+    unsigned long completed;
+    unsigned long timeouts;
+    unsigned long duplicates; /* fragments received again */
+    unsigned long overlaps; /* reassemblies restarted */
+    unsigned long dropped; /* malformed or no room for another datagram */
+} frag_stats;
+
+/* neighbor cache, hosts hashed by address, prefixes longest first */
+struct neighbor_entry *neighbors[NEIGHBOR_HASH_SIZE];
+struct neighbor_entry *neighbor_prefixes = NULL;
+
+struct {
+    unsigned long entries;
+    unsigned long prefixes;
+    unsigned long learned;
+    unsigned long expired;
+    unsigned long unicast; /* downlink packets sent to a known neighbor */
+    unsigned long broadcast; /* and broadcast for want of one */
+} neighbor_stats;
+
+volatile sig_atomic_t g_print_stats = 0;
+
 //lowpan_pkt_t *send_queue = NULL;
 int g_send_pending = 0;
 
@@ -115,6 +147,13 @@ void increment_g_dgram_tag()
     g_dgram_tag = htons(tmp);
 }
 
+unsigned long now_ticks()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
 void stderr_msg(serial_source_msg problem)
 {
   fprintf(stderr, "Note: %s\n", msgs[problem]);
@@ -227,38 +266,115 @@ void clear_pkt(lowpan_pkt_t *pkt)
     pkt->buf_begin = pkt->buf + LOWPAN_OVERHEAD;
 }
 
-void free_frag_list(frag_info_t *p)
+/* FNV-1a over the fields identifying a datagram under reassembly */
+uint32_t hash_bytes(uint32_t h, const void *data, int len)
+{
+    const uint8_t *p = data;
+    while (len--) {
+	h = (h ^ *p++) * 16777619;
+    }
+    return h;
+}
+
+uint32_t hash_hw_addr(uint32_t h, const hw_addr_t *addr)
 {
-    frag_info_t *q;
-    while (p) {
-	q = p->next;
-	free(p);
-	p = q;
+    // same bytes as cmp_hw_addr looks at
+    h = hash_bytes(h, &addr->type, sizeof(addr->type));
+    if (addr->type == HW_ADDR_SHORT) {
+	return hash_bytes(h, addr->addr_short, sizeof(addr->addr_short));
+    } else {
+	return hash_bytes(h, addr->addr_long, sizeof(addr->addr_long));
     }
 }
 
+lowpan_pkt_t ** fragment_bucket(const hw_addr_t *hw_src_addr,
+				const hw_addr_t *hw_dst_addr,
+				uint16_t dgram_size, uint16_t dgram_tag)
+{
+    uint32_t h = 2166136261u;
+    h = hash_hw_addr(h, hw_src_addr);
+    h = hash_hw_addr(h, hw_dst_addr);
+    h = hash_bytes(h, &dgram_size, sizeof(dgram_size));
+    h = hash_bytes(h, &dgram_tag, sizeof(dgram_tag));
+    return &fragments[(h ^ (h >> 16)) & (FRAG_HASH_SIZE - 1)];
+}
+
 void free_lowpan_pkt(lowpan_pkt_t *pkt)
 {
-    lowpan_pkt_t *p;
     lowpan_pkt_t **q;
 
-    if (!fragments) return;
-    for(q=&fragments; *q; q=&(*q)->next) {
+    for(q = fragment_bucket(&pkt->hw_src_addr, &pkt->hw_dst_addr,
+			    pkt->dgram_size, pkt->dgram_tag);
+	*q; q=&(*q)->next) {
 	if (*q == pkt) {
-	    p = *q;
-	    *q = p->next;
-	    free_frag_list(p->frag_list);
-	    free(p);
+	    *q = pkt->next;
+	    tw_del(&timers, &pkt->frag_timer);
+	    free(pkt);
+	    frag_stats.in_progress--;
 	    return;
 	}
     }
 }
 
+void fragment_timeout(tw_timer_t *timer)
+{
+    lowpan_pkt_t *pkt = TW_ENTRY(timer, lowpan_pkt_t, frag_timer);
+    debug("fragment reassembly timed out: tag: 0x%04X, size: %d\n",
+	  ntohs(pkt->dgram_tag), ntohs(pkt->dgram_size));
+    frag_stats.timeouts++;
+    free_lowpan_pkt(pkt);
+}
+
+/* number of the units [first, first + count) set in bitmap */
+int bitmap_count(const uint32_t *bitmap, int first, int count)
+{
+    int i, n = 0;
+    for (i = first; i < first + count; i++) {
+	if (bitmap[i / 32] & (1u << (i % 32))) {
+	    n++;
+	}
+    }
+    return n;
+}
+
+void bitmap_set(uint32_t *bitmap, int first, int count)
+{
+    int i;
+    for (i = first; i < first + count; i++) {
+	bitmap[i / 32] |= 1u << (i % 32);
+    }
+}
+
+void print_frag_stats()
+{
+    fprintf(stderr, "fragment reassembly: in progress: %lu (max: %lu), "
+	    "started: %lu, completed: %lu, timed out: %lu, "
+	    "duplicates: %lu, overlaps: %lu, dropped: %lu\n",
+	    frag_stats.in_progress, frag_stats.max_in_progress,
+	    frag_stats.started, frag_stats.completed, frag_stats.timeouts,
+	    frag_stats.duplicates, frag_stats.overlaps, frag_stats.dropped);
+}
+
+void print_neighbor_stats()
+{
+    fprintf(stderr, "neighbor cache: entries: %lu, prefixes: %lu, "
+	    "learned: %lu, expired: %lu, unicast: %lu, broadcast: %lu\n",
+	    neighbor_stats.entries, neighbor_stats.prefixes,
+	    neighbor_stats.learned, neighbor_stats.expired,
+	    neighbor_stats.unicast, neighbor_stats.broadcast);
+}
+
+void print_stats_signal(int sig)
+{
+    g_print_stats = 1;
+}
+
 lowpan_pkt_t * find_fragment(hw_addr_t *hw_src_addr, hw_addr_t *hw_dst_addr,
 			     uint16_t dgram_size, uint16_t dgram_tag)
 {
     lowpan_pkt_t *p;
-    for(p=fragments; p; p=p->next) {
+    for(p = *fragment_bucket(hw_src_addr, hw_dst_addr, dgram_size, dgram_tag);
+	p; p=p->next) {
 	if ((p->dgram_tag == dgram_tag)
 	    && (p->dgram_size == dgram_size)
 	    && cmp_hw_addr(&p->hw_src_addr, hw_src_addr) == 0
@@ -269,6 +385,280 @@ lowpan_pkt_t * find_fragment(hw_addr_t *hw_src_addr, hw_addr_t *hw_dst_addr,
     }
     return NULL;
 }
+/* ------------------------------------------------------------------------- */
+/* neighbor cache */
+
+int ipv6_addr_is_multicast(const ip6_addr_t *addr)
+{
+    return addr->addr[0] == 0xFF;
+}
+
+/* first len bits of addr equal prefix */
+int ipv6_prefix_match(const ip6_addr_t *addr, const ip6_addr_t *prefix,
+		      int len)
+{
+    int bytes = len / 8;
+    int bits = len % 8;
+    if (memcmp(addr, prefix, bytes) != 0) {
+	return 0;
+    }
+    return !bits
+	|| !((addr->addr[bytes] ^ prefix->addr[bytes]) & (0xFF << (8 - bits)));
+}
+
+/* interface identifier of an 802.15.4 address, RFC 4944 section 6 */
+void hw_addr_to_iid(uint8_t *iid, const hw_addr_t *hw_addr)
+{
+    if (hw_addr->type == HW_ADDR_SHORT) {
+	/* PAN ID (unknown here, 0) : 00ff : fe00 : short address */
+	memset(iid, 0, 8);
+	iid[3] = 0xFF;
+	iid[4] = 0xFE;
+	iid[6] = hw_addr->addr_short[0];
+	iid[7] = hw_addr->addr_short[1];
+    } else {
+	memcpy(iid, hw_addr->addr_long, 8);
+	iid[0] ^= 0x02; /* universal/local bit */
+    }
+}
+
+struct neighbor_entry ** neighbor_bucket(const ip6_addr_t *addr)
+{
+    uint32_t h = hash_bytes(2166136261u, addr, sizeof(*addr));
+    return &neighbors[(h ^ (h >> 16)) & (NEIGHBOR_HASH_SIZE - 1)];
+}
+
+/* link to the entry for exactly addr/prefix_len, *link is NULL if none */
+struct neighbor_entry ** neighbor_link(const ip6_addr_t *addr, int prefix_len)
+{
+    struct neighbor_entry **q;
+    q = (prefix_len == 128) ? neighbor_bucket(addr) : &neighbor_prefixes;
+    for (; *q; q = &(*q)->next) {
+	if ((*q)->prefix_len == prefix_len
+	    && cmp_ipv6_addr(&(*q)->ip_addr, addr) == 0) {
+	    break;
+	}
+    }
+    return q;
+}
+
+void neighbor_remove(struct neighbor_entry **q)
+{
+    struct neighbor_entry *n = *q;
+    *q = n->next;
+    tw_del(&timers, &n->timer);
+    if (n->prefix_len == 128) {
+	neighbor_stats.entries--;
+    } else {
+	neighbor_stats.prefixes--;
+    }
+    free(n);
+}
+
+void neighbor_timeout(tw_timer_t *timer)
+{
+    struct neighbor_entry *n = TW_ENTRY(timer, struct neighbor_entry, timer);
+    neighbor_stats.expired++;
+    neighbor_remove(neighbor_link(&n->ip_addr, n->prefix_len));
+}
+
+/*
+ * adds or refreshes the entry for addr/prefix_len, a lifetime of 0
+ * removes it; addr has to be zero behind the prefix
+ */
+void neighbor_update(const ip6_addr_t *addr, int prefix_len,
+		     const hw_addr_t *hw_addr, int lifetime)
+{
+    struct neighbor_entry **q;
+    struct neighbor_entry *n;
+
+    if (prefix_len > 128 || hw_addr_is_broadcat(hw_addr)) {
+	return;
+    }
+    q = neighbor_link(addr, prefix_len);
+    if (!lifetime) {
+	if (*q) {
+	    neighbor_remove(q);
+	}
+	return;
+    }
+    if (*q) {
+	n = *q;
+	/* AM frames only carry short addresses, keep one once known */
+	if (hw_addr->type == HW_ADDR_SHORT
+	    || n->hw_addr.type != HW_ADDR_SHORT) {
+	    memcpy(&n->hw_addr, hw_addr, sizeof(n->hw_addr));
+	}
+    } else {
+	if (neighbor_stats.entries + neighbor_stats.prefixes
+	    >= NEIGHBOR_ENTRIES) {
+	    return;
+	}
+	n = malloc(sizeof(*n));
+	if (!n) {
+	    fprintf(stderr, "out of memory - not adding a neighbor\n");
+	    return;
+	}
+	memset(n, 0, sizeof(*n));
+	memcpy(&n->ip_addr, addr, sizeof(n->ip_addr));
+	n->prefix_len = prefix_len;
+	memcpy(&n->hw_addr, hw_addr, sizeof(n->hw_addr));
+	tw_timer_init(&n->timer, neighbor_timeout);
+	if (prefix_len == 128) {
+	    neighbor_stats.entries++;
+	} else {
+	    /* keep the prefixes sorted, longest first */
+	    for (q = &neighbor_prefixes;
+		 *q && (*q)->prefix_len >= prefix_len; q = &(*q)->next);
+	    neighbor_stats.prefixes++;
+	}
+	n->next = *q;
+	*q = n;
+	neighbor_stats.learned++;
+    }
+    tw_add(&timers, &n->timer, now_ticks() + lifetime);
+}
+
+struct neighbor_entry * neighbor_lookup(const ip6_addr_t *addr)
+{
+    struct neighbor_entry *n = *neighbor_link(addr, 128);
+    if (n) {
+	return n;
+    }
+    for (n = neighbor_prefixes; n; n = n->next) {
+	if (ipv6_prefix_match(addr, &n->ip_addr, n->prefix_len)) {
+	    return n;
+	}
+    }
+    return NULL;
+}
+
+/* an 802.15.4 address in a ND link-layer address option, RFC 4944 section 8 */
+int nd_opt_hw_addr(const uint8_t *opt, hw_addr_t *hw_addr)
+{
+    if (opt[1] == 1) {
+	hw_addr->type = HW_ADDR_SHORT;
+	memcpy(hw_addr->addr_short, opt + 2, sizeof(hw_addr->addr_short));
+    } else if (opt[1] == 2) {
+	hw_addr->type = HW_ADDR_LONG;
+	memcpy(hw_addr->addr_long, opt + 2, sizeof(hw_addr->addr_long));
+    } else {
+	return 0;
+    }
+    return 1;
+}
+
+/* RPL DAO targets are reachable through the mote that sent the DAO */
+void neighbor_learn_dao(const uint8_t *dao, const uint8_t *end,
+			const hw_addr_t *hw_src_addr)
+{
+    const uint8_t *opt;
+    const uint8_t *targets[8];
+    int target_lens[8];
+    int count = 0;
+    int lifetime = NEIGHBOR_MAX_TIME;
+    int i;
+    ip6_addr_t prefix;
+
+    /* instance, flags, reserved, sequence and the optional DODAGID */
+    if (end - dao < 4) {
+	return;
+    }
+    opt = dao + 4 + ((dao[1] & RPL_DAO_D_FLAG) ? sizeof(ip6_addr_t) : 0);
+    while (opt < end) {
+	if (opt[0] == RPL_OPT_PAD1) {
+	    opt++;
+	    continue;
+	}
+	if (end - opt < 2 || end - opt < 2 + opt[1]) {
+	    break;
+	}
+	if (opt[0] == RPL_OPT_TARGET && opt[1] >= 2 && opt[3] <= 128
+	    && (opt[3] + 7) / 8 <= opt[1] - 2 && count < 8) {
+	    targets[count] = opt + 4;
+	    target_lens[count++] = opt[3];
+	} else if (opt[0] == RPL_OPT_TRANSIT && opt[1] >= 4 && opt[5] == 0) {
+	    /* path lifetime 0: No-Path DAO */
+	    lifetime = 0;
+	}
+	opt += 2 + opt[1];
+    }
+
+    for (i = 0; i < count; i++) {
+	memset(&prefix, 0, sizeof(prefix));
+	memcpy(&prefix, targets[i], (target_lens[i] + 7) / 8);
+	if (target_lens[i] % 8) {
+	    prefix.addr[target_lens[i] / 8] &= 0xFF << (8 - target_lens[i] % 8);
+	}
+	neighbor_update(&prefix, target_lens[i], hw_src_addr, lifetime);
+    }
+}
+
+/*
+ * learns the link-layer address of the sender of an uplink IPv6 packet
+ * and the addresses ND and RPL messages carry
+ */
+void neighbor_learn(const uint8_t *buf, int len, const hw_addr_t *hw_src_addr)
+{
+    const struct ip6_hdr *ip_hdr = (const struct ip6_hdr *) buf;
+    const uint8_t *end = buf + len;
+    const uint8_t *icmp;
+    const uint8_t *opt;
+    hw_addr_t opt_hw_addr;
+
+    if (len < sizeof(struct ip6_hdr)
+	|| (ip_hdr->vtc & IPV6_VERSION_MASK) != IPV6_VERSION) {
+	return;
+    }
+    if (!ipv6_addr_is_zero(&ip_hdr->src_addr)
+	&& !ipv6_addr_is_multicast(&ip_hdr->src_addr)) {
+	neighbor_update(&ip_hdr->src_addr, 128, hw_src_addr,
+			NEIGHBOR_MAX_TIME);
+    }
+
+    if (ip_hdr->nxt_hdr != NEXT_HEADER_ICMP6
+	|| len < sizeof(struct ip6_hdr) + 8) {
+	return;
+    }
+    icmp = buf + sizeof(struct ip6_hdr);
+    switch (icmp[0]) {
+    case ICMP_TYPE_ROUTER_SOLICITATION:
+	opt = icmp + 8;
+	break;
+    case ICMP_TYPE_ROUTER_ADVERTISEMENT:
+	opt = icmp + 16;
+	break;
+    case ICMP_TYPE_NEIGHBOR_SOLICITATION:
+    case ICMP_TYPE_NEIGHBOR_ADVERTISEMENT:
+	opt = icmp + 8 + sizeof(ip6_addr_t);
+	break;
+    case ICMP_TYPE_RPL_CONTROL:
+	if (icmp[1] == RPL_CODE_DAO) {
+	    neighbor_learn_dao(icmp + 4, end, hw_src_addr);
+	}
+	return;
+    default:
+	return;
+    }
+
+    /* options are type, length in units of 8 bytes, data */
+    for (; end - opt >= 2 && opt[1] && end - opt >= opt[1] * 8;
+	 opt += opt[1] * 8) {
+	if (!nd_opt_hw_addr(opt, &opt_hw_addr)) {
+	    continue;
+	}
+	if (opt[0] == ND_OPT_TARGET_LINKADDR
+	    && icmp[0] == ICMP_TYPE_NEIGHBOR_ADVERTISEMENT) {
+	    neighbor_update((const ip6_addr_t *) (icmp + 8), 128,
+			    &opt_hw_addr, NEIGHBOR_MAX_TIME);
+	} else if (opt[0] == ND_OPT_SOURCE_LINKADDR
+		   && !ipv6_addr_is_zero(&ip_hdr->src_addr)) {
+	    neighbor_update(&ip_hdr->src_addr, 128,
+			    &opt_hw_addr, NEIGHBOR_MAX_TIME);
+	}
+    }
+}
+
 /* ------------------------------------------------------------------------- */
 /* HC1 and HC2 compression and decompresstion functions */
 
@@ -325,6 +715,8 @@ int lowpan_decompress(uint8_t *buf, int len,
 	       buf, sizeof(ip_hdr->src_addr)/2);
 	buf += sizeof(ip_hdr->src_addr)/2;
 	len -= sizeof(ip_hdr->src_addr)/2;
+    } else {
+	hw_addr_to_iid(&ip_hdr->src_addr.addr[8], hw_src_addr);
     }
 
     /* destination IP address */
@@ -342,6 +734,8 @@ int lowpan_decompress(uint8_t *buf, int len,
 	       buf, sizeof(ip_hdr->dst_addr)/2);
 	buf += sizeof(ip_hdr->dst_addr)/2;
 	len -= sizeof(ip_hdr->dst_addr)/2;
+    } else {
+	hw_addr_to_iid(&ip_hdr->dst_addr.addr[8], hw_dst_addr);
     }
 
     /* Traffic Class and Flow Label */
@@ -494,9 +888,10 @@ int lowpan_compress(uint8_t **buf_begin, int *len,
 	new_len += 8;
     }
 
-    /* source address interface identifier */
+    /* source address interface identifier, always inline: the mote's
+     * HC1 decompression (IPP.nc) does not derive elided ones */
     *hc1_enc |= HC1_SRC_IFACEID_INLINE;
-    
+
     memcpy(new_buf_p, ((void*)&(ip_hdr->src_addr)) + 8, 8);
     new_buf_p += 8;
     new_len += 8;
@@ -512,9 +907,9 @@ int lowpan_compress(uint8_t **buf_begin, int *len,
 	new_len += 8;
     }
 
-    /* destination address interface identifier */
+    /* destination address interface identifier, inline as well */
     *hc1_enc |= HC1_DST_IFACEID_INLINE;
-    
+
     memcpy(new_buf_p, ((void*)&(ip_hdr->dst_addr)) + 8, 8);
     new_buf_p += 8;
     new_len += 8;
@@ -616,9 +1011,12 @@ int serial_output_am_payload(uint8_t *buf, int len,
     }
     memset(&AMpacket, 0, sizeof(AMpacket));
     AMpacket.pkt_type = 0;
-    // TODO: make the dst addr handling more general
-    //AMpacket.dst = htons(0x14);
-    AMpacket.dst = htons(0xFFFF);
+    if (hw_dst_addr->type == HW_ADDR_SHORT) {
+	memcpy(&AMpacket.dst, hw_dst_addr->addr_short, 2);
+    } else {
+	/* AM frames have no room for a long address */
+	AMpacket.dst = htons(0xFFFF);
+    }
     //AMpacket.src = htons(0x12);
     // TODO: make the src addr handling more general
     memcpy(&AMpacket.src, hw_addr.addr_short, 2);
@@ -662,6 +1060,8 @@ int tun_input()
     uint8_t dgram_offset = 0;
     uint16_t dgram_size;
     hw_addr_t hw_dst_addr;
+    struct ip6_hdr *ip_hdr;
+    struct neighbor_entry *neighbor = NULL;
     uint8_t frag_len; /* length of the fragment just being sent */
 
     uint8_t *frame_begin; /* begin of the frame payload */
@@ -674,10 +1074,21 @@ int tun_input()
     }
     printf("data on tun interface\n");
 
-    /* set 802.15.4 destination address */
-    hw_dst_addr.type = HW_ADDR_SHORT;
-    hw_dst_addr.addr_short[0] =0xFF;
-    hw_dst_addr.addr_short[1] =0xFF;
+    /* set 802.15.4 destination address, unicast to known neighbors */
+    ip_hdr = (struct ip6_hdr *) buf_begin;
+    if (len >= sizeof(struct ip6_hdr)
+	&& !ipv6_addr_is_multicast(&ip_hdr->dst_addr)) {
+	neighbor = neighbor_lookup(&ip_hdr->dst_addr);
+    }
+    if (neighbor && neighbor->hw_addr.type == HW_ADDR_SHORT) {
+	memcpy(&hw_dst_addr, &neighbor->hw_addr, sizeof(hw_dst_addr));
+	neighbor_stats.unicast++;
+    } else {
+	hw_dst_addr.type = HW_ADDR_SHORT;
+	hw_dst_addr.addr_short[0] =0xFF;
+	hw_dst_addr.addr_short[1] =0xFF;
+	neighbor_stats.broadcast++;
+    }
     
     /* HC compression */
     lowpan_compress(&buf_begin, &len,
@@ -793,10 +1204,9 @@ int serial_input()
     uint16_t dgram_tag;
     uint16_t dgram_size;
     uint8_t dgram_offset;
-    struct timeval tv;
-    frag_info_t *p;
-    frag_info_t **q;
-    int last_frag;
+    int units;
+    int received;
+    lowpan_pkt_t **bucket;
     lowpan_pkt_t *pkt;
 
     printf("serial_input()\n");
@@ -916,122 +1326,85 @@ int serial_input()
 		  ntohs(dgram_tag), ntohs(dgram_size),
 		  dgram_offset, dgram_offset*8);
 
+	    /* all fragments but the last carry a multiple of 8 bytes */
+	    units = (len + 7) / 8;
+	    if (len <= 0 || ntohs(dgram_size) > LOWPAN_MTU
+		|| dgram_offset * 8 + len > ntohs(dgram_size)
+		|| (len % 8 && dgram_offset * 8 + len != ntohs(dgram_size))) {
+		debug("malformed fragment - dropping it\n");
+		frag_stats.dropped++;
+		goto discard_packet;
+	    }
+
 	    pkt = find_fragment(&hw_src_addr, &hw_dst_addr,
 				dgram_size, dgram_tag);
 	    if (pkt) {
 		debug("found an existing reassembly buffer\n");
 		/* fragment reassembly buffer found */
-		/* check for overlap */
-		for (p = pkt->frag_list; p; p=p->next) {
-		    if (dgram_offset == p->offset && len == p->len) {
-			/* duplicate - discard it */
-			result = 0;
-			goto discard_packet;
-		    } else if ((dgram_offset == p->offset && len < p->len) ||
-			       (dgram_offset > p->offset
-				&& dgram_offset < p->offset + p->len/8)
-			       ) {
-			goto frag_overlap;
-		    }
+		received = bitmap_count(pkt->frag_units, dgram_offset, units);
+		if (received == units
+		    && bitmap_count(pkt->frag_starts, dgram_offset, 1)) {
+		    /* duplicate - discard it */
+		    frag_stats.duplicates++;
+		    result = 0;
+		    goto discard_packet;
+		} else if (received) {
+		    /* overlap - discard previous frags
+		     * and restart fragment reassembly
+		     */
+		    frag_stats.overlaps++;
+		    memset(pkt->frag_units, 0, sizeof(pkt->frag_units));
+		    memset(pkt->frag_starts, 0, sizeof(pkt->frag_starts));
+		    pkt->frag_received = 0;
+		    tw_add(&timers, &pkt->frag_timer,
+			   now_ticks() + FRAG_TIMEOUT);
 		}
-		/* no overlap found */
-		goto frag_reassemble;
 	    } else {
 		debug("starting a new reassembly buffer\n");
 		/* fragment reassembly buffer not found - set up a new one */
+		if (frag_stats.in_progress >= FRAG_MAX_DGRAMS) {
+		    fprintf(stderr, "too many datagrams in reassembly"
+			    " - dropping a fragment\n");
+		    frag_stats.dropped++;
+		    goto discard_packet;
+		}
 		pkt = malloc(sizeof(lowpan_pkt_t));
 		if (!pkt) {
 		    // no free slot for reassembling fragments
 		    fprintf(stderr, "out of memory - dropping a fragment\n");
+		    frag_stats.dropped++;
 		    result = -1;
 		    goto discard_packet;
 		}
-		pkt->next = fragments;
-		fragments = pkt;
 		clear_pkt(pkt);
 		memcpy(&pkt->hw_src_addr, &hw_src_addr, sizeof(hw_src_addr));
 		memcpy(&pkt->hw_dst_addr, &hw_dst_addr, sizeof(hw_dst_addr));
 		pkt->dgram_tag = dgram_tag;
 		pkt->dgram_size = dgram_size;
-		gettimeofday(&tv, NULL);
-		pkt->frag_timeout = tv.tv_sec + FRAG_TIMEOUT;
-		goto frag_reassemble;
+		bucket = fragment_bucket(&hw_src_addr, &hw_dst_addr,
+					 dgram_size, dgram_tag);
+		pkt->next = *bucket;
+		*bucket = pkt;
+		tw_timer_init(&pkt->frag_timer, fragment_timeout);
+		tw_add(&timers, &pkt->frag_timer, now_ticks() + FRAG_TIMEOUT);
+		frag_stats.started++;
+		if (++frag_stats.in_progress > frag_stats.max_in_progress) {
+		    frag_stats.max_in_progress = frag_stats.in_progress;
+		}
 	    }
-	    
-	frag_overlap:
-	    /* overlap - discard previous frags
-	     * and restart freagment reassembly
-	     */
-	    free_frag_list(pkt->frag_list);
-	    pkt->frag_list = NULL;
-	    /* not sure if we want to clear the whole buf */
-	    //memset(&pkt->buf, 0, sizeof(pkt->buf));
-	    gettimeofday(&tv, NULL);
-	    pkt->frag_timeout = tv.tv_sec + FRAG_TIMEOUT;
-	    goto frag_reassemble;
-	    
-	frag_reassemble:
+
 	    /* copy buf data */
 	    debug("dgram_offset: %d\n", dgram_offset);
 	    memcpy(pkt->buf_begin + dgram_offset*8, buf, len);
-	    //TODO: make sure a large len does not cause a buffer overflow
-
-	    /* update frag_info */
-	    p = malloc(sizeof(frag_info_t));
-	    if (!p) {
-		fprintf(stderr, "out of memory - fragment "\
-			"reassembly failing\n");
-	    } else {
-		p->offset = dgram_offset;
-		p->len = len;
-
-		/* insert frag_info into the orderer list */
-		if (pkt->frag_list) {
-		    for(q = &(pkt->frag_list); (*q)->next; q=&((*q)->next)) {
-			if (p->offset > (*q)->offset) {
-			    break;
-			}
-		    }
-		    if ((*q)) {
-			debug("inserting frag_info before offset %d\n",
-			      (*q)->offset);
-		    } else {
-			debug("inserting frag_info at the beginning/end\n");
-		    }
-
-		    p->next = *q;
-		    *q = p;
-		} else {
-		    debug("inserting frag_info to the beginning "
-			  "of the list\n");
-		    p->next = pkt->frag_list;
-		    pkt->frag_list = p;
-		}
-	    }
+	    bitmap_set(pkt->frag_units, dgram_offset, units);
+	    bitmap_set(pkt->frag_starts, dgram_offset, 1);
+	    pkt->frag_received += len;
 
-	    /* check if this is not the last fragment */
-	    if (!dgram_offset) {
-		/* the first fragment cannot be the last one */
-		last_frag = 0;
-	    } else {
-		debug("checking last_frag...\n");
-		last_frag=1;
-		dgram_offset = ntohs(dgram_size)/8;
-		for(p=pkt->frag_list; p && dgram_offset; p=p->next) {
-		    debug("dgram_offset: %d, p->offset: %d, p->len: %d\n",
-			  dgram_offset, p->offset, p->len);
-		    if (p->offset + p->len/8 != dgram_offset) {
-			debug("offset mismatch - not the last fragment\n");
-			last_frag = 0;
-			break;
-		    }
-		    dgram_offset = p->offset;
-		}
-	    }
-
-	    if (last_frag) {
+	    /* without overlaps all bytes are there once the count matches */
+	    if (pkt->frag_received == ntohs(dgram_size)) {
 		debug("last fragment, reassembly done\n");
 		pkt->len = ntohs(dgram_size);
+		frag_stats.completed++;
 		
 		debug("dumping reassembled datagram...\n");
 		dump_serial_packet(pkt->buf_begin, pkt->len);
@@ -1098,7 +1471,7 @@ int serial_input_ipv6_uncompressed(uint8_t *buf, int len,
 {
     debug("%s()\n", __func__);
     //dump_serial_packet(buf, len);
-    // TODO: update neighbor table
+    neighbor_learn(buf, len, hw_src_addr);
     return tun_write(tun_fd, (char*) buf, len);
 }
 
@@ -1115,9 +1488,9 @@ int serial_input_ipv6_compressed(uint8_t *buf, int len,
 			       hw_src_addr, hw_dst_addr,
 			       &new_buf, &new_len)
 	) {
-	// TODO: update neighbor table
 	buf = new_buf;
 	len = new_len;
+	neighbor_learn(buf, len, hw_src_addr);
 	ret =  tun_write(tun_fd, (char*) buf, len);
 	
 	if (new_buf && new_len) {
@@ -1132,38 +1505,45 @@ int serial_input_ipv6_compressed(uint8_t *buf, int len,
 
 void timer_fired()
 {
-    struct timeval tv;
-    lowpan_pkt_t *p;
-    lowpan_pkt_t **q;
-
-    /* time out old fragments */
-    (void) gettimeofday(&tv, NULL);
-    for(q = &fragments; *q; ) {
-	if ((*q)->frag_timeout > tv.tv_sec) {
-	    p = (*q)->next;
-	    free(*q);
-	    *q = p;
-	} else {
-	    q = &((*q)->next);
-	}
-    }
+    /* time out old fragments and neighbors */
+    tw_advance(&timers, now_ticks());
     // TODO: ND retransmission
-    // TODO: neighbor table timeouts
 }
 
 /* shifts data between the serial port and the tun interface */
 int serial_tunnel(serial_source ser_src, int tun_fd) {
     //int result;
     fd_set fs;
+    struct timeval tv;
+    struct timespec ts;
+    long ticks;
     
     while (1) {
 	FD_ZERO (&fs);
 	FD_SET (tun_fd, &fs);
 	FD_SET (serial_source_fd(ser_src), &fs);
 
-	select (tun_fd>serial_source_fd(ser_src)?
-		tun_fd+1 : serial_source_fd(ser_src)+1,
-		&fs, NULL, NULL, NULL);
+	/* sleep until the tick the next timer may fire in begins */
+	ticks = tw_next(&timers);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv.tv_sec = ticks - 1;
+	tv.tv_usec = 1000000 - ts.tv_nsec / 1000;
+	/* right at a second boundary, select() rejects tv_usec == 1000000 */
+	if (tv.tv_usec >= 1000000) {
+	    tv.tv_sec++;
+	    tv.tv_usec -= 1000000;
+	}
+	if (select (tun_fd>serial_source_fd(ser_src)?
+		    tun_fd+1 : serial_source_fd(ser_src)+1,
+		    &fs, NULL, NULL, ticks < 0 ? NULL : &tv) <= 0) {
+	    FD_ZERO (&fs);
+	}
+	timer_fired();
+	if (g_print_stats) {
+	    g_print_stats = 0;
+	    print_frag_stats();
+	    print_neighbor_stats();
+	}
 
 	debug("--- select() fired ---\n");
 
@@ -1199,6 +1579,10 @@ int main(int argc, char **argv) {
 	    exit(2);
 	}
     
+    tw_init(&timers, now_ticks());
+    /* kill -USR1 prints the fragment reassembly and neighbor statistics */
+    signal(SIGUSR1, print_stats_signal);
+
     hw_addr.type = HW_ADDR_SHORT;
     hw_addr.addr_short[0] = 0x00; // network byte order
     hw_addr.addr_short[1] = 0x12;
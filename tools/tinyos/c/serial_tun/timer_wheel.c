@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+void tw_init(timer_wheel_t *wheel, unsigned long now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void tw_timer_init(tw_timer_t *timer, void (*fired)(tw_timer_t *timer))
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->fired = fired;
+}
+
+static void tw_unlink(timer_wheel_t *wheel, tw_timer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+	timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+void tw_add(timer_wheel_t *wheel, tw_timer_t *timer, unsigned long expires)
+{
+    unsigned long delta;
+    unsigned long slot_expires;
+    tw_timer_t **slot;
+    int level;
+
+    if (tw_pending(timer)) {
+	tw_unlink(wheel, timer);
+    }
+    timer->expires = expires;
+
+    /* expired timers fire on the next tick */
+    slot_expires = (expires > wheel->now) ? expires : wheel->now + 1;
+    delta = slot_expires - wheel->now;
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+	if (delta < (1UL << (TW_BITS * (level + 1)))) {
+	    break;
+	}
+    }
+    if (delta >= (1UL << (TW_BITS * TW_LEVELS))) {
+	/* parked, moved down again when tw_advance gets there */
+	slot_expires = wheel->now + (1UL << (TW_BITS * TW_LEVELS)) - 1;
+    }
+    slot = &wheel->slots[level][(slot_expires >> (TW_BITS * level)) & TW_MASK];
+
+    timer->next = *slot;
+    if (*slot) {
+	(*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+    wheel->count++;
+}
+
+void tw_del(timer_wheel_t *wheel, tw_timer_t *timer)
+{
+    if (tw_pending(timer)) {
+	tw_unlink(wheel, timer);
+    }
+}
+
+/*
+ * takes the timers of a slot off the wheel before looking at them, so
+ * that callbacks may delete any timer (including the next one of the
+ * list) or add timers to the same slot
+ */
+static void tw_run_slot(timer_wheel_t *wheel, int level, int index)
+{
+    tw_timer_t *list = wheel->slots[level][index];
+    tw_timer_t *timer;
+
+    wheel->slots[level][index] = NULL;
+    if (list) {
+	list->pprev = &list;
+    }
+    while (list) {
+	timer = list;
+	tw_unlink(wheel, timer);
+	if (timer->expires <= wheel->now) {
+	    timer->fired(timer);
+	} else {
+	    /* cascade down, or a parked timer not due yet */
+	    tw_add(wheel, timer, timer->expires);
+	}
+    }
+}
+
+void tw_advance(timer_wheel_t *wheel, unsigned long now)
+{
+    int level;
+
+    while (wheel->now < now) {
+	if (!wheel->count) {
+	    wheel->now = now;
+	    return;
+	}
+	wheel->now++;
+	/* a higher level slot is due each time the levels below wrap */
+	for (level = 1; level < TW_LEVELS; level++) {
+	    if (wheel->now & ((1UL << (TW_BITS * level)) - 1)) {
+		break;
+	    }
+	}
+	while (--level > 0) {
+	    tw_run_slot(wheel, level,
+			(wheel->now >> (TW_BITS * level)) & TW_MASK);
+	}
+	tw_run_slot(wheel, 0, wheel->now & TW_MASK);
+    }
+}
+
+long tw_next(const timer_wheel_t *wheel)
+{
+    unsigned long tick;
+    long ticks;
+
+    if (!wheel->count) {
+	return -1;
+    }
+    for (ticks = 1; ticks < TW_SLOTS; ticks++) {
+	tick = wheel->now + ticks;
+	/* work for tw_advance: a level 0 slot or a cascade */
+	if (wheel->slots[0][tick & TW_MASK] || !(tick & TW_MASK)) {
+	    return ticks;
+	}
+    }
+    return TW_SLOTS;
+}
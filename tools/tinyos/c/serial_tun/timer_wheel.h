@@ -0,0 +1,59 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+/*
+ * Hierarchical timer wheel: TW_LEVELS levels of TW_SLOTS slots, a slot
+ * of level n spans TW_SLOTS^n ticks. Adding and removing a timer is
+ * O(1), advancing by one tick fires one slot and now and then moves the
+ * timers of one higher level slot down (cascading). Timers further away
+ * than the wheel covers are parked in the last slot of the top level.
+ *
+ * Timers are embedded in the structures they time out, the callback
+ * gets the timer back (see TW_ENTRY).
+ */
+
+#include <stddef.h>
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 3
+
+#define TW_ENTRY(timer, type, member) \
+    ((type *)((char *)(timer) - offsetof(type, member)))
+
+typedef struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer **pprev; /* NULL if not pending */
+    unsigned long expires;   /* in ticks */
+    void (*fired)(struct tw_timer *timer);
+} tw_timer_t;
+
+typedef struct timer_wheel {
+    unsigned long now; /* last tick processed */
+    unsigned long count; /* pending timers */
+    tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+void tw_init(timer_wheel_t *wheel, unsigned long now);
+
+void tw_timer_init(tw_timer_t *timer, void (*fired)(tw_timer_t *timer));
+
+/* (re)schedules timer to fire once wheel->now reaches expires */
+void tw_add(timer_wheel_t *wheel, tw_timer_t *timer, unsigned long expires);
+
+/* cancels timer, harmless if it is not pending */
+void tw_del(timer_wheel_t *wheel, tw_timer_t *timer);
+
+static inline int tw_pending(const tw_timer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/* fires all timers expired up to now, callbacks may add and delete timers */
+void tw_advance(timer_wheel_t *wheel, unsigned long now);
+
+/* ticks from wheel->now until tw_advance may have work, -1 without timers */
+long tw_next(const timer_wheel_t *wheel);
+
+#endif
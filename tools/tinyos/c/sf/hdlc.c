@@ -0,0 +1,257 @@
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define HDLC_SSE2
+#endif
+
+#include "hdlc.h"
+
+/* Buffer-at-a-time implementation of the serial framing. Runs of bytes
+   that need no escaping are found with a vector (or word) scan and
+   copied with memcpy, the crc is computed slice-by-8 over the whole
+   frame. */
+
+enum {
+  HDLC_NOSYNC,
+  HDLC_INSYNC,
+  HDLC_ESCAPED,
+  HDLC_DONE			/* frame returned, reset on next call */
+};
+
+static uint16_t crc_table[8][256];
+static int crc_ready;
+
+void hdlc_init(void)
+{
+  int i, k;
+
+  if (crc_ready)
+    return;
+
+  /* CRC-CCITT, polynomial 0x1021, not reflected */
+  for (i = 0; i < 256; i++)
+    {
+      uint16_t crc = i << 8;
+
+      for (k = 0; k < 8; k++)
+	crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+      crc_table[0][i] = crc;
+    }
+  /* crc_table[k][i]: byte i followed by k zero bytes */
+  for (k = 1; k < 8; k++)
+    for (i = 0; i < 256; i++)
+      {
+	uint16_t prev = crc_table[k - 1][i];
+
+	crc_table[k][i] = prev << 8 ^ crc_table[0][prev >> 8];
+      }
+  crc_ready = 1;
+}
+
+uint16_t hdlc_crc(uint16_t crc, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  if (!crc_ready)
+    hdlc_init();
+
+  while (len >= 8)
+    {
+      crc = crc_table[7][p[0] ^ crc >> 8] ^ crc_table[6][p[1] ^ (crc & 0xff)] ^
+	crc_table[5][p[2]] ^ crc_table[4][p[3]] ^
+	crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+	crc_table[1][p[6]] ^ crc_table[0][p[7]];
+      p += 8;
+      len -= 8;
+    }
+  while (len--)
+    crc = crc << 8 ^ crc_table[0][(crc >> 8 ^ *p++) & 0xff];
+
+  return crc;
+}
+
+#ifndef HDLC_SSE2
+/* true if any byte of w equals b */
+static int has_byte(uint64_t w, uint8_t b)
+{
+  uint64_t x = w ^ (0x0101010101010101ULL * b);
+
+  return ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) != 0;
+}
+#endif
+
+static const uint8_t *scan_special(const uint8_t *p, const uint8_t *end)
+/* Returns: the first flag or escape byte in [p, end), or end
+*/
+{
+#ifdef HDLC_SSE2
+  const __m128i flag = _mm_set1_epi8(HDLC_FLAG_BYTE);
+  const __m128i escape = _mm_set1_epi8(HDLC_ESCAPE_BYTE);
+
+  while (end - p >= 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag),
+						_mm_cmpeq_epi8(v, escape)));
+
+      if (mask)
+	return p + __builtin_ctz(mask);
+      p += 16;
+    }
+#else
+  while (end - p >= 8)
+    {
+      uint64_t w;
+
+      memcpy(&w, p, sizeof w);
+      if (has_byte(w, HDLC_FLAG_BYTE) || has_byte(w, HDLC_ESCAPE_BYTE))
+	break;
+      p += 8;
+    }
+#endif
+  while (p < end && *p != HDLC_FLAG_BYTE && *p != HDLC_ESCAPE_BYTE)
+    p++;
+
+  return p;
+}
+
+size_t hdlc_escape(uint8_t *to, const void *from, size_t len)
+{
+  const uint8_t *p = from, *end = p + len;
+  uint8_t *out = to;
+
+  for (;;)
+    {
+      const uint8_t *special = scan_special(p, end);
+
+      memcpy(out, p, special - p);
+      out += special - p;
+      p = special;
+      if (p == end)
+	break;
+      *out++ = HDLC_ESCAPE_BYTE;
+      *out++ = *p++ ^ HDLC_ESCAPE_XOR;
+    }
+
+  return out - to;
+}
+
+size_t hdlc_encode(uint8_t *to, const void *header, size_t header_len,
+		   const void *payload, size_t payload_len)
+{
+  uint8_t *out = to;
+  uint8_t fcs[2];
+  uint16_t crc;
+
+  crc = hdlc_crc(hdlc_crc(0, header, header_len), payload, payload_len);
+  fcs[0] = crc & 0xff;
+  fcs[1] = crc >> 8;
+
+  *out++ = HDLC_FLAG_BYTE;
+  out += hdlc_escape(out, header, header_len);
+  if (payload_len)
+    out += hdlc_escape(out, payload, payload_len);
+  out += hdlc_escape(out, fcs, sizeof fcs);
+  *out++ = HDLC_FLAG_BYTE;
+
+  return out - to;
+}
+
+void hdlc_decoder_init(hdlc_decoder *d, uint8_t *frame, size_t size)
+{
+  d->frame = frame;
+  d->size = size;
+  d->count = 0;
+  d->state = HDLC_NOSYNC;
+}
+
+size_t hdlc_decode(hdlc_decoder *d, const uint8_t *in, size_t len,
+		   hdlc_event *event)
+{
+  const uint8_t *p = in, *end = in + len;
+
+  *event = hdlc_none;
+  if (d->state == HDLC_DONE)
+    {
+      d->count = 0;
+      d->state = HDLC_INSYNC;
+    }
+
+  while (p < end)
+    {
+      const uint8_t *special;
+      size_t run, count;
+
+      switch (d->state)
+	{
+	case HDLC_NOSYNC:
+	  special = memchr(p, HDLC_FLAG_BYTE, end - p);
+	  if (!special)
+	    return len;
+	  d->state = HDLC_INSYNC;
+	  d->count = 0;
+	  *event = hdlc_sync;
+	  return special + 1 - in;
+
+	case HDLC_ESCAPED:
+	  if (*p == HDLC_FLAG_BYTE)
+	    {
+	      /* the flag starts the next frame */
+	      d->state = HDLC_INSYNC;
+	      d->count = 0;
+	      *event = hdlc_bad_escape;
+	      return p + 1 - in;
+	    }
+	  if (d->count == d->size)
+	    {
+	      d->state = HDLC_NOSYNC;
+	      *event = hdlc_too_long;
+	      return p + 1 - in;
+	    }
+	  d->frame[d->count++] = *p++ ^ HDLC_ESCAPE_XOR;
+	  d->state = HDLC_INSYNC;
+	  break;
+
+	default:
+	  /* copy the run up to the next flag or escape byte in one go */
+	  special = scan_special(p, end);
+	  run = special - p;
+	  if (run > d->size - d->count)
+	    {
+	      d->state = HDLC_NOSYNC;
+	      *event = hdlc_too_long;
+	      return p + (d->size - d->count) + 1 - in;
+	    }
+	  memcpy(d->frame + d->count, p, run);
+	  d->count += run;
+	  p = special;
+	  if (p == end)
+	    return len;
+	  if (*p++ == HDLC_ESCAPE_BYTE)
+	    {
+	      d->state = HDLC_ESCAPED;
+	      break;
+	    }
+
+	  /* flag: end of frame, and start of the next one */
+	  count = d->count;
+	  d->count = 0;
+	  if (count == 0)
+	    break;
+	  if (count < HDLC_MIN_FRAME)
+	    *event = hdlc_too_short;
+	  else if (hdlc_crc(0, d->frame, count - 2) !=
+		   (d->frame[count - 2] | d->frame[count - 1] << 8))
+	    *event = hdlc_bad_crc;
+	  else
+	    {
+	      d->count = count - 2;
+	      d->state = HDLC_DONE;
+	      *event = hdlc_frame;
+	    }
+	  return p - in;
+	}
+    }
+
+  return p - in;
+}
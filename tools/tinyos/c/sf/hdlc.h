@@ -0,0 +1,85 @@
+#ifndef HDLC_H
+#define HDLC_H
+
+/* HDLC-like framing and CRC-CCITT of the TinyOS serial protocol (see
+   net.tinyos.packet.Packetizer), working on whole buffers. Shared by the
+   C (serialsource.c) and C++ (cpp/sf) serial forwarders. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  HDLC_FLAG_BYTE = 0x7e,
+  HDLC_ESCAPE_BYTE = 0x7d,
+  HDLC_ESCAPE_XOR = 0x20,
+  HDLC_MIN_FRAME = 4		/* protocol, seqno/dispatch and crc */
+};
+
+/* Worst case size of an encoded frame with n bytes of header and payload:
+   everything escaped plus the crc and two flag bytes */
+#define HDLC_ENCODED_SIZE(n) (2 * ((n) + 2) + 2)
+
+typedef enum {
+  hdlc_none,			/* input exhausted, no frame yet */
+  hdlc_frame,			/* complete frame with good crc */
+  hdlc_sync,			/* first flag byte seen */
+  hdlc_too_short,		/* frame shorter than HDLC_MIN_FRAME */
+  hdlc_too_long,		/* frame did not fit, resynchronising */
+  hdlc_bad_escape,		/* flag byte after escape byte */
+  hdlc_bad_crc			/* frame with bad crc */
+} hdlc_event;
+
+typedef struct hdlc_decoder {
+  uint8_t *frame;
+  size_t size;
+  size_t count;
+  int state;
+} hdlc_decoder;
+
+void hdlc_init(void);
+/* Effects: builds the crc tables. Called implicitly, but not thread safe
+     on first use: call it before starting threads that use this module.
+*/
+
+uint16_t hdlc_crc(uint16_t crc, const void *data, size_t len);
+/* Returns: crc updated with len bytes of data (start with crc 0)
+*/
+
+size_t hdlc_escape(uint8_t *to, const void *from, size_t len);
+/* Effects: byte stuffs len bytes of from into to, which must hold
+     2 * len bytes
+   Returns: number of bytes written to to
+*/
+
+size_t hdlc_encode(uint8_t *to, const void *header, size_t header_len,
+		   const void *payload, size_t payload_len);
+/* Effects: encodes a frame of header followed by payload, with crc and
+     flag bytes, into to, which must hold
+     HDLC_ENCODED_SIZE(header_len + payload_len) bytes. payload may be NULL
+     if payload_len is 0.
+   Returns: number of bytes written to to
+*/
+
+void hdlc_decoder_init(hdlc_decoder *d, uint8_t *frame, size_t size);
+/* Effects: prepares d to decode frames of up to size bytes (including the
+     crc) into frame. d waits for a flag byte.
+*/
+
+size_t hdlc_decode(hdlc_decoder *d, const uint8_t *in, size_t len,
+		   hdlc_event *event);
+/* Effects: decodes bytes from in until a frame or an error is found, or
+     the input is exhausted.
+   Returns: number of bytes consumed; *event says why decoding stopped.
+     For hdlc_frame, d->frame holds d->count bytes (crc stripped), valid
+     until the next call.
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
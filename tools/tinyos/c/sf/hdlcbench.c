@@ -0,0 +1,268 @@
+/* Throughput benchmark and self check of the HDLC codec (hdlc.c) against
+   the byte-at-a-time framing it replaced.
+
+   Usage: hdlcbench [payload-size [frames]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "hdlc.h"
+
+enum {
+  MTU = 256,
+  CHUNK = 4096			/* bytes per simulated read() */
+};
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The reference implementation, as in serialsource.c before hdlc.c */
+
+static uint16_t ref_crc_byte(uint16_t crc, uint8_t b)
+{
+  uint8_t i;
+
+  crc = crc ^ b << 8;
+  i = 8;
+  do
+    if (crc & 0x8000)
+      crc = crc << 1 ^ 0x1021;
+    else
+      crc = crc << 1;
+  while (--i);
+
+  return crc;
+}
+
+struct ref_escaper {
+  uint8_t *out;
+  size_t pos;
+  uint16_t crc;
+};
+
+static void ref_escape_byte(struct ref_escaper *e, uint8_t b)
+{
+  e->crc = ref_crc_byte(e->crc, b);
+  if (b == HDLC_FLAG_BYTE || b == HDLC_ESCAPE_BYTE)
+    {
+      e->out[e->pos++] = HDLC_ESCAPE_BYTE;
+      e->out[e->pos++] = b ^ HDLC_ESCAPE_XOR;
+    }
+  else
+    e->out[e->pos++] = b;
+}
+
+static size_t ref_encode(uint8_t *to, const uint8_t *frame, size_t len)
+{
+  struct ref_escaper e = { to, 0, 0 };
+  uint16_t crc;
+  size_t i;
+
+  e.out[e.pos++] = HDLC_FLAG_BYTE;
+  for (i = 0; i < len; i++)
+    ref_escape_byte(&e, frame[i]);
+  crc = e.crc;
+  ref_escape_byte(&e, crc & 0xff);
+  ref_escape_byte(&e, crc >> 8);
+  e.out[e.pos++] = HDLC_FLAG_BYTE;
+
+  return e.pos;
+}
+
+struct ref_decoder {
+  uint8_t packet[MTU];
+  int in_sync, escaped, count;
+};
+
+/* Returns: frame length (crc stripped) if byte completes a good frame,
+     -1 otherwise */
+static int ref_decode_byte(struct ref_decoder *d, uint8_t byte)
+{
+  if (!d->in_sync)
+    {
+      if (byte == HDLC_FLAG_BYTE)
+	{
+	  d->in_sync = 1;
+	  d->count = 0;
+	  d->escaped = 0;
+	}
+      return -1;
+    }
+  if (d->count >= MTU)
+    {
+      d->in_sync = 0;
+      return -1;
+    }
+  if (d->escaped)
+    {
+      if (byte == HDLC_FLAG_BYTE)
+	{
+	  d->in_sync = 0;
+	  return -1;
+	}
+      byte ^= HDLC_ESCAPE_XOR;
+      d->escaped = 0;
+    }
+  else if (byte == HDLC_ESCAPE_BYTE)
+    {
+      d->escaped = 1;
+      return -1;
+    }
+  else if (byte == HDLC_FLAG_BYTE)
+    {
+      int count = d->count;
+      uint16_t crc = 0;
+      int i;
+
+      d->count = 0;
+      if (count < HDLC_MIN_FRAME)
+	return -1;
+      for (i = 0; i < count - 2; i++)
+	crc = ref_crc_byte(crc, d->packet[i]);
+      if (crc != (d->packet[count - 2] | d->packet[count - 1] << 8))
+	return -1;
+      return count - 2;
+    }
+  d->packet[d->count++] = byte;
+  return -1;
+}
+
+static void report(const char *what, size_t bytes, double ref, double codec)
+{
+  printf("%-8s %10.1f MB/s %10.1f MB/s %8.1fx\n", what,
+	 bytes / ref / 1e6, bytes / codec / 1e6, ref / codec);
+}
+
+int main(int argc, char **argv)
+{
+  int payload = argc > 1 ? atoi(argv[1]) : 28;
+  int frames = argc > 2 ? atoi(argv[2]) : 200000;
+  size_t raw_len = (size_t)frames * (payload + 2);
+  size_t max_len = (size_t)frames * HDLC_ENCODED_SIZE(payload + 2);
+  uint8_t *raw = malloc(raw_len);
+  uint8_t *ref_stream = malloc(max_len), *stream = malloc(max_len);
+  size_t ref_stream_len = 0, stream_len = 0, i;
+  volatile uint16_t sink = 0;
+  uint16_t crc;
+  double t0, ref_time, codec_time;
+  int f, ref_frames, codec_frames;
+  struct ref_decoder ref_decoder;
+  uint8_t frame[MTU];
+  hdlc_decoder decoder;
+
+  if (payload < 2 || payload > MTU - 4 || frames <= 0 ||
+      !raw || !ref_stream || !stream)
+    {
+      fprintf(stderr, "Usage: %s [payload-size (2..%d) [frames]]\n",
+	      argv[0], MTU - 4);
+      exit(2);
+    }
+
+  /* header (protocol, dispatch) and payload, with some bytes that
+     need escaping */
+  srand(1);
+  for (f = 0; f < frames; f++)
+    {
+      uint8_t *p = raw + (size_t)f * (payload + 2);
+      int j;
+
+      p[0] = 69;
+      p[1] = 0;
+      for (j = 2; j < payload + 2; j++)
+	p[j] = rand() % 16 ? rand() : HDLC_FLAG_BYTE - rand() % 2;
+    }
+  hdlc_init();
+
+  printf("%d frames, payload %d bytes\n", frames, payload);
+  printf("%-8s %15s %15s %9s\n", "", "byte-wise", "hdlc.c", "speedup");
+
+  t0 = now();
+  crc = 0;
+  for (i = 0; i < raw_len; i++)
+    crc = ref_crc_byte(crc, raw[i]);
+  ref_time = now() - t0;
+  sink = crc;
+  t0 = now();
+  crc = hdlc_crc(0, raw, raw_len);
+  codec_time = now() - t0;
+  if (crc != sink)
+    {
+      fprintf(stderr, "crc mismatch: %04x %04x\n", crc, sink);
+      exit(1);
+    }
+  report("crc", raw_len, ref_time, codec_time);
+
+  t0 = now();
+  for (f = 0; f < frames; f++)
+    ref_stream_len += ref_encode(ref_stream + ref_stream_len,
+				 raw + (size_t)f * (payload + 2), payload + 2);
+  ref_time = now() - t0;
+  t0 = now();
+  for (f = 0; f < frames; f++)
+    {
+      const uint8_t *p = raw + (size_t)f * (payload + 2);
+
+      stream_len += hdlc_encode(stream + stream_len, p, 2, p + 2, payload);
+    }
+  codec_time = now() - t0;
+  if (stream_len != ref_stream_len || memcmp(stream, ref_stream, stream_len))
+    {
+      fprintf(stderr, "encoder mismatch\n");
+      exit(1);
+    }
+  report("encode", raw_len, ref_time, codec_time);
+
+  memset(&ref_decoder, 0, sizeof ref_decoder);
+  ref_frames = 0;
+  t0 = now();
+  for (i = 0; i < stream_len; i++)
+    if (ref_decode_byte(&ref_decoder, stream[i]) >= 0)
+      ref_frames++;
+  ref_time = now() - t0;
+
+  hdlc_decoder_init(&decoder, frame, sizeof frame);
+  codec_frames = 0;
+  t0 = now();
+  for (i = 0; i < stream_len; i += CHUNK)
+    {
+      size_t pos = i, end = i + CHUNK < stream_len ? i + CHUNK : stream_len;
+
+      while (pos < end)
+	{
+	  hdlc_event event;
+
+	  pos += hdlc_decode(&decoder, stream + pos, end - pos, &event);
+	  if (event == hdlc_frame)
+	    {
+	      if (decoder.count != (size_t)payload + 2 ||
+		  memcmp(decoder.frame,
+			 raw + (size_t)codec_frames * (payload + 2),
+			 decoder.count))
+		{
+		  fprintf(stderr, "decoder mismatch in frame %d\n",
+			  codec_frames);
+		  exit(1);
+		}
+	      codec_frames++;
+	    }
+	}
+    }
+  codec_time = now() - t0;
+  if (ref_frames != frames || codec_frames != frames)
+    {
+      fprintf(stderr, "decoded %d / %d of %d frames\n",
+	      ref_frames, codec_frames, frames);
+      exit(1);
+    }
+  report("decode", raw_len, ref_time, codec_time);
+
+  return 0;
+}
@@ -40,13 +40,12 @@ int main(int argc, char **argv)
   for (;;)
     {
       int len, i;
-      const unsigned char *packet = read_serial_packet(src, &len);
+      unsigned char packet[SERIAL_MAX_PACKET];
 
-      if (!packet)
+      if (read_serial_packet_into(src, packet, sizeof packet, &len) < 0)
 	exit(0);
       for (i = 0; i < len; i++)
 	printf("%02x ", packet[i]);
       putchar('\n');
-      free((void *)packet);
     }
 }
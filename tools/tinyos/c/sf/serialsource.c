@@ -35,6 +35,7 @@
 
 #include "serialsource.h"
 #include "serialprotocol.h"
+#include "hdlc.h"
 
 typedef int bool;
 
@@ -46,22 +47,49 @@ enum {
 #endif
 #endif
   BUFSIZE = 256,
-  MTU = 256,
+  MTU = SERIAL_MAX_PACKET,
+  RECV_QUEUE = 64, /* data packets kept until they are read */
   ACK_TIMEOUT = 100000, /* in us */
-  SYNC_BYTE = SERIAL_HDLC_FLAG_BYTE,
-  ESCAPE_BYTE = SERIAL_HDLC_CTLESC_BYTE,
+  WINDOW_SIZE = 8, /* packets in flight in window mode */
+  ACK_QUEUE = 2 * WINDOW_SIZE, /* acks kept until the sender looks at them */
+  MIN_RTO = 20000, /* in us */
+  MAX_RTO = 2000000, /* in us */
+  SYNC_RETRIES = 3,
+  RESYNC_TIMEOUTS = 4,
+  MAX_RETRIES = 25,
 
   P_ACK = SERIAL_SERIAL_PROTO_ACK,
   P_PACKET_ACK = SERIAL_SERIAL_PROTO_PACKET_ACK,
   P_PACKET_NO_ACK = SERIAL_SERIAL_PROTO_PACKET_NOACK,
+  P_WINDOW_SYNC = SERIAL_SERIAL_PROTO_WINDOW_SYNC,
+  P_PACKET_WINDOW = SERIAL_SERIAL_PROTO_PACKET_WINDOW,
+  P_WINDOW_ACK = SERIAL_SERIAL_PROTO_WINDOW_ACK,
   P_UNKNOWN = SERIAL_SERIAL_PROTO_PACKET_UNKNOWN
 };
 
-struct packet_list
+/* Received packets wait in fixed rings of count entries starting at
+   first, data packets in one and the seqnos of the two kinds of acks in
+   others. */
+struct packet_ring
+{
+  uint8_t packet[RECV_QUEUE][MTU];
+  int len[RECV_QUEUE];
+  int first, count;
+};
+
+struct ack_ring
+{
+  uint8_t seqno[ACK_QUEUE];
+  int first, count;
+};
+
+struct window_entry
 {
   uint8_t *packet;
   int len;
-  struct packet_list *next;
+  uint8_t seqno;
+  int retries;
+  struct timeval sent;
 };
 
 struct serial_source_t {
@@ -78,15 +106,18 @@ struct serial_source_t {
     uint8_t buffer[BUFSIZE];
     int bufpos, bufused;
     uint8_t packet[MTU];
-    bool in_sync, escaped;
-    int count;
-    struct packet_list *queue[256]; // indexed by protocol
+    hdlc_decoder decoder;
+    struct packet_ring data;
+    struct ack_ring ack, window_ack;
   } recv;
   struct {
     uint8_t seqno;
-    uint8_t *escaped;
-    int escapeptr;
-    uint16_t crc;
+    /* Window state: window is -1 until probed, 0 for stop-and-wait nodes.
+       inflight is a ring of count packets starting at first. */
+    int window;
+    struct window_entry inflight[WINDOW_SIZE];
+    int first, count;
+    long srtt, rttvar, rto; /* in us */
   } send;
 };
 
@@ -327,6 +358,9 @@ serial_source open_serial_source(const char *device, int baud_rate,
 	  src->non_blocking = non_blocking;
 	  src->message = message;
 	  src->send.seqno = 37;
+	  src->send.window = -1;
+	  src->send.rto = ACK_TIMEOUT;
+	  hdlc_decoder_init(&src->recv.decoder, src->recv.packet, MTU);
 
 	  return src;
 	}
@@ -371,6 +405,9 @@ serial_source open_serial_source(const char *device, int baud_rate,
 	  src->non_blocking = non_blocking;
 	  src->message = message;
 	  src->send.seqno = 37;
+	  /* source_wait has no deadlines here, stay with stop-and-wait */
+	  src->send.window = 0;
+	  hdlc_decoder_init(&src->recv.decoder, src->recv.packet, MTU);
 
 	}
 
@@ -399,6 +436,14 @@ HANDLE serial_source_handle(serial_source src)
 }
 #endif
 
+static void free_window_head(serial_source src)
+/* Effects: forgets the oldest packet in flight */
+{
+  free(src->send.inflight[src->send.first].packet);
+  src->send.first = (src->send.first + 1) % WINDOW_SIZE;
+  src->send.count--;
+}
+
 int close_serial_source(serial_source src)
 /* Effects: closes serial source src
    Returns: 0 if successful, -1 if some problem occured (but source is
@@ -411,6 +456,8 @@ int close_serial_source(serial_source src)
   int ok = CloseHandle(src->hComm);
 #endif
 
+  while (src->send.count > 0)
+    free_window_head(src);
   free(src);
 
   return ok;
@@ -528,42 +575,57 @@ static int source_write(serial_source src, const void *buffer, int count)
 #endif
 }
 
-static void push_protocol_packet(serial_source src,
-				 uint8_t type, uint8_t *packet, uint8_t len)
+static void push_data_packet(serial_source src, const uint8_t *packet, int len)
 {
-  /* I'm assuming short queues */
-  struct packet_list *entry = malloc(sizeof *entry), **last;
+  struct packet_ring *ring = &src->recv.data;
+  int slot;
 
-  if (!entry)
+  if (ring->count == RECV_QUEUE)
     {
+      /* nobody is reading, drop the new one */
       message(src, msg_no_memory);
-      free(packet);
       return;
     }
-
-  entry->packet = packet;
-  entry->len = len;
-  entry->next = NULL;
-
-  last = &src->recv.queue[type];
-  while (*last)
-    last = &(*last)->next;
-  *last = entry;
+  slot = (ring->first + ring->count++) % RECV_QUEUE;
+  memcpy(ring->packet[slot], packet, len);
+  ring->len[slot] = len;
 }
 
-static struct packet_list *pop_protocol_packet(serial_source src, uint8_t type)
+static bool pop_data_packet(serial_source src, void *buf, int cap, int *len)
+/* Effects: copies the oldest data packet to buf, at most cap bytes
+   Returns: TRUE if there was one, *len is set to its length
+*/
 {
-  struct packet_list *entry = src->recv.queue[type];
-
-  if (entry)
-    src->recv.queue[type] = entry->next;
+  struct packet_ring *ring = &src->recv.data;
+
+  if (ring->count == 0)
+    return FALSE;
+  *len = ring->len[ring->first];
+  memcpy(buf, ring->packet[ring->first], *len < cap ? *len : cap);
+  ring->first = (ring->first + 1) % RECV_QUEUE;
+  ring->count--;
+  return TRUE;
+}
 
-  return entry;
+static void push_ack(struct ack_ring *ring, uint8_t seqno)
+{
+  if (ring->count == ACK_QUEUE)
+    {
+      /* the oldest ack is the least useful */
+      ring->first = (ring->first + 1) % ACK_QUEUE;
+      ring->count--;
+    }
+  ring->seqno[(ring->first + ring->count++) % ACK_QUEUE] = seqno;
 }
 
-static bool packet_available(serial_source src, uint8_t type)
+static bool pop_ack(struct ack_ring *ring, uint8_t *seqno)
 {
-  return src->recv.queue[type] != NULL;
+  if (ring->count == 0)
+    return FALSE;
+  *seqno = ring->seqno[ring->first];
+  ring->first = (ring->first + 1) % ACK_QUEUE;
+  ring->count--;
+  return TRUE;
 }
 
 int serial_source_empty(serial_source src)
@@ -577,39 +639,13 @@ int serial_source_empty(serial_source src)
     internal buffering)
 */
 {
-  return src->recv.bufpos >= src->recv.bufused &&
-    !packet_available(src, P_PACKET_NO_ACK);
-}
-
-/* Slow implementation of crc function */
-static uint16_t crc_byte(uint16_t crc, uint8_t b)
-{
-  uint8_t i;
-
-  crc = crc ^ b << 8;
-  i = 8;
-  do
-    if (crc & 0x8000)
-      crc = crc << 1 ^ 0x1021;
-    else
-      crc = crc << 1;
-  while (--i);
-
-  return crc;
+  return src->recv.bufpos >= src->recv.bufused && src->recv.data.count == 0;
 }
 
-static uint16_t crc_packet(uint8_t *data, int len)
-{
-  uint16_t crc = 0;
-
-  while (len-- > 0)
-    crc = crc_byte(crc, *data++);
-
-  return crc;
-}
-
-static int read_byte(serial_source src, int non_blocking)
-/* Returns: next byte (>= 0), or -1 if no data available and non-blocking is true.
+static int fill_buffer(serial_source src, int non_blocking)
+/* Effects: refills the receive buffer if it has been consumed
+   Returns: 0 if data is available, or -1 if no data available and
+     non-blocking is true.
 */
 {
   if (src->recv.bufpos >= src->recv.bufused)
@@ -640,108 +676,63 @@ static int read_byte(serial_source src, int non_blocking)
 #endif
     }
     }
-  //printf("in %02x\n", src->recv.buffer[src->recv.bufpos]);
-  return src->recv.buffer[src->recv.bufpos++];
+  return 0;
 }
 
-static void process_packet(serial_source src, uint8_t *packet, int len);
+static void process_packet(serial_source src, const uint8_t *packet, int len);
 static int write_framed_packet(serial_source src,
 			       uint8_t packet_type, uint8_t first_byte,
 			       const uint8_t *packet, int count);
 
-static void read_and_process(serial_source src, int non_blocking)
+static bool read_and_process(serial_source src, int non_blocking)
 /* Effects: reads and processes up to one packet.
+   Returns: TRUE if a packet was processed, FALSE if the input ran out
 */
 {
-  uint8_t *packet = src->recv.packet;
-
   for (;;)
     {
-      int byte = read_byte(src, non_blocking);
+      hdlc_event event;
 
-      if (byte < 0)
-	return;
+      if (fill_buffer(src, non_blocking) < 0)
+	return FALSE;
 
-      if (!src->recv.in_sync)
-	{
-	  if (byte == SYNC_BYTE)
-	    {
-	      src->recv.in_sync = TRUE;
-	      message(src, msg_sync);
-	      src->recv.count = 0;
-	      src->recv.escaped = FALSE;
-	    }
-	  continue;
-	}
-      if (src->recv.count >= MTU)
+      src->recv.bufpos +=
+	hdlc_decode(&src->recv.decoder, src->recv.buffer + src->recv.bufpos,
+		    src->recv.bufused - src->recv.bufpos, &event);
+      switch (event)
 	{
+	case hdlc_sync:
+	  message(src, msg_sync);
+	  break;
+	case hdlc_too_long:
 	  message(src, msg_too_long);
-	  src->recv.in_sync = FALSE;
-	  continue;
-	}
-      if (src->recv.escaped)
-	{
-	  if (byte == SYNC_BYTE)
-	    {
-	      /* sync byte following escape is an error, resync */
-	      message(src, msg_bad_sync);
-	      src->recv.in_sync = FALSE;
-	      continue;
-	    }
-	  byte ^= 0x20;
-	  src->recv.escaped = FALSE;
-	}
-      else if (byte == ESCAPE_BYTE)
-	{
-	  src->recv.escaped = TRUE;
-	  continue;
-	}
-      else if (byte == SYNC_BYTE)
-	{
-	  int count = src->recv.count;
-	  uint8_t *received;
-	  uint16_t read_crc, computed_crc;
-
-	  src->recv.count = 0; /* ready for next packet */
-
-	  if (count < 4)
-	    /* frames that are too small are ignored */
-	    continue;
-
-	  received = malloc(count - 2);
-	  if (!received)
-	    {
-	      message(src, msg_no_memory);
-	      continue;
-	    }
-	  memcpy(received, packet, count - 2);
-
-	  read_crc = packet[count - 2] | packet[count - 1] << 8;
-	  computed_crc = crc_packet(received, count - 2);
-
+	  break;
+	case hdlc_bad_escape:
+	  /* sync byte following escape is an error */
+	  message(src, msg_bad_sync);
+	  break;
+	case hdlc_bad_crc:
+	  /* We don't lose sync here. If we did, garbage on the line
+	     at startup will cause loss of the first packet. */
+	  message(src, msg_bad_crc);
+	  break;
+	case hdlc_frame:
 #ifdef DEBUG
-	  dump("received", packet, count);
-	  printf("  crc %x comp %x\n", read_crc, computed_crc);
+	  dump("received", src->recv.packet, src->recv.decoder.count);
 #endif
-	  if (read_crc == computed_crc)
-	    {
-	      process_packet(src, received, count - 2);
-	      return; /* give rest of world chance to do something */
-	    }
-	  else
-	    {
-	      message(src, msg_bad_crc);
-	      free(received);
-	      /* We don't lose sync here. If we did, garbage on the line
-		 at startup will cause loss of the first packet. */
-	      continue;
-	    }
+	  process_packet(src, src->recv.packet, src->recv.decoder.count);
+	  return TRUE; /* give rest of world chance to do something */
+	default:
+	  /* frames that are too small are ignored */
+	  break;
 	}
-      packet[src->recv.count++] = byte;
     }
 }
 
-static void process_packet(serial_source src, uint8_t *packet, int len)
+static void process_packet(serial_source src, const uint8_t *packet, int len)
+/* Effects: queues the packet the decoder found (type byte first, at
+     least two bytes), acknowledging it if asked to
+*/
 {
   int packet_type = packet[0], offset = 1;
 
@@ -753,85 +744,91 @@ static void process_packet(serial_source src, uint8_t *packet, int len)
       packet_type = P_PACKET_NO_ACK;
       offset = 2;
     }
-  /* packet must remain a valid pointer to pass to free. So we move the
-     data rather than pass an internal pointer */
-  memmove(packet, packet + offset, len - offset);
-  push_protocol_packet(src, packet_type, packet, len - offset);
+  switch (packet_type)
+    {
+    case P_PACKET_NO_ACK:
+      push_data_packet(src, packet + offset, len - offset);
+      break;
+    case P_ACK:
+      push_ack(&src->recv.ack, packet[1]);
+      break;
+    case P_WINDOW_ACK:
+      push_ack(&src->recv.window_ack, packet[1]);
+      break;
+    default:
+      message(src, msg_unknown_packet_type);
+      break;
+    }
 }
 
-void *read_serial_packet(serial_source src, int *len)
-/* Effects: Read the serial source src. If a packet is available, return it.
-     If in blocking mode and no packet is available, wait for one.
-   Returns: the packet read (in newly allocated memory), with *len is
-     set to the packet length, or NULL if no packet is yet available and
-     the serial source is in non-blocking mode
+int read_serial_packet_into(serial_source src, void *buf, int cap, int *len)
+/* Effects: Read the serial source src. If a packet is available, copy it
+     to buf, at most cap bytes. If in blocking mode and no packet is
+     available, wait for one.
+   Returns: 0 if a packet was read, with *len set to its length, or -1 if
+     no packet is yet available and the serial source is in non-blocking
+     mode
 */
 {
   read_and_process(src, TRUE);
   for (;;)
     {
-      struct packet_list *entry;
-
-      entry = pop_protocol_packet(src, P_PACKET_NO_ACK);
-      if (entry)
-	{
-	  uint8_t *packet = entry->packet;
-
-	  *len = entry->len;
-	  free(entry);
-
-	  return packet;
-	}
+      if (pop_data_packet(src, buf, cap, len))
+	return 0;
       if (src->non_blocking && serial_source_empty(src))
-	return NULL;
+	return -1;
       source_wait(src, NULL);
       read_and_process(src, src->non_blocking);
     }
 }
 
-/* The escaper does the sync bytes+escape-like encoding+crc of packets */
-
-static void escape_add(serial_source src, uint8_t b)
-{
-  src->send.escaped[src->send.escapeptr++] = b;
-}
-
-static int init_escaper(serial_source src, int count)
+int read_serial_packets(serial_source src, void *bufs[], int cap,
+			int lens[], int count)
+/* Effects: reads up to count packets into bufs like
+     read_serial_packet_into. Only waits for the first one, then takes
+     every complete packet that has been received or can be read from the
+     port without waiting.
+   Returns: number of packets read, with lens set to their lengths, 0 if
+     no packet is yet available and the serial source is in non-blocking
+     mode
+*/
 {
-  src->send.escaped = malloc(count * 2 + 2);
-  if (!src->send.escaped)
-    {
-      message(src, msg_no_memory);
-      return -1;
-    }
-  src->send.escapeptr = 0;
-  src->send.crc = 0;
+  int n;
 
-  escape_add(src, SYNC_BYTE);
+  if (count <= 0 ||
+      read_serial_packet_into(src, bufs[0], cap, &lens[0]) < 0)
+    return 0;
+  for (n = 1; n < count; )
+    if (pop_data_packet(src, bufs[n], cap, &lens[n]))
+      n++;
+    else if (!read_and_process(src, TRUE))
+      break;
 
-  return 0;
+  return n;
 }
 
-static void terminate_escaper(serial_source src)
+void *read_serial_packet(serial_source src, int *len)
+/* Effects: Read the serial source src. If a packet is available, return it.
+     If in blocking mode and no packet is available, wait for one.
+   Returns: the packet read (in newly allocated memory), with *len is
+     set to the packet length, or NULL if no packet is yet available and
+     the serial source is in non-blocking mode
+*/
 {
-  escape_add(src, SYNC_BYTE);
-}
+  uint8_t packet[MTU];
+  void *copy;
 
-static void escape_byte(serial_source src, uint8_t b)
-{
-  src->send.crc = crc_byte(src->send.crc, b);
-  if (b == SYNC_BYTE || b == ESCAPE_BYTE)
+  if (read_serial_packet_into(src, packet, sizeof packet, len) < 0)
+    return NULL;
+  copy = malloc(*len > 0 ? *len : 1);
+  if (!copy)
     {
-      escape_add(src, ESCAPE_BYTE);
-      escape_add(src, b ^ 0x20);
+      message(src, msg_no_memory);
+      return NULL;
     }
-  else
-    escape_add(src, b);
-}
+  memcpy(copy, packet, *len);
 
-static void free_escaper(serial_source src)
-{
-  free(src->send.escaped);
+  return copy;
 }
 
 // Write a packet of type 'packetType', first byte 'firstByte'
@@ -840,37 +837,30 @@ static int write_framed_packet(serial_source src,
 			       uint8_t packet_type, uint8_t first_byte,
 			       const uint8_t *packet, int count)
 {
-  int i, crc;
+  uint8_t header[2];
+  uint8_t frame[HDLC_ENCODED_SIZE(sizeof header + MTU)];
+  size_t len;
 
 #ifdef DEBUG
   printf("writing %02x %02x", packet_type, first_byte);
   dump("", packet, count);
 #endif
 
-  if (init_escaper(src, count + 4) < 0)
-    return -1;
-
-  escape_byte(src, packet_type);
-  escape_byte(src, first_byte);
-  for (i = 0; i < count; i++)
-    escape_byte(src, packet[i]);
-
-  crc = src->send.crc;
-  escape_byte(src, crc & 0xff);
-  escape_byte(src, crc >> 8);
-
-  terminate_escaper(src);
+  if (count > MTU)
+    {
+      message(src, msg_too_long);
+      return -1;
+    }
+  header[0] = packet_type;
+  header[1] = first_byte;
+  len = hdlc_encode(frame, header, sizeof header, packet, count);
 
 #ifdef DEBUG
-  dump("encoded", src->send.escaped, src->send.escapeptr);
+  dump("encoded", frame, len);
 #endif
 
-  if (source_write(src, src->send.escaped, src->send.escapeptr) < 0)
-    {
-      free_escaper(src);
-      return -1;
-    }
-  free_escaper(src);
+  if (source_write(src, frame, len) < 0)
+    return -1;
   return 0;
 }
 
@@ -886,6 +876,278 @@ static void add_timeval(struct timeval *tv, long us)
     }
 }
 
+#ifndef LOSE32
+/* Window mode: up to WINDOW_SIZE P_PACKET_WINDOW frames are in flight,
+   the node delivers them in order and acknowledges cumulatively with
+   P_WINDOW_ACK. When the oldest one is not acknowledged within rto, all
+   packets in flight are sent again (go-back-N). */
+
+static long elapsed_us(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) * 1000000L + now.tv_usec - since->tv_usec;
+}
+
+static uint8_t window_base(serial_source src)
+/* Returns: the seqno the node expects next */
+{
+  if (src->send.count > 0)
+    return src->send.inflight[src->send.first].seqno;
+  return src->send.seqno + 1;
+}
+
+static void apply_sync_ack(serial_source src, uint8_t acked)
+/* Effects: continues the window after acked, the answer of the node to a
+     sync frame. Packets up to acked were delivered but lost their acks,
+     they are not sent again. If acked lies outside the window the node
+     waits for other seqnos and the packets in flight are renumbered.
+*/
+{
+  uint8_t delivered = acked + 1 - window_base(src);
+  int i;
+
+  if (delivered <= src->send.count)
+    for (i = 0; i < delivered; i++)
+      free_window_head(src);
+  else
+    for (i = 0; i < src->send.count; i++)
+      src->send.inflight[(src->send.first + i) % WINDOW_SIZE].seqno = acked + 1 + i;
+  src->send.seqno = acked + src->send.count;
+}
+
+static int sync_window(serial_source src)
+/* Effects: tells the node which seqno comes next. A node that is not
+     synced yet takes it and answers with a window ack for the seqno
+     before it, a synced node keeps its state and answers with the last
+     seqno it delivered. Old nodes drop the unknown frame.
+   Returns: 0 if the node answered, -1 otherwise
+*/
+{
+  uint8_t base = window_base(src), acked;
+  int i;
+
+  src->recv.window_ack.count = 0;
+
+  for (i = 0; i < SYNC_RETRIES; i++)
+    {
+      struct timeval deadline;
+
+      if (write_framed_packet(src, P_WINDOW_SYNC, base, NULL, 0) < 0)
+	return -1;
+      gettimeofday(&deadline, NULL);
+      add_timeval(&deadline, ACK_TIMEOUT);
+      for (;;)
+	{
+	  read_and_process(src, TRUE);
+	  if (pop_ack(&src->recv.window_ack, &acked))
+	    {
+	      apply_sync_ack(src, acked);
+	      return 0;
+	    }
+	  else if (source_wait(src, &deadline) < 0)
+	    break;
+	}
+    }
+  return -1;
+}
+
+static void update_rto(serial_source src, long sample)
+/* Effects: Jacobson/Karels estimator as in TCP (RFC 6298) */
+{
+  if (src->send.srtt == 0)
+    {
+      src->send.srtt = sample;
+      src->send.rttvar = sample / 2;
+    }
+  else
+    {
+      long delta = src->send.srtt > sample ?
+	src->send.srtt - sample : sample - src->send.srtt;
+
+      src->send.rttvar = (3 * src->send.rttvar + delta) / 4;
+      src->send.srtt = (7 * src->send.srtt + sample) / 8;
+    }
+  src->send.rto = src->send.srtt + 4 * src->send.rttvar;
+  if (src->send.rto < MIN_RTO)
+    src->send.rto = MIN_RTO;
+  if (src->send.rto > MAX_RTO)
+    src->send.rto = MAX_RTO;
+}
+
+static int take_window_acks(serial_source src)
+/* Effects: slides the window over the window acks received so far
+   Returns: number of packets acknowledged
+*/
+{
+  uint8_t seqno;
+  int acked = 0, i;
+
+  while (pop_ack(&src->recv.window_ack, &seqno))
+    {
+      uint8_t n = seqno - window_base(src);
+
+      if (n < src->send.count)
+	{
+	  struct window_entry *last =
+	    &src->send.inflight[(src->send.first + n) % WINDOW_SIZE];
+
+	  /* Karn: retransmitted packets give no rtt sample */
+	  if (last->retries == 0)
+	    update_rto(src, elapsed_us(&last->sent));
+	  acked += n + 1;
+	  for (i = 0; i <= n; i++)
+	    free_window_head(src);
+	}
+    }
+  return acked;
+}
+
+static int send_window_entry(serial_source src, struct window_entry *entry)
+{
+  gettimeofday(&entry->sent, NULL);
+  return write_framed_packet(src, P_PACKET_WINDOW, entry->seqno,
+			     entry->packet, entry->len);
+}
+
+static int drain_window(serial_source src, int limit)
+/* Effects: processes window acks and retransmissions until at most limit
+     packets are in flight. Falls back to stop-and-wait if the node stops
+     answering sync frames.
+   Returns: number of packets given up on, -1 for write errors
+*/
+{
+  int dropped = 0, timeouts = 0, i;
+
+  while (src->send.count > limit)
+    {
+      struct window_entry *oldest = &src->send.inflight[src->send.first];
+      struct timeval deadline = oldest->sent;
+      bool resync;
+
+      read_and_process(src, TRUE);
+      if (take_window_acks(src))
+	{
+	  timeouts = 0;
+	  continue;
+	}
+      add_timeval(&deadline, src->send.rto);
+      if (source_wait(src, &deadline) == 0)
+	continue;
+
+      /* timeout: back off and go back to the oldest packet */
+      src->send.rto = 2 * src->send.rto < MAX_RTO ? 2 * src->send.rto : MAX_RTO;
+      resync = ++timeouts >= RESYNC_TIMEOUTS;
+      if (oldest->retries >= MAX_RETRIES)
+	{
+	  /* the node still waits for this seqno */
+	  free_window_head(src);
+	  dropped++;
+	  resync = TRUE;
+	}
+      if (resync)
+	{
+	  if (sync_window(src) < 0)
+	    {
+	      /* node is gone or was replaced by an old one */
+	      message(src, msg_ack_timeout);
+	      while (src->send.count > 0)
+		{
+		  free_window_head(src);
+		  dropped++;
+		}
+	      src->send.window = -1;
+	      break;
+	    }
+	  timeouts = 0;
+	}
+      for (i = 0; i < src->send.count; i++)
+	{
+	  struct window_entry *entry =
+	    &src->send.inflight[(src->send.first + i) % WINDOW_SIZE];
+
+	  entry->retries++;
+	  if (send_window_entry(src, entry) < 0)
+	    return -1;
+	}
+    }
+  return dropped;
+}
+#endif
+
+int serial_source_window(serial_source src)
+/* Effects: probes the node for the window protocol if not done yet
+   Returns: the number of packets queue_serial_packet keeps in flight, or
+     0 if the node only speaks stop-and-wait
+*/
+{
+#ifndef LOSE32
+  if (src->send.window < 0)
+    src->send.window = sync_window(src) == 0 ? WINDOW_SIZE : 0;
+#endif
+  return src->send.window;
+}
+
+int queue_serial_packet(serial_source src, const void *packet, int len)
+/* Effects: writes len byte packet to serial source src without waiting
+     for its acknowledgement, unless the window is full.
+     Equivalent to write_serial_packet for stop-and-wait nodes.
+   Returns: number of earlier packets that were given up on, -1 on errors
+*/
+{
+#ifndef LOSE32
+  struct window_entry *entry;
+  int dropped;
+
+  if (serial_source_window(src) == 0)
+    return write_serial_packet(src, packet, len);
+
+  dropped = drain_window(src, WINDOW_SIZE - 1);
+  if (dropped < 0)
+    return -1;
+  if (src->send.window < 0)
+    {
+      /* fell back while draining */
+      int ok = write_serial_packet(src, packet, len);
+
+      return ok < 0 ? -1 : dropped + ok;
+    }
+
+  entry = &src->send.inflight[(src->send.first + src->send.count) % WINDOW_SIZE];
+  entry->packet = malloc(len > 0 ? len : 1);
+  if (!entry->packet)
+    {
+      message(src, msg_no_memory);
+      return -1;
+    }
+  memcpy(entry->packet, packet, len);
+  entry->len = len;
+  entry->seqno = ++src->send.seqno;
+  entry->retries = 0;
+  src->send.count++;
+
+  if (send_window_entry(src, entry) < 0)
+    return -1;
+  return dropped;
+#else
+  return write_serial_packet(src, packet, len);
+#endif
+}
+
+int flush_serial_packets(serial_source src)
+/* Effects: waits until all packets queued with queue_serial_packet are
+     acknowledged or given up on
+   Returns: number of packets given up on, -1 on errors
+*/
+{
+#ifndef LOSE32
+  if (src->send.window > 0)
+    return drain_window(src, 0);
+#endif
+  return 0;
+}
+
 int write_serial_packet(serial_source src, const void *packet, int len)
 /* Effects: writes len byte packet to serial source src
    Returns: 0 if packet successfully written, 1 if successfully written
@@ -894,6 +1156,17 @@ int write_serial_packet(serial_source src, const void *packet, int len)
 {
   struct timeval deadline;
 
+#ifndef LOSE32
+  if (src->send.window > 0)
+    {
+      int dropped = queue_serial_packet(src, packet, len);
+
+      if (dropped >= 0)
+	dropped = flush_serial_packets(src);
+      return dropped < 0 ? -1 : dropped > 0;
+    }
+#endif
+
   src->send.seqno++;
   if (write_framed_packet(src, P_PACKET_ACK, src->send.seqno, packet, len) < 0)
     return -1;
@@ -907,16 +1180,11 @@ int write_serial_packet(serial_source src, const void *packet, int len)
 
   for (;;)
     {
-      struct packet_list *entry;
+      uint8_t acked;
 
       read_and_process(src, TRUE);
-      entry = pop_protocol_packet(src, P_ACK);
-      if (entry)
+      if (pop_ack(&src->recv.ack, &acked))
 	{
-	  uint8_t acked = entry->packet[0];
-
-	  free(entry->packet);
-	  free(entry);
 	  if (acked == src->send.seqno)
 	    return 0;
 	}
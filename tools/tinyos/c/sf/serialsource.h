@@ -11,6 +11,10 @@ extern "C" {
 
 typedef struct serial_source_t *serial_source;
 
+/* Largest frame on the serial line, read_serial_packet_into never
+   returns more */
+#define SERIAL_MAX_PACKET 256
+
 typedef enum {
   msg_unknown_packet_type,	/* packet of unknown type received */
   msg_ack_timeout, 		/* ack not received within timeout */
@@ -75,12 +79,54 @@ void *read_serial_packet(serial_source src, int *len);
      the serial source is in non-blocking mode
 */
 
+int read_serial_packet_into(serial_source src, void *buf, int cap, int *len);
+/* Effects: Read the serial source src. If a packet is available, copy it
+     to buf, at most cap bytes (SERIAL_MAX_PACKET bytes always suffice).
+     If in blocking mode and no packet is available, wait for one.
+   Returns: 0 if a packet was read, with *len set to its length, or -1 if
+     no packet is yet available and the serial source is in non-blocking
+     mode
+*/
+
+int read_serial_packets(serial_source src, void *bufs[], int cap,
+			int lens[], int count);
+/* Effects: reads up to count packets into bufs like
+     read_serial_packet_into. Only waits for the first one, then takes
+     every complete packet that has been received or can be read from the
+     port without waiting.
+   Returns: number of packets read, with lens set to their lengths, 0 if
+     no packet is yet available and the serial source is in non-blocking
+     mode
+*/
+
 int write_serial_packet(serial_source src, const void *packet, int len);
 /* Effects: writes len byte packet to serial source src
    Returns: 0 if packet successfully written, 1 if successfully written
      but not acknowledged, -1 otherwise
 */
 
+int serial_source_window(serial_source src);
+/* Effects: on first use, asks the node whether it speaks the window
+     protocol (costs a few hundred ms with nodes that do not)
+   Returns: the number of packets queue_serial_packet keeps in flight,
+     0 if the node only speaks stop-and-wait
+*/
+
+int queue_serial_packet(serial_source src, const void *packet, int len);
+/* Effects: writes len byte packet to serial source src. In window mode,
+     returns without waiting for the acknowledgement unless the window is
+     full, otherwise the same as write_serial_packet. Use
+     flush_serial_packets to wait for the outstanding acknowledgements.
+   Returns: number of earlier packets that were never acknowledged, or -1
+     on errors
+*/
+
+int flush_serial_packets(serial_source src);
+/* Effects: waits until all packets queued with queue_serial_packet are
+     acknowledged or given up on
+   Returns: number of packets that were never acknowledged, or -1 on errors
+*/
+
 int platform_baud_rate(char *platform_name);
 /* Returns: The baud rate of the specified platform, or -1 for unknown
      platforms. If platform_name starts with a digit, just return 
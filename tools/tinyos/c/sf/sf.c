@@ -14,6 +14,8 @@
 #include "sfsource.h"
 #include "serialsource.h"
 
+#define SERIAL_BATCH 16		/* packets taken from the port at a time */
+
 serial_source src;
 int server_socket;
 int packets_read, packets_written, num_clients;
@@ -22,6 +24,7 @@ struct client_list
 {
   struct client_list *next;
   int fd;
+  sf_filter filter;		/* packets the client asked for */
 } *clients;
 
 int unix_check(const char *msg, int result)
@@ -63,7 +66,7 @@ void pstatus(void)
 void forward_packet(const void *packet, int len);
 
 
-void add_client(int fd)
+struct client_list *add_client(int fd)
 {
   struct client_list *c = xmalloc(sizeof *c);
 
@@ -73,6 +76,7 @@ void add_client(int fd)
   pstatus();
 
   c->fd = fd;
+  return c;
 }
 
 void rem_client(struct client_list **c)
@@ -88,11 +92,13 @@ void rem_client(struct client_list **c)
 
 void new_client(int fd)
 {
+  sf_filter filter;
+
   fcntl(fd, F_SETFL, 0);
-  if (init_sf_source(fd) < 0)
+  if (accept_sf_client(fd, &filter) < 0)
     close(fd);
   else
-    add_client(fd);
+    add_client(fd)->filter = filter;
 }
 
 void check_clients(fd_set *fds)
@@ -137,7 +143,8 @@ void dispatch_packet(const void *packet, int len)
   struct client_list **c;
 
   for (c = &clients; *c; )
-    if (write_sf_packet((*c)->fd, packet, len) >= 0)
+    if (!sf_filter_match(&(*c)->filter, packet, len) ||
+	write_sf_packet((*c)->fd, packet, len) >= 0)
       c = &(*c)->next;
     else
       rem_client(c);
@@ -219,20 +226,24 @@ void open_serial(const char *dev, int baud)
 
 void check_serial(void)
 {
-  int len;
-  const unsigned char *packet = read_serial_packet(src, &len);
-
-  if (packet)
+  /* take every packet the port has for us in one go */
+  static unsigned char packets[SERIAL_BATCH][SERIAL_MAX_PACKET];
+  void *bufs[SERIAL_BATCH];
+  int lens[SERIAL_BATCH], count, i;
+
+  for (i = 0; i < SERIAL_BATCH; i++)
+    bufs[i] = packets[i];
+  count = read_serial_packets(src, bufs, SERIAL_MAX_PACKET, lens, SERIAL_BATCH);
+  for (i = 0; i < count; i++)
     {
       packets_read++;
-      dispatch_packet(packet, len);
-      free((void *)packet);
+      dispatch_packet(packets[i], lens[i]);
     }
 }
 
 void forward_packet(const void *packet, int len)
 {
-  int ok = write_serial_packet(src, packet, len);
+  int ok = queue_serial_packet(src, packet, len);
 
   packets_written++;
   if (ok < 0)
@@ -241,6 +252,26 @@ void forward_packet(const void *packet, int len)
     fprintf(stderr, "Note: write failed: %d\n", ok);
 }
 
+void flush_serial(void)
+{
+  int ok = flush_serial_packets(src);
+
+  if (ok < 0)
+    exit(2);
+  if (ok > 0)
+    fprintf(stderr, "Note: write failed: %d\n", ok);
+}
+
+int fds_ready(fd_set *fds, int maxfd)
+{
+  fd_set ready = *fds;
+  struct timeval zero;
+
+  zero.tv_sec = zero.tv_usec = 0;
+
+  return select(maxfd + 1, &ready, NULL, NULL, &zero) > 0;
+}
+
 int main(int argc, char **argv)
 {
   int serfd;
@@ -276,6 +307,11 @@ int main(int argc, char **argv)
       fd_wait(&rfds, &maxfd, server_socket);
       wait_clients(&rfds, &maxfd);
 
+      /* Only wait for outstanding acks when there is nothing else to do,
+	 so that bursts from the clients are pipelined to the node */
+      if (serial_source_empty(src) && !fds_ready(&rfds, maxfd))
+	flush_serial();
+
       serial_empty = serial_source_empty(src);
       if (serial_empty)
 	ret = select(maxfd + 1, &rfds, NULL, NULL, NULL);
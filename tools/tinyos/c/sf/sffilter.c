@@ -0,0 +1,168 @@
+#include <string.h>
+
+#include "sffilter.h"
+
+/* The filter is compiled into a bit set of the AM types any rule accepts,
+   so that a packet of a type nobody asked for is rejected with one test;
+   only packets passing it are compared against the rules. */
+
+enum {
+  AM_DISPATCH = 0,		/* TOS_SERIAL_ACTIVE_MESSAGE_ID */
+  /* offsets of the serial_header_t fields behind the dispatch byte */
+  AM_SOURCE = 3,
+  AM_GROUP = 6,
+  AM_TYPE = 7,
+  AM_PAYLOAD = 8
+};
+
+void sf_filter_all(sf_filter *f)
+{
+  f->count = 0;
+  memset(f->types, 0xff, sizeof f->types);
+}
+
+int sf_filter_parse(sf_filter *f, const void *packet, int len)
+{
+  const uint8_t *p = packet, *end = p + len;
+  int i, count, all = 0;
+
+  sf_filter_all(f);
+  if (len < 1 || *p > SF_FILTER_MAX_RULES)
+    return -1;
+  count = *p++;
+
+  memset(f->types, 0, sizeof f->types);
+  for (i = 0; i < count; i++)
+    {
+      sf_filter_rule *r = &f->rules[i];
+
+      if (p >= end)
+	break;
+      memset(r, 0, sizeof *r);
+      r->fields = *p++;
+      if (r->fields & ~(SF_FILTER_TYPE | SF_FILTER_SOURCE |
+			SF_FILTER_GROUP | SF_FILTER_PREFIX))
+	break;
+      if (r->fields & SF_FILTER_TYPE)
+	{
+	  if (p >= end)
+	    break;
+	  r->type = *p++;
+	}
+      if (r->fields & SF_FILTER_SOURCE)
+	{
+	  if (end - p < 2)
+	    break;
+	  r->source = p[0] << 8 | p[1];
+	  p += 2;
+	}
+      if (r->fields & SF_FILTER_GROUP)
+	{
+	  if (p >= end)
+	    break;
+	  r->group = *p++;
+	}
+      if (r->fields & SF_FILTER_PREFIX)
+	{
+	  if (p >= end || *p > SF_FILTER_MAX_PREFIX || end - p < 1 + *p)
+	    break;
+	  r->prefix_len = *p++;
+	  memcpy(r->prefix, p, r->prefix_len);
+	  p += r->prefix_len;
+	}
+
+      /* a rule without fields takes everything */
+      if (!r->fields)
+	all = 1;
+      if (r->fields & SF_FILTER_TYPE)
+	f->types[r->type >> 5] |= 1u << (r->type & 31);
+      else
+	memset(f->types, 0xff, sizeof f->types);
+    }
+
+  if (i < count || p != end)
+    {
+      sf_filter_all(f);
+      return -1;
+    }
+  f->count = count;
+  if (all || count == 0)
+    sf_filter_all(f);
+
+  return 0;
+}
+
+int sf_filter_encode(void *to, const sf_filter_rule *rules, int count)
+{
+  uint8_t *p = to, *end = p + 255;
+  int i;
+
+  if (count < 0 || count > SF_FILTER_MAX_RULES)
+    return -1;
+  *p++ = count;
+
+  for (i = 0; i < count; i++)
+    {
+      const sf_filter_rule *r = &rules[i];
+
+      /* fields, type, source, group, prefix length and prefix */
+      if (r->prefix_len > SF_FILTER_MAX_PREFIX ||
+	  end - p < 6 + r->prefix_len)
+	return -1;
+      *p++ = r->fields;
+      if (r->fields & SF_FILTER_TYPE)
+	*p++ = r->type;
+      if (r->fields & SF_FILTER_SOURCE)
+	{
+	  *p++ = r->source >> 8;
+	  *p++ = r->source;
+	}
+      if (r->fields & SF_FILTER_GROUP)
+	*p++ = r->group;
+      if (r->fields & SF_FILTER_PREFIX)
+	{
+	  *p++ = r->prefix_len;
+	  memcpy(p, r->prefix, r->prefix_len);
+	  p += r->prefix_len;
+	}
+    }
+
+  return p - (uint8_t *)to;
+}
+
+int sf_filter_match(const sf_filter *f, const void *packet, int len)
+{
+  const uint8_t *p = packet;
+  uint8_t type;
+  uint16_t source;
+  int i;
+
+  if (f->count == 0)
+    return 1;
+  if (len < AM_PAYLOAD || p[0] != AM_DISPATCH)
+    return 0;
+
+  type = p[AM_TYPE];
+  if (!(f->types[type >> 5] & (1u << (type & 31))))
+    return 0;
+
+  source = p[AM_SOURCE] << 8 | p[AM_SOURCE + 1];
+  for (i = 0; i < f->count; i++)
+    {
+      const sf_filter_rule *r = &f->rules[i];
+
+      if ((r->fields & SF_FILTER_TYPE) && r->type != type)
+	continue;
+      if ((r->fields & SF_FILTER_SOURCE) && r->source != source)
+	continue;
+      if ((r->fields & SF_FILTER_GROUP) && r->group != p[AM_GROUP])
+	continue;
+      if ((r->fields & SF_FILTER_PREFIX) &&
+	  (len - AM_PAYLOAD < r->prefix_len ||
+	   memcmp(p + AM_PAYLOAD, r->prefix, r->prefix_len)))
+	continue;
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef SFFILTER_H
+#define SFFILTER_H
+
+/* Subscription filters of the serial forwarder protocol. Shared by the C
+   (sf.c, sfsource.c) and C++ (cpp/sf) serial forwarders.
+
+   A peer offering subversion SF_FILTER_VERSION ('!') instead of ' ' in
+   the handshake understands filters; the negotiated version is the
+   smaller of the two, so old peers keep talking version ' '. With
+   version '!' the first packet a client sends (after the device
+   selection packet of a cpp/sf gateway) is its filter:
+
+     count, then count rules, each:
+       fields                     SF_FILTER_xxx bits
+       type                       if fields & SF_FILTER_TYPE
+       source (2 bytes, msb first) if fields & SF_FILTER_SOURCE
+       group                      if fields & SF_FILTER_GROUP
+       n, n prefix bytes          if fields & SF_FILTER_PREFIX
+
+   The server then only sends the client serial active messages
+   (tos/lib/serial/Serial.h) for which all fields of at least one rule
+   match. No rules, or a rule without fields, means every packet. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SF_FILTER_VERSION '!'
+
+enum {
+  SF_FILTER_TYPE = 1,
+  SF_FILTER_SOURCE = 2,
+  SF_FILTER_GROUP = 4,
+  SF_FILTER_PREFIX = 8,		/* payload starts with prefix */
+
+  SF_FILTER_MAX_RULES = 16,
+  SF_FILTER_MAX_PREFIX = 16
+};
+
+typedef struct sf_filter_rule {
+  uint8_t fields;
+  uint8_t type;
+  uint16_t source;
+  uint8_t group;
+  uint8_t prefix_len;
+  uint8_t prefix[SF_FILTER_MAX_PREFIX];
+} sf_filter_rule;
+
+typedef struct sf_filter {
+  int count;			/* 0: every packet passes */
+  uint32_t types[8];		/* bit set of the AM types some rule takes */
+  sf_filter_rule rules[SF_FILTER_MAX_RULES];
+} sf_filter;
+
+void sf_filter_all(sf_filter *f);
+/* Effects: makes f let every packet pass
+*/
+
+int sf_filter_parse(sf_filter *f, const void *packet, int len);
+/* Effects: compiles the len byte filter packet into f
+   Returns: 0 for success, -1 if the packet is malformed or has more
+     than SF_FILTER_MAX_RULES rules (f then lets every packet pass)
+*/
+
+int sf_filter_encode(void *to, const sf_filter_rule *rules, int count);
+/* Effects: writes the filter packet for count rules into to, which must
+     hold 255 bytes
+   Returns: the packet length, or -1 if the rules do not fit
+*/
+
+int sf_filter_match(const sf_filter *f, const void *packet, int len);
+/* Returns: non-zero if the len byte serial packet passes f
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -51,9 +51,7 @@ int safewrite(int fd, const void *buffer, int count)
   return actual;
 }
 
-int open_sf_source(const char *host, int port)
-/* Returns: file descriptor for serial forwarder at host:port
- */
+static int sf_connect(const char *host, int port)
 {
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   struct hostent *entry;
@@ -78,7 +76,16 @@ int open_sf_source(const char *host, int port)
       return -1;
     }
 
-  if (init_sf_source(fd) < 0)
+  return fd;
+}
+
+int open_sf_source(const char *host, int port)
+/* Returns: file descriptor for serial forwarder at host:port
+ */
+{
+  int fd = sf_connect(host, port);
+
+  if (fd >= 0 && init_sf_source(fd) < 0)
     {
       close(fd);
       return -1;
@@ -87,19 +94,38 @@ int open_sf_source(const char *host, int port)
   return fd;
 }
 
-int init_sf_source(int fd)
-/* Effects: Checks that fd is following the TinyOS 2.0 serial forwarder 
-     protocol. Use this if you obtain your file descriptor from some other
-     source than open_sf_source (e.g., you're a server)
-   Returns: 0 if it is, -1 otherwise
+int open_sf_source_filtered(const char *host, int port,
+			    const sf_filter_rule *rules, int count,
+			    int *filtered)
+/* Returns: file descriptor for serial forwarder at host:port, *filtered
+     says if it filters
  */
+{
+  int fd = sf_connect(host, port);
+
+  if (fd >= 0)
+    {
+      *filtered = init_sf_source_filtered(fd, rules, count);
+      if (*filtered < 0)
+	{
+	  close(fd);
+	  return -1;
+	}
+    }
+
+  return fd;
+}
+
+static int sf_handshake(int fd, char subversion)
+/* Returns: the protocol version agreed on with the other end, -1 for
+     failure */
 {
   char check[2], us[2];
   int version;
 
   /* Indicate version and check if a TinyOS 2.0 serial forwarder on the
      other end */
-  us[0] = 'U'; us[1] = ' ';
+  us[0] = 'U'; us[1] = subversion;
   if (safewrite(fd, us, 2) != 2 ||
       saferead(fd, check, 2) != 2 ||
       check[0] != 'U')
@@ -113,10 +139,68 @@ int init_sf_source(int fd)
   switch (version)
     {
     case ' ': break;
+    case SF_FILTER_VERSION: break;
     default: return -1; /* not a valid version */
     }
 
-  return 0;
+  return version;
+}
+
+int init_sf_source(int fd)
+/* Effects: Checks that fd is following the TinyOS 2.0 serial forwarder 
+     protocol. Use this if you obtain your file descriptor from some other
+     source than open_sf_source (e.g., you're a server)
+   Returns: 0 if it is, -1 otherwise
+ */
+{
+  return sf_handshake(fd, ' ') < 0 ? -1 : 0;
+}
+
+int init_sf_source_filtered(int fd, const sf_filter_rule *rules, int count)
+/* Effects: init_sf_source for open_sf_source_filtered
+   Returns: 1 if the other end filters, 0 if it does not, -1 for failure
+ */
+{
+  unsigned char filter[255];
+  int len = sf_filter_encode(filter, rules, count);
+  int version;
+
+  if (len < 0)
+    return -1;
+
+  version = sf_handshake(fd, SF_FILTER_VERSION);
+  if (version < 0)
+    return -1;
+  if (version != SF_FILTER_VERSION)
+    return 0;
+
+  return write_sf_packet(fd, filter, len) < 0 ? -1 : 1;
+}
+
+int accept_sf_client(int fd, sf_filter *filter)
+/* Effects: server side of the handshake with a new client on fd, reads
+     the filter of clients that have one into filter (all packets
+     otherwise)
+   Returns: 0 for success, -1 for failure
+ */
+{
+  int version = sf_handshake(fd, SF_FILTER_VERSION);
+  void *packet;
+  int len, ok;
+
+  sf_filter_all(filter);
+  if (version < 0)
+    return -1;
+  if (version != SF_FILTER_VERSION)
+    return 0;
+
+  packet = read_sf_packet(fd, &len);
+  if (!packet)
+    return -1;
+  ok = sf_filter_parse(filter, packet, len);
+  free(packet);
+
+  return ok;
 }
 
 void *read_sf_packet(int fd, int *len)
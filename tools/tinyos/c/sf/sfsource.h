@@ -1,6 +1,8 @@
 #ifndef SFSOURCE_H
 #define SFSOURCE_H
 
+#include "sffilter.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,6 +19,29 @@ int init_sf_source(int fd);
    Returns: 0 if it is, -1 otherwise
  */
 
+int open_sf_source_filtered(const char *host, int port,
+			    const sf_filter_rule *rules, int count,
+			    int *filtered);
+/* Effects: like open_sf_source, but asks the serial forwarder to only
+     send the packets passing count rules (see sffilter.h). *filtered is
+     set to 0 if the serial forwarder is too old to filter: it then sends
+     every packet, check them with sf_filter_match.
+   Returns: file descriptor for TinyOS 2.0 serial forwarder at host:port, or
+     -1 for failure
+ */
+
+int init_sf_source_filtered(int fd, const sf_filter_rule *rules, int count);
+/* Effects: init_sf_source for open_sf_source_filtered
+   Returns: 1 if the other end filters, 0 if it does not, -1 for failure
+ */
+
+int accept_sf_client(int fd, sf_filter *filter);
+/* Effects: server side of the handshake with a new client on fd, reads
+     the filter of clients that have one into filter (all packets
+     otherwise)
+   Returns: 0 for success, -1 for failure
+ */
+
 void *read_sf_packet(int fd, int *len);
 /* Effects: reads packet from serial forwarder on file descriptor fd
    Returns: the packet read (in newly allocated memory), and *len is
@@ -0,0 +1,138 @@
+#include "latencyhistogram.h"
+
+#include <time.h>
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram() : count(0), sum(0), max(0)
+{
+    for (int i = 0; i < cBuckets; i++)
+    {
+        buckets[i] = 0;
+    }
+}
+
+long long LatencyHistogram::now()
+{
+    struct timespec currentTime;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+    return (long long)currentTime.tv_sec * 1000 * 1000 * 1000 + currentTime.tv_nsec;
+}
+
+/* cSubBuckets = 8: 0..7 us get a bucket each, then [8,9) .. [15,16),
+   [16,18) .. [30,32), [32,36) .. and so on */
+int LatencyHistogram::bucketOf(long long pUs)
+{
+    if (pUs < cSubBuckets)
+    {
+        return (int)pUs;
+    }
+    // position of the highest bit above the sub bucket bits (3 for 8)
+    int octave = 63 - __builtin_clzll((unsigned long long)pUs) - __builtin_ctz(cSubBuckets);
+    if (octave >= cOctaves)
+    {
+        return cBuckets - 1;
+    }
+    int sub = (int)(pUs >> octave) - cSubBuckets;
+    return cSubBuckets * (octave + 1) + sub;
+}
+
+long long LatencyHistogram::bucketLimit(int pBucket)
+{
+    if (pBucket < cSubBuckets)
+    {
+        return pBucket + 1;
+    }
+    int octave = pBucket / cSubBuckets - 1;
+    int sub = pBucket % cSubBuckets;
+    return (long long)(cSubBuckets + sub + 1) << octave;
+}
+
+void LatencyHistogram::add(long long pLatency)
+{
+    if (pLatency < 0)
+    {
+        pLatency = 0;
+    }
+    __atomic_add_fetch(&buckets[bucketOf(pLatency / 1000)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sum, pLatency, __ATOMIC_RELAXED);
+    long long seen = __atomic_load_n(&max, __ATOMIC_RELAXED);
+    while ((pLatency > seen) &&
+           !__atomic_compare_exchange_n(&max, &seen, pLatency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+unsigned long LatencyHistogram::getCount() const
+{
+    return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+long long LatencyHistogram::getSum() const
+{
+    return __atomic_load_n(&sum, __ATOMIC_RELAXED);
+}
+
+unsigned long LatencyHistogram::getCountBelow(long long pLimit) const
+{
+    unsigned long seen = 0;
+    for (int i = 0; (i < cBuckets - 1) && (bucketLimit(i) <= pLimit); i++)
+    {
+        seen += __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+    }
+    return seen;
+}
+
+long long LatencyHistogram::percentile(double pFraction) const
+{
+    unsigned long total = __atomic_load_n(&count, __ATOMIC_RELAXED);
+    unsigned long seen = 0;
+    for (int i = 0; i < cBuckets - 1; i++)
+    {
+        seen += __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+        if (seen >= pFraction * total)
+        {
+            return bucketLimit(i);
+        }
+    }
+    return __atomic_load_n(&max, __ATOMIC_RELAXED) / 1000;
+}
+
+void LatencyHistogram::reportStatus(ostream& os) const
+{
+    unsigned long total = __atomic_load_n(&count, __ATOMIC_RELAXED);
+    os << "packets = " << total;
+    if (total == 0)
+    {
+        os << endl;
+        return;
+    }
+    os << " , mean = " << __atomic_load_n(&sum, __ATOMIC_RELAXED) / total / 1000 << " us"
+       << " , p50 < " << percentile(0.5) << " us"
+       << " , p90 < " << percentile(0.9) << " us"
+       << " , p99 < " << percentile(0.99) << " us"
+       << " , max = " << __atomic_load_n(&max, __ATOMIC_RELAXED) / 1000 << " us" << endl
+       << "       ";
+    // non-empty buckets, merged to powers of two to keep the line short
+    unsigned long n = 0;
+    for (int i = 0; i < cBuckets; i++)
+    {
+        n += __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+        long long limit = bucketLimit(i);
+        bool octaveEnd = (i == cBuckets - 1) || ((limit & (limit - 1)) == 0);
+        if ((n > 0) && octaveEnd)
+        {
+            if (i < cBuckets - 1)
+            {
+                os << " <" << limit << "us: " << n;
+            }
+            else
+            {
+                os << " more: " << n;
+            }
+            n = 0;
+        }
+    }
+    os << endl;
+}
@@ -0,0 +1,68 @@
+/**
+ * Lock-free histogram of packet latencies, used to measure the time from
+ * serial byte arrival to the TCP send of a packet, from its TCP arrival
+ * to the ack of the node and the ack round trip times.
+ *
+ * Buckets are log-linear as in HdrHistogram: every power of two of
+ * microseconds is split into cSubBuckets buckets, so a bucket limit is
+ * never off by more than 1/cSubBuckets of the latency it stands for.
+ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <iostream>
+
+class LatencyHistogram
+{
+public:
+    /* buckets per power of two, below cSubBuckets us one per us */
+    static const int cSubBuckets = 8;
+
+    /* powers of two covered above cSubBuckets us, up to 2^27 us (134 s) */
+    static const int cOctaves = 24;
+
+    /* the last bucket counts everything above */
+    static const int cBuckets = cSubBuckets * (cOctaves + 1) + 1;
+
+protected:
+    unsigned long buckets[cBuckets];
+
+    unsigned long count;
+
+    /* in ns */
+    long long sum;
+    long long max;
+
+    /* bucket counting latencies of pUs us */
+    static int bucketOf(long long pUs);
+
+    /* upper bound of bucket pBucket in us */
+    static long long bucketLimit(int pBucket);
+
+    /* smallest bucket limit covering pFraction of all samples */
+    long long percentile(double pFraction) const;
+
+public:
+    LatencyHistogram();
+
+    /* current time in ns, the clock packet arrival times are taken with */
+    static long long now();
+
+    /* adds a sample in ns, may be called from any thread */
+    void add(long long pLatency);
+
+    /* number of samples */
+    unsigned long getCount() const;
+
+    /* sum of all samples in ns */
+    long long getSum() const;
+
+    /* samples below pLimit us, pLimit must be a power of two */
+    unsigned long getCountBelow(long long pLimit) const;
+
+    /* prints count, mean, percentiles and the non-empty buckets */
+    void reportStatus(std::ostream& os) const;
+};
+
+#endif
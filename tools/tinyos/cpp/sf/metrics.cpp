@@ -0,0 +1,97 @@
+#include "metrics.h"
+
+#include <sstream>
+
+using namespace std;
+
+/* name{labels}, just name without labels */
+static string series(const string& pName, const string& pLabels)
+{
+    return pLabels.empty() ? pName : pName + "{" + pLabels + "}";
+}
+
+Metrics::family_t& Metrics::family(const string& pName, const char* pType, const char* pHelp)
+{
+    map<string, family_t>::iterator it = families.find(pName);
+    if (it == families.end())
+    {
+        names.push_back(pName);
+        family_t &newFamily = families[pName];
+        newFamily.type = pType;
+        newFamily.help = pHelp;
+        return newFamily;
+    }
+    return it->second;
+}
+
+string Metrics::label(const char* pName, const string& pValue)
+{
+    string escaped;
+    for (unsigned i = 0; i < pValue.size(); i++)
+    {
+        if ((pValue[i] == '\\') || (pValue[i] == '"'))
+        {
+            escaped += '\\';
+        }
+        if (pValue[i] == '\n')
+        {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += pValue[i];
+    }
+    return string(pName) + "=\"" + escaped + "\"";
+}
+
+string Metrics::label(const char* pName, long long pValue)
+{
+    ostringstream value;
+    value << pValue;
+    return label(pName, value.str());
+}
+
+void Metrics::counter(const string& pName, const char* pHelp, const string& pLabels, unsigned long pValue)
+{
+    ostringstream sample;
+    sample << series(pName, pLabels) << " " << pValue << "\n";
+    family(pName, "counter", pHelp).samples += sample.str();
+}
+
+void Metrics::gauge(const string& pName, const char* pHelp, const string& pLabels, double pValue)
+{
+    ostringstream sample;
+    sample.precision(9);
+    sample << series(pName, pLabels) << " " << pValue << "\n";
+    family(pName, "gauge", pHelp).samples += sample.str();
+}
+
+void Metrics::histogram(const string& pName, const char* pHelp, const string& pLabels, const LatencyHistogram& pHistogram)
+{
+    ostringstream sample;
+    sample.precision(9);
+    string labels = pLabels.empty() ? "" : pLabels + ",";
+    // read the count first: buckets may only grow while we look at them
+    unsigned long total = pHistogram.getCount();
+    long long lastLimit = (long long)LatencyHistogram::cSubBuckets << LatencyHistogram::cOctaves;
+    for (long long limit = 1; limit <= lastLimit; limit *= 2)
+    {
+        unsigned long below = pHistogram.getCountBelow(limit);
+        sample << pName << "_bucket{" << labels << "le=\"" << limit / 1e6 << "\"} "
+               << ((below < total) ? below : total) << "\n";
+    }
+    sample << pName << "_bucket{" << labels << "le=\"+Inf\"} " << total << "\n"
+           << series(pName + "_sum", pLabels) << " " << pHistogram.getSum() / 1e9 << "\n"
+           << series(pName + "_count", pLabels) << " " << total << "\n";
+    family(pName, "histogram", pHelp).samples += sample.str();
+}
+
+void Metrics::write(ostream& os) const
+{
+    for (unsigned i = 0; i < names.size(); i++)
+    {
+        const family_t &f = families.find(names[i])->second;
+        os << "# HELP " << names[i] << " " << f.help << "\n"
+           << "# TYPE " << names[i] << " " << f.type << "\n"
+           << f.samples;
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * Counters and gauges read by sf-control while the threads of the
+ * sf-servers update them, and the Prometheus text format they are
+ * exported in.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "latencyhistogram.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+
+/* counter updated by a single thread and read by any: relaxed atomic
+   loads and stores, no locked read-modify-write on the hot path */
+class Counter
+{
+protected:
+    unsigned long value;
+
+public:
+    Counter(unsigned long pValue = 0) : value(pValue) {}
+
+    void add(unsigned long pCount)
+    {
+        __atomic_store_n(&value, __atomic_load_n(&value, __ATOMIC_RELAXED) + pCount, __ATOMIC_RELAXED);
+    }
+
+    Counter& operator++() { add(1); return *this; }
+
+    void operator++(int) { add(1); }
+
+    unsigned long get() const { return __atomic_load_n(&value, __ATOMIC_RELAXED); }
+
+    operator unsigned long() const { return get(); }
+};
+
+/* current value of something, e.g. a queue length, same rules as Counter */
+class Gauge
+{
+protected:
+    long long value;
+
+public:
+    Gauge(long long pValue = 0) : value(pValue) {}
+
+    void set(long long pValue) { __atomic_store_n(&value, pValue, __ATOMIC_RELAXED); }
+
+    long long get() const { return __atomic_load_n(&value, __ATOMIC_RELAXED); }
+
+    operator long long() const { return get(); }
+};
+
+/* collects samples and writes them in the Prometheus text format, samples
+   of one metric are grouped no matter in which order they are added */
+class Metrics
+{
+protected:
+    typedef struct
+    {
+        std::string type;
+        std::string help;
+        std::string samples;
+    } family_t;
+
+    /* families in the order they were first added */
+    std::vector<std::string> names;
+
+    std::map<std::string, family_t> families;
+
+    family_t& family(const std::string& pName, const char* pType, const char* pHelp);
+
+public:
+    /* label list entry pName="pValue", escaped */
+    static std::string label(const char* pName, const std::string& pValue);
+
+    static std::string label(const char* pName, long long pValue);
+
+    /* pLabels: comma separated label list entries, may be empty */
+    void counter(const std::string& pName, const char* pHelp, const std::string& pLabels, unsigned long pValue);
+
+    void gauge(const std::string& pName, const char* pHelp, const std::string& pLabels, double pValue);
+
+    /* latencies in seconds, one bucket per power of two us */
+    void histogram(const std::string& pName, const char* pHelp, const std::string& pLabels, const LatencyHistogram& pHistogram);
+
+    void write(std::ostream& os) const;
+};
+
+#endif
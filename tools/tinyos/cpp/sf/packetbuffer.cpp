@@ -32,136 +32,413 @@
 
 #include "packetbuffer.h"
 
-#include "pthread.h"
-#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
-PacketBuffer::PacketBuffer()
+using namespace std;
+
+PacketBuffer::Ring::Ring(unsigned pCapacity) : head(0), tail(0)
+{
+    unsigned long capacity = 2;
+    while (capacity < pCapacity)
+    {
+        capacity <<= 1;
+    }
+    mask = capacity - 1;
+    slots = new slot_t[capacity];
+    for (unsigned long i = 0; i < capacity; i++)
+    {
+        slots[i].seq = i;
+    }
+}
+
+PacketBuffer::Ring::~Ring()
+{
+    delete[] slots;
+}
+
+/* claims the slot at tail, fails if the ring is full */
+bool PacketBuffer::Ring::tryPush(const SFPacket &pPacket)
+{
+    slot_t *slot;
+    unsigned long pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    while (true)
+    {
+        slot = &slots[pos & mask];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->packet = pPacket;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* claims the slot at head, fails if the ring is empty */
+bool PacketBuffer::Ring::tryPop(SFPacket &pPacket)
+{
+    slot_t *slot;
+    unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    while (true)
+    {
+        slot = &slots[pos & mask];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    // hand over the reference instead of copying, the slot keeps none
+    pPacket.swap(slot->packet);
+    slot->packet = SFPacket();
+    __atomic_store_n(&slot->seq, pos + mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+unsigned long PacketBuffer::Ring::capacity() const
 {
-    pthread_mutex_init(&buffer.lock, NULL);
-    pthread_cond_init(&buffer.notempty, NULL);
-    pthread_cond_init(&buffer.notfull, NULL);
+    return mask + 1;
+}
+
+/* approximate while other threads are working on the ring */
+unsigned long PacketBuffer::Ring::size() const
+{
+    unsigned long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    unsigned long t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    return (t > h) ? t - h : 0;
+}
+
+PacketBuffer::PacketBuffer(unsigned pCapacity, overflowPolicy_t pPolicy) : queue(pCapacity), urgent(cUrgentCapacity), policy(pPolicy), enqueuedCount(0), dequeuedCount(0), droppedOldestCount(0), droppedNewestCount(0), blockedCount(0)
+{
+    initWakeup(notempty);
+    initWakeup(notfull);
 }
 
 
 PacketBuffer::~PacketBuffer()
 {
-  pthread_cond_destroy(&buffer.notempty);
-  pthread_cond_destroy(&buffer.notfull);
-  pthread_mutex_destroy(&buffer.lock);
+    closeWakeup(notempty);
+    closeWakeup(notfull);
+}
+
+void PacketBuffer::initWakeup(wakeup_t &pWakeup)
+{
+    pWakeup.waiters = 0;
+#ifdef __linux__
+    // semaphore mode: every notify releases exactly one read()
+    pWakeup.fds[0] = pWakeup.fds[1] = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+    if (pWakeup.fds[0] >= 0)
+    {
+        return;
+    }
+#endif
+    if (pipe(pWakeup.fds) == 0)
+    {
+        fcntl(pWakeup.fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(pWakeup.fds[1], F_SETFL, O_NONBLOCK);
+    }
+    else
+    {
+        pWakeup.fds[0] = pWakeup.fds[1] = -1;
+    }
+}
+
+void PacketBuffer::closeWakeup(wakeup_t &pWakeup)
+{
+    if (pWakeup.fds[0] >= 0)
+    {
+        close(pWakeup.fds[0]);
+    }
+    if (pWakeup.fds[1] != pWakeup.fds[0])
+    {
+        close(pWakeup.fds[1]);
+    }
+}
+
+void PacketBuffer::notify(wakeup_t &pWakeup)
+{
+    // pairs with the fence in wait(): either the sleeper sees the new state
+    // or we see the sleeper
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pWakeup.waiters, __ATOMIC_RELAXED) > 0)
+    {
+        // a full pipe already holds enough wakeups
+        uint64_t one = 1;
+        if (write(pWakeup.fds[1], &one, (pWakeup.fds[0] == pWakeup.fds[1]) ? sizeof(one) : 1) < 0)
+        {
+            DEBUG("PacketBuffer::notify : write failed")
+        }
+    }
+}
+
+void leaveWait(void* ob)
+{
+    __atomic_sub_fetch(&static_cast<PacketBuffer::wakeup_t*>(ob)->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+bool PacketBuffer::wait(wakeup_t &pWakeup, int pTimeout)
+{
+    uint64_t token;
+    bool woken = true;
+    pthread_cleanup_push(leaveWait, (void *) &pWakeup);
+    struct pollfd pfd;
+    pfd.fd = pWakeup.fds[0];
+    pfd.events = POLLIN;
+    int n = poll(&pfd, 1, pWakeup.fds[0] >= 0 ? pTimeout : 1);
+    if (n > 0)
+    {
+        // another sleeper may have taken the token, that is a spurious wakeup
+        if (read(pWakeup.fds[0], &token, (pWakeup.fds[0] == pWakeup.fds[1]) ? sizeof(token) : 1) < 0)
+        {
+            DEBUG("PacketBuffer::wait : token already taken")
+        }
+    }
+    else if (n == 0)
+    {
+        woken = (pWakeup.fds[0] < 0);
+    }
+    pthread_cleanup_pop(1);
+    return woken;
+}
+
+/* urgent packets first, then the queue */
+bool PacketBuffer::tryDequeue(SFPacket &pPacket)
+{
+    if (urgent.tryPop(pPacket) || queue.tryPop(pPacket))
+    {
+        __atomic_add_fetch(&dequeuedCount, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
 }
 
 // clears the buffer
 void PacketBuffer::clear() {
+    SFPacket packet;
     pthread_testcancel();
-    pthread_mutex_lock(&buffer.lock);
-    // clear
-    buffer.container.clear();
+    while (urgent.tryPop(packet) || queue.tryPop(packet))
+    {
+    }
     DEBUG("PacketBuffer::clear : cleared buffer and signal <notfull>")
-    pthread_cond_signal(&buffer.notfull);
-    pthread_mutex_unlock(&buffer.lock);
+    notify(notfull);
 }
 
-// gets a packet from the buffer (NULL = buffer empty)
+// gets a packet from the buffer, blocks while the buffer is empty
 SFPacket PacketBuffer::dequeue()
 {
     SFPacket packet;
+    dequeue(&packet, 1);
+    return packet;
+}
+
+// gets up to pMax packets from the buffer, blocks while the buffer is empty
+// but at most pTimeout ms (-1: forever). returns 0 on timeout
+unsigned PacketBuffer::dequeue(SFPacket *pPackets, unsigned pMax, int pTimeout)
+{
+    unsigned count = 0;
+    struct timeval deadline;
+    if (pTimeout > 0)
+    {
+        gettimeofday(&deadline, NULL);
+        deadline.tv_sec += pTimeout / 1000;
+        deadline.tv_usec += (pTimeout % 1000) * 1000;
+        if (deadline.tv_usec >= 1000000)
+        {
+            deadline.tv_usec -= 1000000;
+            deadline.tv_sec++;
+        }
+    }
     pthread_testcancel();
-    pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &buffer.lock);
-    pthread_mutex_lock(&buffer.lock);
-    // wait until buffer is _not_ empty
-    while(buffer.container.size() == 0)
+    while (!tryDequeue(pPackets[0]))
     {
+        int timeout = -1;
+        if (pTimeout >= 0)
+        {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            timeout = (pTimeout == 0) ? 0 : (deadline.tv_sec - now.tv_sec) * 1000
+                + (deadline.tv_usec - now.tv_usec + 999) / 1000;
+            if (timeout <= 0)
+            {
+                return 0;
+            }
+        }
+        __atomic_add_fetch(&notempty.waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (tryDequeue(pPackets[0]))
+        {
+            __atomic_sub_fetch(&notempty.waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
         DEBUG("PacketBuffer::dequeue : waiting until buffer is <notempty>")
-        pthread_cond_wait(&buffer.notempty, &buffer.lock);
+        // decrements waiters again (also if the thread is canceled)
+        wait(notempty, timeout);
+    }
+    count = 1;
+    while ((count < pMax) && tryDequeue(pPackets[count]))
+    {
+        ++count;
     }
-    // dequeue
-    packet = buffer.container.front();
-    buffer.container.pop_front();
     DEBUG("PacketBuffer::dequeue : get from buffer and signal <notfull>")
-    pthread_cond_signal(&buffer.notfull);
-    pthread_cleanup_pop(1); 
-    return packet;
+    notify(notfull);
+    return count;
 }
 
-// puts a packet into buffer... (SUCCESS = true)
-bool PacketBuffer::enqueueFront(SFPacket &pPacket)
+/* enqueues according to pPolicy (SUCCESS = true) */
+bool PacketBuffer::push(Ring &pRing, SFPacket &pPacket, overflowPolicy_t pPolicy)
 {
     pthread_testcancel();
-    pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &buffer.lock);
-    pthread_mutex_lock(&buffer.lock);
-    // wait until buffer is _not_ full
-    while(buffer.container.size() >= cMaxBufferSize)
-    {
-        DEBUG("PacketBuffer::enqueueFront : waiting until buffer is <notfull>")
-        pthread_cond_wait(&buffer.notfull, &buffer.lock);
-    }
-    // enqueue
-    buffer.container.push_front(pPacket);
-    DEBUG("PacketBuffer::enqueueFront : put in buffer and signal <notempty>")
-    // signal that buffer is now not empty
-    pthread_cond_signal(&buffer.notempty);
-    pthread_cleanup_pop(1); 
+    while (!pRing.tryPush(pPacket))
+    {
+        SFPacket dropped;
+        switch (pPolicy)
+        {
+        case cDropNewest:
+            __atomic_add_fetch(&droppedNewestCount, 1, __ATOMIC_RELAXED);
+            return false;
+        case cDropOldest:
+            if (pRing.tryPop(dropped))
+            {
+                __atomic_add_fetch(&droppedOldestCount, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        case cBlock:
+        default:
+            __atomic_add_fetch(&notfull.waiters, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (pRing.tryPush(pPacket))
+            {
+                __atomic_sub_fetch(&notfull.waiters, 1, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&enqueuedCount, 1, __ATOMIC_RELAXED);
+                notify(notempty);
+                return true;
+            }
+            DEBUG("PacketBuffer::push : waiting until buffer is <notfull>")
+            __atomic_add_fetch(&blockedCount, 1, __ATOMIC_RELAXED);
+            wait(notfull, -1);
+            break;
+        }
+    }
+    __atomic_add_fetch(&enqueuedCount, 1, __ATOMIC_RELAXED);
+    DEBUG("PacketBuffer::push : put in buffer and signal <notempty>")
+    notify(notempty);
     return true;
 }
 
+// puts a packet in front of all queued packets (SUCCESS = true)
+bool PacketBuffer::enqueueFront(SFPacket &pPacket)
+{
+    // stale ACKs are useless, so the urgent ring never blocks
+    return push(urgent, pPacket, cDropOldest);
+}
+
 // puts a packet into buffer... (SUCCESS = true)
 bool PacketBuffer::enqueueBack(SFPacket &pPacket)
 {
-    pthread_testcancel();
-    pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &buffer.lock);
-    pthread_mutex_lock(&buffer.lock);
-    // wait until buffer is _not_ full
-    while(buffer.container.size() >= cMaxBufferSize)
-    {
-        DEBUG("PacketBuffer::enqueueBack : waiting until buffer is <notfull>")
-        pthread_cond_wait(&buffer.notfull, &buffer.lock);
-    }
-    // enqueue
-    buffer.container.push_back(pPacket);
-    DEBUG("PacketBuffer::enqueueBack : put in buffer and signal <notempty>")
-    // signal that buffer is now not empty
-    pthread_cond_signal(&buffer.notempty);
-    pthread_cleanup_pop(1); 
-    return true;
+    return push(queue, pPacket, policy);
 }
 
 /* checks if packet buffer is full */
 bool PacketBuffer::isFull() {
-  bool isFull = true;
-  pthread_testcancel();
-  pthread_mutex_lock(&buffer.lock);
-  if (buffer.container.size() < cMaxBufferSize) {
-      isFull = false;
-  }
-  pthread_mutex_unlock(&buffer.lock);
-  return isFull;
+    pthread_testcancel();
+    return queue.size() >= queue.capacity();
 }
 
 /* checks if packet buffer is empty */
 bool PacketBuffer::isEmpty() {
-  bool isEmpty = true;
-  pthread_testcancel();
-  pthread_mutex_lock(&buffer.lock);
-  if (buffer.container.size() > 0) {
-      isEmpty = false;
-  }
-  pthread_mutex_unlock(&buffer.lock);
-  return isEmpty;
+    pthread_testcancel();
+    return (queue.size() == 0) && (urgent.size() == 0);
 }
 
-/* checks if pPacket is in queue */
-bool PacketBuffer::isInQueue(SFPacket &pPacket)
+unsigned long PacketBuffer::getCapacity() const
 {
-    bool result = false;
-    DEBUG("PacketBuffer::isInQueue : lock")
-    pthread_testcancel();
-    pthread_mutex_lock(&buffer.lock);
-    container_t::const_iterator it = find(buffer.container.begin(), buffer.container.end(), pPacket);
-    if( it != buffer.container.end() )
+    return queue.capacity();
+}
+
+PacketBuffer::overflowPolicy_t PacketBuffer::getPolicy() const
+{
+    return policy;
+}
+
+static const char* policyNames[] = { "block", "drop-oldest", "drop-newest" };
+
+const char* PacketBuffer::getPolicyName(overflowPolicy_t pPolicy)
+{
+    return policyNames[pPolicy];
+}
+
+bool PacketBuffer::parsePolicy(const string& pName, overflowPolicy_t& pPolicy)
+{
+    for (int i = cBlock; i <= cDropNewest; i++)
     {
-        result = true;
+        if (pName == policyNames[i])
+        {
+            pPolicy = (overflowPolicy_t)i;
+            return true;
+        }
     }
-    pthread_mutex_unlock(&buffer.lock);
-    DEBUG("PacketBuffer::isInQueue : unlock")
-    return result;
+    return false;
+}
+
+unsigned long PacketBuffer::getDroppedCount() const
+{
+    return __atomic_load_n(&droppedOldestCount, __ATOMIC_RELAXED)
+        + __atomic_load_n(&droppedNewestCount, __ATOMIC_RELAXED);
+}
+
+/* prints out some stats */
+void PacketBuffer::reportStatus(ostream& os)
+{
+    os << "PacketBuffer : capacity = " << queue.capacity()
+       << " ( policy = " << policyNames[policy] << " )"
+       << " , queued = " << queue.size() + urgent.size()
+       << " , enqueued = " << enqueuedCount
+       << " , dequeued = " << dequeuedCount
+       << " ( dropped oldest = " << droppedOldestCount
+       << " , dropped newest = " << droppedNewestCount
+       << " , blocked = " << blockedCount << " )"
+       << endl;
+}
+
+/* exports the stats of reportStatus */
+void PacketBuffer::reportMetrics(Metrics& pMetrics, const string& pLabels)
+{
+    pMetrics.gauge("sf_buffer_capacity_packets", "Packets a buffer holds", pLabels, queue.capacity());
+    pMetrics.gauge("sf_buffer_queued_packets", "Packets waiting in a buffer", pLabels, queue.size() + urgent.size());
+    pMetrics.counter("sf_buffer_enqueued_packets_total", "Packets put into a buffer", pLabels, __atomic_load_n(&enqueuedCount, __ATOMIC_RELAXED));
+    pMetrics.counter("sf_buffer_dequeued_packets_total", "Packets taken from a buffer", pLabels, __atomic_load_n(&dequeuedCount, __ATOMIC_RELAXED));
+    pMetrics.counter("sf_buffer_dropped_oldest_packets_total", "Packets dropped to make room in a full buffer", pLabels, __atomic_load_n(&droppedOldestCount, __ATOMIC_RELAXED));
+    pMetrics.counter("sf_buffer_dropped_newest_packets_total", "Packets dropped because a buffer was full", pLabels, __atomic_load_n(&droppedNewestCount, __ATOMIC_RELAXED));
+    pMetrics.counter("sf_buffer_blocked_total", "Times a producer waited for room in a buffer", pLabels, __atomic_load_n(&blockedCount, __ATOMIC_RELAXED));
 }
@@ -34,8 +34,10 @@
 #define PACKETBUFFER_H
 
 #include <pthread.h>
-#include <list>
+#include <iostream>
+#include <string>
 #include "sfpacket.h"
+#include "metrics.h"
 
 // #define DEBUG_PACKETBUFFER
 
@@ -47,48 +49,147 @@
 #define DEBUG(message) 
 #endif
 
+/*
+ * Bounded packet queue between the serial and the TCP side of a sf-server.
+ *
+ * The packets live in a preallocated ring (capacity rounded up to a power
+ * of two), a slot only holds a reference to the payload of its packet.
+ * Producers and consumers claim slots with compare-and-swap on a
+ * per-slot sequence number, so enqueue and dequeue never take a lock and
+ * never allocate. A thread only enters the kernel when it has to sleep:
+ * it then blocks in poll() on an eventfd (a pipe on non-Linux systems),
+ * which keeps dequeue() a cancellation point as it was before.
+ *
+ * What happens when the ring is full is decided by the overflow policy.
+ */
 class PacketBuffer
 {
+public:
+    typedef enum
+    {
+        // producer sleeps until a slot becomes free
+        cBlock,
+        // the oldest queued packet is discarded to make room
+        cDropOldest,
+        // the packet that is enqueued is discarded
+        cDropNewest
+    } overflowPolicy_t;
+
+    static const unsigned cDefaultCapacity = 256;
+
 protected:
+    // packets enqueued with enqueueFront (serial ACKs) bypass the queue
+    static const unsigned cUrgentCapacity = 8;
+
+    typedef struct
+    {
+        unsigned long seq;
+        SFPacket packet;
+    } slot_t;
+
+    // lock-free bounded ring
+    class Ring
+    {
+    protected:
+        slot_t* slots;
+        unsigned long mask;
+        unsigned long head;
+        unsigned long tail;
+
+    public:
+        Ring(unsigned pCapacity);
+
+        ~Ring();
+
+        bool tryPush(const SFPacket &pPacket);
+
+        bool tryPop(SFPacket &pPacket);
+
+        unsigned long capacity() const;
+
+        unsigned long size() const;
+    };
+
+    // sleeping threads wait on fds[0] until someone writes to fds[1]
+    typedef struct
+    {
+        int fds[2];
+        int waiters;
+    } wakeup_t;
 
-  static const unsigned cMaxBufferSize = 25;
+    Ring queue;
 
-  typedef std::list<SFPacket> container_t;
+    Ring urgent;
 
-  // thread safe buffer
-  typedef struct
-  {
-    // mutex lock for any of this vars
-    pthread_mutex_t lock;
-    // notempty cond
-    pthread_cond_t notempty;
-    // not full cond
-    pthread_cond_t notfull;
-    // actual buffer 
-    container_t container;
-  } sharedBuffer_t;
+    overflowPolicy_t policy;
 
-  sharedBuffer_t buffer;
+    wakeup_t notempty;
+
+    wakeup_t notfull;
+
+    // statistics
+    unsigned long enqueuedCount;
+    unsigned long dequeuedCount;
+    unsigned long droppedOldestCount;
+    unsigned long droppedNewestCount;
+    unsigned long blockedCount;
+
+    static void initWakeup(wakeup_t &pWakeup);
+
+    static void closeWakeup(wakeup_t &pWakeup);
+
+    /* wakes one sleeping thread (if any) */
+    static void notify(wakeup_t &pWakeup);
+
+    /* sleeps until notified or pTimeout ms passed (-1: forever),
+       returns false on timeout */
+    static bool wait(wakeup_t &pWakeup, int pTimeout);
+
+    friend void leaveWait(void* ob);
+
+    bool tryDequeue(SFPacket &pPacket);
+
+    bool push(Ring &pRing, SFPacket &pPacket, overflowPolicy_t pPolicy);
 
 public:
-  PacketBuffer();
+    PacketBuffer(unsigned pCapacity = cDefaultCapacity, overflowPolicy_t pPolicy = cBlock);
+
+    ~PacketBuffer();
+
+    void clear();
+
+    SFPacket dequeue();
+
+    /* blocks until at least one packet is available (or pTimeout ms
+       passed, -1: forever), returns up to pMax packets or 0 on timeout */
+    unsigned dequeue(SFPacket *pPackets, unsigned pMax, int pTimeout = -1);
+
+    bool enqueueFront(SFPacket &pPacket);
+
+    bool enqueueBack(SFPacket &pPacket);
+
+    bool isFull();
 
-  ~PacketBuffer();
+    bool isEmpty();
 
-  void clear();
+    unsigned long getCapacity() const;
 
-  SFPacket dequeue();
+    overflowPolicy_t getPolicy() const;
 
-  bool enqueueFront(SFPacket &pPacket);
+    /* "block", "drop-oldest" or "drop-newest" */
+    static const char* getPolicyName(overflowPolicy_t pPolicy);
 
-  bool enqueueBack(SFPacket &pPacket);
+    /* false if pName is not the name of a policy */
+    static bool parsePolicy(const std::string& pName, overflowPolicy_t& pPolicy);
 
-  bool isFull();
+    /* packets lost to the overflow policy */
+    unsigned long getDroppedCount() const;
 
-  bool isEmpty();
+    /* prints out some stats */
+    void reportStatus(std::ostream& os);
 
-  bool isInQueue(SFPacket &pPacket);
-  
+    /* adds the stats, pLabels identify the buffer */
+    void reportMetrics(Metrics& pMetrics, const std::string& pLabels);
 };
 
 #endif
@@ -32,6 +32,7 @@
 
 #include "serialcomm.h"
 #include "sharedinfo.h"
+#include "latencyhistogram.h"
 
 #include <ctime>
 #include <cstdlib>
@@ -43,6 +44,7 @@
 #include <sstream>
 #include <sys/time.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -244,16 +246,23 @@ tcflag_t SerialComm::parseBaudrate(int requested)
     return baudrate;
 }
 
-SerialComm::SerialComm(const char* pDevice, int pBaudrate, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl) : readBuffer(pReadBuffer), writeBuffer(pWriteBuffer), droppedReadPacketCount(0), droppedWritePacketCount(0), readPacketCount(0), writtenPacketCount(0), badPacketCount(0), sumRetries(0), device(pDevice), baudrate(pBaudrate), serialReadFD(-1), serialWriteFD(-1), errorReported(false), errorMsg(""), control(pControl)
+SerialComm::SerialComm(const char* pDevice, int pBaudrate, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl) : readBuffer(pReadBuffer), writeBuffer(pWriteBuffer), droppedReadPacketCount(0), readPacketCount(0), badPacketCount(0), droppedWritePacketCount(0), writtenPacketCount(0), sumRetries(0), device(pDevice), baudrate(pBaudrate), serialReadFD(-1), serialWriteFD(-1), errorReported(false), errorMsg(""), control(pControl)
 {
     writerThreadRunning = false;
     readerThreadRunning = false;
     rawFifo.head = rawFifo.tail = 0;
+    rawFifo.arrival = 0;
+    hdlc_init();
+    hdlc_decoder_init(&decoder, frameBuffer, sizeof(frameBuffer));
     tcflag_t baudflag = parseBaudrate(pBaudrate);
 
     srand ( time(NULL) );
     seqno = rand();
-    FD_ZERO(&rfds);
+    windowState = cWindowUnknown;
+    lastWindowAckCount = 0;
+    srtt = rttvar = 0;
+    rto = ackTimeout;
+    windowSyncCount = 0;
     FD_ZERO(&wfds);
 
     serialReadFD = open(device.c_str(), O_RDONLY | O_NOCTTY | O_NONBLOCK);
@@ -297,6 +306,8 @@ SerialComm::SerialComm(const char* pDevice, int pBaudrate, PacketBuffer &pReadBu
 
     pthread_mutex_init(&ack.lock, NULL);
     pthread_cond_init(&ack.received, NULL);
+    ack.windowAck = -1;
+    ack.windowAckCount = 0;
 
     if (!errorReported)
     {
@@ -321,21 +332,6 @@ SerialComm::~SerialComm()
     if(serialWriteFD > 2) close(serialWriteFD);
 }
 
-int SerialComm::hdlcEncode(int count, const char* from, char *to) {
-    int offset = 0;
-    for(int i = 0; i < count; i++) {
-        if (from[i] == SYNC_BYTE || from[i] == ESCAPE_BYTE)
-        {
-            to[offset++] = ESCAPE_BYTE;
-            to[offset++] = from[i] ^ 0x20;
-        }
-        else {
-            to[offset++] = from[i];
-        }
-    }
-    return offset;
-}
-
 int SerialComm::writeFD(int fd, const char *buffer, int count, int *err)
 {
     int cnt = 0;
@@ -358,145 +354,122 @@ int SerialComm::writeFD(int fd, const char *buffer, int count, int *err)
 }
 
 
-/* Work around buggy usb serial driver (returns 0 when no data is
-   available, independent of the blocking/non-blocking mode) */
-int SerialComm::readFD(int fd, char *buffer, int count, int maxCount, int *err)
+int SerialComm::readFD(int fd, char *buffer, int maxCount, int *err)
 {
-    int cnt = 0;
-    timeval tvold;
-    timeval tv;
-    unsigned to = (10000000 / baudrate) * count; // time out in usec
-    tvold.tv_sec = to / 1000000;
-    tvold.tv_usec = to % 1000000;
-    while (cnt == 0)
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (true)
     {
-        // no FD_ZERO here because of performance issues. It is done in constructor...
-        FD_SET(serialReadFD, &rfds);
-        if (select(serialReadFD + 1, &rfds, NULL, NULL, NULL) < 0) {
+        // poll is a cancellation point
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
             return -1;
         }
-        FD_CLR(serialReadFD, &rfds);
-        tv = tvold;
-        select(0, NULL, NULL, NULL, &tv);
-        int tmpCnt = read(fd, buffer, maxCount);
-        if (tmpCnt < 0) {
+        rawFifo.arrival = LatencyHistogram::now();
+        int cnt = read(fd, buffer, maxCount);
+        if (cnt > 0)
+        {
+            return cnt;
+        }
+        if ((cnt < 0) && (errno != EAGAIN) && (errno != EINTR))
+        {
             *err = errno;
-            return tmpCnt;
+            return cnt;
         }
-        else {
-            cnt += tmpCnt;
+        if (cnt == 0)
+        {
+            /* Work around buggy usb serial driver (reports readable but
+               returns 0 when no data is available): wait a byte time */
+            usleep(10000000 / baudrate + 1);
         }
     }
-    return cnt;
 }
 
-char SerialComm::nextRaw() {
-    char nextByte = 0;
+void SerialComm::fillRaw() {
     int err = 0;
-    if(rawFifo.tail < rawFifo.head) {
-        nextByte = rawFifo.queue[rawFifo.tail++];
-    }
-    else {
-        // fifo empty -- need to get some bytes
-        rawFifo.tail = 0;
-        rawFifo.head = readFD(serialReadFD, rawFifo.queue, rawReadBytes, maxMTU-1, &err);
-        if(rawFifo.head < 0) {
-            close(serialReadFD);
-            close(serialWriteFD);
-            serialReadFD = -1;
-            serialWriteFD = -1;
-            errno = err;
-        }
-        reportError("SerialComm::nextRaw: readFD(serialReadFD, rawFifo.queue, rawReadBytes, maxMTU-1)",
+    rawFifo.tail = 0;
+    rawFifo.head = readFD(serialReadFD, rawFifo.queue, rawBufferSize, &err);
+    if(rawFifo.head < 0) {
+        close(serialReadFD);
+        close(serialWriteFD);
+        serialReadFD = -1;
+        serialWriteFD = -1;
+        errno = err;
+        reportError("SerialComm::fillRaw: readFD(serialReadFD, rawFifo.queue, rawBufferSize)",
                     rawFifo.head);
-        nextByte = rawFifo.queue[rawFifo.tail++];
+        rawFifo.head = 0;
     }
-    return nextByte;
 }
 
 /* reads packet */
 bool SerialComm::readPacket(SFPacket &pPacket)
 {
-    uint8_t buffer[maxMTU + 10];
-    int count = 0;
-    rx_states_t state = WAIT_FOR_SYNC;
     for(;;) {
-        uint8_t nextByte = nextRaw();
-        if(state == WAIT_FOR_SYNC) {
-            if(nextByte == SYNC_BYTE) {
-                count = 0;
-                state = IN_SYNC;
-            }
+        if(rawFifo.tail >= rawFifo.head) {
+            fillRaw();
+            continue;
         }
-        else if(state == IN_SYNC) {
-            if(nextByte == SYNC_BYTE) {
-                if(count < minMTU) {
-                    DEBUG("SerialComm::readPacket : frame too short - size = " << count << " : resynchronising ");
-                    badPacketCount++; 
-                    count = 0;
-                }
-                else {
-                    bool dobreak = true;
-                    DEBUG("SerialComm::readPacket : frame size = " << count);
-                    if(checkCrc(buffer, count)) {
-                        pPacket.setType(buffer[typeOffset]);
-                        pPacket.setSeqno(buffer[seqnoOffset]);
-                        switch (buffer[typeOffset]) {
-                        case SF_ACK:
-                            break;
-                        case SF_PACKET_NO_ACK:
-                            pPacket.setPayload((char *)(&buffer[payloadOffset]-1), count+1+1 - serialHeaderBytes);
-                            break;
-                        case SF_PACKET_ACK:
-                            pPacket.setPayload((char *)(&buffer[payloadOffset]), count+1 - serialHeaderBytes);
-                            break;
-                        default:
-                            dobreak = false;
-                            DEBUG("SerialComm::readPacket : unknown packet type = " \
-                                  << static_cast<uint16_t>(buffer[typeOffset] & 0xff));
-                            break;
-                        }
-                        if(dobreak) break; // leave loop
-                    }
-                    else {
-                        DEBUG("SerialComm::readPacket : bad crc");
-                        count = 0;
-                        badPacketCount++;
-                    }
-                }
-            }
-            else if(nextByte == ESCAPE_BYTE) {
-                state = ESCAPED;
-            }
-            else {
-                buffer[count++] = nextByte;
-                if(count >= maxMTU) {
-                    DEBUG("SerialComm::readPacket : packet too long, resynchronizing");
-                    count = 0;
+        hdlc_event event;
+        rawFifo.tail += hdlc_decode(&decoder, (uint8_t *)rawFifo.queue + rawFifo.tail,
+                                    rawFifo.head - rawFifo.tail, &event);
+        switch(event) {
+        case hdlc_frame:
+        {
+            uint8_t *buffer = decoder.frame;
+            int count = decoder.count;
+            DEBUG("SerialComm::readPacket : frame size = " << count);
+            pPacket.setType(buffer[typeOffset]);
+            pPacket.setSeqno(buffer[seqnoOffset]);
+            switch (buffer[typeOffset]) {
+            case SF_ACK:
+            case SF_WINDOW_ACK:
+                return true;
+            case SF_PACKET_NO_ACK:
+                // no seqno, the payload follows the type
+                if (!pPacket.setPayload((char *)(&buffer[seqnoOffset]), count - seqnoOffset)) {
                     badPacketCount++;
-                    state = WAIT_FOR_SYNC;
+                    break;
                 }
-            }
-        }
-        else if(state == ESCAPED) {
-            if(nextByte == SYNC_BYTE) {
-                DEBUG("SerialComm::readPacket : state ESCAPED, packet got sync byte, resynchronizing");
-                count = 0;
-                badPacketCount++;
-                state = IN_SYNC;
-            }
-            else {
-                buffer[count++] = nextByte ^ 0x20;
-                if(count >= maxMTU) {
-                    DEBUG("SerialComm::readPacket : state ESCAPED, packet too long, resynchronizing");
-                    count = 0;
+                pPacket.setArrival(rawFifo.arrival);
+                return true;
+            case SF_PACKET_ACK:
+                if (!pPacket.setPayload((char *)(&buffer[payloadOffset]), count - payloadOffset)) {
                     badPacketCount++;
-                    state = WAIT_FOR_SYNC;
-                }
-                else {
-                    state = IN_SYNC;
+                    break;
                 }
+                pPacket.setArrival(rawFifo.arrival);
+                return true;
+            default:
+                DEBUG("SerialComm::readPacket : unknown packet type = " \
+                      << static_cast<uint16_t>(buffer[typeOffset] & 0xff));
+                break;
             }
+            break;
+        }
+        case hdlc_too_short:
+            DEBUG("SerialComm::readPacket : frame too short : resynchronising ");
+            badPacketCount++;
+            break;
+        case hdlc_bad_crc:
+            DEBUG("SerialComm::readPacket : bad crc");
+            badPacketCount++;
+            break;
+        case hdlc_too_long:
+            DEBUG("SerialComm::readPacket : packet too long, resynchronizing");
+            badPacketCount++;
+            break;
+        case hdlc_bad_escape:
+            DEBUG("SerialComm::readPacket : sync byte after escape byte, resynchronizing");
+            badPacketCount++;
+            break;
+        default:
+            break;
         }
     }
     return true;
@@ -505,50 +478,31 @@ bool SerialComm::readPacket(SFPacket &pPacket)
 /* writes packet */
 bool SerialComm::writePacket(SFPacket &pPacket)
 {
-    char type, byte = 0;
-    uint16_t crc = 0;
-    char buffer[2*pPacket.getLength() + 20];
+    uint8_t header[2];
+    uint8_t buffer[HDLC_ENCODED_SIZE(sizeof(header) + pPacket.getLength())];
     int offset = 0;
     int err = 0;
     int written = 0;
-    
-    // put SFD into buffer 
-    buffer[offset++] = SYNC_BYTE;
-
-    // packet type
-    byte = type = pPacket.getType();
-    crc = byteCRC(byte, crc);
-    offset += hdlcEncode(1, &byte, buffer + offset);
-
-    // seqno
-    byte = pPacket.getSeqno();
-    crc = byteCRC(byte, crc);
-    offset += hdlcEncode(1, &byte, buffer + offset);
-    switch (type)
+
+    // packet type and seqno
+    header[typeOffset] = pPacket.getType();
+    header[seqnoOffset] = pPacket.getSeqno();
+    switch (header[typeOffset])
     {
     case SF_ACK:
+    case SF_WINDOW_SYNC:
+        offset = hdlc_encode(buffer, header, sizeof(header), NULL, 0);
         break;
     case SF_PACKET_NO_ACK:
     case SF_PACKET_ACK:
-        // compute crc
-        for(int i = 0; i < pPacket.getLength(); i++) {
-            crc = byteCRC(pPacket.getPayload()[i], crc);
-        }
-        offset += hdlcEncode(pPacket.getLength(), pPacket.getPayload(), buffer + offset);
+    case SF_PACKET_WINDOW:
+        offset = hdlc_encode(buffer, header, sizeof(header), pPacket.getPayload(), pPacket.getLength());
         break;
     default:
         return false;
     }
 
-    // crc two bytes
-    byte = crc & 0xff;
-    offset += hdlcEncode(1, &byte, buffer + offset);
-    byte = (crc >> 8) & 0xff;
-    offset += hdlcEncode(1, &byte, buffer + offset);
-    
-    // put SFD into buffer
-    buffer[offset++] = SYNC_BYTE;
-    written = writeFD(serialWriteFD, buffer, offset, &err);
+    written = writeFD(serialWriteFD, (char *)buffer, offset, &err);
     if(written < 0) {
         if(err != EINTR) {
             close(serialReadFD);
@@ -598,6 +552,14 @@ void SerialComm::readSerial()
             // FIXME: seqnos are not implemented on the node !
             pthread_cond_signal(&ack.received);
             break;
+	case SF_WINDOW_ACK:
+            // cumulative ack, the writer only needs the latest one
+            pthread_mutex_lock(&ack.lock);
+            ack.windowAck = packet.getSeqno();
+            ++ack.windowAckCount;
+            pthread_cond_signal(&ack.received);
+            pthread_mutex_unlock(&ack.lock);
+            break;
 	case SF_PACKET_ACK:
         {
 	    // put ack in front of queue
@@ -607,19 +569,11 @@ void SerialComm::readSerial()
 	case SF_PACKET_NO_ACK:
             // do nothing - fall through
 	default:
-            if (!readBuffer.isFull())
-	    {
-                ++readPacketCount;
-                // put silently into buffer...
-                readBuffer.enqueueBack(packet);
-	    }
-            else
+            ++readPacketCount;
+            // a full buffer discards or blocks according to its policy
+            if (!readBuffer.enqueueBack(packet))
 	    {
-                while(readBuffer.isFull()) {
-                    readBuffer.dequeue();
-                    ++droppedReadPacketCount;
-                }
-                readBuffer.enqueueBack(packet);
+                ++droppedReadPacketCount;
                 // DEBUG("SerialComm::readSerial : dropped packet")
 	    }
 	}
@@ -645,8 +599,26 @@ void SerialComm::writeSerial()
     {
         if (!retry)
 	{
-            cerr << " serial deqeue packet, empty: " << writeBuffer.isEmpty() << endl;
-            packet = writeBuffer.dequeue();
+            if (!pending.empty())
+            {
+                packet = pending.front();
+                pending.pop_front();
+            }
+            else
+            {
+                packet = writeBuffer.dequeue();
+            }
+            // probe lazily, the node is most likely up once there is data for it
+            if ((windowState == cWindowUnknown) && (packet.getType() != SF_ACK))
+            {
+                windowState = syncWindow() ? cWindowOn : cWindowOff;
+            }
+            if ((windowState == cWindowOn) && (packet.getType() != SF_ACK))
+            {
+                pending.push_front(packet);
+                writeWindow();
+                continue;
+            }
 	}
         switch (packet.getType())
 	{
@@ -672,6 +644,8 @@ void SerialComm::writeSerial()
                 DEBUG("SerialComm::writeSerial : writePacket failed (SF_PACKET)")
                     reportError("SerialComm::writeSerial : writeFD(SF_PACKET)", -1);
 	    }
+            unackedPackets.set(1);
+            long long sent = LatencyHistogram::now();
             // wait for ack...
             struct timeval currentTime;
             struct timespec ackTime;
@@ -691,7 +665,16 @@ void SerialComm::writeSerial()
             int retval = pthread_cond_timedwait(&ack.received, &ack.lock, &ackTime);
             if (!((retryCount < maxRetries) && (retval == ETIMEDOUT)))
 	    {
-                if (retryCount >= maxRetries) ++droppedWritePacketCount;
+                if (retval != ETIMEDOUT)
+                {
+                    long long acked = LatencyHistogram::now();
+                    if (retryCount == 0)
+                        ackRtt.add(acked - sent);
+                    if (packet.getArrival() != 0)
+                        writeLatency.add(acked - packet.getArrival());
+                }
+                else if (retryCount >= maxRetries) ++droppedWritePacketCount;
+                unackedPackets.set(0);
                 retry = false;
                 retryCount = 0;
 	    }
@@ -707,6 +690,290 @@ void SerialComm::writeSerial()
     }
 }
 
+long long SerialComm::now()
+{
+    struct timeval currentTime;
+    gettimeofday(&currentTime, NULL);
+    return (long long)currentTime.tv_sec * 1000 * 1000 * 1000 + (long long)currentTime.tv_usec * 1000;
+}
+
+bool SerialComm::takeWindowAck(int &pAck)
+{
+    bool fresh = false;
+    pthread_testcancel();
+    pthread_mutex_lock(&ack.lock);
+    if (ack.windowAckCount != lastWindowAckCount)
+    {
+        lastWindowAckCount = ack.windowAckCount;
+        pAck = ack.windowAck;
+        fresh = true;
+    }
+    pthread_mutex_unlock(&ack.lock);
+    return fresh;
+}
+
+bool SerialComm::waitWindowAck(long long pDeadline, int &pAck)
+{
+    bool fresh = false;
+    struct timespec ackTime;
+    ackTime.tv_sec = pDeadline / (1000*1000*1000);
+    ackTime.tv_nsec = pDeadline % (1000*1000*1000);
+
+    pthread_testcancel();
+    pthread_mutex_lock(&ack.lock);
+    pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &ack.lock);
+    while ((ack.windowAckCount == lastWindowAckCount) &&
+           (pthread_cond_timedwait(&ack.received, &ack.lock, &ackTime) != ETIMEDOUT))
+    {
+    }
+    if (ack.windowAckCount != lastWindowAckCount)
+    {
+        lastWindowAckCount = ack.windowAckCount;
+        pAck = ack.windowAck;
+        fresh = true;
+    }
+    pthread_cleanup_pop(1);
+    return fresh;
+}
+
+/* a sync frame carries the seqno of the next packet. A node that is not
+   synced yet takes it and answers with a window ack for the seqno before
+   it, a synced node keeps its state and answers with the last seqno it
+   delivered. Old nodes drop the unknown frame. */
+bool SerialComm::syncWindow()
+{
+    uint8_t base = window.empty() ? (uint8_t)seqno : window.front().seqno;
+    int acked;
+    takeWindowAck(acked);
+    for (int i = 0; i < cSyncRetries; i++)
+    {
+        SFPacket sync(SF_WINDOW_SYNC, base);
+        if (!writePacket(sync))
+        {
+            return false;
+        }
+        long long deadline = now() + ackTimeout;
+        if (waitWindowAck(deadline, acked))
+        {
+            applySyncAck(acked);
+            DEBUG("SerialComm::syncWindow : synced at seqno " << (int)(uint8_t)(acked + 1))
+            ++windowSyncCount;
+            return true;
+        }
+    }
+    DEBUG("SerialComm::syncWindow : no answer")
+    return false;
+}
+
+bool SerialComm::applyWindowAck(uint8_t pAck)
+{
+    if (window.empty())
+    {
+        return false;
+    }
+    unsigned acked = (uint8_t)(pAck - window.front().seqno);
+    if (acked >= window.size())
+    {
+        // duplicate or stale ack
+        return false;
+    }
+    // Karn: retransmitted packets give no rtt sample
+    if (window[acked].retries == 0)
+    {
+        long long sample = now() - window[acked].sent;
+        updateRTO(sample, srtt, rttvar, rto);
+        ackRtt.add(sample);
+    }
+    long long ackTime = LatencyHistogram::now();
+    for (unsigned i = 0; i <= acked; i++)
+    {
+        if (window[i].packet.getArrival() != 0)
+        {
+            writeLatency.add(ackTime - window[i].packet.getArrival());
+        }
+    }
+    window.erase(window.begin(), window.begin() + acked + 1);
+    unackedPackets.set(window.size());
+    return true;
+}
+
+void SerialComm::applySyncAck(uint8_t pAck)
+{
+    uint8_t base = window.empty() ? (uint8_t)seqno : window.front().seqno;
+    unsigned delivered = (uint8_t)(pAck + 1 - base);
+    if (delivered <= window.size())
+    {
+        // the acks of these were lost, they must not be sent again
+        long long ackTime = LatencyHistogram::now();
+        for (unsigned i = 0; i < delivered; i++)
+        {
+            if (window[i].packet.getArrival() != 0)
+            {
+                writeLatency.add(ackTime - window[i].packet.getArrival());
+            }
+        }
+        window.erase(window.begin(), window.begin() + delivered);
+    }
+    else
+    {
+        // the node waits for other seqnos, e.g. after a dropped packet
+        for (unsigned i = 0; i < window.size(); i++)
+        {
+            window[i].seqno = (uint8_t)(pAck + 1 + i);
+        }
+    }
+    seqno = (uint8_t)(pAck + 1 + window.size());
+    unackedPackets.set(window.size());
+}
+
+/* Jacobson/Karels estimator as in TCP (RFC 6298) */
+void SerialComm::updateRTO(long long pSample, long long &pSrtt, long long &pRttvar, long long &pRto)
+{
+    if (pSrtt == 0)
+    {
+        pSrtt = pSample;
+        pRttvar = pSample / 2;
+    }
+    else
+    {
+        long long delta = (pSrtt > pSample) ? pSrtt - pSample : pSample - pSrtt;
+        pRttvar = (3 * pRttvar + delta) / 4;
+        pSrtt = (7 * pSrtt + pSample) / 8;
+    }
+    pRto = pSrtt + 4 * pRttvar;
+    if (pRto < cMinRTO)
+    {
+        pRto = cMinRTO;
+    }
+    else if (pRto > cMaxRTO)
+    {
+        pRto = cMaxRTO;
+    }
+}
+
+bool SerialComm::sendWindowEntry(windowEntry_t &pEntry)
+{
+    pEntry.packet.setType(SF_PACKET_WINDOW);
+    pEntry.packet.setSeqno(pEntry.seqno);
+    pEntry.sent = now();
+    return writePacket(pEntry.packet);
+}
+
+/* go-back-N: up to cWindowSize packets are in flight, the node delivers
+   them in order and acknowledges cumulatively. When the oldest one is not
+   acknowledged within rto all packets in flight are sent again. */
+void SerialComm::writeWindow()
+{
+    int timeouts = 0;
+    int acked;
+    while (true)
+    {
+        if (takeWindowAck(acked) && applyWindowAck(acked))
+        {
+            timeouts = 0;
+        }
+        if (window.size() < cWindowSize)
+        {
+            SFPacket packet;
+            bool got = false;
+            if (!pending.empty())
+            {
+                packet = pending.front();
+                pending.pop_front();
+                got = true;
+            }
+            else
+            {
+                int wait = -1;
+                if (!window.empty())
+                {
+                    long long left = window.front().sent + rto - now();
+                    wait = (left > 0) ? (int)(left / (1000 * 1000)) + 1 : 0;
+                }
+                got = (writeBuffer.dequeue(&packet, 1, wait) == 1);
+            }
+            if (got)
+            {
+                if (packet.getType() == SF_ACK)
+                {
+                    if (!writePacket(packet))
+                    {
+                        reportError("SerialComm::writeWindow : writePacket(SF_ACK)", -1);
+                    }
+                    continue;
+                }
+                windowEntry_t entry;
+                entry.packet = packet;
+                entry.seqno = (uint8_t)seqno++;
+                entry.retries = 0;
+                window.push_back(entry);
+                unackedPackets.set(window.size());
+                ++writtenPacketCount;
+                if (!sendWindowEntry(window.back()))
+                {
+                    reportError("SerialComm::writeWindow : writePacket(SF_PACKET_WINDOW)", -1);
+                }
+                continue;
+            }
+        }
+        else if (waitWindowAck(window.front().sent + rto, acked))
+        {
+            if (applyWindowAck(acked))
+            {
+                timeouts = 0;
+            }
+            continue;
+        }
+        if (window.empty() || (now() < window.front().sent + rto))
+        {
+            continue;
+        }
+        if (takeWindowAck(acked) && applyWindowAck(acked))
+        {
+            timeouts = 0;
+            continue;
+        }
+
+        // timeout
+        rto = (2 * rto < cMaxRTO) ? 2 * rto : cMaxRTO;
+        bool resync = (++timeouts >= cResyncTimeouts);
+        if (window.front().retries >= maxRetries)
+        {
+            // the node still waits for this seqno
+            window.pop_front();
+            unackedPackets.set(window.size());
+            ++droppedWritePacketCount;
+            resync = true;
+        }
+        if (resync)
+        {
+            if (!syncWindow())
+            {
+                // node is gone or was replaced by an old one
+                while (!window.empty())
+                {
+                    pending.push_front(window.back().packet);
+                    window.pop_back();
+                }
+                unackedPackets.set(0);
+                windowState = cWindowUnknown;
+                return;
+            }
+            timeouts = 0;
+        }
+        for (unsigned i = 0; i < window.size(); i++)
+        {
+            ++window[i].retries;
+            ++sumRetries;
+            DEBUG("SerialComm::writeWindow : resend seqno " << (int)window[i].seqno)
+            if (!sendWindowEntry(window[i]))
+            {
+                reportError("SerialComm::writeWindow : writePacket(SF_PACKET_WINDOW)", -1);
+            }
+        }
+    }
+}
+
 /* cancels all running threads */
 void SerialComm::cancel()
 {
@@ -784,10 +1051,39 @@ void SerialComm::reportStatus(ostream& os)
     os << "SF-Server ( SerialComm on device " << device << " ) : "
        << "baudrate = " << baudrate
        << " , packets read = " << readPacketCount
-       << " ( dropped = " << droppedReadPacketCount 
+       << " ( dropped = " << droppedReadPacketCount + readBuffer.getDroppedCount()
        << ", bad = " << badPacketCount << " )"
        << " , packets written = " << writtenPacketCount
        << " ( dropped = " << droppedWritePacketCount 
-       << ", total retries: " << sumRetries << " )"
-       << endl;
+       << ", total retries: " << sumRetries << " )";
+    if (windowState == cWindowOn)
+    {
+        os << " , window = " << cWindowSize
+           << " ( rto = " << rto / (1000 * 1000) << " ms"
+           << " , syncs = " << windowSyncCount << " )";
+    }
+    else
+    {
+        os << " , stop-and-wait";
+    }
+    os << endl;
+    os << "     tcp -> serial latency : ";
+    writeLatency.reportStatus(os);
+    os << "     ack rtt : ";
+    ackRtt.reportStatus(os);
+}
+
+/* exports the counters of reportStatus */
+void SerialComm::reportMetrics(Metrics& pMetrics, const string& pLabels)
+{
+    pMetrics.counter("sf_serial_read_packets_total", "Packets read from the node", pLabels, readPacketCount);
+    pMetrics.counter("sf_serial_read_dropped_packets_total", "Packets from the node dropped before reaching the TCP side", pLabels, droppedReadPacketCount);
+    pMetrics.counter("sf_serial_bad_packets_total", "Frames with CRC or length errors", pLabels, badPacketCount);
+    pMetrics.counter("sf_serial_written_packets_total", "Packets written to the node", pLabels, writtenPacketCount);
+    pMetrics.counter("sf_serial_write_dropped_packets_total", "Packets the node never acknowledged", pLabels, droppedWritePacketCount);
+    pMetrics.counter("sf_serial_retries_total", "Retransmissions to the node", pLabels, sumRetries);
+    pMetrics.counter("sf_serial_window_syncs_total", "Window (re-)synchronisations", pLabels, windowSyncCount);
+    pMetrics.gauge("sf_serial_unacked_packets", "Packets sent to the node and not acknowledged yet", pLabels, unackedPackets);
+    pMetrics.histogram("sf_tcp_to_serial_latency_seconds", "Time from the TCP arrival of a packet to its ack by the node", pLabels, writeLatency);
+    pMetrics.histogram("sf_serial_ack_rtt_seconds", "Round trip time of first transmissions to the node", pLabels, ackRtt);
 }
@@ -37,9 +37,13 @@
 #include "sfpacket.h"
 #include "packetbuffer.h"
 #include "sharedinfo.h"
+#include "latencyhistogram.h"
+#include "metrics.h"
+#include "hdlc.h"
 
 #include <sys/select.h>
 #include <pthread.h>
+#include <deque>
 #include <termios.h>
 #include <string>
 #include <sstream>
@@ -60,14 +64,10 @@
 class SerialComm : public BaseComm
 {
 
-    /** Constants **/
-protected:
+    /** Constants, shared with SerialGateway **/
+public:
     // max serial MTU
     static const int maxMTU = (SFPacket::cMaxPacketLength+1)*2;
-    // min serial MTU
-    static const int minMTU = 4;
-    // byte count of serial header
-    static const int serialHeaderBytes = 5;
     // byte offset of type field
     static const int typeOffset = 0;
     // byte offset of sequence number field
@@ -78,15 +78,19 @@ protected:
     static const int ackTimeout = 1000 * 1000 * 200;
     // max. reties for packets from pc to node
     static const int maxRetries = 25;
+    // packets in flight when the node speaks the window protocol
+    static const unsigned cWindowSize = 8;
+    // bounds of the adaptive retransmission timeout in ns
+    static const long long cMinRTO = 1000LL * 1000 * 20;
+    static const long long cMaxRTO = 1000LL * 1000 * 2000;
+    // unanswered sync frames before the node is taken for a stop-and-wait node
+    static const int cSyncRetries = 3;
+    // timeouts without progress before the window is synced again
+    static const int cResyncTimeouts = 4;
+
+    // how many bytes do we read from the serial line at most in one go?
+    static const int rawBufferSize = 4096;
 
-    // how many bytes do we attempt to read from the serial line in one go?
-    static const int rawReadBytes = 20;
-
-    enum rx_states_t {
-        WAIT_FOR_SYNC,
-        IN_SYNC,
-        ESCAPED
-    };
     
     /** Member vars */
 protected:
@@ -107,18 +111,66 @@ protected:
         pthread_mutex_t lock;
         // notempty cond
         pthread_cond_t received;
+        // last cumulative window ack from the node
+        int windowAck;
+        // incremented with every window ack
+        unsigned windowAckCount;
     } ackCondition_t;
 
     ackCondition_t ack;
 
+    typedef enum
+    {
+        // not probed yet
+        cWindowUnknown,
+        // node acknowledged a sync frame
+        cWindowOn,
+        // node ignores sync frames, use stop-and-wait
+        cWindowOff
+    } windowState_t;
+
+    // a packet in flight in window mode
+    typedef struct
+    {
+        SFPacket packet;
+        uint8_t seqno;
+        // time of the last transmission in ns
+        long long sent;
+        int retries;
+    } windowEntry_t;
+
+    /* window state, only touched by the writer thread */
+    windowState_t windowState;
+
+    std::deque<windowEntry_t> window;
+
+    /* packets handed over between window and stop-and-wait mode */
+    std::deque<SFPacket> pending;
+
+    unsigned lastWindowAckCount;
+
+    /* smoothed rtt, rtt variance and retransmission timeout in ns */
+    long long srtt;
+    long long rttvar;
+    long long rto;
+
+    /* number of successful window syncs */
+    Counter windowSyncCount;
+
     /* raw read buffer */
     struct rawFifo_t {
-        char queue[maxMTU];
+        char queue[rawBufferSize];
         int head;
         int tail;
+        /* time the bytes became readable (LatencyHistogram::now) */
+        long long arrival;
     };
 
     rawFifo_t rawFifo;
+
+    /* frame decoder working on rawFifo */
+    uint8_t frameBuffer[maxMTU];
+    hdlc_decoder decoder;
     
     /* reference to read packet buffer */
     PacketBuffer &readBuffer;
@@ -126,23 +178,36 @@ protected:
     /* reference to write packet buffer */
     PacketBuffer &writeBuffer;
 
-    /* number of dropped (read) packets */
-    int droppedReadPacketCount;
+    /* the counters of the reader thread */
 
-    /* number of dropped (write) packets */
-    int droppedWritePacketCount;
+    /* number of dropped (read) packets */
+    Counter droppedReadPacketCount;
 
     /* number of read packets */
-    int readPacketCount;
-
-    /* number of written packets */
-    int writtenPacketCount;
+    Counter readPacketCount;
 
     /* number of bad packets read from serial line, counts resynchronizations! */
-    int badPacketCount;
+    Counter badPacketCount;
+
+    /* the counters of the writer thread */
+
+    /* number of dropped (write) packets */
+    Counter droppedWritePacketCount;
+
+    /* number of written packets */
+    Counter writtenPacketCount;
 
     /* sum retry attempts for all packets */
-    int sumRetries;
+    Counter sumRetries;
+
+    /* packets sent to the node and not acknowledged yet */
+    Gauge unackedPackets;
+
+    /* TCP arrival -> ack of the node, per packet */
+    LatencyHistogram writeLatency;
+
+    /* ack round trip times, first transmissions only */
+    LatencyHistogram ackRtt;
     
     /* device port of this sf */
     std::string device;
@@ -150,9 +215,6 @@ protected:
     /* baudrate of connected device */
     int baudrate;
 
-    /* read fd set */
-    fd_set rfds;
-
     /* write fd set */
     fd_set wfds;
 
@@ -185,46 +247,14 @@ private:
     SerialComm();
 
 protected:
-    char nextRaw();
-    
-    /* claculates crc byte-wise */
-    inline static uint16_t byteCRC(uint8_t byte, uint16_t crc) {
-        crc = (uint8_t)(crc >> 8) | (crc << 8);
-        crc ^= byte;
-        crc ^= (uint8_t)(crc & 0xff) >> 4;
-        crc ^= crc << 12;
-        crc ^= (crc & 0xff) << 5;
-        return crc;
-    }
-    
-    inline static uint16_t calcCRC(uint8_t *bytes, uint16_t len) {
-        uint16_t crc = 0;
-        for(unsigned i = 0; i < len; i++) {
-            crc = SerialComm::byteCRC(bytes[i], crc);
-        }
-        return crc;
-    }
-
-    inline static uint16_t checkCrc(uint8_t *bytes, uint16_t count) {
-        bool crcOk = false;
-        if(count > 2) {
-            uint16_t crc = calcCRC(bytes, count - 2);
-            uint16_t packetCrc = (bytes[count-1] << 8) | bytes[count-2];
-            if(crc == packetCrc) crcOk = true;
-        }
-        return crcOk;
-    }
-
-    /* HDLC encode (byte stuff) count bytes from buffer from into buffer to.
-     * to must be at least count * 2 bytes large. Returns the number of bytes
-     * written into to.
-     */
-    int hdlcEncode(int count, const char* from, char *to);
+    /* refills rawFifo from the serial line */
+    void fillRaw();
     
     /**
-     *  try to read at least count bytes in one go, but may read up to maxCount bytes.
+     *  waits until data is available and reads up to maxCount bytes, sets
+     *  rawFifo.arrival to the time the data became readable.
      */
-    virtual int readFD(int fd, char *buffer, int count, int maxCount, int *err);
+    virtual int readFD(int fd, char *buffer, int maxCount, int *err);
 
     /* enables byte escaping. overwrites method from base class.*/
     virtual int writeFD(int fd, const char *buffer, int count, int *err);
@@ -235,9 +265,6 @@ protected:
     /* writes a packet to serial source */
     bool writePacket(SFPacket &pPacket);
 
-    /* returns tcflag of requested baudrate */
-    static tcflag_t parseBaudrate(int requested);
-
     int reportError(const char *msg, int result);
 
     /* checks for messages from node - producer thread */
@@ -245,8 +272,37 @@ protected:
 
     /* write messages to serial / node - consumer thread */
     void writeSerial();
+
+    /* current time in ns */
+    static long long now();
+
+    /* gets a new window ack without waiting */
+    bool takeWindowAck(int &pAck);
+
+    /* waits until pDeadline (ns) for a new window ack */
+    bool waitWindowAck(long long pDeadline, int &pAck);
+
+    /* tells the node which seqno comes next, false if it does not answer */
+    bool syncWindow();
+
+    /* slides the window, returns false if pAck acknowledges nothing */
+    bool applyWindowAck(uint8_t pAck);
+
+    /* continues the window after pAck, the answer of the node to a sync */
+    void applySyncAck(uint8_t pAck);
+
+    bool sendWindowEntry(windowEntry_t &pEntry);
+
+    /* pipelined writing, returns when the node stops answering */
+    void writeWindow();
     
 public:
+    /* returns tcflag of requested baudrate, 0 if not supported */
+    static tcflag_t parseBaudrate(int requested);
+
+    /* feeds an rtt sample (ns) into the retransmission timeout */
+    static void updateRTO(long long pSample, long long &pSrtt, long long &pRttvar, long long &pRto);
+
     SerialComm(const char* pDevice, int pBaudrate, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer,  sharedControlInfo_t& pControl);
 
     ~SerialComm();
@@ -260,6 +316,9 @@ public:
 
     void reportStatus(std::ostream& os);
 
+    /* adds the counters, pLabels identify the sf-server */
+    void reportMetrics(Metrics& pMetrics, const std::string& pLabels);
+
     /* returns if error occurred */
     bool isErrorReported() { return errorReported; }
 };
@@ -0,0 +1,928 @@
+#include "serialgateway.h"
+#include "latencyhistogram.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+using namespace std;
+
+/* forward declarations of pthread helper functions */
+void* serveDevicesThread(void*);
+void* dispatchThread(void*);
+
+SerialGateway::SerialGateway(PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl, int pWorkers) : readBuffer(pReadBuffer), writeBuffer(pWriteBuffer), errorReported(false), control(pControl)
+{
+    dispatcherThreadRunning = false;
+    unroutedPacketCount = 0;
+    pthread_mutex_init(&lock, NULL);
+    hdlc_init();
+
+    if (pWorkers < 1)
+    {
+        pWorkers = 1;
+    }
+    else if (pWorkers > cMaxWorkers)
+    {
+        pWorkers = cMaxWorkers;
+    }
+    for (int i = 0; (i < pWorkers) && !errorReported; i++)
+    {
+        worker_t *worker = new worker_t;
+        worker->gateway = this;
+        worker->running = false;
+        worker->removals = 0;
+        worker->wakeupPending = false;
+        worker->wakeups = 0;
+        pthread_mutex_init(&worker->lock, NULL);
+        workers.push_back(worker);
+#ifdef __linux__
+        worker->wakeFDs[0] = worker->wakeFDs[1] = reportError("SerialGateway::SerialGateway : eventfd(0, EFD_NONBLOCK)",
+                                                              eventfd(0, EFD_NONBLOCK));
+#else
+        worker->wakeFDs[0] = worker->wakeFDs[1] = -1;
+        if (reportError("SerialGateway::SerialGateway : pipe(worker->wakeFDs)", pipe(worker->wakeFDs)) == 0)
+        {
+            fcntl(worker->wakeFDs[0], F_SETFL, O_NONBLOCK);
+            fcntl(worker->wakeFDs[1], F_SETFL, O_NONBLOCK);
+        }
+#endif
+        if (!errorReported)
+        {
+            if (reportError("SerialGateway::SerialGateway : pthread_create( &worker->thread, NULL, serveDevicesThread, worker)",
+                            pthread_create( &worker->thread, NULL, serveDevicesThread, worker)) == 0)
+            {
+                worker->running = true;
+            }
+        }
+    }
+    if (!errorReported)
+    {
+        if (reportError("SerialGateway::SerialGateway : pthread_create( &dispatcherThread, NULL, dispatchThread, this)",
+                        pthread_create( &dispatcherThread, NULL, dispatchThread, this)) == 0)
+        {
+            dispatcherThreadRunning = true;
+        }
+    }
+}
+
+SerialGateway::~SerialGateway()
+{
+    cancel();
+
+    map<int, device_t*>::iterator it;
+    for (it = devices.begin(); it != devices.end(); it++)
+    {
+        if (it->second->fd >= 0) close(it->second->fd);
+        delete it->second;
+    }
+    vector<worker_t*>::iterator worker;
+    for (worker = workers.begin(); worker != workers.end(); worker++)
+    {
+        if ((*worker)->wakeFDs[0] >= 0) close((*worker)->wakeFDs[0]);
+        if (((*worker)->wakeFDs[1] >= 0) && ((*worker)->wakeFDs[1] != (*worker)->wakeFDs[0])) close((*worker)->wakeFDs[1]);
+        pthread_mutex_destroy(&(*worker)->lock);
+        delete *worker;
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+/* the threads are only canceled while they wait, never with a lock held */
+void SerialGateway::cancel()
+{
+    if (dispatcherThreadRunning)
+    {
+        pthread_cancel(dispatcherThread);
+        DEBUG("SerialGateway::cancel : dispatcherThread canceled, joining")
+        pthread_join(dispatcherThread, NULL);
+        dispatcherThreadRunning = false;
+    }
+    vector<worker_t*>::iterator worker;
+    for (worker = workers.begin(); worker != workers.end(); worker++)
+    {
+        if ((*worker)->running)
+        {
+            pthread_cancel((*worker)->thread);
+            DEBUG("SerialGateway::cancel : worker canceled, joining")
+            pthread_join((*worker)->thread, NULL);
+            (*worker)->running = false;
+        }
+    }
+}
+
+bool SerialGateway::addDevice(int pId, string pDevice, int pBaudrate)
+{
+    tcflag_t baudflag = SerialComm::parseBaudrate(pBaudrate);
+    int fd = open(pDevice.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if ((fd < 0) || !baudflag)
+    {
+        cerr << "error : SF-Gateway : could not open device = " << pDevice
+             << " with baudrate = " << pBaudrate << endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    /* Serial port setting, as in SerialComm */
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+    newtio.c_cflag = CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR | IGNBRK;
+    cfsetispeed(&newtio, baudflag);
+    cfsetospeed(&newtio, baudflag);
+    newtio.c_oflag = 0;
+    if ((tcflush(fd, TCIFLUSH) < 0) || (tcsetattr(fd, TCSANOW, &newtio) < 0))
+    {
+        cerr << "error : SF-Gateway : could not set ioflags for opened device = " << pDevice << endl
+             << "error-description : " << strerror(errno) << endl;
+        close(fd);
+        return false;
+    }
+
+    device_t *device = new device_t;
+    device->id = pId;
+    device->device = pDevice;
+    device->baudrate = pBaudrate;
+    device->fd = fd;
+    hdlc_decoder_init(&device->decoder, device->frameBuffer, sizeof(device->frameBuffer));
+    device->windowState = cWindowUnknown;
+    device->resync = false;
+    device->syncTries = 0;
+    device->failedResyncs = 0;
+    device->syncBase = 0;
+    device->seqno = rand();
+    device->srtt = device->rttvar = 0;
+    device->rto = SerialComm::ackTimeout;
+    device->timeouts = 0;
+    device->waiting = false;
+    device->retries = 0;
+    device->sent = 0;
+    device->timer = 0;
+    device->deadline = 0;
+    device->readPacketCount = 0;
+    device->droppedReadPacketCount = 0;
+    device->badPacketCount = 0;
+    device->writtenPacketCount = 0;
+    device->droppedWritePacketCount = 0;
+    device->sumRetries = 0;
+    device->windowSyncCount = 0;
+    device->errorReported = false;
+
+    pthread_mutex_lock(&lock);
+    // the worker with the fewest devices
+    unsigned chosen = 0;
+    for (unsigned i = 1; i < workers.size(); i++)
+    {
+        if (workers[i]->devices.size() < workers[chosen]->devices.size())
+        {
+            chosen = i;
+        }
+    }
+    device->worker = chosen;
+    devices[pId] = device;
+    worker_t &worker = *workers[chosen];
+    pthread_mutex_lock(&worker.lock);
+    worker.devices.push_back(device);
+    wakeWorker(worker);
+    pthread_mutex_unlock(&worker.lock);
+    pthread_mutex_unlock(&lock);
+    DEBUG("SerialGateway::addDevice : " << pDevice << " served by worker " << chosen)
+    return true;
+}
+
+bool SerialGateway::removeDevice(int pId)
+{
+    pthread_mutex_lock(&lock);
+    map<int, device_t*>::iterator it = devices.find(pId);
+    if (it == devices.end())
+    {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    device_t *device = it->second;
+    devices.erase(it);
+    worker_t &worker = *workers[device->worker];
+    pthread_mutex_lock(&worker.lock);
+    vector<device_t*>::iterator d;
+    for (d = worker.devices.begin(); d != worker.devices.end(); d++)
+    {
+        if (*d == device)
+        {
+            worker.devices.erase(d);
+            break;
+        }
+    }
+    // the event loop may still hold the fd in its poll set
+    ++worker.removals;
+    wakeWorker(worker);
+    pthread_mutex_unlock(&worker.lock);
+    pthread_mutex_unlock(&lock);
+
+    if (device->fd >= 0) close(device->fd);
+    delete device;
+    return true;
+}
+
+int SerialGateway::getDeviceCount()
+{
+    pthread_mutex_lock(&lock);
+    int count = devices.size();
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+bool SerialGateway::isErrorReported(int pId)
+{
+    bool failed = false;
+    pthread_mutex_lock(&lock);
+    map<int, device_t*>::iterator it = devices.find(pId);
+    if (it != devices.end())
+    {
+        worker_t &worker = *workers[it->second->worker];
+        pthread_mutex_lock(&worker.lock);
+        failed = it->second->errorReported;
+        pthread_mutex_unlock(&worker.lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return failed;
+}
+
+/* only one wakeup is outstanding at a time */
+void SerialGateway::wakeWorker(worker_t &pWorker)
+{
+    if (!pWorker.wakeupPending)
+    {
+        uint64_t one = 1;
+        pWorker.wakeupPending = true;
+        if (write(pWorker.wakeFDs[1], &one, (pWorker.wakeFDs[0] == pWorker.wakeFDs[1]) ? sizeof(one) : 1) < 0)
+        {
+            DEBUG("SerialGateway::wakeWorker : write failed")
+        }
+    }
+}
+
+/* helper function to start a worker pthread */
+void* serveDevicesThread(void* ob)
+{
+    SerialGateway::worker_t *worker = static_cast<SerialGateway::worker_t*>(ob);
+    worker->gateway->serveDevices(*worker);
+    return NULL;
+}
+
+void SerialGateway::serveDevices(worker_t &pWorker)
+{
+    vector<struct pollfd> pfds;
+    vector<device_t*> polled;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (true)
+    {
+        struct pollfd pfd;
+        long long next = 0;
+        pfds.clear();
+        polled.clear();
+        pthread_mutex_lock(&pWorker.lock);
+        pfd.fd = pWorker.wakeFDs[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+        vector<device_t*>::iterator it;
+        for (it = pWorker.devices.begin(); it != pWorker.devices.end(); it++)
+        {
+            device_t *device = *it;
+            if (device->fd < 0)
+            {
+                continue;
+            }
+            pfd.fd = device->fd;
+            pfd.events = POLLIN | (device->output.empty() ? 0 : POLLOUT);
+            pfds.push_back(pfd);
+            polled.push_back(device);
+            if ((device->deadline != 0) && ((next == 0) || (device->deadline < next)))
+            {
+                next = device->deadline;
+            }
+        }
+        unsigned long removals = pWorker.removals;
+        pWorker.wakeupPending = false;
+        pthread_mutex_unlock(&pWorker.lock);
+
+        int timeout = -1;
+        if (next != 0)
+        {
+            long long left = next - LatencyHistogram::now();
+            timeout = (left > 0) ? (int)(left / (1000 * 1000)) + 1 : 0;
+        }
+        // the only place where the worker may be canceled
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int n = poll(&pfds[0], pfds.size(), timeout);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if ((n < 0) && (errno != EINTR))
+        {
+            reportError("SerialGateway::serveDevices : poll(&pfds[0], pfds.size(), timeout)", -1);
+            // do not spin on a persistent error, cancelable while waiting
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            usleep(cPollErrorBackoff);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            continue;
+        }
+
+        pthread_mutex_lock(&pWorker.lock);
+        ++pWorker.wakeups;
+        if (pfds[0].revents != 0)
+        {
+            uint64_t wakeups;
+            while (read(pWorker.wakeFDs[0], &wakeups, sizeof(wakeups)) > 0)
+            {
+            }
+        }
+        long long now = LatencyHistogram::now();
+        // polled devices are gone if one was removed meanwhile
+        if (removals == pWorker.removals)
+        {
+            for (unsigned i = 1; (n > 0) && (i < pfds.size()); i++)
+            {
+                device_t &device = *polled[i - 1];
+                if ((pfds[i].revents & POLLOUT) && (device.fd >= 0))
+                {
+                    flushOutput(device);
+                }
+                if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) && (device.fd >= 0))
+                {
+                    readDevice(device, pfds[i].revents, now);
+                }
+            }
+        }
+        for (it = pWorker.devices.begin(); it != pWorker.devices.end(); it++)
+        {
+            serviceDevice(**it, now);
+        }
+        pthread_mutex_unlock(&pWorker.lock);
+    }
+}
+
+void SerialGateway::readDevice(device_t &pDevice, short pEvents, long long pNow)
+{
+    uint8_t buffer[SerialComm::rawBufferSize];
+    while (pDevice.fd >= 0)
+    {
+        int count = read(pDevice.fd, buffer, sizeof(buffer));
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                reportDeviceError(pDevice, "read(fd, buffer, sizeof(buffer))");
+            }
+            return;
+        }
+        if (count == 0)
+        {
+            // buggy usb serial drivers report readable without data
+            if (pEvents & POLLHUP)
+            {
+                errno = EIO;
+                reportDeviceError(pDevice, "read(fd, buffer, sizeof(buffer)) : hangup");
+            }
+            return;
+        }
+        int pos = 0;
+        while (pos < count)
+        {
+            hdlc_event event;
+            pos += hdlc_decode(&pDevice.decoder, buffer + pos, count - pos, &event);
+            switch (event)
+            {
+            case hdlc_frame:
+                receiveFrame(pDevice, pNow);
+                break;
+            case hdlc_too_short:
+            case hdlc_bad_crc:
+            case hdlc_too_long:
+            case hdlc_bad_escape:
+                ++pDevice.badPacketCount;
+                break;
+            default:
+                break;
+            }
+        }
+        if (count < (int)sizeof(buffer))
+        {
+            return;
+        }
+    }
+}
+
+void SerialGateway::receiveFrame(device_t &pDevice, long long pNow)
+{
+    uint8_t *buffer = pDevice.decoder.frame;
+    int count = pDevice.decoder.count;
+    int offset = SerialComm::payloadOffset;
+    SFPacket packet(buffer[SerialComm::typeOffset], buffer[SerialComm::seqnoOffset]);
+    switch (buffer[SerialComm::typeOffset])
+    {
+    case SF_ACK:
+        // FIXME: seqnos are not implemented on the node, as in SerialComm
+        if (pDevice.waiting)
+        {
+            if (pDevice.retries == 0)
+            {
+                pDevice.ackRtt.add(pNow - pDevice.sent);
+            }
+            if (pDevice.current.getArrival() != 0)
+            {
+                pDevice.writeLatency.add(pNow - pDevice.current.getArrival());
+            }
+        }
+        pDevice.waiting = false;
+        return;
+    case SF_WINDOW_ACK:
+        receiveWindowAck(pDevice, buffer[SerialComm::seqnoOffset], pNow);
+        return;
+    case SF_PACKET_ACK:
+        writeFrame(pDevice, SF_ACK, buffer[SerialComm::seqnoOffset], NULL);
+        break;
+    case SF_PACKET_NO_ACK:
+        // no seqno, the payload follows the type
+        offset = SerialComm::seqnoOffset;
+        break;
+    default:
+        DEBUG("SerialGateway::receiveFrame : unknown packet type = " << (int)buffer[SerialComm::typeOffset])
+        return;
+    }
+    ++pDevice.readPacketCount;
+    if (!packet.setPayload((char *)&buffer[offset], count - offset))
+    {
+        ++pDevice.badPacketCount;
+        return;
+    }
+    packet.setArrival(pNow);
+    packet.setChannel(pDevice.id);
+    // a full buffer discards or blocks according to its policy
+    if (!readBuffer.enqueueBack(packet))
+    {
+        ++pDevice.droppedReadPacketCount;
+    }
+}
+
+void SerialGateway::writeFrame(device_t &pDevice, int pType, int pSeqno, const SFPacket *pPacket)
+{
+    uint8_t header[2];
+    uint8_t buffer[HDLC_ENCODED_SIZE(sizeof(header) + SFPacket::cMaxPacketLength)];
+    header[SerialComm::typeOffset] = pType;
+    header[SerialComm::seqnoOffset] = pSeqno;
+    size_t length = hdlc_encode(buffer, header, sizeof(header),
+                                pPacket ? pPacket->getPayload() : NULL,
+                                pPacket ? pPacket->getLength() : 0);
+    pDevice.output.append((char *)buffer, length);
+    flushOutput(pDevice);
+}
+
+void SerialGateway::flushOutput(device_t &pDevice)
+{
+    while (!pDevice.output.empty() && (pDevice.fd >= 0))
+    {
+        int count = write(pDevice.fd, pDevice.output.data(), pDevice.output.size());
+        if (count > 0)
+        {
+            pDevice.output.erase(0, count);
+        }
+        else if ((count < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else if ((count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            // the event loop polls for POLLOUT while output is left
+            return;
+        }
+        else
+        {
+            reportDeviceError(pDevice, "write(fd, output, size)");
+        }
+    }
+}
+
+void SerialGateway::serviceDevice(device_t &pDevice, long long pNow)
+{
+    pDevice.deadline = 0;
+    if (pDevice.fd < 0)
+    {
+        return;
+    }
+    switch (pDevice.windowState)
+    {
+    case cWindowUnknown:
+        // probe lazily, the node is most likely up once there is data for it
+        if (!pDevice.queue.empty() || !pDevice.window.empty())
+        {
+            startSync(pDevice, pNow, pDevice.failedResyncs > 0);
+        }
+        break;
+    case cWindowSyncing:
+        if (pNow < pDevice.timer)
+        {
+            pDevice.deadline = pDevice.timer;
+        }
+        else if (++pDevice.syncTries < SerialComm::cSyncRetries)
+        {
+            writeFrame(pDevice, SF_WINDOW_SYNC, pDevice.syncBase, NULL);
+            pDevice.timer = pNow + SerialComm::ackTimeout;
+            pDevice.deadline = pDevice.timer;
+        }
+        else
+        {
+            DEBUG("SerialGateway::serviceDevice : no answer from " << pDevice.device)
+            while (!pDevice.window.empty())
+            {
+                pDevice.queue.push_front(pDevice.window.back().packet);
+                pDevice.window.pop_back();
+            }
+            if (pDevice.resync && (++pDevice.failedResyncs >= cMaxFailedResyncs))
+            {
+                // the node is gone: fail its packets instead of probing forever
+                errno = ETIMEDOUT;
+                reportDeviceError(pDevice, "no answer to window resync");
+                break;
+            }
+            // a failed resync means the node is gone or was replaced: probe again
+            pDevice.windowState = pDevice.resync ? cWindowUnknown : cWindowOff;
+            serviceDevice(pDevice, pNow);
+        }
+        break;
+    case cWindowOn:
+        serviceWindow(pDevice, pNow);
+        break;
+    case cWindowOff:
+        serviceStopAndWait(pDevice, pNow);
+        break;
+    }
+}
+
+/* go-back-N as in SerialComm::writeWindow, driven by the event loop */
+void SerialGateway::serviceWindow(device_t &pDevice, long long pNow)
+{
+    while ((pDevice.window.size() < SerialComm::cWindowSize) && !pDevice.queue.empty())
+    {
+        windowEntry_t entry;
+        entry.packet = pDevice.queue.front();
+        entry.seqno = (uint8_t)pDevice.seqno++;
+        entry.retries = 0;
+        pDevice.queue.pop_front();
+        pDevice.window.push_back(entry);
+        ++pDevice.writtenPacketCount;
+        sendWindowEntry(pDevice, pDevice.window.back(), pNow);
+    }
+    if (pDevice.window.empty())
+    {
+        return;
+    }
+    if (pNow < pDevice.window.front().sent + pDevice.rto)
+    {
+        pDevice.deadline = pDevice.window.front().sent + pDevice.rto;
+        return;
+    }
+
+    // timeout
+    pDevice.rto = (2 * pDevice.rto < SerialComm::cMaxRTO) ? 2 * pDevice.rto : SerialComm::cMaxRTO;
+    bool resync = (++pDevice.timeouts >= SerialComm::cResyncTimeouts);
+    if (pDevice.window.front().retries >= SerialComm::maxRetries)
+    {
+        // the node still waits for this seqno
+        pDevice.window.pop_front();
+        ++pDevice.droppedWritePacketCount;
+        resync = true;
+    }
+    if (resync)
+    {
+        startSync(pDevice, pNow, true);
+        return;
+    }
+    for (unsigned i = 0; i < pDevice.window.size(); i++)
+    {
+        ++pDevice.window[i].retries;
+        ++pDevice.sumRetries;
+        sendWindowEntry(pDevice, pDevice.window[i], pNow);
+    }
+    pDevice.deadline = pDevice.window.front().sent + pDevice.rto;
+}
+
+/* stop-and-wait as in SerialComm::writeSerial */
+void SerialGateway::serviceStopAndWait(device_t &pDevice, long long pNow)
+{
+    if (pDevice.waiting && (pNow >= pDevice.timer))
+    {
+        if (pDevice.retries < SerialComm::maxRetries)
+        {
+            ++pDevice.retries;
+            ++pDevice.sumRetries;
+            pDevice.sent = pNow;
+            writeFrame(pDevice, SF_PACKET_ACK, pDevice.current.getSeqno(), &pDevice.current);
+            pDevice.timer = pNow + (long long)SerialComm::ackTimeout * (pDevice.retries + 1);
+        }
+        else
+        {
+            ++pDevice.droppedWritePacketCount;
+            pDevice.waiting = false;
+        }
+    }
+    if (!pDevice.waiting && !pDevice.queue.empty())
+    {
+        pDevice.current = pDevice.queue.front();
+        pDevice.queue.pop_front();
+        ++pDevice.writtenPacketCount;
+        pDevice.retries = 0;
+        pDevice.waiting = true;
+        pDevice.sent = pNow;
+        writeFrame(pDevice, SF_PACKET_ACK, pDevice.current.getSeqno(), &pDevice.current);
+        pDevice.timer = pNow + SerialComm::ackTimeout;
+    }
+    if (pDevice.waiting)
+    {
+        pDevice.deadline = pDevice.timer;
+    }
+}
+
+void SerialGateway::startSync(device_t &pDevice, long long pNow, bool pResync)
+{
+    pDevice.syncBase = pDevice.window.empty() ? (uint8_t)pDevice.seqno : pDevice.window.front().seqno;
+    pDevice.resync = pResync;
+    pDevice.syncTries = 0;
+    pDevice.windowState = cWindowSyncing;
+    writeFrame(pDevice, SF_WINDOW_SYNC, pDevice.syncBase, NULL);
+    pDevice.timer = pNow + SerialComm::ackTimeout;
+    pDevice.deadline = pDevice.timer;
+}
+
+void SerialGateway::receiveWindowAck(device_t &pDevice, uint8_t pAck, long long pNow)
+{
+    if (pDevice.windowState == cWindowSyncing)
+    {
+        // a new node takes syncBase, a synced one answers with the last
+        // seqno it delivered: continue after it, as SerialComm::applySyncAck
+        unsigned delivered = (uint8_t)(pAck + 1 - pDevice.syncBase);
+        if (delivered <= pDevice.window.size())
+        {
+            for (unsigned i = 0; i < delivered; i++)
+            {
+                if (pDevice.window[i].packet.getArrival() != 0)
+                {
+                    pDevice.writeLatency.add(pNow - pDevice.window[i].packet.getArrival());
+                }
+            }
+            pDevice.window.erase(pDevice.window.begin(), pDevice.window.begin() + delivered);
+        }
+        else
+        {
+            for (unsigned i = 0; i < pDevice.window.size(); i++)
+            {
+                pDevice.window[i].seqno = (uint8_t)(pAck + 1 + i);
+            }
+        }
+        pDevice.seqno = (uint8_t)(pAck + 1 + pDevice.window.size());
+        DEBUG("SerialGateway::receiveWindowAck : " << pDevice.device << " synced at seqno " << (int)(uint8_t)(pAck + 1))
+        pDevice.windowState = cWindowOn;
+        pDevice.timeouts = 0;
+        pDevice.failedResyncs = 0;
+        ++pDevice.windowSyncCount;
+        for (unsigned i = 0; i < pDevice.window.size(); i++)
+        {
+            ++pDevice.window[i].retries;
+            ++pDevice.sumRetries;
+            sendWindowEntry(pDevice, pDevice.window[i], pNow);
+        }
+        return;
+    }
+    if ((pDevice.windowState != cWindowOn) || pDevice.window.empty())
+    {
+        return;
+    }
+    unsigned acked = (uint8_t)(pAck - pDevice.window.front().seqno);
+    if (acked >= pDevice.window.size())
+    {
+        // duplicate or stale ack
+        return;
+    }
+    // Karn: retransmitted packets give no rtt sample
+    if (pDevice.window[acked].retries == 0)
+    {
+        SerialComm::updateRTO(pNow - pDevice.window[acked].sent, pDevice.srtt, pDevice.rttvar, pDevice.rto);
+        pDevice.ackRtt.add(pNow - pDevice.window[acked].sent);
+    }
+    for (unsigned i = 0; i <= acked; i++)
+    {
+        if (pDevice.window[i].packet.getArrival() != 0)
+        {
+            pDevice.writeLatency.add(pNow - pDevice.window[i].packet.getArrival());
+        }
+    }
+    pDevice.window.erase(pDevice.window.begin(), pDevice.window.begin() + acked + 1);
+    pDevice.timeouts = 0;
+}
+
+void SerialGateway::sendWindowEntry(device_t &pDevice, windowEntry_t &pEntry, long long pNow)
+{
+    pEntry.sent = pNow;
+    writeFrame(pDevice, SF_PACKET_WINDOW, pEntry.seqno, &pEntry.packet);
+}
+
+/* helper function to start the dispatcher pthread */
+void* dispatchThread(void* ob)
+{
+    static_cast<SerialGateway*>(ob)->dispatch();
+    return NULL;
+}
+
+void SerialGateway::dispatch()
+{
+    SFPacket packets[cDispatchBatchSize];
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (true)
+    {
+        // blocks until buffer is not empty, the only place to cancel
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        unsigned count = writeBuffer.dequeue(packets, cDispatchBatchSize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&lock);
+        unsigned i = 0;
+        while (i < count)
+        {
+            map<int, device_t*>::iterator it = devices.find(packets[i].getChannel());
+            if (it == devices.end())
+            {
+                ++unroutedPacketCount;
+                ++i;
+                continue;
+            }
+            device_t &device = *it->second;
+            worker_t &worker = *workers[device.worker];
+            pthread_mutex_lock(&worker.lock);
+            if ((device.fd >= 0) && (device.queue.size() >= cMaxDeviceQueue) &&
+                (writeBuffer.getPolicy() == PacketBuffer::cBlock))
+            {
+                // wait for the device, meanwhile the full buffer holds back the TCP side
+                pthread_mutex_unlock(&worker.lock);
+                pthread_mutex_unlock(&lock);
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                usleep(cDispatchBackoff);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+                pthread_mutex_lock(&lock);
+                continue;
+            }
+            if ((device.fd >= 0) && (device.queue.size() < cMaxDeviceQueue))
+            {
+                device.queue.push_back(packets[i]);
+                wakeWorker(worker);
+            }
+            else
+            {
+                ++device.droppedWritePacketCount;
+            }
+            pthread_mutex_unlock(&worker.lock);
+            ++i;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/* a device error only takes down the device */
+void SerialGateway::reportDeviceError(device_t &pDevice, const char *msg)
+{
+    cerr << "error : SF-Gateway ( device = " << pDevice.device << " ) : "
+         << msg << endl
+         << "error-description : " << strerror(errno) << endl;
+    close(pDevice.fd);
+    pDevice.fd = -1;
+    pDevice.output.clear();
+    // nothing will be sent anymore
+    pDevice.droppedWritePacketCount += pDevice.queue.size() + pDevice.window.size() + (pDevice.waiting ? 1 : 0);
+    pDevice.queue.clear();
+    pDevice.window.clear();
+    pDevice.waiting = false;
+    pDevice.errorReported = true;
+    pthread_cond_signal(&control.cancel);
+}
+
+/* reports error */
+int SerialGateway::reportError(const char *msg, int result)
+{
+    if ((result < 0) && (!errorReported))
+    {
+        cerr << "error : SF-Gateway : "
+             << msg << " ( result = " << result << " )" << endl
+             << "error-description : " << strerror(errno) << endl;
+        errorReported = true;
+        pthread_cond_signal(&control.cancel);
+    }
+    return result;
+}
+
+/* prints out status */
+void SerialGateway::reportStatus(ostream& os)
+{
+    pthread_mutex_lock(&lock);
+    os << "SF-Gateway : devices = " << devices.size()
+       << " , workers = " << workers.size()
+       << " , unrouted packets = " << unroutedPacketCount << endl;
+    for (unsigned i = 0; i < workers.size(); i++)
+    {
+        pthread_mutex_lock(&workers[i]->lock);
+        os << "     worker " << i << " : devices = " << workers[i]->devices.size()
+           << " , wakeups = " << workers[i]->wakeups << endl;
+        pthread_mutex_unlock(&workers[i]->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* prints out the status of one device, as SerialComm::reportStatus */
+void SerialGateway::reportDeviceStatus(ostream& os, int pId)
+{
+    pthread_mutex_lock(&lock);
+    map<int, device_t*>::iterator it = devices.find(pId);
+    if (it != devices.end())
+    {
+        device_t &device = *it->second;
+        pthread_mutex_lock(&workers[device.worker]->lock);
+        os << "SF-Gateway ( device " << device.device << " , worker " << device.worker << " ) : "
+           << "baudrate = " << device.baudrate
+           << " , packets read = " << device.readPacketCount
+           << " ( dropped = " << device.droppedReadPacketCount
+           << ", bad = " << device.badPacketCount << " )"
+           << " , packets written = " << device.writtenPacketCount
+           << " ( queued = " << device.queue.size()
+           << ", dropped = " << device.droppedWritePacketCount
+           << ", total retries: " << device.sumRetries << " )";
+        if (device.windowState == cWindowOn)
+        {
+            os << " , window = " << SerialComm::cWindowSize
+               << " ( rto = " << device.rto / (1000 * 1000) << " ms"
+               << " , syncs = " << device.windowSyncCount << " )";
+        }
+        else if (device.windowState == cWindowOff)
+        {
+            os << " , stop-and-wait";
+        }
+        if (device.errorReported)
+        {
+            os << " , FAILED";
+        }
+        os << endl;
+        pthread_mutex_unlock(&workers[device.worker]->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* exports the counters of reportStatus */
+void SerialGateway::reportMetrics(Metrics& pMetrics, const string& pLabels)
+{
+    pthread_mutex_lock(&lock);
+    pMetrics.gauge("sf_gateway_devices", "Devices of a gateway", pLabels, devices.size());
+    pMetrics.counter("sf_gateway_unrouted_packets_total", "Packets for unknown gateway devices", pLabels, unroutedPacketCount);
+    for (unsigned i = 0; i < workers.size(); i++)
+    {
+        string labels = pLabels + "," + Metrics::label("worker", i);
+        pthread_mutex_lock(&workers[i]->lock);
+        pMetrics.gauge("sf_gateway_worker_devices", "Devices served by a gateway worker", labels, workers[i]->devices.size());
+        pMetrics.counter("sf_gateway_worker_wakeups_total", "Event loop wakeups of a gateway worker", labels, workers[i]->wakeups);
+        pthread_mutex_unlock(&workers[i]->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* exports the counters of reportDeviceStatus, named as those of SerialComm */
+void SerialGateway::reportDeviceMetrics(Metrics& pMetrics, int pId, const string& pLabels)
+{
+    pthread_mutex_lock(&lock);
+    map<int, device_t*>::iterator it = devices.find(pId);
+    if (it != devices.end())
+    {
+        device_t &device = *it->second;
+        pthread_mutex_lock(&workers[device.worker]->lock);
+        pMetrics.counter("sf_serial_read_packets_total", "Packets read from the node", pLabels, device.readPacketCount);
+        pMetrics.counter("sf_serial_read_dropped_packets_total", "Packets from the node dropped before reaching the TCP side", pLabels, device.droppedReadPacketCount);
+        pMetrics.counter("sf_serial_bad_packets_total", "Frames with CRC or length errors", pLabels, device.badPacketCount);
+        pMetrics.counter("sf_serial_written_packets_total", "Packets written to the node", pLabels, device.writtenPacketCount);
+        pMetrics.counter("sf_serial_write_dropped_packets_total", "Packets the node never acknowledged", pLabels, device.droppedWritePacketCount);
+        pMetrics.counter("sf_serial_retries_total", "Retransmissions to the node", pLabels, device.sumRetries);
+        pMetrics.counter("sf_serial_window_syncs_total", "Window (re-)synchronisations", pLabels, device.windowSyncCount);
+        pMetrics.gauge("sf_serial_unacked_packets", "Packets sent to the node and not acknowledged yet", pLabels,
+                       device.waiting ? 1 : device.window.size());
+        pMetrics.gauge("sf_gateway_device_queued_packets", "Packets waiting for a gateway device", pLabels, device.queue.size());
+        pMetrics.gauge("sf_gateway_device_queue_capacity_packets", "Packets queued for a gateway device before new ones are dropped", pLabels, cMaxDeviceQueue);
+        pMetrics.histogram("sf_tcp_to_serial_latency_seconds", "Time from the TCP arrival of a packet to its ack by the node", pLabels, device.writeLatency);
+        pMetrics.histogram("sf_serial_ack_rtt_seconds", "Round trip time of first transmissions to the node", pLabels, device.ackRtt);
+        pthread_mutex_unlock(&workers[device.worker]->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
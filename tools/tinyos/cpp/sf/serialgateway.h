@@ -0,0 +1,291 @@
+/**
+ * Serial side of a gateway: one sf-server serving many serial devices.
+ *
+ * A SerialComm runs two threads per device. A gateway instead has a fixed
+ * pool of worker threads, each running an event loop over the devices it
+ * was given: it reads and decodes their frames, answers their acks and
+ * drives their stop-and-wait or window protocol from timers. A dispatcher
+ * thread routes the packets coming from the TCP side to the device named
+ * by the packet channel (the sf-server id of the device). An idle device
+ * costs a poll entry, threads only wake up for traffic and timers.
+ */
+
+#ifndef SERIALGATEWAY_H
+#define SERIALGATEWAY_H
+
+#include "sfpacket.h"
+#include "packetbuffer.h"
+#include "serialcomm.h"
+#include "sharedinfo.h"
+#include "latencyhistogram.h"
+#include "metrics.h"
+#include "hdlc.h"
+
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+
+// #define DEBUG_SERIALGATEWAY
+
+#undef DEBUG
+#ifdef DEBUG_SERIALGATEWAY
+#define DEBUG(message) std::cout << message << std::endl;
+#else
+#define DEBUG(message)
+#endif
+
+class SerialGateway
+{
+public:
+    static const int cDefaultWorkers = 2;
+
+    static const int cMaxWorkers = 16;
+
+    /** Constants **/
+protected:
+    /* max. number of packets the dispatcher takes from the buffer at once */
+    static const unsigned cDispatchBatchSize = 16;
+
+    /* packets queued towards one device before new ones are dropped, or
+       held back if the tcp -> serial buffer blocks */
+    static const unsigned cMaxDeviceQueue = 256;
+
+    /* pause of the dispatcher while it holds back a packet, in us */
+    static const int cDispatchBackoff = 1000;
+
+    /* failed resyncs in a row before the device is taken down */
+    static const int cMaxFailedResyncs = 3;
+
+    /* pause of a worker after poll() failed, in us */
+    static const int cPollErrorBackoff = 100 * 1000;
+
+    typedef enum
+    {
+        // not probed yet
+        cWindowUnknown,
+        // sync frame sent, waiting for the answer
+        cWindowSyncing,
+        // node acknowledged a sync frame
+        cWindowOn,
+        // node ignores sync frames, use stop-and-wait
+        cWindowOff
+    } windowState_t;
+
+    // a packet in flight in window mode
+    typedef struct
+    {
+        SFPacket packet;
+        uint8_t seqno;
+        // time of the last transmission in ns
+        long long sent;
+        int retries;
+    } windowEntry_t;
+
+    // a serial device, only touched with the lock of its worker held
+    typedef struct
+    {
+        /* sf-server id, the channel of its packets */
+        int id;
+        std::string device;
+        int baudrate;
+        /* non-blocking, -1 after an error */
+        int fd;
+        /* index of the worker serving the device */
+        int worker;
+
+        uint8_t frameBuffer[SerialComm::maxMTU];
+        hdlc_decoder decoder;
+
+        /* encoded frames the fd did not take yet */
+        std::string output;
+
+        /* packets from the TCP side, filled by the dispatcher */
+        std::deque<SFPacket> queue;
+
+        windowState_t windowState;
+        /* the sync is a resync of a running window */
+        bool resync;
+        int syncTries;
+        /* resyncs without answer since the last successful sync */
+        int failedResyncs;
+        uint8_t syncBase;
+        std::deque<windowEntry_t> window;
+        int seqno;
+        /* smoothed rtt, rtt variance and retransmission timeout in ns */
+        long long srtt;
+        long long rttvar;
+        long long rto;
+        /* timeouts without progress */
+        int timeouts;
+
+        /* stop-and-wait: packet waiting for its ack */
+        bool waiting;
+        SFPacket current;
+        int retries;
+        /* time of the last transmission of current in ns */
+        long long sent;
+
+        /* sync or ack timeout in ns */
+        long long timer;
+        /* next time the device needs the worker in ns, 0 if not */
+        long long deadline;
+
+        /* statistics */
+        unsigned long readPacketCount;
+        unsigned long droppedReadPacketCount;
+        unsigned long badPacketCount;
+        unsigned long writtenPacketCount;
+        unsigned long droppedWritePacketCount;
+        unsigned long sumRetries;
+        unsigned long windowSyncCount;
+        /* TCP arrival -> ack of the node, per packet */
+        LatencyHistogram writeLatency;
+        /* ack round trip times, first transmissions only */
+        LatencyHistogram ackRtt;
+
+        bool errorReported;
+    } device_t;
+
+    // a worker thread and the devices it serves
+    typedef struct
+    {
+        SerialGateway *gateway;
+        pthread_t thread;
+        bool running;
+        /* protects devices and everything in them */
+        pthread_mutex_t lock;
+        std::vector<device_t*> devices;
+        /* incremented when a device is removed */
+        unsigned long removals;
+        /* the dispatcher wakes the event loop through wakeFDs[1] */
+        int wakeFDs[2];
+        bool wakeupPending;
+        /* statistics */
+        unsigned long wakeups;
+    } worker_t;
+
+    /** Member vars */
+protected:
+    /* protects devices and the assignment of devices to workers */
+    pthread_mutex_t lock;
+
+    /* all devices by id */
+    std::map<int, device_t*> devices;
+
+    std::vector<worker_t*> workers;
+
+    /* pthread routing packets from the TCP side to the workers */
+    pthread_t dispatcherThread;
+
+    bool dispatcherThreadRunning;
+
+    /* packets for unknown devices */
+    unsigned long unroutedPacketCount;
+
+    /* reference to read packet buffer (serial -> tcp) */
+    PacketBuffer &readBuffer;
+
+    /* reference to write packet buffer (tcp -> serial) */
+    PacketBuffer &writeBuffer;
+
+    /* indicates that an error occured */
+    bool errorReported;
+
+    /* for noticing the parent thread of cancelation */
+    sharedControlInfo_t &control;
+
+    /** Member functions */
+
+    /* needed to start pthreads */
+    friend void* serveDevicesThread(void* ob);
+    friend void* dispatchThread(void* ob);
+
+private:
+    /* disable standard constructor */
+    SerialGateway();
+
+protected:
+    /* event loop of a worker */
+    void serveDevices(worker_t &pWorker);
+
+    /* routes packets from the TCP side into the device queues */
+    void dispatch();
+
+    /* wakes the event loop of a worker (worker lock held) */
+    void wakeWorker(worker_t &pWorker);
+
+    /* reads and decodes everything the device has to offer */
+    void readDevice(device_t &pDevice, short pEvents, long long pNow);
+
+    /* handles a decoded frame */
+    void receiveFrame(device_t &pDevice, long long pNow);
+
+    /* encodes a frame into the output of the device and writes it */
+    void writeFrame(device_t &pDevice, int pType, int pSeqno, const SFPacket *pPacket);
+
+    /* writes as much of the output as the device takes */
+    void flushOutput(device_t &pDevice);
+
+    /* runs the timers and sends what the protocol allows, sets the deadline */
+    void serviceDevice(device_t &pDevice, long long pNow);
+
+    void serviceWindow(device_t &pDevice, long long pNow);
+
+    void serviceStopAndWait(device_t &pDevice, long long pNow);
+
+    /* sends a sync frame announcing the next seqno */
+    void startSync(device_t &pDevice, long long pNow, bool pResync);
+
+    /* handles a cumulative window ack from the node */
+    void receiveWindowAck(device_t &pDevice, uint8_t pAck, long long pNow);
+
+    void sendWindowEntry(device_t &pDevice, windowEntry_t &pEntry, long long pNow);
+
+    /* closes the device after an I/O error, sf-control removes it */
+    void reportDeviceError(device_t &pDevice, const char *msg);
+
+    int reportError(const char *msg, int result);
+
+public:
+    /* starts pWorkers worker threads and the dispatcher */
+    SerialGateway(PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl, int pWorkers = cDefaultWorkers);
+
+    /* stops all threads and closes all devices */
+    ~SerialGateway();
+
+    /* cancels all running threads */
+    void cancel();
+
+    /* opens a device and hands it to the least busy worker,
+       false if it could not be opened */
+    bool addDevice(int pId, std::string pDevice, int pBaudrate);
+
+    /* closes a device, false if there is no device pId */
+    bool removeDevice(int pId);
+
+    /* number of devices */
+    int getDeviceCount();
+
+    /* reports the workers and routing */
+    void reportStatus(std::ostream& os);
+
+    /* reports the counters of one device */
+    void reportDeviceStatus(std::ostream& os, int pId);
+
+    /* adds the counters of the workers, pLabels identify the gateway */
+    void reportMetrics(Metrics& pMetrics, const std::string& pLabels);
+
+    /* adds the counters and queue lengths of one device */
+    void reportDeviceMetrics(Metrics& pMetrics, int pId, const std::string& pLabels);
+
+    /* returns if error occurred */
+    bool isErrorReported() { return errorReported; }
+
+    /* returns if device pId failed */
+    bool isErrorReported(int pId);
+};
+
+#endif
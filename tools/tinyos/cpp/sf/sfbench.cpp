@@ -0,0 +1,251 @@
+/**
+ * Client-count scaling benchmark for the TCP side of the serial
+ * forwarder. It runs a TCPComm server in-process, connects N clients,
+ * feeds packets into the serial->tcp buffer as fast as the server takes
+ * them and measures how long it takes until every client has received
+ * the last one (and how many got lost in the queues of clients that did
+ * not keep up). One more client connects but never reads, it must not
+ * slow down the others. Finally every client sends packets upstream and
+ * the benchmark measures how fast they arrive in the tcp->serial buffer.
+ *
+ * usage: sfbench [PORT [PACKETS [CLIENTS ...]]]
+ */
+
+#include "tcpcomm.h"
+#include "packetbuffer.h"
+#include "sfpacket.h"
+#include "sharedinfo.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool readAll(int fd, char *buffer, int count)
+{
+    while (count > 0) {
+        int n = read(fd, buffer, count);
+        if (n <= 0) return false;
+        buffer += n;
+        count -= n;
+    }
+    return true;
+}
+
+static int connectClient(int port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    char check[2];
+    const char us[2] = { 'U', ' ' };
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        !readAll(fd, check, 2) || write(fd, us, 2) != 2) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct producer_t {
+    PacketBuffer *buffer;
+    int run;
+    int count;
+    volatile bool stop;
+};
+
+/* keeps the serial->tcp buffer filled with numbered packets */
+static void* produce(void *arg)
+{
+    producer_t *p = static_cast<producer_t*>(arg);
+    for (int i = 0; (p->count < 0 || i < p->count) && !p->stop; i++) {
+        char payload[20];
+        memset(payload, 0, sizeof(payload));
+        memcpy(payload, &i, sizeof(i));
+        memcpy(payload + sizeof(i), &p->run, sizeof(p->run));
+        SFPacket packet(SF_PACKET_NO_ACK);
+        packet.setPayload(payload, sizeof(payload));
+        p->buffer->enqueueBack(packet);
+    }
+    return NULL;
+}
+
+/* reads from all clients until each has seen packet `last` of `run`
+   (any packet of `run` if last < 0). returns false on a broken
+   connection, counts the packets of `run` that arrived in delivered */
+static bool drainClients(vector<int> &fds, int run, int last, long *delivered)
+{
+    vector<struct pollfd> pfds(fds.size());
+    vector<string> partial(fds.size());
+    vector<bool> finished(fds.size(), false);
+    unsigned done = 0;
+    *delivered = 0;
+    for (unsigned i = 0; i < fds.size(); i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    while (done < fds.size()) {
+        if (poll(&pfds[0], pfds.size(), 10000) <= 0) return false;
+        for (unsigned i = 0; i < fds.size(); i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            char data[8192];
+            int n = read(fds[i], data, sizeof(data));
+            if (n <= 0) return false;
+            partial[i].append(data, n);
+            size_t pos = 0;
+            while (pos < partial[i].size() &&
+                   pos + 1 + (uint8_t)partial[i][pos] <= partial[i].size()) {
+                int seq, packetRun;
+                memcpy(&seq, partial[i].data() + pos + 1, sizeof(seq));
+                memcpy(&packetRun, partial[i].data() + pos + 1 + sizeof(seq), sizeof(packetRun));
+                if (packetRun == run && !finished[i]) {
+                    ++*delivered;
+                    if (last < 0 || seq == last) {
+                        finished[i] = true;
+                        done++;
+                    }
+                }
+                pos += 1 + (uint8_t)partial[i][pos];
+            }
+            partial[i].erase(0, pos);
+        }
+    }
+    return true;
+}
+
+static void runBenchmark(int port, int packets, int clients)
+{
+    sharedControlInfo_t control;
+    pthread_mutex_init(&control.lock, NULL);
+    pthread_cond_init(&control.cancel, NULL);
+    PacketBuffer serial2tcp, tcp2serial;
+    TCPComm server(port, tcp2serial, serial2tcp, control);
+    if (server.isErrorReported()) return;
+
+    vector<int> fds;
+    double start = now();
+    for (int i = 0; i < clients; i++) {
+        int fd = connectClient(port);
+        if (fd < 0) {
+            cerr << "sfbench: connecting client " << i << " failed: " << strerror(errno) << endl;
+            break;
+        }
+        fds.push_back(fd);
+    }
+    double connected = now();
+    int stalled = connectClient(port);
+
+    // wait until the server forwards to every client
+    long delivered = 0;
+    producer_t warmup = { &serial2tcp, 0, -1, false };
+    pthread_t producer;
+    pthread_create(&producer, NULL, produce, &warmup);
+    bool ok = drainClients(fds, 0, -1, &delivered);
+    warmup.stop = true;
+    pthread_join(producer, NULL);
+
+    // downstream: serial -> all clients
+    double down = 0;
+    if (ok) {
+        serial2tcp.clear();
+        producer_t run = { &serial2tcp, 1, packets, false };
+        double t0 = now();
+        pthread_create(&producer, NULL, produce, &run);
+        ok = drainClients(fds, 1, packets - 1, &delivered);
+        down = now() - t0;
+        pthread_join(producer, NULL);
+    }
+
+    // upstream: all clients -> serial
+    double up = 0;
+    int perClient = packets / (clients > 0 ? clients : 1) + 1;
+    if (ok) {
+        char frame[21];
+        frame[0] = 20;
+        memset(frame + 1, 0, 20);
+        double t0 = now();
+        int expected = perClient * fds.size();
+        for (int k = 0; k < perClient; k++) {
+            for (unsigned i = 0; i < fds.size(); i++) {
+                if (write(fds[i], frame, sizeof(frame)) != sizeof(frame)) ok = false;
+            }
+        }
+        for (int k = 0; ok && k < expected; k++) {
+            tcp2serial.dequeue();
+        }
+        up = now() - t0;
+    }
+
+    cout << "clients " << fds.size() << " (+" << (stalled >= 0 ? 1 : 0) << " stalled)"
+         << " : connect " << (connected - start) * 1000 << " ms";
+    if (ok) {
+        cout << " , downstream " << packets / down << " packets/s ("
+             << delivered / down << " deliveries/s, "
+             << packets * fds.size() - delivered << " lost)"
+             << " , upstream " << perClient * fds.size() / up << " packets/s";
+    }
+    else {
+        cout << " , FAILED";
+    }
+    cout << endl;
+
+    for (unsigned i = 0; i < fds.size(); i++) {
+        close(fds[i]);
+    }
+    if (stalled >= 0) close(stalled);
+    server.cancel();
+}
+
+int main(int argc, char *argv[])
+{
+    int port = (argc > 1) ? atoi(argv[1]) : 9100;
+    int packets = (argc > 2) ? atoi(argv[2]) : 2000;
+    vector<int> counts;
+    for (int i = 3; i < argc; i++) {
+        counts.push_back(atoi(argv[i]));
+    }
+    if (counts.empty()) {
+        int defaults[] = { 1, 10, 100, 500, 1000 };
+        counts.assign(defaults, defaults + 5);
+    }
+
+    // every client needs two fds in this process
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#ifdef __APPLE__
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    for (unsigned i = 0; i < counts.size(); i++) {
+        runBenchmark(port + i, packets, counts[i]);
+    }
+    return EXIT_SUCCESS;
+}
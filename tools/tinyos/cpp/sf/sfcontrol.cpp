@@ -35,6 +35,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -55,6 +56,7 @@ using namespace std;
 
 /* forward declarations of pthrad helper functions*/
 void* checkCancelThread(void*);
+void* serveMetricsThread(void*);
 
 SFControl::SFControl()
 {
@@ -70,6 +72,9 @@ SFControl::SFControl()
     clientFD = -1;
     controlPort = -1;
     controlServerStarted = false;
+    metricsServerStarted = false;
+    metricsPort = -1;
+    metricsFD = -1;
     daemon = false;
     reportError("SFControl::SFControl : pthread_create( &cancelThread, NULL, checkCancelThread, this)", pthread_create( &cancelThread, NULL, checkCancelThread, this));
 }
@@ -104,18 +109,36 @@ string SFControl::getHelpMessage(string msg)
     }
     else if (msg == "start")
     {
-        helpMessage << ">> start PORT DEVICE_NAME BAUDRATE:" << endl
+        helpMessage << ">> start PORT DEVICE_NAME BAUDRATE [BUFFER_SIZE [SERIAL_POLICY [TCP_POLICY]]]:" << endl
         << ">> Starts a sf-server on a given TCP port connecting to a given device with the given baudrate." << endl
+        << ">> BUFFER_SIZE is the number of packets queued in each direction (default " << PacketBuffer::cDefaultCapacity << ")." << endl
+        << ">> SERIAL_POLICY and TCP_POLICY decide what happens when the queue towards the TCP clients" << endl
+        << ">> or the one towards the device is full: block, drop-oldest or drop-newest" << endl
+        << ">> (default drop-oldest and block, a full device queue holds back the TCP clients)." << endl
         << ">> The TCP port device name must be specified and must not" << endl
         << ">> overlap with any other TCP port or device name pair of an already running sf-server." << endl
         << ">> (e.g: \"start 9002 /dev/ttyUSB2 115200\" starts server on port 9002 and device /dev/ttyUSB2 with baudrate 115200)" << endl;
     }
+    else if (msg == "gateway")
+    {
+        helpMessage << ">> gateway PORT DEVICE_NAME BAUDRATE [WORKERS [SERIAL_POLICY [TCP_POLICY]]]:" << endl
+        << ">> Adds a device to the gateway on the given TCP port, the first device starts the gateway." << endl
+        << ">> A gateway serves all its devices with WORKERS threads (default " << SerialGateway::cDefaultWorkers << ")" << endl
+        << ">> instead of two threads per device. Every device gets its own id, as a sf-server would." << endl
+        << ">> The policies of the shared queues are those of start and are set by the first device." << endl
+        << ">> After the usual handshake a client sends one packet holding the id of the device" << endl
+        << ">> it wants to talk to as decimal number (e.g. \"3\"), afterwards the connection" << endl
+        << ">> behaves like one to a sf-server of that device." << endl
+        << ">> (e.g: \"gateway 9100 /dev/ttyUSB2 115200\" adds /dev/ttyUSB2 to the gateway on port 9100)" << endl;
+    }
     else if (msg == "stop")
     {
         helpMessage << ">> stop ID | PORT | DEVICE_NAME:" << endl
         << ">> Stops the specified sf-server." << endl
         << ">> The unique id or the device or the TCP port of the" << endl
         << ">> sf-server must be specified." << endl
+        << ">> Devices of a gateway are stopped by id or device, the gateway" << endl
+        << ">> closes its port with its last device." << endl
         << ">> (e.g: \"stop 1\" stops server with id 1 " << endl
         << ">>      \"stop /dev/ttyUSB0\" stops server connected to /dev/ttyUSB0" << endl
         << ">>      \"stop 9002\" prints stops server listening on TCPport 90002)" << endl;
@@ -130,6 +153,13 @@ string SFControl::getHelpMessage(string msg)
         << ">>      \"info /dev/ttyUSB0\" prints out information about server connected to /dev/ttyUSB0" << endl
         << ">>      \"info 9002\" prints out information about server listening on TCPport 90002)" << endl;
     }
+    else if (msg == "metrics")
+    {
+        helpMessage << ">> metrics PORT:" << endl
+        << ">> Serves the counters, queue lengths and latency histograms of all sf-servers" << endl
+        << ">> in the Prometheus text format on http://127.0.0.1:PORT/metrics ." << endl
+        << ">> (e.g: \"metrics 9102\" lets a Prometheus server on this host scrape 127.0.0.1:9102)" << endl;
+    }
     else if (msg == "list")
     {
         helpMessage << ">> list:" << endl
@@ -155,9 +185,11 @@ string SFControl::getHelpMessage(string msg)
         helpMessage << ">> Supported commands are:" << endl
         << ">> " << endl
         << ">> start - starts a sf-server on a given port and device" << endl
+        << ">> gateway - adds a device to a multi-device sf-server on a given port" << endl
         << ">> stop  - stops a running sf-server" << endl
         << ">> list  - lists all running sf-servers" << endl
-        << ">> info  - prints out some information about a given sf-server" << endl;
+        << ">> info  - prints out some information about a given sf-server" << endl
+        << ">> metrics - serves the statistics of all sf-servers via http" << endl;
         if (controlServerStarted) {
           helpMessage << ">> close - closes the TCP connection to the control-client" << endl;
         }
@@ -218,20 +250,111 @@ void SFControl::parseArgs(int argc, char *argv[])
 }
 
 /* starts a sf-server */
-void SFControl::startServer(int port, string device, int baudrate)
+void SFControl::startServer(int port, string device, int baudrate, unsigned bufferSize,
+                            PacketBuffer::overflowPolicy_t serialPolicy, PacketBuffer::overflowPolicy_t tcpPolicy)
 {
     pthread_testcancel();
     pthread_mutex_lock(&sfControlInfo.lock);
     sfServer_t newSFServer;
-    newSFServer.serial2tcp = new PacketBuffer();
-    newSFServer.tcp2serial = new PacketBuffer();
+    newSFServer.serial2tcp = new PacketBuffer(bufferSize, serialPolicy);
+    newSFServer.tcp2serial = new PacketBuffer(bufferSize, tcpPolicy);
     newSFServer.TcpServer = new TCPComm(port, *(newSFServer.tcp2serial), *(newSFServer.serial2tcp), sfControlInfo);
     newSFServer.SerialDevice = new SerialComm(device.c_str(), baudrate, *(newSFServer.serial2tcp), *(newSFServer.tcp2serial), sfControlInfo);
+    newSFServer.gateway = NULL;
     newSFServer.id = ++uniqueId;
+    newSFServer.port = port;
+    newSFServer.device = device;
+    newSFServer.baudrate = baudrate;
     servers.push_back(newSFServer);
     pthread_mutex_unlock(&sfControlInfo.lock);
 }
 
+bool SFControl::parsePolicies(const vector<string>& tokens, unsigned pFirst,
+                              PacketBuffer::overflowPolicy_t& serialPolicy, PacketBuffer::overflowPolicy_t& tcpPolicy)
+{
+    if ((tokens.size() > pFirst) && !PacketBuffer::parsePolicy(tokens[pFirst], serialPolicy))
+    {
+        return false;
+    }
+    if ((tokens.size() > pFirst + 1) && !PacketBuffer::parsePolicy(tokens[pFirst + 1], tcpPolicy))
+    {
+        return false;
+    }
+    return true;
+}
+
+/* adds a device to a gateway */
+void SFControl::startGatewayServer(int port, string device, int baudrate, int workers,
+                                   PacketBuffer::overflowPolicy_t serialPolicy, PacketBuffer::overflowPolicy_t tcpPolicy)
+{
+    pthread_testcancel();
+    pthread_mutex_lock(&sfControlInfo.lock);
+    gateway_t* gateway = NULL;
+    list<gateway_t*>::iterator it;
+    for (it = gateways.begin(); it != gateways.end(); it++)
+    {
+        if ((*it)->port == port)
+        {
+            gateway = *it;
+        }
+    }
+    if (gateway == NULL)
+    {
+        gateway = new gateway_t;
+        gateway->port = port;
+        gateway->serial2tcp = new PacketBuffer(gatewayBufferSize, serialPolicy);
+        gateway->tcp2serial = new PacketBuffer(gatewayBufferSize, tcpPolicy);
+        gateway->TcpServer = new TCPComm(port, *(gateway->tcp2serial), *(gateway->serial2tcp), sfControlInfo, TCPComm::cDropLagging, true);
+        gateway->Devices = new SerialGateway(*(gateway->serial2tcp), *(gateway->tcp2serial), sfControlInfo, workers);
+        gateways.push_back(gateway);
+    }
+    sfServer_t newSFServer;
+    newSFServer.serial2tcp = NULL;
+    newSFServer.tcp2serial = NULL;
+    newSFServer.TcpServer = NULL;
+    newSFServer.SerialDevice = NULL;
+    newSFServer.gateway = gateway;
+    newSFServer.id = ++uniqueId;
+    newSFServer.port = port;
+    newSFServer.device = device;
+    newSFServer.baudrate = baudrate;
+    if (!gateway->TcpServer->isErrorReported() && !gateway->Devices->isErrorReported() &&
+        gateway->Devices->addDevice(newSFServer.id, device, baudrate))
+    {
+        gateway->TcpServer->addChannel(newSFServer.id);
+        servers.push_back(newSFServer);
+    }
+    else
+    {
+        os << ">> FAIL: could not add device " << device << " to gateway on port " << port << endl;
+        deliverOutput();
+        if (gateway->Devices->getDeviceCount() == 0)
+        {
+            stopGatewayServer(newSFServer);
+        }
+    }
+    pthread_mutex_unlock(&sfControlInfo.lock);
+}
+
+/* called with sfControlInfo.lock held */
+void SFControl::stopGatewayServer(sfServer_t& server)
+{
+    gateway_t* gateway = server.gateway;
+    gateway->TcpServer->removeChannel(server.id);
+    gateway->Devices->removeDevice(server.id);
+    if (gateway->Devices->getDeviceCount() == 0)
+    {
+        gateway->TcpServer->cancel();
+        gateway->Devices->cancel();
+        delete gateway->TcpServer;
+        delete gateway->Devices;
+        delete gateway->tcp2serial;
+        delete gateway->serial2tcp;
+        gateways.remove(gateway);
+        delete gateway;
+    }
+}
+
 /* stops a given sf-server. returns false if specified server not running */
 bool SFControl::stopServer(int& id, int& port, string& device)
 {
@@ -243,15 +366,22 @@ bool SFControl::stopServer(int& id, int& port, string& device)
     while( (it != servers.end()) && (!found))
     {
         ++next;
-        if (((*it).SerialDevice->getDevice() == device) || ((*it).TcpServer->getPort() == port) || ((*it).id == id) )
+        if (((*it).device == device) || (((*it).gateway == NULL) && ((*it).port == port)) || ((*it).id == id) )
         {
+            // set id, port and device accordingly
+            id = (*it).id;
+            port = (*it).port;
+            device = (*it).device;
+            if ((*it).gateway != NULL)
+            {
+                stopGatewayServer(*it);
+                servers.erase(it);
+                found = true;
+                break;
+            }
             // cancel
             (*it).TcpServer->cancel();
             (*it).SerialDevice->cancel();
-            // set id, port and device accordingly
-            id = (*it).id;
-            port = (*it).TcpServer->getPort();
-            device = (*it).SerialDevice->getDevice();
             // clean up
             delete (*it).TcpServer;
             delete (*it).SerialDevice;
@@ -277,7 +407,31 @@ bool SFControl::showServerInfo(ostream& pOs, int id, int port, string device)
     while( it != servers.end() && (!found))
     {
         ++next;
-        if (((*it).SerialDevice->getDevice() == device) || ((*it).TcpServer->getPort() == port) || ((*it).id == id) )
+        if ((((*it).device == device) || ((*it).id == id)) && ((*it).gateway != NULL))
+        {
+            gateway_t* gateway = (*it).gateway;
+            pOs << ">> info for sf-server with id = " << (*it).id
+            << " ( gateway port =  " << (*it).port
+            << " , device = " << (*it).device
+            << " , baudrate = " << (*it).baudrate
+            << " )" << endl;
+            pOs << ">> ";
+            gateway->TcpServer->reportChannelStatus(pOs, (*it).id);
+            pOs << ">> ";
+            gateway->Devices->reportDeviceStatus(pOs, (*it).id);
+            pOs << ">> ";
+            gateway->TcpServer->reportStatus(pOs);
+            pOs << ">> ";
+            gateway->Devices->reportStatus(pOs);
+            pOs << ">> serial -> tcp ";
+            gateway->serial2tcp->reportStatus(pOs);
+            pOs << ">> tcp -> serial ";
+            gateway->tcp2serial->reportStatus(pOs);
+            pOs << ">> ";
+            SFPacket::reportPoolStatus(pOs);
+            found = true;
+        }
+        else if ((((*it).device == device) || ((*it).port == port) || ((*it).id == id)) && ((*it).gateway == NULL))
         {
             pOs << ">> info for sf-server with id = " << (*it).id
             << " ( port =  " << (*it).TcpServer->getPort()
@@ -288,6 +442,12 @@ bool SFControl::showServerInfo(ostream& pOs, int id, int port, string device)
             (*it).TcpServer->reportStatus(os);
             pOs << ">> ";
             (*it).SerialDevice->reportStatus(os);
+            pOs << ">> serial -> tcp ";
+            (*it).serial2tcp->reportStatus(os);
+            pOs << ">> tcp -> serial ";
+            (*it).tcp2serial->reportStatus(os);
+            pOs << ">> ";
+            SFPacket::reportPoolStatus(os);
             found = true;
         }
         it = next;
@@ -305,9 +465,9 @@ void SFControl::listServers(ostream& pOs)
     for ( it = servers.begin(); it != servers.end(); it++ )
     {
         pOs << ">> sf-server id = " << (*it).id
-        << " , port = " << (*it).TcpServer->getPort()
-        << " , device = " << (*it).SerialDevice->getDevice()
-        << " , baudrate = " << (*it).SerialDevice->getBaudRate() << endl;
+        << " , " << (((*it).gateway != NULL) ? "gateway port" : "port") << " = " << (*it).port
+        << " , device = " << (*it).device
+        << " , baudrate = " << (*it).baudrate << endl;
     }
     if (servers.size() == 0)
     {
@@ -327,7 +487,9 @@ void SFControl::parseInput(std::string arg)
 
     if (tokens[0] == "start")
     {
-        if (tokens.size() == 4)
+        PacketBuffer::overflowPolicy_t serialPolicy = PacketBuffer::cDropOldest;
+        PacketBuffer::overflowPolicy_t tcpPolicy = PacketBuffer::cBlock;
+        if ((tokens.size() >= 4) && (tokens.size() <= 7) && parsePolicies(tokens, 5, serialPolicy, tcpPolicy))
         {
             if (servers.size() < maxSFServers)
             {
@@ -340,9 +502,14 @@ void SFControl::parseInput(std::string arg)
                 stringstream helpInt;
                 int baudrate = 0;
                 int port = 0;
+                unsigned bufferSize = PacketBuffer::cDefaultCapacity;
                 helpInt << tokens[3] << " " << tokens[1];
-                helpInt >> baudrate >> port;
-                startServer(port, tokens[2], baudrate);
+                if (tokens.size() >= 5)
+                {
+                    helpInt << " " << tokens[4];
+                }
+                helpInt >> baudrate >> port >> bufferSize;
+                startServer(port, tokens[2], baudrate, bufferSize, serialPolicy, tcpPolicy);
             }
             else
             {
@@ -356,6 +523,44 @@ void SFControl::parseInput(std::string arg)
             deliverOutput();
         }
     }
+    else if (tokens[0] == "gateway")
+    {
+        PacketBuffer::overflowPolicy_t serialPolicy = PacketBuffer::cDropOldest;
+        PacketBuffer::overflowPolicy_t tcpPolicy = PacketBuffer::cBlock;
+        if ((tokens.size() >= 4) && (tokens.size() <= 7) && parsePolicies(tokens, 5, serialPolicy, tcpPolicy))
+        {
+            if (servers.size() < maxSFServers)
+            {
+                os << ">> Trying to add device with id = " << (uniqueId+1)
+                << " to gateway ( port = " << tokens[1]
+                << " , device = " << tokens[2]
+                << " , baudrate = " << tokens[3]
+                << " )" << endl;
+                deliverOutput();
+                stringstream helpInt;
+                int baudrate = 0;
+                int port = 0;
+                int workers = SerialGateway::cDefaultWorkers;
+                helpInt << tokens[3] << " " << tokens[1];
+                if (tokens.size() >= 5)
+                {
+                    helpInt << " " << tokens[4];
+                }
+                helpInt >> baudrate >> port >> workers;
+                startGatewayServer(port, tokens[2], baudrate, workers, serialPolicy, tcpPolicy);
+            }
+            else
+            {
+                os << ">> FAIL: Too many running servers (currently " << servers.size() << " servers running)" << endl;
+                deliverOutput();
+            }
+        }
+        else
+        {
+            os << getHelpMessage("gateway");
+            deliverOutput();
+        }
+    }
     else if (tokens[0] == "stop")
     {
         if (tokens.size() == 2)
@@ -409,6 +614,24 @@ void SFControl::parseInput(std::string arg)
             deliverOutput();
         }
     }
+    else if (tokens[0] == "metrics")
+    {
+        int port = 0;
+        if (tokens.size() == 2)
+        {
+            stringstream helpInt(tokens[1]);
+            helpInt >> port;
+        }
+        if (port > 0)
+        {
+            startMetricsServer(port);
+        }
+        else
+        {
+            os << getHelpMessage("metrics");
+            deliverOutput();
+        }
+    }
     else if ((tokens[0] == "close") && (controlServerStarted))
     {
         if (clientFD > 0) {
@@ -611,7 +834,20 @@ void SFControl::checkThreadCancel()
         while( it != servers.end() )
         {
             ++next;
-            if ((*it).TcpServer->isErrorReported() || (*it).SerialDevice->isErrorReported())
+            if (((*it).gateway != NULL) &&
+                ((*it).gateway->TcpServer->isErrorReported() || (*it).gateway->Devices->isErrorReported() ||
+                 (*it).gateway->Devices->isErrorReported((*it).id)))
+            {
+                os << ">> FAIL: sf-server with id = " << (*it).id
+                << " ( gateway port =  " << (*it).port
+                << " , device = " << (*it).device
+                << " ) canceled" << endl;
+                deliverOutput();
+                stopGatewayServer(*it);
+                servers.erase(it);
+            }
+            else if (((*it).gateway == NULL) &&
+                     ((*it).TcpServer->isErrorReported() || (*it).SerialDevice->isErrorReported()))
             {
                 // cancel
                 (*it).TcpServer->cancel();
@@ -654,6 +890,176 @@ void SFControl::startControlServer()
     controlServerStarted = true;
 }
 
+void SFControl::startMetricsServer(int port)
+{
+    struct sockaddr_in me;
+    int opt = 1;
+
+    if (metricsServerStarted)
+    {
+        os << ">> FAIL: metrics are already served on port " << metricsPort << endl;
+        deliverOutput();
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&me, 0, sizeof me);
+    me.sin_family = AF_INET;
+    me.sin_port = htons(port);
+    // metrics are for the local Prometheus server (or a local proxy) only
+    me.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((fd < 0) ||
+        (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0) ||
+        (bind(fd, (struct sockaddr *)&me, sizeof me) < 0) ||
+        (listen(fd, 4) < 0))
+    {
+        os << ">> FAIL: could not serve metrics on port " << port << " ( " << strerror(errno) << " )" << endl;
+        deliverOutput();
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    metricsFD = fd;
+    metricsPort = port;
+    if (pthread_create(&metricsThread, NULL, serveMetricsThread, this) != 0)
+    {
+        os << ">> FAIL: could not start the metrics thread" << endl;
+        deliverOutput();
+        close(metricsFD);
+        metricsFD = -1;
+        return;
+    }
+    metricsServerStarted = true;
+    os << ">> serving metrics on http://127.0.0.1:" << port << "/metrics" << endl;
+    deliverOutput();
+}
+
+void* serveMetricsThread(void* ob)
+{
+    static_cast<SFControl*>(ob)->serveMetrics();
+    return NULL;
+}
+
+/* one request per connection (HTTP/1.0), only GET /metrics is answered */
+void SFControl::serveMetrics()
+{
+    bool errorLogged = false;
+    while (true)
+    {
+        int fd = accept(metricsFD, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // e.g. out of fds: log once per run of errors and do not spin
+            if (!errorLogged)
+            {
+                cerr << "error : SF-Control-Server : accept(metricsFD, NULL, NULL)" << endl
+                     << "error-description : " << strerror(errno) << endl;
+                errorLogged = true;
+            }
+            usleep(metricsErrorBackoff);
+            continue;
+        }
+        errorLogged = false;
+        // a stuck client must not stall the scrapes of the others for long
+        struct timeval timeout;
+        timeout.tv_sec = 2;
+        timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos)
+        {
+            int n = read(fd, buffer, sizeof(buffer));
+            if ((n <= 0) || (request.size() > 8192))
+            {
+                break;
+            }
+            request.append(buffer, n);
+        }
+
+        ostringstream response;
+        if ((request.compare(0, 13, "GET /metrics ") == 0) ||
+            (request.compare(0, 14, "GET /metrics?") == 0))
+        {
+            ostringstream body;
+            reportMetrics(body);
+            response << "HTTP/1.0 200 OK\r\n"
+                     << "Content-Type: text/plain; version=0.0.4\r\n"
+                     << "Content-Length: " << body.str().size() << "\r\n\r\n"
+                     << body.str();
+        }
+        else
+        {
+            response << "HTTP/1.0 404 Not Found\r\n"
+                     << "Content-Type: text/plain\r\n\r\n"
+                     << "metrics are served on /metrics\n";
+        }
+        string data = response.str();
+        const char* bufPtr = data.c_str();
+        int length = data.size();
+        while (length > 0)
+        {
+#ifdef __APPLE__
+            int n = send(fd, bufPtr, length, 0);
+#else
+            int n = send(fd, bufPtr, length, MSG_NOSIGNAL);
+#endif
+            if (n <= 0)
+            {
+                break;
+            }
+            length -= n;
+            bufPtr += n;
+        }
+        close(fd);
+    }
+}
+
+/* collects the metrics of all sf-servers, labelled with their id, port
+   and device as listed by "list" */
+void SFControl::reportMetrics(ostream& pOs)
+{
+    Metrics metrics;
+    pthread_mutex_lock(&sfControlInfo.lock);
+    metrics.gauge("sf_servers", "Running sf-servers, gateway devices included", "", servers.size());
+    list<sfServer_t>::iterator it;
+    for (it = servers.begin(); it != servers.end(); it++)
+    {
+        string labels = Metrics::label("id", (*it).id) + ","
+            + Metrics::label("port", (*it).port) + ","
+            + Metrics::label("device", (*it).device);
+        if ((*it).gateway != NULL)
+        {
+            (*it).gateway->Devices->reportDeviceMetrics(metrics, (*it).id, labels);
+            (*it).gateway->TcpServer->reportChannelMetrics(metrics, (*it).id, labels);
+            continue;
+        }
+        (*it).TcpServer->reportMetrics(metrics, labels);
+        (*it).SerialDevice->reportMetrics(metrics, labels);
+        (*it).serial2tcp->reportMetrics(metrics, labels + "," + Metrics::label("direction", "serial_to_tcp"));
+        (*it).tcp2serial->reportMetrics(metrics, labels + "," + Metrics::label("direction", "tcp_to_serial"));
+    }
+    list<gateway_t*>::iterator gateway;
+    for (gateway = gateways.begin(); gateway != gateways.end(); gateway++)
+    {
+        string labels = Metrics::label("port", (*gateway)->port);
+        (*gateway)->TcpServer->reportMetrics(metrics, labels);
+        (*gateway)->Devices->reportMetrics(metrics, labels);
+        (*gateway)->serial2tcp->reportMetrics(metrics, labels + "," + Metrics::label("direction", "serial_to_tcp"));
+        (*gateway)->tcp2serial->reportMetrics(metrics, labels + "," + Metrics::label("direction", "tcp_to_serial"));
+    }
+    pthread_mutex_unlock(&sfControlInfo.lock);
+    SFPacket::reportPoolMetrics(metrics);
+    metrics.write(pOs);
+}
+
 void SFControl::deliverOutput()
 {
     if (!(clientFD < 0))
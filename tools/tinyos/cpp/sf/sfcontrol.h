@@ -37,7 +37,9 @@
 #include "packetbuffer.h"
 #include "tcpcomm.h"
 #include "serialcomm.h"
+#include "serialgateway.h"
 #include "pthread.h"
+#include <list>
 #include <vector>
 #include <string>
 
@@ -45,13 +47,29 @@ class SFControl
 {
 protected:
 
+    // many devices behind one multiplexed TCP port
+    typedef struct
+    {
+        PacketBuffer* serial2tcp;
+        PacketBuffer* tcp2serial;
+        TCPComm* TcpServer;
+        SerialGateway* Devices;
+        int port;
+    }
+    gateway_t;
+
     typedef struct
     {
         PacketBuffer* serial2tcp;
         PacketBuffer* tcp2serial;
         TCPComm* TcpServer;
         SerialComm* SerialDevice;
+        /* set instead of the four above for a device of a gateway */
+        gateway_t* gateway;
         int id;
+        int port;
+        std::string device;
+        int baudrate;
     }
     sfServer_t;
 
@@ -64,6 +82,12 @@ protected:
     /* max. allowed sf-servers */
     static const unsigned int maxSFServers = 512;
 
+    /* running gateways */
+    std::list<gateway_t*> gateways;
+
+    /* packets queued in each direction of a gateway, shared by its devices */
+    static const unsigned int gatewayBufferSize = 4096;
+
     /* pthread for thread cancel notification */
     pthread_t cancelThread;
 
@@ -88,10 +112,23 @@ protected:
     /* control-client fd */
     int clientFD;
 
+    /* metrics server, serves GET /metrics on localhost */
+    bool metricsServerStarted;
+
+    int metricsPort;
+
+    int metricsFD;
+
+    pthread_t metricsThread;
+
+    /* pause of the metrics thread after accept() failed, in us */
+    static const int metricsErrorBackoff = 500 * 1000;
+
     /* string stream for multiplexing output (cout and control-client) */
     std::ostringstream os;
 
     friend void* checkCancelThread(void* ob);
+    friend void* serveMetricsThread(void* ob);
 
     /* needed for id generation */
     int uniqueId;
@@ -128,7 +165,22 @@ protected:
     bool readFromClient(std::string& message);
 
     /* starts a sf-server */
-    void startServer(int port, std::string device, int baudrate);
+    void startServer(int port, std::string device, int baudrate, unsigned bufferSize = PacketBuffer::cDefaultCapacity,
+                     PacketBuffer::overflowPolicy_t serialPolicy = PacketBuffer::cDropOldest,
+                     PacketBuffer::overflowPolicy_t tcpPolicy = PacketBuffer::cBlock);
+
+    /* adds a device to the gateway on port, starts the gateway if needed,
+       the policies only apply when it is started */
+    void startGatewayServer(int port, std::string device, int baudrate, int workers,
+                            PacketBuffer::overflowPolicy_t serialPolicy = PacketBuffer::cDropOldest,
+                            PacketBuffer::overflowPolicy_t tcpPolicy = PacketBuffer::cBlock);
+
+    /* reads the optional policies from tokens[pFirst] on, false if one is unknown */
+    bool parsePolicies(const std::vector<std::string>& tokens, unsigned pFirst,
+                       PacketBuffer::overflowPolicy_t& serialPolicy, PacketBuffer::overflowPolicy_t& tcpPolicy);
+
+    /* removes a gateway device, stops the gateway with its last device */
+    void stopGatewayServer(sfServer_t& server);
 
     /* stops a given sf-server. returns false if specified server not running */
     bool stopServer(int& id, int& port, std::string& device);
@@ -139,6 +191,15 @@ protected:
     /* lists all running servers */
     void listServers(std::ostream& pOs);
 
+    /* starts the metrics server on localhost:port */
+    void startMetricsServer(int port);
+
+    /* answers http requests for metrics - metrics thread */
+    void serveMetrics();
+
+    /* writes the metrics of all sf-servers in the Prometheus text format */
+    void reportMetrics(std::ostream& pOs);
+
     /* send output to console and/or to connected control client */
     void deliverOutput();
 
@@ -32,38 +32,125 @@
 
 #include "sfpacket.h"
 #include <cstring>
+#include <pthread.h>
+
+/* payload blocks are allocated in chunks and never given back */
+static const int cPoolChunkSize = 64;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static void *poolFree = NULL;
+static unsigned long poolBlocks = 0;
+static unsigned long poolUsed = 0;
+static unsigned long poolMaxUsed = 0;
+
+SFPacket::payload_t* SFPacket::allocPayload()
+{
+    pthread_mutex_lock(&poolLock);
+    if (poolFree == NULL)
+    {
+        payload_t *chunk = new payload_t[cPoolChunkSize];
+        for (int i = 0; i < cPoolChunkSize; i++)
+        {
+            chunk[i].next = (i + 1 < cPoolChunkSize) ? &chunk[i + 1] : NULL;
+        }
+        poolFree = chunk;
+        poolBlocks += cPoolChunkSize;
+    }
+    payload_t *payload = static_cast<payload_t*>(poolFree);
+    poolFree = payload->next;
+    if (++poolUsed > poolMaxUsed)
+    {
+        poolMaxUsed = poolUsed;
+    }
+    pthread_mutex_unlock(&poolLock);
+    payload->refs = 1;
+    return payload;
+}
+
+void SFPacket::releasePayload(payload_t *pPayload)
+{
+    if (pPayload && (__atomic_sub_fetch(&pPayload->refs, 1, __ATOMIC_ACQ_REL) == 0))
+    {
+        pthread_mutex_lock(&poolLock);
+        pPayload->next = static_cast<payload_t*>(poolFree);
+        poolFree = pPayload;
+        --poolUsed;
+        pthread_mutex_unlock(&poolLock);
+    }
+}
 
 SFPacket::SFPacket(int pType, int pSeqno) {
-    length = 0;
+    data = NULL;
     seqno = pSeqno;
     type = pType;
+    channel = 0;
 }
 
-// copy constructor
+// copy constructor, shares the payload
 SFPacket::SFPacket(const SFPacket &pPacket) {
-    length = pPacket.getLength();
     type = pPacket.getType();
     seqno = pPacket.getSeqno();
-    setPayload(pPacket.getPayload(), length);
+    channel = pPacket.channel;
+    data = pPacket.data;
+    if (data)
+    {
+        __atomic_add_fetch(&data->refs, 1, __ATOMIC_RELAXED);
+    }
 }
 
 SFPacket::~SFPacket()
 {
-    // if (buffer) delete[] buffer;
+    releasePayload(data);
+}
+
+SFPacket& SFPacket::operator=(const SFPacket &pPacket)
+{
+    if (pPacket.data)
+    {
+        __atomic_add_fetch(&pPacket.data->refs, 1, __ATOMIC_RELAXED);
+    }
+    releasePayload(data);
+    data = pPacket.data;
+    type = pPacket.getType();
+    seqno = pPacket.getSeqno();
+    channel = pPacket.channel;
+    return *this;
+}
+
+void SFPacket::swap(SFPacket &pPacket)
+{
+    payload_t *d = data;
+    int t = type;
+    int s = seqno;
+    int c = channel;
+    data = pPacket.data;
+    type = pPacket.type;
+    seqno = pPacket.seqno;
+    channel = pPacket.channel;
+    pPacket.data = d;
+    pPacket.type = t;
+    pPacket.seqno = s;
+    pPacket.channel = c;
 }
 
 const char* SFPacket::getPayload() const
 {
-    if(((type == SF_PACKET_ACK) || (type == SF_PACKET_NO_ACK))) {
-        return buffer + 1;
+    if(data && hasPayload()) {
+        return data->buffer + 1;
     }
     else {
         return NULL;
     }
 }
 
+/* data packets carry a payload, acks and sync frames do not */
+bool SFPacket::hasPayload() const
+{
+    return (type == SF_PACKET_ACK) || (type == SF_PACKET_NO_ACK) || (type == SF_PACKET_WINDOW);
+}
+
 int SFPacket::getLength() const {
-    return length;
+    return data ? data->length : 0;
 }
 
 int SFPacket::getType() const
@@ -78,16 +165,44 @@ int SFPacket::getSeqno() const
 
 bool SFPacket::setPayload(const char* pBuffer, uint8_t pLength)
 {
-    if ((pLength > 0) && (pLength < cMaxPacketLength) && ((type == SF_PACKET_ACK) || (type == SF_PACKET_NO_ACK)))
+    if ((pLength > 0) && (pLength < cMaxPacketLength) && hasPayload())
     {
-        length = pLength;
-        memcpy(buffer + 1, pBuffer, pLength);
+        payload_t *payload = allocPayload();
+        payload->length = pLength;
+        payload->arrival = 0;
+        payload->buffer[0] = pLength;
+        memcpy(payload->buffer + 1, pBuffer, pLength);
+        releasePayload(data);
+        data = payload;
         return true;
     }
     DEBUG("SFPACKET::setPayload : wrong packet length = " << static_cast<int>(pLength) << " or type = " << type)
     return false;
 }
 
+void SFPacket::setArrival(long long pArrival)
+{
+    if (data)
+    {
+        data->arrival = pArrival;
+    }
+}
+
+long long SFPacket::getArrival() const
+{
+    return data ? data->arrival : 0;
+}
+
+void SFPacket::setChannel(int pChannel)
+{
+    channel = pChannel;
+}
+
+int SFPacket::getChannel() const
+{
+    return channel;
+}
+
 void SFPacket::setSeqno(int pSeqno)
 {
     seqno = pSeqno;
@@ -107,9 +222,9 @@ int const SFPacket::getMaxPayloadLength()
 bool SFPacket::operator==(SFPacket const& pPacket)
 {
     bool retval=false;
-    if((pPacket.getType() == type) && (pPacket.getLength() == length) && (pPacket.getSeqno() == seqno)) {
-        if((type == SF_PACKET_ACK) || (type == SF_PACKET_NO_ACK)) {
-            retval = (memcmp(pPacket.getPayload(), getPayload(), length) == 0);
+    if((pPacket.getType() == type) && (pPacket.getLength() == getLength()) && (pPacket.getSeqno() == seqno)) {
+        if(hasPayload()) {
+            retval = (pPacket.data == data) || (memcmp(pPacket.getPayload(), getPayload(), getLength()) == 0);
         }
     }
     return retval;
@@ -117,13 +232,30 @@ bool SFPacket::operator==(SFPacket const& pPacket)
 
     /* return the length that shall be transmitted via TCP */
 int SFPacket::getTcpLength() const {
-    return length + 1;
+    return getLength() + 1;
+}
+
+/* return the payload of the TCP packet, the length byte is set by setPayload */
+const char* SFPacket::getTcpPayload() const {
+    return data ? data->buffer : NULL;
 }
 
-/* return the payload of the TCP packet */
-const char* SFPacket::getTcpPayload() {
-    char l = length;
-    buffer[0] = l;
-    return buffer;
+/* prints out statistics of the payload pool */
+void SFPacket::reportPoolStatus(std::ostream& os)
+{
+    pthread_mutex_lock(&poolLock);
+    os << "SFPacket pool : blocks = " << poolBlocks
+       << " , in use = " << poolUsed
+       << " ( max = " << poolMaxUsed << " )" << std::endl;
+    pthread_mutex_unlock(&poolLock);
 }
 
+/* exports the statistics of reportPoolStatus */
+void SFPacket::reportPoolMetrics(Metrics& pMetrics)
+{
+    pthread_mutex_lock(&poolLock);
+    pMetrics.gauge("sf_packet_pool_blocks", "Payload blocks allocated", "", poolBlocks);
+    pMetrics.gauge("sf_packet_pool_used_blocks", "Payload blocks in use", "", poolUsed);
+    pMetrics.gauge("sf_packet_pool_max_used_blocks", "Payload blocks in use at most", "", poolMaxUsed);
+    pthread_mutex_unlock(&poolLock);
+}
@@ -47,6 +47,7 @@
 #include <stdint.h>
 
 #include "serialprotocol.h"
+#include "metrics.h"
 enum {
   SYNC_BYTE = SERIAL_HDLC_FLAG_BYTE,
   ESCAPE_BYTE = SERIAL_HDLC_CTLESC_BYTE,
@@ -54,9 +55,19 @@ enum {
   SF_ACK = SERIAL_SERIAL_PROTO_ACK,
   SF_PACKET_ACK = SERIAL_SERIAL_PROTO_PACKET_ACK,
   SF_PACKET_NO_ACK = SERIAL_SERIAL_PROTO_PACKET_NOACK,
+  SF_WINDOW_SYNC = SERIAL_SERIAL_PROTO_WINDOW_SYNC,
+  SF_PACKET_WINDOW = SERIAL_SERIAL_PROTO_PACKET_WINDOW,
+  SF_WINDOW_ACK = SERIAL_SERIAL_PROTO_WINDOW_ACK,
   SF_UNKNOWN = SERIAL_SERIAL_PROTO_PACKET_UNKNOWN
 };
 
+/*
+ * A packet is a small handle: type and seqno belong to the handle, the
+ * payload lives in a reference counted block from a shared pool. Copying
+ * a packet (into a PacketBuffer, into the queue of every TCP client) only
+ * takes a reference. The payload is never modified once it is set,
+ * setPayload() always attaches a fresh block.
+ */
 class SFPacket{
 
 
@@ -66,19 +77,40 @@ public:
 
 /** member vars **/
 protected:
-    /* internal buffer */
-    char buffer[cMaxPacketLength + 1];
-    
-    /* length of byte buffer */
-    int length;
+    typedef struct payload
+    {
+        /* number of packets referring to this block */
+        int refs;
+        /* length of the payload */
+        int length;
+        /* time the payload arrived on the serial line in ns, 0 if unknown */
+        long long arrival;
+        /* length byte (TCP framing) followed by the payload */
+        char buffer[cMaxPacketLength + 1];
+        /* next free block while in the pool */
+        struct payload *next;
+    } payload_t;
+
+    /* shared payload, NULL for packets without payload */
+    payload_t *data;
     /* type */
     int type;
     /* sequence number */
     int seqno;
+    /* gateway device the packet comes from or goes to, 0 outside a gateway */
+    int channel;
 
 
 /** member functions **/
 protected:
+    /* takes a block from the pool (refs = 1) */
+    static payload_t* allocPayload();
+
+    /* drops a reference, the last one returns the block to the pool */
+    static void releasePayload(payload_t *pPayload);
+
+    /* true for packet types that carry a payload */
+    bool hasPayload() const;
 
 public:
     SFPacket(int type = SF_PACKET_ACK, int pSeqno = 0);
@@ -87,6 +119,11 @@ public:
 
     SFPacket(const SFPacket &pPacket);
 
+    SFPacket& operator=(const SFPacket &pPacket);
+
+    /* exchanges two packets without touching reference counts */
+    void swap(SFPacket &pPacket);
+
     /* returns buffer */
     const char* getPayload() const;
 
@@ -96,8 +133,8 @@ public:
     /* return the length that shall be transmitted via TCP */
     int getTcpLength() const;
 
-    /* return the payload of the TCP packet */
-    const char* getTcpPayload();
+    /* return the payload of the TCP packet (length byte + payload) */
+    const char* getTcpPayload() const;
     
     /* returns the seqno of this packet */
     int getSeqno() const;
@@ -114,11 +151,29 @@ public:
     /* sets the type */
     void setType(int pType);
 
+    /* sets the arrival time (see LatencyHistogram::now), after setPayload */
+    void setArrival(long long pArrival);
+
+    /* returns the arrival time, 0 if unknown */
+    long long getArrival() const;
+
+    /* sets the gateway device id */
+    void setChannel(int pChannel);
+
+    /* returns the gateway device id */
+    int getChannel() const;
+
     /* returns max payload length */
     static const int getMaxPayloadLength();
 
     /* == operator */
     bool operator==(SFPacket const& pPacket);
+
+    /* prints out statistics of the payload pool */
+    static void reportPoolStatus(std::ostream& os);
+
+    /* adds the statistics of the payload pool */
+    static void reportPoolMetrics(Metrics& pMetrics);
 };
 
 #endif
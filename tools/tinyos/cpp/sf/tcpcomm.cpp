@@ -47,29 +47,47 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
 
+#ifdef __APPLE__
+#define SF_SEND_FLAGS 0
+#else
+#define SF_SEND_FLAGS MSG_NOSIGNAL
+#endif
 
 using namespace std;
 
 /* forward declarations of pthrad helper functions*/
-void* checkClientsThread(void*);
-void* readClientsThread(void*);
+void* serveClientsThread(void*);
 void* writeClientsThread(void*);
 
 /* opens tcp server port for listening and start threads*/
-TCPComm::TCPComm(int pPort, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl) : readBuffer(pReadBuffer), writeBuffer(pWriteBuffer), errorReported(false), errorMsg(""), control(pControl)
+TCPComm::TCPComm(int pPort, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl, lagPolicy_t pLagPolicy, bool pMultiplexed) : readBuffer(pReadBuffer), writeBuffer(pWriteBuffer), errorReported(false), errorMsg(""), control(pControl)
 {   
     // init values
     writerThreadRunning = false;
-    readerThreadRunning = false;
     serverThreadRunning = false;
     clientInfo.count = 0;
-    clientInfo.FDs.clear();
+    clientInfo.queues.clear();
+    clientInfo.wakeupPending = false;
     readPacketCount = 0;
+    droppedReadPacketCount = 0;
     writtenPacketCount = 0;
+    droppedWritePacketCount = 0;
+    laggingClientCount = 0;
+    lagPolicy = pLagPolicy;
+    multiplexed = pMultiplexed;
     port = pPort;
+    serverFD = -1;
+    pollFD = -1;
+    wakeFDs[0] = wakeFDs[1] = -1;
     
-    pthread_mutex_init(&clientInfo.sleeplock, NULL);
     pthread_mutex_init(&clientInfo.countlock, NULL);
     pthread_cond_init(&clientInfo.wakeup, NULL);
 
@@ -77,16 +95,35 @@ TCPComm::TCPComm(int pPort, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffe
     int opt;
     int rxBuf = 1024;
 
-    /* create pipe to inform client reader of new clients */
+#ifdef __linux__
+    /* create epoll instance for the client event loop */
+    if (!errorReported) {
+        pollFD = reportError("TCPComm::TCPComm : epoll_create(cMaxEvents)",
+                             epoll_create(cMaxEvents));
+    }
+    /* create eventfd through which the writer thread wakes the event loop */
+    if (!errorReported) {
+        wakeFDs[0] = wakeFDs[1] = reportError("TCPComm::TCPComm : eventfd(0, EFD_NONBLOCK)",
+                                              eventfd(0, EFD_NONBLOCK));
+    }
+#else
+    /* create pipe through which the writer thread wakes the event loop */
+    if (!errorReported) {
+        reportError("TCPComm::TCPComm : pipe(wakeFDs)", pipe(wakeFDs));
+    }
     if (!errorReported) {
-        int pipeFDPair[2];
-        reportError("TCPComm::TCPComm : pipe(pipeFDPair)", pipe(pipeFDPair));
-        pipeWriteFD = pipeFDPair[1];
-        pipeReadFD = pipeFDPair[0];
+        reportError("TCPComm::TCPComm : fcntl(wakeFDs[0], F_SETFL, O_NONBLOCK)",
+                    fcntl(wakeFDs[0], F_SETFL, O_NONBLOCK));
     }
     if (!errorReported) {
-        reportError("TCPComm::TCPComm : fcntl(pipeReadFD, F_SETFL, O_NONBLOCK);",
-                    fcntl(pipeReadFD, F_SETFL, O_NONBLOCK));
+        reportError("TCPComm::TCPComm : fcntl(wakeFDs[1], F_SETFL, O_NONBLOCK)",
+                    fcntl(wakeFDs[1], F_SETFL, O_NONBLOCK));
+    }
+#endif
+    if (!errorReported) {
+        if (!watchFD(wakeFDs[0], false)) {
+            reportError("TCPComm::TCPComm : watchFD(wakeFDs[0], false)", -1);
+        }
     }
     /* create server socket where clients connect */
     if (!errorReported) {
@@ -106,27 +143,31 @@ TCPComm::TCPComm(int pPort, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffe
         reportError("TCPComm::TCPComm : setsockopt(serverFD, SOL_SOCKET, SO_RCVBUF, (char *)&rxBuf, sizeof(rxBuf))",
                     setsockopt(serverFD, SOL_SOCKET, SO_RCVBUF, (char *)&rxBuf, sizeof(rxBuf)));
     }
+    if (!errorReported) {
+        reportError("TCPComm::TCPComm : fcntl(serverFD, F_SETFL, O_NONBLOCK)",
+                    fcntl(serverFD, F_SETFL, O_NONBLOCK));
+    }
     if (!errorReported) {
         reportError("TCPComm::TCPComm : bind(serverFD, (struct sockaddr *)&me, sizeof me)",
                     bind(serverFD, (struct sockaddr *)&me, sizeof me));
     }
     if (!errorReported) {
-        reportError("TCPComm::TCPComm : listen(serverFD, 5)",
-                    listen(serverFD, 5));
+        reportError("TCPComm::TCPComm : listen(serverFD, SOMAXCONN)",
+                    listen(serverFD, SOMAXCONN));
+    }
+    if (!errorReported) {
+        if (!watchFD(serverFD, false)) {
+            reportError("TCPComm::TCPComm : watchFD(serverFD, false)", -1);
+        }
     }
 
-    // start thread for server socket (adding and removing clients)
+    // start thread for the client event loop (accepting and reading clients)
     if (!errorReported)
     {
-        if (reportError("TCPComm::TCPComm : pthread_create( &serverThread, NULL, checkClientsThread, this)",
-                        pthread_create( &serverThread, NULL, checkClientsThread, this)) == 0) {
+        if (reportError("TCPComm::TCPComm : pthread_create( &serverThread, NULL, serveClientsThread, this)",
+                        pthread_create( &serverThread, NULL, serveClientsThread, this)) == 0) {
             serverThreadRunning = true;
         }
-        // start thread for reading from client connections
-        if (reportError("TCPComm::TCPComm : pthread_create( &readerThread, NULL, readClientsThread, this)",
-                        pthread_create( &readerThread, NULL, readClientsThread, this)) == 0) {
-            readerThreadRunning = true;
-        }
         // start thread for writing to client connections
         if (reportError("TCPComm::TCPComm : pthread_create( &writerThread, NULL, writeClientsThread, this)",
                         pthread_create( &writerThread, NULL, writeClientsThread, this)) == 0) {
@@ -140,15 +181,15 @@ TCPComm::~TCPComm()
 {
     cancel();
 
-    close(serverFD);
-    set<int>::iterator it;
-    for( it = clientInfo.FDs.begin(); it != clientInfo.FDs.end(); it++ )
+    if (serverFD >= 0) close(serverFD);
+    clientStates_t::iterator it;
+    for( it = clientStates.begin(); it != clientStates.end(); it++ )
     {
-        close(*it);
+        close(it->first);
     }
-    close(pipeWriteFD);
-    close(pipeReadFD);
-    pthread_mutex_destroy(&clientInfo.sleeplock);
+    if (pollFD >= 0) close(pollFD);
+    if (wakeFDs[0] >= 0) close(wakeFDs[0]);
+    if ((wakeFDs[1] >= 0) && (wakeFDs[1] != wakeFDs[0])) close(wakeFDs[1]);
     pthread_mutex_destroy(&clientInfo.countlock);
     pthread_cond_destroy(&clientInfo.wakeup);
 }
@@ -158,106 +199,36 @@ int TCPComm::getPort()
     return port;
 }
 
-/* reads packet */
-bool TCPComm::readPacket(int pFD, SFPacket &pPacket)
-{
-    char l;
-    char* buffer[SFPacket::getMaxPayloadLength()];
-    int err;
-    
-    if (readFD(pFD, &l, 1, &err) != 1)
-    {
-        return false;
-    }
-    if (l > SFPacket::getMaxPayloadLength())
-    {
-        return false;
-    }
-    if (readFD(pFD, (char*) buffer, static_cast<int>(l), &err) != l)
-    {
-        return false;
-    }
-    if (pPacket.setPayload((char*)buffer ,l))
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
-}
-
-int TCPComm::writeFD(int fd, const char *buffer, int count, int *err)
-{
-    int actual = 0;
-    while (count > 0)
-    {
-#ifdef __APPLE__
-        int n = send(fd, buffer, count, 0);
-#else
-        int n = send(fd, buffer, count, MSG_NOSIGNAL);
-#endif
-        if (n == -1) {
-            *err = errno;
-            return -1;
-        }
-        count -= n;
-        actual += n;
-        buffer += n;
-    }
-    return actual;
-}
-
-/* writes packet */
-bool TCPComm::writePacket(int pFD, SFPacket &pPacket)
-{
-    int len = pPacket.getTcpLength();
-    int err;
-    return (writeFD(pFD, pPacket.getTcpPayload(), len, &err) == len);
-}
-
 /* checks for correct version of SF protocol */
-bool TCPComm::versionCheck(int clientFD)
+int TCPComm::versionCheck(const char *check)
 {
-    char check[2], us[2];
     int version;
-    int err = 0;
-    /* Indicate version and check if a TinyOS 2.0 serial forwarder on the other end */
-    us[0] = 'U';
-    us[1] = ' ';
-    
-    if (writeFD(clientFD, us, 2, &err) != 2)
-    {
-        return false;
-    }
-    if (readFD(clientFD, check, 2, &err) != 2)
-    {
-        return false;
-    }
+    /* check if a TinyOS 2.0 serial forwarder is on the other end */
     if (check[0] != 'U')
     {
-        return false;
+        return -1;
     }
 
     version = check[1];
-    if (us[1] < version)
+    if (SF_FILTER_VERSION < version)
     {
-        version = us[1];
+        version = SF_FILTER_VERSION;
     }
     /* Add other cases here for later protocol versions */
     switch (version)
     {
     case ' ':
+    case SF_FILTER_VERSION:
         break;
     default:
-        return false;
+        return -1;
     }
 
-    return true;
+    return version;
 }
 
-/* adds a client to the client list and wakes up all threads */
-void TCPComm::addClient(int clientFD)
+/* adds a client to the client list and wakes up the writer thread */
+void TCPComm::addClient(int clientFD, int channel, const sf_filter &filter)
 {
     DEBUG("TCPComm::addClient : lock")
     pthread_testcancel();
@@ -268,32 +239,43 @@ void TCPComm::addClient(int clientFD)
         wakeupClientThreads = true;
     }
     ++clientInfo.count;
-    clientInfo.FDs.insert(clientFD);
+    clientQueue_t &queue = clientInfo.queues[clientFD];
+    queue.packets.clear();
+    queue.offset = 0;
+    queue.writable = true;
+    queue.lagging = false;
+    queue.channel = channel;
+    queue.closed = false;
+    queue.filter = filter;
+    queue.written = 0;
+    queue.dropped = 0;
+    queue.filtered = 0;
+    queue.maxLag = 0;
     if (wakeupClientThreads)
     {
         pthread_cond_broadcast( &clientInfo.wakeup );
     }
     pthread_mutex_unlock( &clientInfo.countlock );
-    stuffPipe();
     DEBUG("TCPComm::addClient : unlock")
 }
 
+/* must only be called by the event loop, which owns the client sockets */
 void TCPComm::removeClient(int clientFD)
 {
     DEBUG("TCPComm::removeClient : lock")
     pthread_testcancel();
     pthread_mutex_lock( &clientInfo.countlock );
-    if (clientInfo.count > 0)
+    if (clientInfo.queues.erase(clientFD) > 0)
     {
-        clientInfo.FDs.erase(clientFD);
-        if (close(clientFD) != 0)
-        {
-            DEBUG("TCPComm::removeClient : error closing fd " << clientFD)
-        }
-        else
-        {
-            --clientInfo.count;
-        }
+        --clientInfo.count;
+    }
+    clientStates.erase(clientFD);
+#ifdef __linux__
+    epoll_ctl(pollFD, EPOLL_CTL_DEL, clientFD, NULL);
+#endif
+    if (close(clientFD) != 0)
+    {
+        DEBUG("TCPComm::removeClient : error closing fd " << clientFD)
     }
     if (clientInfo.count == 0)
     {
@@ -301,108 +283,517 @@ void TCPComm::removeClient(int clientFD)
         writeBuffer.clear();
     }
     pthread_mutex_unlock( &clientInfo.countlock );
-    stuffPipe();
     DEBUG("TCPComm::removeClient : unlock")
 }
 
-/* helper function to start server pthread */
-void* checkClientsThread(void* ob)
+bool TCPComm::watchFD(int fd, bool output)
+{
+#ifdef __linux__
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET | (output ? EPOLLOUT : 0);
+    event.data.fd = fd;
+    return (epoll_ctl(pollFD, EPOLL_CTL_ADD, fd, &event) == 0);
+#else
+    // poll() set is rebuilt from serverFD, wakeFDs and clientStates on every wait
+    return true;
+#endif
+}
+
+int TCPComm::waitForEvents(vector<int> &readyFDs)
+{
+    readyFDs.clear();
+#ifdef __linux__
+    struct epoll_event events[cMaxEvents];
+    int n = epoll_wait(pollFD, events, cMaxEvents, -1);
+    for (int i = 0; i < n; i++)
+    {
+        readyFDs.push_back(events[i].data.fd);
+    }
+#else
+    vector<struct pollfd> pfds;
+    struct pollfd pfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfd.fd = serverFD;
+    pfds.push_back(pfd);
+    pfd.fd = wakeFDs[0];
+    pfds.push_back(pfd);
+    pthread_mutex_lock( &clientInfo.countlock );
+    clientStates_t::iterator it;
+    for (it = clientStates.begin(); it != clientStates.end(); it++)
+    {
+        clientQueues_t::iterator queue = clientInfo.queues.find(it->first);
+        pfd.fd = it->first;
+        pfd.events = POLLIN;
+        if ((queue != clientInfo.queues.end()) && !queue->second.writable)
+        {
+            pfd.events |= POLLOUT;
+        }
+        pfds.push_back(pfd);
+    }
+    pthread_mutex_unlock( &clientInfo.countlock );
+    int n = poll(&pfds[0], pfds.size(), -1);
+    for (unsigned i = 0; (n > 0) && (i < pfds.size()); i++)
+    {
+        if (pfds[i].revents != 0)
+        {
+            readyFDs.push_back(pfds[i].fd);
+        }
+    }
+#endif
+    return n;
+}
+
+/* helper function to start the client event loop pthread */
+void* serveClientsThread(void* ob)
 {
-    static_cast<TCPComm*>(ob)->connectClients();
+    static_cast<TCPComm*>(ob)->serveClients();
     return NULL;
 }
 
-/* checks for new connected clients */
-void TCPComm::connectClients()
+/* accepts new clients and sends them our protocol version */
+void TCPComm::acceptClients()
 {
     while (true)
     {
         int clientFD = accept(serverFD, NULL, NULL);
-	pthread_testcancel();
-        if (clientFD >= 0)
+        if (clientFD < 0)
         {
-            if (versionCheck(clientFD))
+            if ((errno == EINTR) || (errno == ECONNABORTED))
             {
-                addClient(clientFD);
+                continue;
             }
-            else
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
             {
-                close(clientFD);
+                reportError("TCPComm::acceptClients : accept(serverFD, NULL, NULL)", -1);
             }
+            return;
+        }
+        /* Indicate version; the socket buffer of a new connection always has room */
+        const char us[2] = { 'U', SF_FILTER_VERSION };
+        if ((fcntl(clientFD, F_SETFL, O_NONBLOCK) != 0) ||
+            (send(clientFD, us, 2, SF_SEND_FLAGS) != 2) || !watchFD(clientFD, true))
+        {
+            close(clientFD);
+            continue;
+        }
+        clientState_t &client = clientStates[clientFD];
+        client.versionChecked = false;
+        client.channel = 0;
+        client.filterPending = false;
+        client.count = 0;
+    }
+}
+
+/* reads until the (non-blocking) socket is drained */
+bool TCPComm::readClient(int clientFD, clientState_t &client)
+{
+    char data[cReadChunkSize];
+    while (true)
+    {
+        int n = recv(clientFD, data, sizeof(data), 0);
+        if (n > 0)
+        {
+            if (!processClientData(clientFD, client, data, n, LatencyHistogram::now()))
+            {
+                return false;
+            }
+        }
+        else if (n == 0)
+        {
+            return false;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
         }
         else
         {
-            pthread_testcancel();
-            cancel();
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
         }
     }
 }
 
-/* helper function to start client reader pthread */
-void* readClientsThread(void* ob)
+/* a client sends its two version bytes, then packets consisting of a
+   length byte followed by that many payload bytes. The first packets of a
+   client may select its gateway device and its filter. */
+bool TCPComm::processClientData(int clientFD, clientState_t &client, const char *data, int count, long long pArrival)
 {
-    static_cast<TCPComm*>(ob)->readClients();
-    return NULL;
+    while (count > 0)
+    {
+        int needed;
+        if (!client.versionChecked)
+        {
+            needed = 2;
+        }
+        else if (client.count == 0)
+        {
+            needed = 1;
+        }
+        else
+        {
+            needed = 1 + static_cast<uint8_t>(client.buffer[0]);
+        }
+        int n = needed - client.count;
+        if (n > count)
+        {
+            n = count;
+        }
+        memcpy(client.buffer + client.count, data, n);
+        client.count += n;
+        data += n;
+        count -= n;
+        if (client.count < needed)
+        {
+            continue;
+        }
+        if (!client.versionChecked)
+        {
+            int version = versionCheck(client.buffer);
+            if (version < 0)
+            {
+                return false;
+            }
+            client.versionChecked = true;
+            client.filterPending = (version == SF_FILTER_VERSION);
+            client.count = 0;
+            if (!multiplexed && !client.filterPending)
+            {
+                sf_filter all;
+                sf_filter_all(&all);
+                addClient(clientFD, 0, all);
+            }
+        }
+        else if ((needed > 1) && multiplexed && (client.channel == 0))
+        {
+            if (!selectChannel(clientFD, client, client.buffer + 1, needed - 1))
+            {
+                return false;
+            }
+            client.count = 0;
+        }
+        else if ((needed > 1) && client.filterPending)
+        {
+            if (!selectFilter(clientFD, client, client.buffer + 1, needed - 1))
+            {
+                return false;
+            }
+            client.count = 0;
+        }
+        else if (needed > 1)
+        {
+            SFPacket packet;
+            if (!packet.setPayload(client.buffer + 1, needed - 1))
+            {
+                return false;
+            }
+            packet.setChannel(client.channel);
+            packet.setArrival(pArrival);
+            // never blocks the event loop unless the buffer policy says so
+            if (readBuffer.enqueueBack(packet))
+            {
+                ++readPacketCount;
+                if (multiplexed)
+                {
+                    pthread_mutex_lock( &clientInfo.countlock );
+                    channelMap_t::iterator channel = channels.find(client.channel);
+                    if (channel != channels.end())
+                    {
+                        ++channel->second.read;
+                    }
+                    pthread_mutex_unlock( &clientInfo.countlock );
+                }
+            }
+            else
+            {
+                ++droppedReadPacketCount;
+            }
+            client.count = 0;
+        }
+        else if (client.buffer[0] == 0)
+        {
+            // empty packets are not allowed
+            return false;
+        }
+    }
+    return true;
+}
+
+/* the first packet of a multiplexed client carries the id of the gateway
+   device it wants to talk to as a decimal number, e.g. "3" */
+bool TCPComm::selectChannel(int clientFD, clientState_t &client, const char *data, int count)
+{
+    int channel = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if ((data[i] < '0') || (data[i] > '9') || (channel > 100000))
+        {
+            return false;
+        }
+        channel = channel * 10 + (data[i] - '0');
+    }
+    pthread_mutex_lock( &clientInfo.countlock );
+    bool known = (channels.find(channel) != channels.end());
+    pthread_mutex_unlock( &clientInfo.countlock );
+    if (!known)
+    {
+        DEBUG("TCPComm::selectChannel : unknown device id " << channel)
+        return false;
+    }
+    client.channel = channel;
+    if (!client.filterPending)
+    {
+        sf_filter all;
+        sf_filter_all(&all);
+        addClient(clientFD, channel, all);
+    }
+    return true;
+}
+
+/* a client that negotiated SF_FILTER_VERSION sends its filter (see
+   sffilter.h) next; it gets no packets before */
+bool TCPComm::selectFilter(int clientFD, clientState_t &client, const char *data, int count)
+{
+    sf_filter filter;
+    if (sf_filter_parse(&filter, data, count) < 0)
+    {
+        DEBUG("TCPComm::selectFilter : malformed filter")
+        return false;
+    }
+    client.filterPending = false;
+    addClient(clientFD, client.channel, filter);
+    return true;
 }
 
-/* reads from connected clients */
-void TCPComm::readClients()
+/* accepts, checks and reads from clients, sends their queued packets */
+void TCPComm::serveClients()
 {
-    FD_t clientFDs;
+    vector<int> readyFDs;
     while (true)
     {
-        pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &clientInfo.countlock);
-        pthread_mutex_lock( &clientInfo.countlock );
-        while( clientInfo.count == 0 )
+        int n = waitForEvents(readyFDs);
+        pthread_testcancel();
+        if (n < 0)
         {
-            // do nothing when no client is connected...
-            DEBUG("TCPComm::readClients : sleeping reader thread")
-            pthread_cond_wait( &clientInfo.wakeup, &clientInfo.countlock );
+            if (errno != EINTR)
+            {
+                reportError("TCPComm::serveClients : waitForEvents(readyFDs)", -1);
+            }
+            continue;
         }
-        // copy set in to temp set
-        clientFDs = clientInfo.FDs;
-        // removes the cleanup handler and executes it (unlock mutex)
-        pthread_cleanup_pop(1);
-        // check all fds (work with temp set)...
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        int maxFD = pipeReadFD;
-        FD_SET(pipeReadFD, &rfds);
-        set<int>::iterator it;
-        for( it = clientFDs.begin(); it != clientFDs.end(); it++ )
-        {
-            if (*it > maxFD)
+        bool flush = false;
+        vector<int>::iterator it;
+        for (it = readyFDs.begin(); it != readyFDs.end(); it++)
+        {
+            if (*it == serverFD)
             {
-                maxFD = *it;
+                acceptClients();
+                continue;
+            }
+            if (*it == wakeFDs[0])
+            {
+                uint64_t wakeups;
+                while (read(wakeFDs[0], &wakeups, sizeof(wakeups)) > 0)
+                {
+                }
+                flush = true;
+                continue;
+            }
+            clientStates_t::iterator client = clientStates.find(*it);
+            if (client == clientStates.end())
+            {
+                continue;
+            }
+            if (!readClient(*it, client->second))
+            {
+                DEBUG("TCPComm::serveClients : removeClient")
+                removeClient(*it);
+                continue;
+            }
+            // the socket may have become writable again
+            bool ok = true;
+            pthread_mutex_lock( &clientInfo.countlock );
+            clientQueues_t::iterator queue = clientInfo.queues.find(*it);
+            if (queue != clientInfo.queues.end())
+            {
+                queue->second.writable = true;
+                ok = flushClient(*it, queue->second);
+            }
+            pthread_mutex_unlock( &clientInfo.countlock );
+            if (!ok)
+            {
+                removeClient(*it);
             }
-            FD_SET(*it, &rfds);
         }
-        if (select(maxFD + 1, &rfds, NULL, NULL, NULL) < 0 )
+        if (flush)
         {
-            //             run = false;
-            reportError("TCPComm::readClients : select(maxFD+1, &rfds, NULL, NULL, NULL)", -1);
+            flushClients();
         }
-        else
+    }
+}
+
+/* applies the lag policy when the client queue is full */
+void TCPComm::queuePacket(clientQueue_t &pQueue, SFPacket &pPacket)
+{
+    if (pQueue.lagging)
+    {
+        return;
+    }
+    // a packet without payload would fail the whole sendmsg with EFAULT
+    if (pPacket.getTcpPayload() == NULL)
+    {
+        DEBUG("TCPComm::queuePacket : dropped packet without payload")
+        ++pQueue.dropped;
+        ++droppedWritePacketCount;
+        return;
+    }
+    if (pQueue.packets.size() >= cMaxClientQueue)
+    {
+        if (lagPolicy == cDisconnectLagging)
+        {
+            pQueue.lagging = true;
+            return;
+        }
+        // a partially sent packet must stay, the stream would break otherwise
+        deque<SFPacket>::iterator victim = pQueue.packets.begin();
+        if (pQueue.offset > 0)
+        {
+            ++victim;
+        }
+        pQueue.packets.erase(victim);
+        ++pQueue.dropped;
+        ++droppedWritePacketCount;
+    }
+    pQueue.packets.push_back(pPacket);
+    if (pQueue.packets.size() > pQueue.maxLag)
+    {
+        pQueue.maxLag = pQueue.packets.size();
+    }
+}
+
+/* sends queued packets with scatter/gather I/O until the queue is empty or
+   the socket would block */
+bool TCPComm::flushClient(int clientFD, clientQueue_t &pQueue)
+{
+    while (pQueue.writable && !pQueue.packets.empty())
+    {
+        struct iovec iov[cMaxIovecs];
+        int count = 0;
+        deque<SFPacket>::iterator it;
+        for (it = pQueue.packets.begin(); (it != pQueue.packets.end()) && (count < cMaxIovecs); it++)
+        {
+            iov[count].iov_base = const_cast<char*>(it->getTcpPayload());
+            iov[count].iov_len = it->getTcpLength();
+            ++count;
+        }
+        iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + pQueue.offset;
+        iov[0].iov_len -= pQueue.offset;
+
+        // sendmsg instead of writev for MSG_NOSIGNAL
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(clientFD, &msg, SF_SEND_FLAGS);
+        channelStats_t *stats = NULL;
+        if (multiplexed)
+        {
+            channelMap_t::iterator channel = channels.find(pQueue.channel);
+            if (channel != channels.end())
+            {
+                stats = &channel->second;
+            }
+        }
+        long long sentTime = LatencyHistogram::now();
+        if (sent < 0)
         {
-            if(FD_ISSET(pipeReadFD, &rfds)) {
-                clearPipe();
+            if (errno == EINTR)
+            {
+                continue;
             }
-            for (it = clientFDs.begin(); it != clientFDs.end(); it++)
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
             {
-                if (FD_ISSET(*it, &rfds))
+                // resumed when the event loop reports the socket writable
+                pQueue.writable = false;
+                return true;
+            }
+            DEBUG("TCPComm::flushClient : sendmsg failed on fd " << clientFD)
+            return false;
+        }
+        while (sent > 0)
+        {
+            int left = pQueue.packets.front().getTcpLength() - pQueue.offset;
+            if (sent < left)
+            {
+                pQueue.offset += sent;
+                break;
+            }
+            sent -= left;
+            if (pQueue.packets.front().getArrival() != 0)
+            {
+                latency.add(sentTime - pQueue.packets.front().getArrival());
+                if (stats)
                 {
-                    SFPacket packet;
-                    if(readPacket(*it, packet)) {
-                        // this call blocks until buffer is not full
-                        readBuffer.enqueueBack(packet);
-                        ++readPacketCount;
-                    }
-                    else {
-                        DEBUG("TCPComm::readClients : removeClient")
-                        removeClient(*it);
-                    }
+                    stats->latency.add(sentTime - pQueue.packets.front().getArrival());
                 }
             }
+            if (stats)
+            {
+                ++stats->written;
+            }
+            pQueue.packets.pop_front();
+            pQueue.offset = 0;
+            ++pQueue.written;
+            ++writtenPacketCount;
+        }
+    }
+    return true;
+}
+
+/* drains all client queues that can take data */
+void TCPComm::flushClients()
+{
+    vector<int> failedFDs;
+    pthread_testcancel();
+    pthread_mutex_lock( &clientInfo.countlock );
+    clientInfo.wakeupPending = false;
+    clientQueues_t::iterator it;
+    for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
+    {
+        if (it->second.closed)
+        {
+            failedFDs.push_back(it->first);
+        }
+        else if (it->second.lagging)
+        {
+            ++laggingClientCount;
+            failedFDs.push_back(it->first);
+        }
+        else if (!flushClient(it->first, it->second))
+        {
+            failedFDs.push_back(it->first);
+        }
+    }
+    pthread_mutex_unlock( &clientInfo.countlock );
+    vector<int>::iterator fd;
+    for (fd = failedFDs.begin(); fd != failedFDs.end(); fd++)
+    {
+        DEBUG("TCPComm::flushClients : removeClient " << *fd)
+        removeClient(*fd);
+    }
+}
+
+/* only one wakeup is outstanding at a time */
+void TCPComm::wakeEventLoop()
+{
+    if (!clientInfo.wakeupPending)
+    {
+        uint64_t one = 1;
+        clientInfo.wakeupPending = true;
+        if (write(wakeFDs[1], &one, (wakeFDs[0] == wakeFDs[1]) ? sizeof(one) : 1) < 0)
+        {
+            DEBUG("TCPComm::wakeEventLoop : write failed")
         }
     }
 }
@@ -414,10 +805,10 @@ void* writeClientsThread(void* ob)
     return NULL;
 }
 
-/* writes to connected clients */
+/* queues packets for all connected clients */
 void TCPComm::writeClients()
 {
-    FD_t clientFDs;
+    SFPacket packets[cWriteBatchSize];
     while (true)
     {
         pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &clientInfo.countlock);
@@ -432,28 +823,33 @@ void TCPComm::writeClients()
         pthread_cleanup_pop(1); 
 
         // blocks until buffer is not empty
-        SFPacket packet = writeBuffer.dequeue();
+        unsigned count = writeBuffer.dequeue(packets, cWriteBatchSize);
         pthread_testcancel();
+        pthread_cleanup_push((void(*)(void*)) pthread_mutex_unlock, (void *) &clientInfo.countlock);
         pthread_mutex_lock( &clientInfo.countlock );
-        // copy client fd set into temp set
-        clientFDs = clientInfo.FDs;
-        pthread_mutex_unlock( &clientInfo.countlock );
-
-        // check all fds (work with temp set)...
-        set<int>::iterator it;
-        // duplicate and send out packet to all connected clients
-        for( it = clientFDs.begin(); it != clientFDs.end(); it++ )
+        // duplicate packets into the queues, the event loop sends them
+        clientQueues_t::iterator it;
+        for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
         {
-            if (writePacket(*it, packet))
+            for (unsigned i = 0; i < count; i++)
             {
-                ++writtenPacketCount;
-            }
-            else
-            {
-                DEBUG("TCPComm::writeClients : removeClient")
-                removeClient(*it);
+                // a multiplexed client only gets the packets of its device
+                if (multiplexed && (packets[i].getChannel() != it->second.channel))
+                {
+                    continue;
+                }
+                if (sf_filter_match(&it->second.filter, packets[i].getPayload(), packets[i].getLength()))
+                {
+                    queuePacket(it->second, packets[i]);
+                }
+                else
+                {
+                    ++it->second.filtered;
+                }
             }
         }
+        wakeEventLoop();
+        pthread_cleanup_pop(1);
     }
 }
 
@@ -461,10 +857,10 @@ void TCPComm::writeClients()
 void TCPComm::cancel()
 {
     pthread_t callingThread = pthread_self();
-    if (pthread_equal(callingThread, readerThread))
+    if (serverThreadRunning && pthread_equal(callingThread, serverThread))
     {
-        DEBUG("TCPComm::cancel : by readerThread")
-        pthread_detach(readerThread);
+        DEBUG("TCPComm::cancel : by serverThread")
+        pthread_detach(serverThread);
         if (writerThreadRunning)
         {
             pthread_cancel(writerThread);
@@ -472,28 +868,14 @@ void TCPComm::cancel()
             pthread_join(writerThread, NULL);
             writerThreadRunning = false;
         }
-        if (serverThreadRunning)
-        {
-            pthread_cancel(serverThread);
-            DEBUG("TCPComm::cancel : serverThread canceled, joining")
-            pthread_join(serverThread, NULL);
-            serverThreadRunning = false;
-        }
-        readerThreadRunning = false;
+        serverThreadRunning = false;
 	pthread_cond_signal(&control.cancel);
         pthread_exit(NULL);
     }
-    else if (pthread_equal(callingThread, writerThread))
+    else if (writerThreadRunning && pthread_equal(callingThread, writerThread))
     {
         DEBUG("TCPComm::cancel : by writerThread")
         pthread_detach(writerThread);
-        if (readerThreadRunning)
-        {
-            pthread_cancel(readerThread);
-            DEBUG("TCPComm::cancel : readerThread canceled, joining")
-            pthread_join(readerThread, NULL);
-            readerThreadRunning = false;
-        }
         if (serverThreadRunning)
         {
             pthread_cancel(serverThread);
@@ -505,28 +887,6 @@ void TCPComm::cancel()
 	pthread_cond_signal(&control.cancel);
         pthread_exit(NULL);
     }
-    else if (pthread_equal(callingThread, serverThread))
-    {
-        DEBUG("TCPComm::cancel : by serverThread")
-        pthread_detach(serverThread);
-        if (readerThreadRunning)
-        {
-            pthread_cancel(readerThread);
-            DEBUG("TCPComm::cancel : readerThread canceled, joining")
-	    pthread_join(readerThread, NULL);
-            readerThreadRunning = false;
-        }
-        if (writerThreadRunning)
-        {
-            pthread_cancel(writerThread);
-            DEBUG("TCPComm::cancel : writerThread canceled, joining")
-            pthread_join(writerThread, NULL);
-            writerThreadRunning = false;
-        }
-        serverThreadRunning = false;
-	pthread_cond_signal(&control.cancel);
-        pthread_exit(NULL);
-    }
     else
     {
         DEBUG("TCPComm::cancel : by other thread")
@@ -544,13 +904,6 @@ void TCPComm::cancel()
             pthread_join(writerThread, NULL);
             writerThreadRunning = false;
         }
-        if (readerThreadRunning)
-        {
-            pthread_cancel(readerThread);
-            DEBUG("TCPComm::cancel : readerThread canceled, joining")
-            pthread_join(readerThread, NULL);
-            readerThreadRunning = false;
-        }
 	pthread_cond_signal(&control.cancel);
     }
 }
@@ -574,21 +927,144 @@ int TCPComm::reportError(const char *msg, int result)
 /* prints out status */
 void TCPComm::reportStatus(ostream& os)
 {
+    pthread_mutex_lock( &clientInfo.countlock );
     os << "SF-Server ( TCPComm on port " << port << " )"
     << " : clients = " << clientInfo.count
     << " , packets read = " << readPacketCount
-    << " , packets written = " << writtenPacketCount << endl;
+    << " ( dropped = " << droppedReadPacketCount << " )"
+    << " , packets written = " << writtenPacketCount
+    << " ( dropped = " << droppedWritePacketCount
+    << " , lagging clients disconnected = " << laggingClientCount << " )" << endl;
+    os << "     serial -> tcp latency : ";
+    latency.reportStatus(os);
+    clientQueues_t::iterator it;
+    for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
+    {
+        os << "     client fd " << it->first;
+        if (multiplexed)
+        {
+            os << " ( device id " << it->second.channel << " )";
+        }
+        os << " : queued = " << it->second.packets.size()
+        << " ( max = " << it->second.maxLag << " )"
+        << " , written = " << it->second.written
+        << " , dropped = " << it->second.dropped;
+        if (it->second.filter.count > 0)
+        {
+            os << " , filtered = " << it->second.filtered
+            << " ( filter rules = " << it->second.filter.count << " )";
+        }
+        os << endl;
+    }
+    pthread_mutex_unlock( &clientInfo.countlock );
 }
 
-void TCPComm::stuffPipe() 
+void TCPComm::addChannel(int pChannel)
 {
-    char info = 'n';
-    if(write(pipeWriteFD, &info, 1) != 1) DEBUG("TCPComm::stuffPipe : lokal pipe is broken");
+    pthread_mutex_lock( &clientInfo.countlock );
+    channels[pChannel].read = 0;
+    channels[pChannel].written = 0;
+    pthread_mutex_unlock( &clientInfo.countlock );
 }
 
-void TCPComm::clearPipe() {
-    char buf;
-    while(read(pipeReadFD, &buf, 1) > 0) {
-        ;
+/* the sockets belong to the event loop, it closes them on the next flush */
+void TCPComm::removeChannel(int pChannel)
+{
+    pthread_mutex_lock( &clientInfo.countlock );
+    channels.erase(pChannel);
+    bool found = false;
+    clientQueues_t::iterator it;
+    for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
+    {
+        if (it->second.channel == pChannel)
+        {
+            it->second.closed = true;
+            found = true;
+        }
     }
+    if (found)
+    {
+        wakeEventLoop();
+    }
+    pthread_mutex_unlock( &clientInfo.countlock );
+}
+
+/* prints out the status of one gateway device */
+void TCPComm::reportChannelStatus(ostream& os, int pChannel)
+{
+    pthread_mutex_lock( &clientInfo.countlock );
+    channelMap_t::iterator channel = channels.find(pChannel);
+    if (channel != channels.end())
+    {
+        int clients = 0;
+        clientQueues_t::iterator it;
+        for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
+        {
+            if (it->second.channel == pChannel)
+            {
+                ++clients;
+            }
+        }
+        os << "SF-Server ( TCPComm on port " << port << " , device id " << pChannel << " )"
+        << " : clients = " << clients
+        << " , packets read = " << channel->second.read
+        << " , packets written = " << channel->second.written << endl;
+        os << "     serial -> tcp latency : ";
+        channel->second.latency.reportStatus(os);
+        for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
+        {
+            if (it->second.channel != pChannel)
+            {
+                continue;
+            }
+            os << "     client fd " << it->first
+            << " : queued = " << it->second.packets.size()
+            << " ( max = " << it->second.maxLag << " )"
+            << " , written = " << it->second.written
+            << " , dropped = " << it->second.dropped << endl;
+        }
+    }
+    pthread_mutex_unlock( &clientInfo.countlock );
+}
+
+/* exports the counters of reportStatus */
+void TCPComm::reportMetrics(Metrics& pMetrics, const string& pLabels)
+{
+    pthread_mutex_lock( &clientInfo.countlock );
+    unsigned long queued = 0;
+    unsigned long maxQueued = 0;
+    clientQueues_t::iterator it;
+    for (it = clientInfo.queues.begin(); it != clientInfo.queues.end(); it++)
+    {
+        queued += it->second.packets.size();
+        if (it->second.packets.size() > maxQueued)
+        {
+            maxQueued = it->second.packets.size();
+        }
+    }
+    pMetrics.gauge("sf_tcp_clients", "Connected TCP clients", pLabels, clientInfo.count);
+    pMetrics.counter("sf_tcp_read_packets_total", "Packets read from TCP clients", pLabels, readPacketCount);
+    pMetrics.counter("sf_tcp_read_dropped_packets_total", "Packets from TCP clients that did not fit into the buffer", pLabels, droppedReadPacketCount);
+    pMetrics.counter("sf_tcp_written_packets_total", "Packets sent to TCP clients", pLabels, writtenPacketCount);
+    pMetrics.counter("sf_tcp_write_dropped_packets_total", "Packets dropped from the queues of lagging clients", pLabels, droppedWritePacketCount);
+    pMetrics.counter("sf_tcp_lagging_clients_total", "Clients disconnected because they lagged behind", pLabels, laggingClientCount);
+    pMetrics.gauge("sf_tcp_queued_packets", "Packets queued for all TCP clients", pLabels, queued);
+    pMetrics.gauge("sf_tcp_client_queue_max_packets", "Longest queue of a TCP client", pLabels, maxQueued);
+    pMetrics.gauge("sf_tcp_client_queue_capacity_packets", "Packets queued for a client before it lags", pLabels, cMaxClientQueue);
+    pMetrics.histogram("sf_serial_to_tcp_latency_seconds", "Time from the serial arrival of a packet to its TCP send", pLabels, latency);
+    pthread_mutex_unlock( &clientInfo.countlock );
+}
+
+/* exports the counters of reportChannelStatus */
+void TCPComm::reportChannelMetrics(Metrics& pMetrics, int pChannel, const string& pLabels)
+{
+    pthread_mutex_lock( &clientInfo.countlock );
+    channelMap_t::iterator channel = channels.find(pChannel);
+    if (channel != channels.end())
+    {
+        pMetrics.counter("sf_tcp_device_read_packets_total", "Packets read from the TCP clients of a gateway device", pLabels, channel->second.read);
+        pMetrics.counter("sf_tcp_device_written_packets_total", "Packets sent to the TCP clients of a gateway device", pLabels, channel->second.written);
+        pMetrics.histogram("sf_serial_to_tcp_device_latency_seconds", "Time from the serial arrival of a packet of a gateway device to its TCP send", pLabels, channel->second.latency);
+    }
+    pthread_mutex_unlock( &clientInfo.countlock );
 }
@@ -38,10 +38,16 @@
 #include "packetbuffer.h"
 #include "basecomm.h"
 #include "sharedinfo.h"
+#include "latencyhistogram.h"
+#include "metrics.h"
+#include "sffilter.h"
 
 #include <pthread.h>
+#include <deque>
+#include <map>
 #include <set>
 #include <string>
+#include <vector>
 #include <sstream>
 
 // #define DEBUG_TCPCOMM
@@ -56,49 +62,146 @@
 
 class TCPComm : public BaseComm
 {
+public:
+    /* what happens to a client whose outbound queue is full */
+    typedef enum
+    {
+        // the client loses its oldest queued packets
+        cDropLagging,
+        // the client is disconnected
+        cDisconnectLagging
+    } lagPolicy_t;
+
+    /** Constants **/
+protected:
+    /* max. events handled per wakeup of the client event loop */
+    static const int cMaxEvents = 64;
+
+    /* bytes read from a client socket in one go */
+    static const int cReadChunkSize = 4096;
+
+    /* max. number of packets the writer takes from the buffer at once */
+    static const unsigned cWriteBatchSize = 16;
+
+    /* packets queued for one client before its lag policy applies */
+    static const unsigned cMaxClientQueue = 256;
+
+    /* max. packets handed to the kernel in one send */
+    static const int cMaxIovecs = 64;
 
     /** Member vars */
 protected:
-    /* pthread for tcp client connection handling */
+    /* pthread for the client event loop (accept, handshake, reading) */
     pthread_t serverThread;
 
     bool serverThreadRunning;
 
-    /* pthread for tcp client reading */
-    pthread_t readerThread;
-
-    bool readerThreadRunning;
-
-    /* pthread for tcp client writing */
+    /* pthread that distributes packets into the client queues */
     pthread_t writerThread;
 
     bool writerThreadRunning;
 
-    typedef std::set<int> FD_t;
+    // outbound queue of a client, filled by the writer thread and
+    // drained by the event loop
+    typedef struct
+    {
+        /* packets not (completely) sent yet */
+        std::deque<SFPacket> packets;
+        /* bytes of the first packet already sent */
+        int offset;
+        /* the last send did not hit EAGAIN */
+        bool writable;
+        /* queue overflowed under cDisconnectLagging */
+        bool lagging;
+        /* gateway device of the client, 0 if not multiplexed */
+        int channel;
+        /* the device was removed, the event loop closes the client */
+        bool closed;
+        /* packets the client subscribed to */
+        sf_filter filter;
+        /* statistics */
+        unsigned long written;
+        unsigned long dropped;
+        unsigned long filtered;
+        unsigned long maxLag;
+    } clientQueue_t;
+
+    typedef std::map<int, clientQueue_t> clientQueues_t;
 
     // thread safe shared info about connected clients
     typedef struct
     {
-        /* mutex to protect clientCount and clientFDs */
+        /* mutex to protect count, queues and wakeupPending */
         pthread_mutex_t countlock;
-	/* mutex to protect wakeup condiation */
-	pthread_mutex_t sleeplock;        
-	/* wakeup condition which is siganled if clients are connected */
+        /* wakeup condition which is siganled if clients are connected */
         pthread_cond_t wakeup;
         /* number of connected clients */
         int count;
-        /* container for client stuff */
-        FD_t FDs;
+        /* outbound queues of all clients that passed the version check */
+        clientQueues_t queues;
+        /* event loop has been woken up but has not flushed yet */
+        bool wakeupPending;
     } sharedClientInfo_t;
 
     /* information about clients */
     sharedClientInfo_t clientInfo;
 
-    /* number of read packets */
-    int readPacketCount;
+    // receive state of a client socket, only touched by the event loop
+    typedef struct
+    {
+        /* client has passed the version check */
+        bool versionChecked;
+        /* selected gateway device, 0 until selected (multiplexed only) */
+        int channel;
+        /* client speaks SF_FILTER_VERSION and has not sent its filter yet */
+        bool filterPending;
+        /* bytes of the current handshake or packet received so far */
+        int count;
+        /* handshake or length byte followed by packet payload */
+        char buffer[SFPacket::cMaxPacketLength + 1];
+    } clientState_t;
+
+    typedef std::map<int, clientState_t> clientStates_t;
+
+    /* all accepted client sockets, including those still in the handshake */
+    clientStates_t clientStates;
+
+    /* number of read packets (event loop) */
+    Counter readPacketCount;
+
+    /* number of read packets that did not fit into the buffer (event loop) */
+    Counter droppedReadPacketCount;
 
     /* number of written packets */
-    int writtenPacketCount;
+    unsigned long writtenPacketCount;
+
+    /* packets dropped from the queues of lagging clients */
+    unsigned long droppedWritePacketCount;
+
+    /* clients disconnected because they lagged behind */
+    unsigned long laggingClientCount;
+
+    /* serial byte arrival -> TCP send, per packet and client */
+    LatencyHistogram latency;
+
+    // per device statistics of a multiplexed server
+    typedef struct
+    {
+        unsigned long read;
+        unsigned long written;
+        LatencyHistogram latency;
+    } channelStats_t;
+
+    typedef std::map<int, channelStats_t> channelMap_t;
+
+    /* gateway devices clients may select (countlock) */
+    channelMap_t channels;
+
+    /* clients select a gateway device with their first packet */
+    bool multiplexed;
+
+    /* how lagging clients are treated */
+    lagPolicy_t lagPolicy;
 
     /* port of this sf */
     int port;
@@ -106,10 +209,12 @@ protected:
     /* file descriptor for server port on local machine */
     int serverFD;
 
-    /* pipe fd pair to inform client reader thread of new clients */
-    int pipeWriteFD;
-    int pipeReadFD;
-    
+    /* epoll instance watching serverFD and all client sockets */
+    int pollFD;
+
+    /* the writer thread wakes the event loop through wakeFDs[1] */
+    int wakeFDs[2];
+
     /* reference to read packet buffer */
     PacketBuffer &readBuffer;    
 
@@ -128,8 +233,7 @@ protected:
     /** Member functions */
 
     /* needed to start pthreads */
-    friend void* checkClientsThread(void* ob);
-    friend void* readClientsThread(void* ob);
+    friend void* serveClientsThread(void* ob);
     friend void* writeClientsThread(void* ob);
 
 private:
@@ -137,45 +241,63 @@ private:
     TCPComm();
 
 protected:
-    /* performs blocking write on fd */
-    virtual int writeFD(int fd, const char *buffer, int count, int *err);
+    /* checks SF client protocol version of a received handshake,
+       returns the version to use or -1 */
+    int versionCheck(const char *check);
+
+    /* queues a packet for a client, applies the lag policy (countlock held) */
+    void queuePacket(clientQueue_t &pQueue, SFPacket &pPacket);
+
+    /* sends as much of the client queue as the socket takes (countlock held),
+       returns false if the client must be removed */
+    bool flushClient(int clientFD, clientQueue_t &pQueue);
 
-    /* checks SF client protocol version */
-    bool versionCheck(int clientFD);
+    /* flushes all writable clients and removes lagging ones */
+    void flushClients();
 
-    /* reads packet */
-    bool readPacket(int pFD, SFPacket &pPacket);
+    /* wakes the event loop to flush the client queues (countlock held) */
+    void wakeEventLoop();
 
-    /* writes packet */
-    bool writePacket(int pFD, SFPacket &pPacket);
+    /* adds client to the list of clients that get packets */
+    void addClient(int clientFD, int channel, const sf_filter &filter);
 
-    /* adds client to the list */
-    void addClient(int clientFD);
+    /* handles the device selection packet of a multiplexed client */
+    bool selectChannel(int clientFD, clientState_t &client, const char *data, int count);
 
-    /* removes client from the list */
+    /* handles the filter packet of a client, adds the client */
+    bool selectFilter(int clientFD, clientState_t &client, const char *data, int count);
+
+    /* closes a client socket and removes it from all lists */
     void removeClient(int clientFD);
 
-    /* checks for connecting clients - main thread for connection handling */
-    void connectClients();
+    /* registers fd with the event loop, output: also report writability */
+    bool watchFD(int fd, bool output);
+
+    /* waits until one or more watched fds are readable or writable */
+    int waitForEvents(std::vector<int> &readyFDs);
+
+    /* accepts all pending connections and starts their handshake */
+    void acceptClients();
 
-    /* checks for messages from the clients - producer thread */
-    void readClients();
+    /* reads everything a client has sent, returns false if it must be removed */
+    bool readClient(int clientFD, clientState_t &client);
 
-    /* write messages to clients (duplicate) - consumer thread */
+    /* feeds received bytes into the handshake / packet framing of a client,
+       pArrival: time the bytes were received */
+    bool processClientData(int clientFD, clientState_t &client, const char *data, int count, long long pArrival);
+
+    /* event loop: connects clients, reads their packets and sends their queues */
+    void serveClients();
+
+    /* duplicates packets into the client queues - consumer thread */
     void writeClients();
 
     /* reports error to stderr */
     int reportError(const char *msg, int result);
 
-    /* write something into pipe to wake up client readerThread */
-    void stuffPipe();
-    
-    /* remove data written into pipe */
-    void clearPipe();
-
 public:
     /* create SF TCP server - init and start threads */
-    TCPComm(int pPort, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl);
+    TCPComm(int pPort, PacketBuffer &pReadBuffer, PacketBuffer &pWriteBuffer, sharedControlInfo_t& pControl, lagPolicy_t pLagPolicy = cDropLagging, bool pMultiplexed = false);
 
     /* wait for threads, close fds and cleanup */
     ~TCPComm();
@@ -189,6 +311,21 @@ public:
     /* reports status info to stdout */
     void reportStatus(std::ostream& os);
 
+    /* multiplexed: allows clients to select gateway device pChannel */
+    void addChannel(int pChannel);
+
+    /* multiplexed: disconnects the clients of pChannel */
+    void removeChannel(int pChannel);
+
+    /* multiplexed: reports the clients and counters of one device */
+    void reportChannelStatus(std::ostream& os, int pChannel);
+
+    /* adds the counters and queue lengths, pLabels identify the sf-server */
+    void reportMetrics(Metrics& pMetrics, const std::string& pLabels);
+
+    /* multiplexed: adds the counters of one device */
+    void reportChannelMetrics(Metrics& pMetrics, int pChannel, const std::string& pLabels);
+
     /* returns if error occurred */
     bool isErrorReported() { return errorReported; }
 };
@@ -30,6 +30,16 @@
 #
 VERSION = "U"
 SUBVERSION = " "
+# subversion of serial forwarders understanding subscription filters
+FILTER_SUBVERSION = "!"
+
+# rule fields of a filter, see tools/tinyos/c/sf/sffilter.h
+FILTER_TYPE = 1
+FILTER_SOURCE = 2
+FILTER_GROUP = 4
+FILTER_PREFIX = 8
+FILTER_MAX_RULES = 16
+FILTER_MAX_PREFIX = 16
 
 PLATFORM_UNKNOWN = 0
 
@@ -37,21 +47,104 @@ class SFProtocolException(Exception):
     def __init__(self, *args):
         self.args = args
 
+class SFFilter:
+    """Subscription filter: a list of rules, each a dict with some of the
+    keys 'type', 'source', 'group' and 'prefix' (a string). A serial
+    active message passes if it matches all keys of one rule; no rules
+    or an empty rule let every packet pass."""
+
+    def __init__(self, rules):
+        if len(rules) > FILTER_MAX_RULES:
+            raise SFProtocolException("too many filter rules")
+        for rule in rules:
+            if len(rule.get('prefix', "")) > FILTER_MAX_PREFIX:
+                raise SFProtocolException("filter prefix too long")
+        self.rules = rules
+
+    def parse(spec):
+        """Rules separated by '|' of fields separated by ',', e.g.
+        'type=0x22,source=5|type=10' or 'prefix=0102'."""
+        rules = []
+        for text in spec.split("|"):
+            rule = {}
+            for field in text.split(","):
+                if field == "":
+                    continue
+                (key, value) = field.split("=", 1)
+                if key == "prefix":
+                    rule[key] = value.decode("hex")
+                elif key in ("type", "source", "group"):
+                    rule[key] = int(value, 0)
+                else:
+                    raise SFProtocolException("bad filter field " + key)
+            rules.append(rule)
+        return SFFilter(rules)
+    parse = staticmethod(parse)
+
+    def encode(self):
+        data = chr(len(self.rules))
+        for rule in self.rules:
+            fields = 0
+            values = ""
+            if 'type' in rule:
+                fields |= FILTER_TYPE
+                values += chr(rule['type'])
+            if 'source' in rule:
+                fields |= FILTER_SOURCE
+                values += chr(rule['source'] >> 8) + chr(rule['source'] & 0xff)
+            if 'group' in rule:
+                fields |= FILTER_GROUP
+                values += chr(rule['group'])
+            if 'prefix' in rule:
+                fields |= FILTER_PREFIX
+                values += chr(len(rule['prefix'])) + rule['prefix']
+            data += chr(fields) + values
+        return data
+
+    def match(self, packet):
+        if len(self.rules) == 0:
+            return True
+        # serial active message: dispatch 0, dest, source, length, group, type
+        if len(packet) < 8 or packet[0] != "\x00":
+            return False
+        source = (ord(packet[3]) << 8) | ord(packet[4])
+        for rule in self.rules:
+            if 'type' in rule and rule['type'] != ord(packet[7]):
+                continue
+            if 'source' in rule and rule['source'] != source:
+                continue
+            if 'group' in rule and rule['group'] != ord(packet[6]):
+                continue
+            if 'prefix' in rule and not packet[8:].startswith(rule['prefix']):
+                continue
+            return True
+        return False
+
 class SFProtocol:
-    def __init__(self, ins, outs):
+    def __init__(self, ins, outs, filter=None):
         self.ins = ins
         self.outs = outs
         self.platform = None
+        self.filter = filter
+        # packets an old serial forwarder sends us regardless of filter
+        self.localFilter = None
 
     def open(self):
-        self.outs.write(VERSION + SUBVERSION)
+        if self.filter == None:
+            self.outs.write(VERSION + SUBVERSION)
+        else:
+            self.outs.write(VERSION + FILTER_SUBVERSION)
         partner = self.ins.read(2)
         if partner[0] != VERSION:
             print "SFProtocol : version error"
             raise SFProtocolException("protocol version error")
 
 	# Actual version is min received vs our version
-        # ourversion = partner[1] & 0xff
+        if self.filter != None:
+            if partner[1] >= FILTER_SUBVERSION:
+                self.writePacket(self.filter.encode())
+            else:
+                self.localFilter = self.filter
         
         if self.platform == None:
             self.platform = PLATFORM_UNKNOWN
@@ -63,9 +156,11 @@ class SFProtocol:
 
 
     def readPacket(self):
-        size = self.ins.read(1)
-        packet = self.ins.read(ord(size))
-        return packet
+        while True:
+            size = self.ins.read(1)
+            packet = self.ins.read(ord(size))
+            if self.localFilter == None or self.localFilter.match(packet):
+                return packet
 
     def writePacket(self, packet):
         if len(packet) > 255:
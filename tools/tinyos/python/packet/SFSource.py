@@ -40,15 +40,20 @@ class SFSource(PacketSource):
     def __init__(self, dispatcher, args):
         PacketSource.__init__(self, dispatcher)
 
-        m = re.match(r'(.*):(.*)', args)
+        # host:port, optionally followed by ?filter (see SFFilter.parse)
+        m = re.match(r'(.*):([^?]*)(\?(.*))?$', args)
         if m == None:
             raise PacketSourceException("bad arguments")
 
-        (host, port) = m.groups()
+        (host, port, _, spec) = m.groups()
         port = int(port)
 
+        filter = None
+        if spec != None:
+            filter = SFFilter.parse(spec)
+
         self.io = SocketIO(host, port)
-        self.prot = SFProtocol(self.io, self.io)
+        self.prot = SFProtocol(self.io, self.io, filter)
 
     def cancel(self):
         self.done = True
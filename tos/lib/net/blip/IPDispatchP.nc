@@ -274,12 +274,11 @@ void SENDINFO_DECR(struct send_info *si) {
 
   void ip_print_heap() {
 #ifdef PRINTFUART_ENABLED
-    bndrt_t *cur = (bndrt_t *)heap;
-    while (((uint8_t *)cur)  - heap < IP_MALLOC_HEAP_SIZE) {
-      printf ("heap region start: %p length: %u used: %u\n",
-                  cur, (*cur & IP_MALLOC_LEN), (*cur & IP_MALLOC_INUSE) >> 15);
-      cur = (bndrt_t *)(((uint8_t *)cur) + ((*cur) & IP_MALLOC_LEN));
-    }
+    struct ip_malloc_stats heap_stats;
+    ip_malloc_stats(&heap_stats);
+    printf("heap: %u of %u free, largest block: %u free blocks: %u high water: %u failures: %u\n",
+           heap_stats.free, heap_stats.heap_size, heap_stats.largest_free,
+           heap_stats.free_blocks, heap_stats.high_water, heap_stats.failures);
 #endif
   }
 
@@ -375,26 +374,26 @@ void SENDINFO_DECR(struct send_info *si) {
       recon->r_meta.lqi = call ReadLqi.readLqi(msg);
       recon->r_meta.rssi = call ReadLqi.readRssi(msg);
 
-      if (hasFrag1Header(&lowmsg)) {
-        // Fail if the buffer is already allocated. In that case we have already
-        // received the Frag1 header.
-        if (recon->r_buf != NULL) goto fail;
+      // Fragments may come in any order; whichever arrives first
+      // sets up the reconstruction.
+      if (recon->r_buf == NULL) {
         rv = lowpan_recon_start(&frame_address, recon, buf, buflen);
       } else {
-        // Fail if we try to reconstruct a packet without receiving the Frag1
-        // header first.
-        if (recon->r_buf == NULL) goto fail;
-        rv = lowpan_recon_add(recon, buf, buflen);
+        rv = lowpan_recon_add(&frame_address, recon, buf, buflen);
       }
 
+      recon->r_source_key = source_key;
+      recon->r_tag = tag;
       if (rv < 0) {
         recon->r_timeout = T_FAILED1;
         goto fail;
+      } else if (rv > 0) {
+        // a duplicate of a fragment we already have
+        recon->r_timeout = T_ACTIVE;
+        goto fail;
       } else {
         // printf("start recon buf: %p\n", recon->r_buf);
         recon->r_timeout = T_ACTIVE;
-        recon->r_source_key = source_key;
-        recon->r_tag = tag;
       }
 
       if (recon->r_size == recon->r_bytes_rcvd) {
@@ -135,6 +135,11 @@ module TcpP {
     if (tcplib_send(&socks[client], payload, len) < 0) return FAIL;
     return SUCCESS;
   }
+
+  command error_t Tcp.sendv[uint8_t client](struct ip_iovec *data) {
+    if (tcplib_send_iov(&socks[client], data) < 0) return FAIL;
+    return SUCCESS;
+  }
   
   command error_t Tcp.close[uint8_t client]() {
     if (!tcplib_close(&socks[client]))
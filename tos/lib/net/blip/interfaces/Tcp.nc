@@ -31,6 +31,13 @@ interface Tcp {
    */
   command error_t send(void *payload, uint16_t len);
 
+  /*
+   * Send the data in an iovec chain without gathering it first.  It
+   * is copied into the tx buffer, so the chain may be reused once
+   * this returns.
+   */
+  command error_t sendv(struct ip_iovec *data);
+
   event void recv(void *payload, uint16_t len);
 
   /*
@@ -104,6 +104,10 @@ enum {
   SERIAL_PROTO_ACK = 67,
   SERIAL_PROTO_PACKET_ACK = 68,
   SERIAL_PROTO_PACKET_NOACK = 69,
+  // window protocol, see SerialP.nc
+  SERIAL_PROTO_WINDOW_SYNC = 70,
+  SERIAL_PROTO_PACKET_WINDOW = 71,
+  SERIAL_PROTO_WINDOW_ACK = 72,
   SERIAL_PROTO_PACKET_UNKNOWN = 255
 };
 
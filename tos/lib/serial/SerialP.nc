@@ -48,6 +48,16 @@
  * acknowledgement to the sender which serves as a crude form of
  * flow-control.
  *
+ * Hosts that want several packets in flight first send a
+ * SERIAL_PROTO_WINDOW_SYNC frame carrying the sequence number of their
+ * next packet, answered with a SERIAL_PROTO_WINDOW_ACK for the number
+ * before it. Once synced, the node answers later sync frames with the
+ * last number it delivered and the host continues from there.
+ * SERIAL_PROTO_PACKET_WINDOW frames are then delivered only
+ * in sequence and acknowledged cumulatively; out of order frames are
+ * dropped and answered with a duplicate ack (go-back-N). Hosts that
+ * never send a sync frame see the old stop-and-wait behaviour.
+ *
  * @author Phil Buonadonna
  * @author Lewis Girod
  * @author Ben Greenstein
@@ -151,6 +161,10 @@ implementation {
   uint8_t  rxSeqno;
   uint16_t rxCRC;
 
+  /* Window receive state, kept across frames */
+  bool     rxSynced;
+  uint8_t  rxExpected;
+
   /* Transmit State */
 
   uint8_t  txState;
@@ -164,6 +178,10 @@ implementation {
   /* Ack Queue */
   ack_queue_t ackQ;
 
+  /* Window acks are cumulative, only the latest one is sent */
+  bool    winAckPending;
+  uint8_t winAckSeqno;
+
   bool offPending = FALSE;
 
   // Prototypes
@@ -177,6 +195,7 @@ implementation {
   inline void ack_queue_push(uint8_t token);
   inline uint8_t ack_queue_top();
   uint8_t ack_queue_pop();
+  inline void window_ack_push(uint8_t seqno);
 
   inline void rx_buffer_init();
   inline bool rx_buffer_is_full();
@@ -215,6 +234,10 @@ implementation {
 
   inline void ackInit(){
     ackQ.writePtr = ackQ.readPtr = 0;
+    winAckPending = FALSE;
+    winAckSeqno = 0;
+    rxSynced = FALSE;
+    rxExpected = 0;
   }
 
   command error_t Init.init() {
@@ -278,6 +301,14 @@ implementation {
     return retval;
   }
 
+  inline void window_ack_push(uint8_t seqno) {
+    atomic {
+      winAckSeqno = seqno;
+      winAckPending = TRUE;
+    }
+    MaybeScheduleTx();
+  }
+
 
   /* 
    * Buffer Manipulation
@@ -402,6 +433,8 @@ implementation {
     switch (proto){
     case SERIAL_PROTO_PACKET_ACK: 
     case SERIAL_PROTO_PACKET_NOACK:
+    case SERIAL_PROTO_WINDOW_SYNC:
+    case SERIAL_PROTO_PACKET_WINDOW:
       return TRUE;
     case SERIAL_PROTO_ACK:
     default: 
@@ -427,6 +460,12 @@ implementation {
           goto nosync;
         
         rxCRC = crcByte(rxCRC,data);
+        if (rxProto == SERIAL_PROTO_WINDOW_SYNC ||
+            rxProto == SERIAL_PROTO_PACKET_WINDOW) {
+          /* the packet is only started once its seqno is known */
+          rxState = RXSTATE_TOKEN;
+          break;
+        }
         if( rxProto == SERIAL_PROTO_PACKET_ACK )
           rxState = RXSTATE_TOKEN;
         else
@@ -445,6 +484,20 @@ implementation {
         rxSeqno = data;
         rxCRC = crcByte(rxCRC,rxSeqno);
         rxState = RXSTATE_INFO;
+        if (rxProto == SERIAL_PROTO_PACKET_WINDOW) {
+          if (!rxSynced) {
+            /* the host resyncs when it gets no acks */
+            goto nosync;
+          }
+          if (rxSeqno != rxExpected) {
+            /* lost or repeated packet, tell the host where we are */
+            window_ack_push(rxExpected - 1);
+            goto nosync;
+          }
+          if (signal ReceiveBytePacket.startPacket() != SUCCESS){
+            goto nosync;
+          }
+        }
       }
       break;
       
@@ -453,9 +506,24 @@ implementation {
         if (isDelimeter) { /* handle end of frame */
           if (rxByteCnt >= 2) {
             if (rx_current_crc() == rxCRC) {
-              signal ReceiveBytePacket.endPacket(SUCCESS);
+              if (rxProto == SERIAL_PROTO_WINDOW_SYNC) {
+                if (!rxSynced) {
+                  rxSynced = TRUE;
+                  rxExpected = rxSeqno;
+                }
+                /* a synced node keeps its place: rewinding it would
+                   deliver packets whose acks were lost a second time */
+                window_ack_push(rxExpected - 1);
+              }
+              else {
+                signal ReceiveBytePacket.endPacket(SUCCESS);
+              }
               if( rxProto == SERIAL_PROTO_PACKET_ACK)
                 ack_queue_push(rxSeqno);
+              else if (rxProto == SERIAL_PROTO_PACKET_WINDOW) {
+                rxExpected = rxSeqno + 1;
+                window_ack_push(rxSeqno);
+              }
 	      rxInit();
 	      call SerialFrameComm.resetReceive();
 	      if (offPending) {
@@ -474,7 +542,8 @@ implementation {
 	}
         else { /* handle new bytes to save */
           if (rxByteCnt >= 2){ 
-            signal ReceiveBytePacket.byteReceived(rx_buffer_top());
+            if (rxProto != SERIAL_PROTO_WINDOW_SYNC)
+              signal ReceiveBytePacket.byteReceived(rx_buffer_top());
             rxCRC = crcByte(rxCRC,rx_buffer_pop());
           }
 	  rx_buffer_push(data);
@@ -592,6 +661,11 @@ implementation {
 	if (txProto == SERIAL_PROTO_ACK){
 	  ack_queue_pop();
 	}
+	else if (txProto == SERIAL_PROTO_WINDOW_ACK){
+	  /* a newer ack may have replaced the one just sent */
+	  if (winAckSeqno == txBuf[TX_ACK_INDEX].buf)
+	    winAckPending = FALSE;
+	}
 	else {
 	  result = done ? SUCCESS : FAIL;
 	  send_completed = TRUE;
@@ -611,11 +685,23 @@ implementation {
         /* acks are top priority */
         uint8_t myAckState;
         uint8_t myDataState;
+        bool myWinAck;
         atomic {
           myAckState = txBuf[TX_ACK_INDEX].state;
           myDataState = txBuf[TX_DATA_INDEX].state;
+          myWinAck = winAckPending;
+        }
+        if (myWinAck && myAckState == BUFFER_AVAILABLE) {
+          atomic {
+            txBuf[TX_ACK_INDEX].state = BUFFER_COMPLETE;
+            txBuf[TX_ACK_INDEX].buf = winAckSeqno;
+
+	    txProto = SERIAL_PROTO_WINDOW_ACK;
+	    txIndex = TX_ACK_INDEX;
+	    start_it = TRUE;
+	  }
         }
-        if (!ack_queue_is_empty() && myAckState == BUFFER_AVAILABLE) {
+        else if (!ack_queue_is_empty() && myAckState == BUFFER_AVAILABLE) {
           atomic {
             txBuf[TX_ACK_INDEX].state = BUFFER_COMPLETE;
             txBuf[TX_ACK_INDEX].buf = ack_queue_top();
@@ -49,6 +49,7 @@
 #include <sim_noise.h>
 #include <randomlib.h>
 #include "sim_lqi.c"
+#include <sim_prr.h>
 
 module CpmModelC {
 	provides interface GainRadioModel as Model;
@@ -81,7 +82,16 @@ implementation {
 		uint8_t lqi;   // MIKE_LIANG
 	};
 
-	receive_message_t* outstandingReceptionHead = NULL;
+	// Outstanding receptions are bucketed by channel, so that computing
+	// the noise on one channel does not walk traffic on the others.
+	enum {
+		CPM_CHANNEL_BUCKETS = 16,
+	};
+	receive_message_t* outstandingReceptions[CPM_CHANNEL_BUCKETS];
+
+	uint8_t channelBucket(uint8_t channel) {
+		return (channel >= 11 && channel <= 26) ? (channel - 11) : (channel % CPM_CHANNEL_BUCKETS);
+	}
 
 	receive_message_t* allocate_receive_message();
 	void free_receive_message(receive_message_t* msg);
@@ -154,11 +164,7 @@ implementation {
 	}
 
 	double arr_estimate_from_snr(double SNR) {
-		double beta1 = 0.9794;
-		double beta2 = 2.3851;
-		double X = SNR-beta2;
-		double PSE = 0.5*erfc(beta1*X/sqrt(2));
-		double prr_hat = pow(1-PSE, 23*2);
+		double prr_hat = sim_prr_from_snr(SNR);
 		dbg("CpmModelC,SNRLoss", "SNR is %lf, ARR is %lf\n", SNR, prr_hat);
 		if (prr_hat > 1)
 			prr_hat = 1.1;
@@ -233,14 +239,9 @@ implementation {
 	}
 
 	double prr_estimate_from_snr(double SNR) {
-		// Based on CC2420 measurement by Kannan.
-		// The updated function below fixes the problem of non-zero PRR
-		// at very low SNR. With this function PRR is 0 for SNR <= 3.
-		double beta1 = 0.9794;
-		double beta2 = 2.3851;
-		double X = SNR-beta2;
-		double PSE = 0.5*erfc(beta1*X/sqrt(2));
-		double prr_hat = pow(1-PSE, 23*2);
+		// Based on CC2420 measurement by Kannan, see sim_prr_exact().
+		// With this function PRR is 0 for SNR <= 3.
+		double prr_hat = sim_prr_from_snr(SNR);
 		dbg("CpmModelC,SNR", "SNR is %lf, PRR is %lf\n", SNR, prr_hat);
 		if (prr_hat > 1)
 			prr_hat = 1.1;
@@ -264,9 +265,9 @@ implementation {
 
 	bool checkReceive(receive_message_t* msg) {
 		double noise = noise_hash_generation();
-		receive_message_t* list = outstandingReceptionHead;
+		receive_message_t* list = outstandingReceptions[channelBucket(sim_mote_get_radio_channel(sim_node()))];
 		int count = 0;
-		noise = pow(10.0, noise / 10.0);
+		noise = sim_dbm_to_mw(noise);
 		while (list != NULL) {
 			dbg("CpmModelC", "checkReceive: outstanding from %d\n", list->source);
 			count++;
@@ -277,11 +278,11 @@ implementation {
 			}
 
 			if (list != msg) {
-				noise += pow(10.0, list->power / 10.0);
+				noise += sim_dbm_to_mw(list->power);
 			}
 			list = list->next;
 		}
-		noise = 10.0 * log(noise) / log(10.0);
+		noise = sim_mw_to_dbm(noise);
 		dbg("CpmModelC", "checkReceive: outstanding count %d noise %lf at %lf\n", count, noise, (double) sim_time() / sim_ticks_per_sec());
 		msg->lqi = sim_lqi_generate(msg->power - noise);
 		return shouldReceive(msg->power - noise);
@@ -289,9 +290,9 @@ implementation {
 
 	double packetNoise(receive_message_t* msg) {
 		double noise = noise_hash_generation();
-		receive_message_t* list = outstandingReceptionHead;
+		receive_message_t* list = outstandingReceptions[channelBucket(sim_mote_get_radio_channel(sim_node()))];
 		int count = 0;
-		noise = pow(10.0, noise / 10.0);
+		noise = sim_dbm_to_mw(noise);
 		while (list != NULL) {
 			dbg("CpmModelC", "packetReceive: outstanding from %d\n", list->source);
 			count++;
@@ -301,11 +302,11 @@ implementation {
 				continue;
 			}
 			if (list != msg) {
-				noise += pow(10.0, list->power / 10.0);
+				noise += sim_dbm_to_mw(list->power);
 			}
 			list = list->next;
 		}
-		noise = 10.0 * log(noise) / log(10.0);
+		noise = sim_mw_to_dbm(noise);
 		dbg("CpmModelC", "packetReceive: outstanding count %d noise %lf at %lf\n", count, noise, (double) sim_time() / sim_ticks_per_sec());
 		return noise;
 	}
@@ -321,7 +322,8 @@ implementation {
 	void sim_gain_receive_handle(sim_event_t* evt) {
 		receive_message_t* mine = (receive_message_t*)evt->data;
 		receive_message_t* predecessor = NULL;
-		receive_message_t* list = outstandingReceptionHead;
+		receive_message_t** head = &outstandingReceptions[channelBucket(mine->channel)];
+		receive_message_t* list = *head;
 
 		dbg("CpmModelC", "Handling reception event @ %s.\n", sim_time_string());
 		while (list != NULL) {
@@ -333,8 +335,8 @@ implementation {
 		if (predecessor) {
 			predecessor->next = mine->next;
 		}
-		else if (mine == outstandingReceptionHead) { // must be head
-			outstandingReceptionHead = mine->next;
+		else if (mine == *head) { // must be head
+			*head = mine->next;
 		}
 		else {
 			dbgerror("CpmModelC", "Incoming packet list structure is corrupted: entry is not the head and no entry points to it.\n");
@@ -402,6 +404,7 @@ implementation {
 	void enqueue_receive_event(int source, sim_time_t endTime, message_t* msg, bool receive, double power, double reversePower) {
 		sim_event_t* evt;
 		receive_message_t* list;
+		receive_message_t** head;
 		receive_message_t* rcv = allocate_receive_message();
 		double noiseStr = packetNoise(rcv);
 		rcv->source = source;
@@ -413,7 +416,7 @@ implementation {
 		// the signal. By sampling this here, it assumes that the packet RSSI is sampled at
 		// the beginning of the packet. This is true for the CC2420, but is not true for all
 		// radios. But generalizing seems like complexity for minimal gain at this point.
-		rcv->strength = (int8_t)(floor(10.0 * log(pow(10.0, power/10.0) + pow(10.0, noiseStr/10.0)) / log(10.0)));
+		rcv->strength = (int8_t)(floor(sim_mw_to_dbm(sim_dbm_to_mw(power) + sim_dbm_to_mw(noiseStr))));
 		rcv->msg = msg;
 		rcv->lost = 0;
 		rcv->ack = receive;
@@ -446,9 +449,10 @@ implementation {
 			receiving = 1;
 		}
 
-		list = outstandingReceptionHead;
+		head = &outstandingReceptions[channelBucket(rcv->channel)];
+		list = *head;
 		while (list != NULL) {
-			if (list->channel != sim_mote_get_radio_channel(source)) {   // MIKE_LIANG
+			if (list->channel != rcv->channel) {   // MIKE_LIANG
 				list = list->next;
 				continue;
 			}
@@ -459,8 +463,8 @@ implementation {
 			list = list->next;
 		}
 
-		rcv->next = outstandingReceptionHead;
-		outstandingReceptionHead = rcv;
+		rcv->next = *head;
+		*head = rcv;
 		evt = allocate_receive_event(endTime, rcv);
 		sim_queue_insert(evt);
 
@@ -476,6 +480,7 @@ implementation {
 
 	command void Model.putOnAirTo(int dest, message_t* msg, bool ack, sim_time_t endTime, double power, double reversePower) {
 		receive_message_t* list;
+		int bucket;
 		gain_entry_t* neighborEntry = sim_gain_first(sim_node());
 		requestAck = ack;
 		outgoing = msg;
@@ -488,11 +493,13 @@ implementation {
 			neighborEntry = sim_gain_next(neighborEntry);
 		}
 
-		list = outstandingReceptionHead;
-		while (list != NULL) {    
-			list->lost = 1;
-			dbg("CpmModelC,SNRLoss", "Lost packet from %i because %i has outstanding reception, startTime %llu endTime %llu\n", list->source, sim_node(), list->start, list->end);
-			list = list->next;
+		for (bucket = 0; bucket < CPM_CHANNEL_BUCKETS; bucket++) {
+			list = outstandingReceptions[bucket];
+			while (list != NULL) {
+				list->lost = 1;
+				dbg("CpmModelC,SNRLoss", "Lost packet from %i because %i has outstanding reception, startTime %llu endTime %llu\n", list->source, sim_node(), list->start, list->end);
+				list = list->next;
+			}
 		}
 	}
 
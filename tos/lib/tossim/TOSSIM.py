@@ -259,6 +259,12 @@ class Tossim(_object):
     def addChannel(*args): return _TOSSIM.Tossim_addChannel(*args)
     def removeChannel(*args): return _TOSSIM.Tossim_removeChannel(*args)
     def randomSeed(*args): return _TOSSIM.Tossim_randomSeed(*args)
+    def setPrrMode(*args): return _TOSSIM.Tossim_setPrrMode(*args)
+    def prrReport(*args): return _TOSSIM.Tossim_prrReport(*args)
+    def setNoiseDecorrelationHorizon(*args): return _TOSSIM.Tossim_setNoiseDecorrelationHorizon(*args)
+    def noiseDecorrelationHorizon(*args): return _TOSSIM.Tossim_noiseDecorrelationHorizon(*args)
+    def noiseResyncCount(*args): return _TOSSIM.Tossim_noiseResyncCount(*args)
+    def noiseSkippedSamples(*args): return _TOSSIM.Tossim_noiseSkippedSamples(*args)
     def runNextEvent(*args): return _TOSSIM.Tossim_runNextEvent(*args)
     def mac(*args): return _TOSSIM.Tossim_mac(*args)
     def radio(*args): return _TOSSIM.Tossim_radio(*args)
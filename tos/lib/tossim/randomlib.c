@@ -39,6 +39,7 @@
 static double randU[97], randC, randCD, randCM;
 static int i97,j97;
 static int test = FALSE;
+static unsigned int draws = 0;
 
 /*
    This is the initialization routine for the random number generator.
@@ -96,6 +97,23 @@ void RandomInitialise(int ij,int kl)
    test = TRUE;
 }
 
+/*
+   Makes the next RandomUniform() initialise from sim_random() again, so
+   that its sequence follows the simulation seed (used by trace replay).
+*/
+void RandomReseed(void)
+{
+   test = FALSE;
+}
+
+/*
+   Number of RandomUniform() calls so far (counted by the event trace).
+*/
+unsigned int RandomDraws(void)
+{
+   return draws;
+}
+
 /* 
    This is the random number generator proposed by George Marsaglia in
    Florida State University Report: FSU-SCRI-87-50
@@ -116,6 +134,7 @@ double RandomUniform(void)
    	RandomInitialise(seed1,seed2);
 #endif
 	}
+   draws++;
    uni = randU[i97-1] - randU[j97-1];
    if (uni <= 0.0)
       uni++;
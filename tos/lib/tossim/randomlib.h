@@ -44,6 +44,8 @@ extern "C" {
 #endif
 
 void   RandomInitialise(int,int);
+void   RandomReseed(void);
+unsigned int RandomDraws(void);
 double RandomUniform(void);
 double RandomGaussian(double,double);
 int    RandomInt(int,int);
@@ -88,6 +88,7 @@ extern uint16_t TOS_NODE_ID;
 #include <sim_tossim.h>
 #include <sim_mote.h>
 #include <sim_log.h>
+#include <sim_trace.h>
 
 // We only want to include these files if we are compiling TOSSIM proper,
 // that is, the C file representing the TinyOS application. The TinyOS
@@ -102,6 +103,7 @@ struct @exactlyonce { };
 #include <sim_log.c>
 #include <heap.c>
 #include <sim_event_queue.c>
+#include <sim_trace.c>
 #include <sim_tossim.c>
 #include <sim_mac.c>
 #include <sim_packet.c>
@@ -55,8 +55,20 @@ int numTotal = 0;
 
 uint32_t FreqKeyNum = 0;
 
+uint32_t noiseDecorrelationHorizon = NOISE_DECORRELATION_HORIZON;
+// Noise samples not generated because a stale key was resynchronized.
+uint64_t noiseSkippedSamples = 0;
+
 sim_noise_node_t noiseData[TOSSIM_MAX_NODES];
 
+#define NOISE_KEY_BIN_MASK ((uint64_t)((1 << NOISE_KEY_BIN_BITS) - 1))
+#define NOISE_KEY_LO_MASK ((((uint64_t)1) << (NOISE_KEY_LO_SLOTS * NOISE_KEY_BIN_BITS)) - 1)
+#define NOISE_KEY_HI_MASK ((((uint64_t)1) << (NOISE_KEY_HI_SLOTS * NOISE_KEY_BIN_BITS)) - 1)
+
+// noiseKeyPow[i] is the weight of history position i in the key hash,
+// NOISE_KEY_HASH_MULT^(NOISE_HISTORY - 1 - i).
+static unsigned int noiseKeyPow[NOISE_HISTORY];
+
 static unsigned int sim_noise_hash(void *key);
 static int sim_noise_eq(void *key1, void *key2);
 
@@ -70,18 +82,24 @@ void sim_noise_init()__attribute__ ((C, spontaneous))
   int i;
   
   //printf("Starting\n");
+
+  noiseKeyPow[NOISE_HISTORY - 1] = 1;
+  for (i = NOISE_HISTORY - 2; i >= 0; i--) {
+    noiseKeyPow[i] = noiseKeyPow[i + 1] * NOISE_KEY_HASH_MULT;
+  }
   
   for (j=0; j< TOSSIM_MAX_NODES; j++) {
-    for (i = 0; i < 16; i++) {
-      noiseData[j].noiseGenTime[i] = 0;
-      noiseData[j].key[i] = (char*)malloc(NOISE_HISTORY);
+    memset(&noiseData[j].key, 0, sizeof(sim_noise_key_t));
+    for (i = 0; i < NOISE_CHANNELS; i++) {
+      noiseData[j].channel[i] = NULL;
     }
     noiseData[j].noiseTable = create_hashtable(NOISE_HASHTABLE_SIZE, sim_noise_hash, sim_noise_eq);
     noiseData[j].noiseTrace = (char*)(malloc(sizeof(char) * NOISE_MIN_TRACE));
     noiseData[j].noiseTraceLen = NOISE_MIN_TRACE;
     noiseData[j].noiseTraceIndex = 0;
-
+    noiseData[j].resyncCount = 0;
   }
+  noiseSkippedSamples = 0;
   //printf("Done with sim_noise_init()\n");
 }
 
@@ -91,8 +109,10 @@ void sim_noise_create_model(uint16_t node_id)__attribute__ ((C, spontaneous)) {
   makeNoiseModel(node_id);
   makePmfDistr(node_id);
   
-  for (i = 1; i < 16; i++) {
-    memcpy((void *)(noiseData[node_id].key[i]), (void *)(noiseData[node_id].key[0]), NOISE_HISTORY);
+  for (i = 0; i < NOISE_CHANNELS; i++) {
+    if (noiseData[node_id].channel[i] != NULL) {
+      noiseData[node_id].channel[i]->key = noiseData[node_id].key;
+    }
   }
 }
 
@@ -137,31 +157,64 @@ char search_noise_from_bin_num(int i)__attribute__ ((C, spontaneous))
   return noise;
 }
 
-static unsigned int sim_noise_hash(void *key) {
-  char *pt = (char *)key;
-  unsigned int hashVal = 0;
-  int i;
-  for (i=0; i< NOISE_HISTORY; i++) {
-    hashVal = pt[i] + (hashVal << 6) + (hashVal << 16) - hashVal;
+/*
+ * History position 0 is the oldest sample, NOISE_HISTORY-1 the newest.
+ */
+static inline uint8_t sim_noise_key_get(sim_noise_key_t *key, int pos) {
+  int slot = NOISE_HISTORY - 1 - pos;
+  if (slot < NOISE_KEY_LO_SLOTS) {
+    return (uint8_t)((key->lo >> (slot * NOISE_KEY_BIN_BITS)) & NOISE_KEY_BIN_MASK);
+  }
+  slot -= NOISE_KEY_LO_SLOTS;
+  return (uint8_t)((key->hi >> (slot * NOISE_KEY_BIN_BITS)) & NOISE_KEY_BIN_MASK);
+}
+
+static inline void sim_noise_key_set(sim_noise_key_t *key, int pos, uint8_t bin) {
+  int slot = NOISE_HISTORY - 1 - pos;
+  uint8_t old = sim_noise_key_get(key, pos);
+  if (slot < NOISE_KEY_LO_SLOTS) {
+    int shift = slot * NOISE_KEY_BIN_BITS;
+    key->lo = (key->lo & ~(NOISE_KEY_BIN_MASK << shift)) | ((uint64_t)bin << shift);
   }
-  return hashVal;
+  else {
+    int shift = (slot - NOISE_KEY_LO_SLOTS) * NOISE_KEY_BIN_BITS;
+    key->hi = (key->hi & ~(NOISE_KEY_BIN_MASK << shift)) | ((uint64_t)bin << shift);
+  }
+  key->hash += ((unsigned int)bin - (unsigned int)old) * noiseKeyPow[pos];
+}
+
+/*
+ * Drop the oldest bin and append bin as the newest one.
+ */
+static inline void sim_noise_key_shift(sim_noise_key_t *key, uint8_t bin) {
+  uint8_t oldest = sim_noise_key_get(key, 0);
+  key->hi = ((key->hi << NOISE_KEY_BIN_BITS) |
+             (key->lo >> ((NOISE_KEY_LO_SLOTS - 1) * NOISE_KEY_BIN_BITS))) & NOISE_KEY_HI_MASK;
+  key->lo = ((key->lo << NOISE_KEY_BIN_BITS) | bin) & NOISE_KEY_LO_MASK;
+  key->hash = (key->hash - oldest * noiseKeyPow[0]) * NOISE_KEY_HASH_MULT + bin;
+}
+
+static unsigned int sim_noise_hash(void *key) {
+  return ((sim_noise_key_t *)key)->hash;
 }
 
 static int sim_noise_eq(void *key1, void *key2) {
-  return (memcmp((void *)key1, (void *)key2, NOISE_HISTORY) == 0);
+  sim_noise_key_t *k1 = (sim_noise_key_t *)key1;
+  sim_noise_key_t *k2 = (sim_noise_key_t *)key2;
+  return (k1->lo == k2->lo) && (k1->hi == k2->hi);
 }
 
 void sim_noise_add(uint16_t node_id, char noise)__attribute__ ((C, spontaneous))
 {
   int i;
   struct hashtable *pnoiseTable = noiseData[node_id].noiseTable;
-  char *key = noiseData[node_id].key[0];
+  sim_noise_key_t *key = &noiseData[node_id].key;
   sim_noise_hash_t *noise_hash;
   noise_hash = (sim_noise_hash_t *)hashtable_search(pnoiseTable, key);
   dbg("Insert", "Adding noise value %hhi\n", noise);
   if (noise_hash == NULL)	{
     noise_hash = (sim_noise_hash_t *)malloc(sizeof(sim_noise_hash_t));
-    memcpy((void *)(noise_hash->key), (void *)key, NOISE_HISTORY);
+    noise_hash->key = *key;
     
     noise_hash->numElements = 0;
     noise_hash->size = NOISE_DEFAULT_ELEMENT_SIZE;
@@ -173,15 +226,15 @@ void sim_noise_add(uint16_t node_id, char noise)__attribute__ ((C, spontaneous))
 	noise_hash->dist[i] = 0;
     }
     {   // MIKE_LIANG
-      void* ckey = malloc(NOISE_HISTORY);
-      memcpy(ckey, key, NOISE_HISTORY);
+      sim_noise_key_t* ckey = (sim_noise_key_t*)malloc(sizeof(sim_noise_key_t));
+      *ckey = *key;
       hashtable_insert(pnoiseTable, ckey, noise_hash);
     }
     dbg("Insert", "Inserting %p into table %p with key ", noise_hash, pnoiseTable);
     {
       int ctr;
       for(ctr = 0; ctr < NOISE_HISTORY; ctr++)
-	dbg_clear("Insert", "%0.3hhi ", key[ctr]);
+	dbg_clear("Insert", "%0.3hhi ", sim_noise_key_get(key, ctr));
     }
     dbg_clear("Insert", "\n");
   }
@@ -209,8 +262,8 @@ void sim_noise_dist(uint16_t node_id)__attribute__ ((C, spontaneous))
   uint8_t bin;
   float cmf = 0;
   struct hashtable *pnoiseTable = noiseData[node_id].noiseTable;
-  char *key = noiseData[node_id].key[0];
-  char *freqKey = noiseData[node_id].freqKey;
+  sim_noise_key_t *key = &noiseData[node_id].key;
+  sim_noise_key_t *freqKey = &noiseData[node_id].freqKey;
   sim_noise_hash_t *noise_hash;
   noise_hash = (sim_noise_hash_t *)hashtable_search(pnoiseTable, key);
 
@@ -247,21 +300,43 @@ void sim_noise_dist(uint16_t node_id)__attribute__ ((C, spontaneous))
     {
       int j;
       FreqKeyNum = noise_hash->numElements;
-      memcpy((void *)freqKey, (void *)key, NOISE_HISTORY);
+      *freqKey = *key;
       dbg("HashZeroDebug", "Setting most frequent key (%i): ", (int) FreqKeyNum);
       for (j = 0; j < NOISE_HISTORY; j++) {
-	dbg_clear("HashZeroDebug", "[%hhu] ", key[j]);
+	dbg_clear("HashZeroDebug", "[%hhu] ", sim_noise_key_get(key, j));
       }
       dbg_clear("HashZeroDebug", "\n");
     }
 }
 
-void arrangeKey(uint16_t node_id, uint8_t channel)__attribute__ ((C, spontaneous))
+static inline uint8_t sim_noise_channel_index(uint8_t channel) {
+  return (channel >= 11 && channel <= 26) ? (channel - 11) : (channel % NOISE_CHANNELS);
+}
+
+/*
+ * Returns the generation state of a channel, allocating it on first use.
+ * A new channel starts from the key the model finished building with.
+ */
+sim_noise_channel_t* sim_noise_channel(uint16_t node_id, uint8_t channel)__attribute__ ((C, spontaneous))
 {
-  uint8_t cchannel = (channel >= 11 && channel <= 26) ? (channel - 11) : channel;
-  char *pKey = noiseData[node_id].key[cchannel];
-  memcpy(pKey, pKey+1, NOISE_HISTORY-1);
+  uint8_t cchannel = sim_noise_channel_index(channel);
+  sim_noise_channel_t* state = noiseData[node_id].channel[cchannel];
+  if (state == NULL) {
+    state = (sim_noise_channel_t*)malloc(sizeof(sim_noise_channel_t));
+    state->key = noiseData[node_id].key;
+    state->lastNoiseVal = 0;
+    state->noiseGenTime = 0;
+    noiseData[node_id].channel[cchannel] = state;
+  }
+  return state;
+}
 
+/*
+ * Shift the bin of a new noise sample into a history key.
+ */
+void arrangeKey(sim_noise_key_t *key, char noise)__attribute__ ((C, spontaneous))
+{
+  sim_noise_key_shift(key, search_bin_num(noise));
 }
 
 /*
@@ -270,27 +345,23 @@ void arrangeKey(uint16_t node_id, uint8_t channel)__attribute__ ((C, spontaneous
 void makePmfDistr(uint16_t node_id)__attribute__ ((C, spontaneous))
 {
   int i;
-  char *pKey = noiseData[node_id].key[0];
-  char *fKey = noiseData[node_id].freqKey;
+  sim_noise_key_t *pKey = &noiseData[node_id].key;
+  sim_noise_key_t *fKey = &noiseData[node_id].freqKey;
 
   FreqKeyNum = 0;
   for(i=0; i<NOISE_HISTORY; i++) {
-    pKey[i] = /* noiseData[node_id].noiseTrace[i]; // */ search_bin_num(noiseData[node_id].noiseTrace[i]);
+    sim_noise_key_set(pKey, i, search_bin_num(noiseData[node_id].noiseTrace[i]));
   }
 
   for(i = NOISE_HISTORY; i < noiseData[node_id].noiseTraceIndex; i++) {
-    if (i == NOISE_HISTORY) {
-      //printf("Inserting first element.\n");
-    }
     sim_noise_dist(node_id);
-    arrangeKey(node_id, 11);
-    pKey[NOISE_HISTORY-1] =  search_bin_num(noiseData[node_id].noiseTrace[i]);
+    arrangeKey(pKey, noiseData[node_id].noiseTrace[i]);
   }
 
   dbg_clear("HASH", "FreqKey = ");
   for (i=0; i< NOISE_HISTORY ; i++)
     {
-      dbg_clear("HASH", "%d,", fKey[i]);
+      dbg_clear("HASH", "%d,", sim_noise_key_get(fKey, i));
     }
   dbg_clear("HASH", "\n");
 }
@@ -300,15 +371,13 @@ void sim_noise_alarm() {
   dummy = 5;
 }
 
-char sim_noise_gen(uint16_t node_id, uint8_t channel)__attribute__ ((C, spontaneous))
+char sim_noise_gen(uint16_t node_id, sim_noise_key_t *pKey)__attribute__ ((C, spontaneous))
 {
-  uint8_t cchannel = (channel >= 11 && channel <= 26) ? (channel - 11) : channel;
   int i;
   int noiseIndex = 0;
   char noise;
   struct hashtable *pnoiseTable = noiseData[node_id].noiseTable;
-  char *pKey = noiseData[node_id].key[cchannel];
-  char *fKey = noiseData[node_id].freqKey;
+  sim_noise_key_t *fKey = &noiseData[node_id].freqKey;
   double ranNum = RandomUniform();
   sim_noise_hash_t *noise_hash;
   noise_hash = (sim_noise_hash_t *)hashtable_search(pnoiseTable, pKey);
@@ -321,13 +390,13 @@ char sim_noise_gen(uint16_t node_id, uint8_t channel)__attribute__ ((C, spontane
     noise = 0;
     dbg_clear("HASH", "(N)Noise\n");
     dbg("HashZeroDebug", "Defaulting to common hash.\n");
-    memcpy((void *)pKey, (void *)fKey, NOISE_HISTORY);
+    *pKey = *fKey;
     noise_hash = (sim_noise_hash_t *)hashtable_search(pnoiseTable, pKey);
   }
   
   dbg_clear("HASH", "Key = ");
   for (i=0; i< NOISE_HISTORY ; i++) {
-    dbg_clear("HASH", "%d,", pKey[i]);
+    dbg_clear("HASH", "%d,", sim_noise_key_get(pKey, i));
   }
   dbg_clear("HASH", "\n");
   
@@ -377,25 +446,62 @@ char sim_noise_gen(uint16_t node_id, uint8_t channel)__attribute__ ((C, spontane
   return noise;
 }
 
+void sim_noise_set_decorrelation_horizon(uint32_t horizon)__attribute__ ((C, spontaneous)) {
+  noiseDecorrelationHorizon = horizon;
+}
+
+uint32_t sim_noise_get_decorrelation_horizon()__attribute__ ((C, spontaneous)) {
+  return noiseDecorrelationHorizon;
+}
+
+uint32_t sim_noise_resync_count(uint16_t node_id)__attribute__ ((C, spontaneous)) {
+  return noiseData[node_id].resyncCount;
+}
+
+uint64_t sim_noise_skipped_samples()__attribute__ ((C, spontaneous)) {
+  return noiseSkippedSamples;
+}
+
+/*
+ * Replace the history key of a channel with one drawn from the
+ * stationary distribution of the model. Every history window of the
+ * trace was inserted into the table by makeNoiseModel(), so picking a
+ * window uniformly samples keys in proportion to how often they occur.
+ */
+void sim_noise_resync(uint16_t node_id, sim_noise_key_t *pKey)__attribute__ ((C, spontaneous)) {
+  char *trace = noiseData[node_id].noiseTrace;
+  uint32_t windows = noiseData[node_id].noiseTraceIndex - NOISE_HISTORY;
+  uint32_t end = NOISE_HISTORY + (uint32_t)(RandomUniform() * windows);
+  uint32_t i;
+
+  if (end >= noiseData[node_id].noiseTraceIndex) {
+    end = noiseData[node_id].noiseTraceIndex - 1;
+  }
+  for (i = end - NOISE_HISTORY; i < end; i++) {
+    sim_noise_key_shift(pKey, search_bin_num(trace[i]));
+  }
+  noiseData[node_id].resyncCount++;
+}
+
 char sim_noise_generate(uint16_t node_id, uint8_t channel, uint32_t cur_t)__attribute__ ((C, spontaneous)) {
   uint32_t i;
   uint32_t prev_t;
   uint32_t delta_t;
-  char *noiseG;
   char noise;
-  uint8_t cchannel = (channel >= 11 && channel <= 26) ? (channel - 11) : channel;
-  
-  prev_t = noiseData[node_id].noiseGenTime[cchannel];
+  sim_noise_channel_t *state;
 
   if (noiseData[node_id].generated == 0) {
     dbgerror("TOSSIM", "Tried to generate noise from an uninitialized radio model of node %hu.\n", node_id);
     return 127;
   }
+
+  state = sim_noise_channel(node_id, channel);
+  prev_t = state->noiseGenTime;
   
   if ( (0<= cur_t) && (cur_t < NOISE_HISTORY) ) {
-    noiseData[node_id].noiseGenTime[cchannel] = cur_t;
-    noiseData[node_id].key[cchannel][cur_t] = search_bin_num(noiseData[node_id].noiseTrace[cur_t]);
-    noiseData[node_id].lastNoiseVal[cchannel] = noiseData[node_id].noiseTrace[cur_t];
+    state->noiseGenTime = cur_t;
+    sim_noise_key_set(&state->key, cur_t, search_bin_num(noiseData[node_id].noiseTrace[cur_t]));
+    state->lastNoiseVal = noiseData[node_id].noiseTrace[cur_t];
     return noiseData[node_id].noiseTrace[cur_t];
   }
 
@@ -407,21 +513,23 @@ char sim_noise_generate(uint16_t node_id, uint8_t channel, uint32_t cur_t)__attr
   dbg_clear("HASH", "delta_t = %d\n", delta_t);
   
   if (delta_t == 0)
-    noise = noiseData[node_id].lastNoiseVal[cchannel];
+    noise = state->lastNoiseVal;
   else {
-    noiseG = (char *)malloc(sizeof(char)*delta_t);
-    
+    if (noiseDecorrelationHorizon > 0 && delta_t > noiseDecorrelationHorizon &&
+        noiseData[node_id].noiseTraceIndex > NOISE_HISTORY) {
+      dbg("Noise", "Resynchronizing noise key of node %hu after %u samples.\n", node_id, delta_t);
+      sim_noise_resync(node_id, &state->key);
+      noiseSkippedSamples += delta_t - 1;
+      delta_t = 1;
+    }
+    noise = 0;
     for(i=0; i< delta_t; i++) {
-      noiseG[i] = sim_noise_gen(node_id, channel);
-      arrangeKey(node_id, channel);
-      noiseData[node_id].key[cchannel][NOISE_HISTORY-1] = search_bin_num(noiseG[i]);
+      noise = sim_noise_gen(node_id, &state->key);
+      arrangeKey(&state->key, noise);
     }
-    noise = noiseG[delta_t-1];
-    noiseData[node_id].lastNoiseVal[cchannel] = noise;
-    
-    free(noiseG);
+    state->lastNoiseVal = noise;
   }
-  noiseData[node_id].noiseGenTime[cchannel] = cur_t;
+  state->noiseGenTime = cur_t;
   if (noise == 0) {
     dbg("HashZeroDebug", "Generated noise of zero.\n");
   }
@@ -436,8 +544,8 @@ char sim_noise_generate(uint16_t node_id, uint8_t channel, uint32_t cur_t)__attr
 void makeNoiseModel(uint16_t node_id)__attribute__ ((C, spontaneous)) {
   int i;
   for(i=0; i<NOISE_HISTORY; i++) {
-    noiseData[node_id].key[0][i] = search_bin_num(noiseData[node_id].noiseTrace[i]);
-    dbg("Insert", "Setting history %i to be %i\n", (int)i, (int)noiseData[node_id].key[i]);
+    sim_noise_key_set(&noiseData[node_id].key, i, search_bin_num(noiseData[node_id].noiseTrace[i]));
+    dbg("Insert", "Setting history %i to be %i\n", (int)i, (int)sim_noise_key_get(&noiseData[node_id].key, i));
   }
   
   //sim_noise_add(node_id, noiseData[node_id].noiseTrace[NOISE_HISTORY]);
@@ -445,8 +553,7 @@ void makeNoiseModel(uint16_t node_id)__attribute__ ((C, spontaneous)) {
   
   for(i = NOISE_HISTORY; i < noiseData[node_id].noiseTraceIndex; i++) {
     sim_noise_add(node_id, noiseData[node_id].noiseTrace[i]);
-    arrangeKey(node_id, 11);
-    noiseData[node_id].key[0][NOISE_HISTORY-1] = search_bin_num(noiseData[node_id].noiseTrace[i]);
+    arrangeKey(&noiseData[node_id].key, noiseData[node_id].noiseTrace[i]);
   }
   noiseData[node_id].generated = 1;
 }
@@ -48,6 +48,16 @@
 extern "C" {
 #endif
 
+/*
+ * If a channel has not been sampled for more than this many noise
+ * samples, sim_noise_generate() does not chain through the whole gap.
+ * Instead it resynchronizes the history key by drawing one from the
+ * model's stationary (empirical) distribution. 0 disables resyncing.
+ */
+#ifndef NOISE_DECORRELATION_HORIZON
+#define NOISE_DECORRELATION_HORIZON 0
+#endif
+
 enum {
   NOISE_MIN = -115,
   NOISE_MAX = -5,
@@ -59,10 +69,29 @@ enum {
   NOISE_HASHTABLE_SIZE = 128,
   NOISE_MIN_TRACE = 128, 
   NOISE_NUM_VALUES = NOISE_MAX - NOISE_MIN + 1,    //TODO check the + 1, also in NOISE_BIN_SIZE above in the inner parens
+  // A history key is NOISE_HISTORY bin numbers (1..NOISE_BIN_SIZE) packed
+  // into two 64-bit words, NOISE_KEY_BIN_BITS each. The newest bin sits in
+  // the low bits of lo; a bin never straddles the two words.
+  NOISE_KEY_BIN_BITS = 5,
+  NOISE_KEY_LO_SLOTS = 12,
+  NOISE_KEY_HI_SLOTS = NOISE_HISTORY - NOISE_KEY_LO_SLOTS,
+  NOISE_KEY_HASH_MULT = 65599,
+  NOISE_CHANNELS = 16,
 };
-  
+
+/*
+ * Packed noise history. hash is maintained incrementally as the key is
+ * shifted so that lookups never rehash the whole history; it is the same
+ * polynomial hash that was computed over the old char[] keys.
+ */
+typedef struct sim_noise_key_t {
+  uint64_t lo;
+  uint64_t hi;
+  unsigned int hash;
+} sim_noise_key_t;
+
 typedef struct sim_noise_hash_t {
-  char key[NOISE_HISTORY];
+  sim_noise_key_t key;
   int numElements;
   int size;
   char *elements;
@@ -70,16 +99,26 @@ typedef struct sim_noise_hash_t {
   float dist[NOISE_NUM_VALUES];
 } sim_noise_hash_t;
 
+/*
+ * Generation state of one radio channel. It is allocated the first time
+ * noise is generated on the channel, so nodes only pay for the channels
+ * they actually use.
+ */
+typedef struct sim_noise_channel_t {
+  sim_noise_key_t key;
+  char lastNoiseVal;
+  uint32_t noiseGenTime;
+} sim_noise_channel_t;
+
 typedef struct sim_noise_node_t {
-  //char key[NOISE_HISTORY];
-  char* key[16];
-  char freqKey[NOISE_HISTORY];
-  char lastNoiseVal[16];
-  uint32_t noiseGenTime[16];
+  sim_noise_key_t key;   // key used while building the model
+  sim_noise_key_t freqKey;
+  sim_noise_channel_t* channel[NOISE_CHANNELS];
   struct hashtable *noiseTable;
   char* noiseTrace;
   uint32_t noiseTraceLen;
   uint32_t noiseTraceIndex;
+  uint32_t resyncCount;
   bool generated;
 } sim_noise_node_t;
 
@@ -88,6 +127,10 @@ char sim_real_noise(uint16_t node_id, uint32_t cur_t);
 char sim_noise_generate(uint16_t node_id, uint8_t channel, uint32_t cur_t);   // char sim_noise_generate(uint16_t node_id, uint32_t cur_t);
 void sim_noise_trace_add(uint16_t node_id, char val);
 void sim_noise_create_model(uint16_t node_id);
+void sim_noise_set_decorrelation_horizon(uint32_t horizon);
+uint32_t sim_noise_get_decorrelation_horizon();
+uint32_t sim_noise_resync_count(uint16_t node_id);
+uint64_t sim_noise_skipped_samples();
   
 #ifdef __cplusplus
 }
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2005 Stanford University. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holder nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * SNR to PRR curve and dBm/mW conversions of the CPM radio model,
+ * exact or table-driven. See sim_prr.h.
+ */
+
+#include <math.h>
+#include <sim_prr.h>
+
+int prrMode = -1;
+double prrTable[SIM_PRR_TABLE_SIZE];
+double prrExp2Table[SIM_PRR_MANTISSA_STEPS + 1];  // 2^x, x in [0, 1]
+double prrLog2Table[SIM_PRR_MANTISSA_STEPS + 1];  // log2(x), x in [0.5, 1]
+
+static const double PRR_LOG2_10_OVER_10 = 0.33219280948873623479;
+static const double PRR_10_LOG10_2 = 3.01029995663981195214;
+
+void sim_prr_init(int mode)__attribute__ ((C, spontaneous))
+{
+  int i;
+  prrMode = mode;
+  if (mode != SIM_PRR_TABLE) {
+    return;
+  }
+  for (i = 0; i < SIM_PRR_TABLE_SIZE; i++) {
+    prrTable[i] = sim_prr_exact(SIM_PRR_SNR_MIN + (double)i / SIM_PRR_STEPS_PER_DB);
+  }
+  for (i = 0; i <= SIM_PRR_MANTISSA_STEPS; i++) {
+    prrExp2Table[i] = pow(2.0, (double)i / SIM_PRR_MANTISSA_STEPS);
+    prrLog2Table[i] = log(0.5 + 0.5 * i / SIM_PRR_MANTISSA_STEPS) / log(2.0);
+  }
+}
+
+int sim_prr_mode()__attribute__ ((C, spontaneous))
+{
+  if (prrMode < 0) {
+    sim_prr_init(SIM_PRR_DEFAULT_MODE);
+  }
+  return prrMode;
+}
+
+/*
+ * Based on CC2420 measurement by Kannan. PRR is 0 for SNR <= 3.
+ */
+double sim_prr_exact(double snr)__attribute__ ((C, spontaneous))
+{
+  double beta1 = 0.9794;
+  double beta2 = 2.3851;
+  double X = snr-beta2;
+  double PSE = 0.5*erfc(beta1*X/sqrt(2));
+  return pow(1-PSE, 23*2);
+}
+
+double sim_prr_from_snr(double snr)__attribute__ ((C, spontaneous))
+{
+  double pos;
+  int i;
+  if (sim_prr_mode() != SIM_PRR_TABLE) {
+    return sim_prr_exact(snr);
+  }
+  if (snr <= SIM_PRR_SNR_MIN) {
+    return prrTable[0];
+  }
+  if (snr >= SIM_PRR_SNR_MAX) {
+    return prrTable[SIM_PRR_TABLE_SIZE - 1];
+  }
+  pos = (snr - SIM_PRR_SNR_MIN) * SIM_PRR_STEPS_PER_DB;
+  i = (int)pos;
+  return prrTable[i] + (pos - i) * (prrTable[i + 1] - prrTable[i]);
+}
+
+/*
+ * 10^(dBm/10) computed as 2^(dBm * log2(10) / 10): the integer part of
+ * the exponent goes straight into the floating point exponent and the
+ * fraction is interpolated from prrExp2Table.
+ */
+double sim_dbm_to_mw(double dbm)__attribute__ ((C, spontaneous))
+{
+  double y, f, pos;
+  int n, i;
+  if (sim_prr_mode() != SIM_PRR_TABLE) {
+    return pow(10.0, dbm / 10.0);
+  }
+  y = dbm * PRR_LOG2_10_OVER_10;
+  n = (int)floor(y);
+  f = y - n;
+  pos = f * SIM_PRR_MANTISSA_STEPS;
+  i = (int)pos;
+  return ldexp(prrExp2Table[i] + (pos - i) * (prrExp2Table[i + 1] - prrExp2Table[i]), n);
+}
+
+double sim_mw_to_dbm(double mw)__attribute__ ((C, spontaneous))
+{
+  double m, pos;
+  int e, i;
+  if (sim_prr_mode() != SIM_PRR_TABLE || mw <= 0) {
+    return 10.0 * log(mw) / log(10.0);
+  }
+  m = frexp(mw, &e);
+  pos = (m - 0.5) * 2 * SIM_PRR_MANTISSA_STEPS;
+  i = (int)pos;
+  if (i >= SIM_PRR_MANTISSA_STEPS) {
+    i = SIM_PRR_MANTISSA_STEPS - 1;
+  }
+  return PRR_10_LOG10_2 * (e + prrLog2Table[i] + (pos - i) * (prrLog2Table[i + 1] - prrLog2Table[i]));
+}
+
+/*
+ * Print the worst-case error of the current mode against the exact
+ * expressions, over the ranges the radio model works in.
+ */
+void sim_prr_report(FILE* out)__attribute__ ((C, spontaneous))
+{
+  double x;
+  double prrErr = 0, mwErr = 0, dbmErr = 0;
+  for (x = SIM_PRR_SNR_MIN - 5; x <= SIM_PRR_SNR_MAX + 5; x += 0.001) {
+    double err = fabs(sim_prr_from_snr(x) - sim_prr_exact(x));
+    prrErr = (err > prrErr) ? err : prrErr;
+  }
+  for (x = -150.0; x <= 30.0; x += 0.001) {
+    double exact = pow(10.0, x / 10.0);
+    double err = fabs(sim_dbm_to_mw(x) - exact) / exact;
+    mwErr = (err > mwErr) ? err : mwErr;
+    err = fabs(sim_mw_to_dbm(exact) - x);
+    dbmErr = (err > dbmErr) ? err : dbmErr;
+  }
+  fprintf(out, "PRR mode %s: max |PRR error| %.3g, max relative mW error %.3g, max dBm error %.3g\n",
+          (sim_prr_mode() == SIM_PRR_TABLE) ? "table" : "exact", prrErr, mwErr, dbmErr);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2005 Stanford University. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the
+ *   distribution.
+ * - Neither the name of the copyright holder nor the names of
+ *   its contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIM_PRR_H_
+#define _SIM_PRR_H_
+
+#include <stdio.h>
+
+/*
+ * SNR to PRR curve and dBm/mW conversions used by the CPM radio model.
+ * SIM_PRR_EXACT evaluates the closed-form expressions with libm, as
+ * TOSSIM always has. SIM_PRR_TABLE uses precomputed tables with linear
+ * interpolation; sim_prr_report() prints its error against the exact
+ * formulas.
+ */
+enum {
+  SIM_PRR_EXACT = 0,
+  SIM_PRR_TABLE = 1,
+};
+
+#ifndef SIM_PRR_DEFAULT_MODE
+#define SIM_PRR_DEFAULT_MODE SIM_PRR_EXACT
+#endif
+
+enum {
+  // The PRR curve is 0 below and 1 above this SNR range (in dB).
+  SIM_PRR_SNR_MIN = -10,
+  SIM_PRR_SNR_MAX = 20,
+  SIM_PRR_STEPS_PER_DB = 64,
+  SIM_PRR_TABLE_SIZE = (SIM_PRR_SNR_MAX - SIM_PRR_SNR_MIN) * SIM_PRR_STEPS_PER_DB + 1,
+  // Resolution of the 2^x and log2(x) mantissa tables.
+  SIM_PRR_MANTISSA_STEPS = 256,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void sim_prr_init(int mode);
+int sim_prr_mode();
+double sim_prr_exact(double snr);
+double sim_prr_from_snr(double snr);
+double sim_dbm_to_mw(double dbm);
+double sim_mw_to_dbm(double mw);
+void sim_prr_report(FILE* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
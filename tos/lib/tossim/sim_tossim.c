@@ -47,18 +47,27 @@
 #include <sys/time.h>
 
 #include <sim_noise.h> //added by HyungJune Lee
+#include <sim_trace.h>
+#include <randomlib.h>
 
 static sim_time_t sim_ticks;
 static unsigned long current_node;
 static int sim_seed;
+static uint32_t sim_random_draws;
 
 static int __nesc_nido_resolve(int mote, char* varname, uintptr_t* addr, size_t* size);
 
+// Random numbers drawn from either generator, for the event trace
+static uint32_t sim_random_draw_count() {
+  return sim_random_draws + RandomDraws();
+}
+
 void sim_init() __attribute__ ((C, spontaneous)) {
   sim_queue_init();
   sim_log_init();
   sim_log_commit_change();
   sim_noise_init(); //added by HyungJune Lee
+  sim_trace_init();
 
   {
     struct timeval tv;
@@ -79,6 +88,7 @@ void sim_init() __attribute__ ((C, spontaneous)) {
 
 void sim_end() __attribute__ ((C, spontaneous)) {
   sim_queue_init();
+  sim_trace_close();
 }
 
 
@@ -86,6 +96,7 @@ void sim_end() __attribute__ ((C, spontaneous)) {
 int sim_random() __attribute__ ((C, spontaneous)) {
   uint32_t mlcg,p,q;
   uint64_t tmpseed;
+  sim_random_draws++;
   tmpseed =  (uint64_t)33614U * (uint64_t)sim_seed;
   q = tmpseed;    /* low */
   q = q >> 1;
@@ -129,7 +140,13 @@ void sim_set_node(unsigned long node) __attribute__ ((C, spontaneous)) {
 bool sim_run_next_event() __attribute__ ((C, spontaneous)) {
   bool result = FALSE;
   if (!sim_queue_is_empty()) {
-    sim_event_t* event = sim_queue_pop();
+    sim_event_t* event;
+    uint32_t draws;
+    if (sim_trace_enabled) {
+      sim_trace_start(&sim_seed);
+    }
+    draws = sim_random_draw_count();
+    event = sim_queue_pop();
     sim_set_time(event->time);
     sim_set_node(event->mote);
 
@@ -145,6 +162,9 @@ bool sim_run_next_event() __attribute__ ((C, spontaneous)) {
     else {
       dbg_clear("Tossim", "\n");
     }
+    if (sim_trace_enabled) {
+      sim_trace_event(event, sim_random_draw_count() - draws, result);
+    }
     if (event->cleanup != NULL) {
       event->cleanup(event);
     }
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sim_trace.h>
+#include <randomlib.h>
+
+int sim_trace_enabled = 0;
+static FILE* traceOut = NULL;
+static FILE* traceIn = NULL;
+static bool traceStarted = FALSE;
+static bool traceDiverged = FALSE;
+static uint64_t traceEvents = 0;
+
+static struct {
+  void (*handle)(sim_event_t* e);
+  uint32_t id;
+} traceHandlers[SIM_TRACE_MAX_HANDLERS];
+static uint32_t traceHandlerCount = 0;
+
+void sim_trace_init() __attribute__ ((C, spontaneous)) {
+  char* path;
+  sim_trace_close();
+  path = getenv("TOSSIM_TRACE");
+  if (path != NULL && path[0] != 0) {
+    sim_trace_record(path);
+  }
+  path = getenv("TOSSIM_REPLAY");
+  if (path != NULL && path[0] != 0) {
+    sim_trace_replay(path);
+  }
+}
+
+void sim_trace_close() __attribute__ ((C, spontaneous)) {
+  if (traceOut != NULL) {
+    fclose(traceOut);
+    traceOut = NULL;
+  }
+  if (traceIn != NULL) {
+    fclose(traceIn);
+    traceIn = NULL;
+  }
+  sim_trace_enabled = 0;
+  traceStarted = FALSE;
+  traceDiverged = FALSE;
+  traceEvents = 0;
+  traceHandlerCount = 0;
+  memset(traceHandlers, 0, sizeof(traceHandlers));
+}
+
+bool sim_trace_record(const char* path) __attribute__ ((C, spontaneous)) {
+  traceOut = fopen(path, "wb");
+  if (traceOut == NULL) {
+    fprintf(stderr, "TOSSIM: could not open trace file %s for writing.\n", path);
+    return FALSE;
+  }
+  sim_trace_enabled = 1;
+  return TRUE;
+}
+
+bool sim_trace_replay(const char* path) __attribute__ ((C, spontaneous)) {
+  traceIn = fopen(path, "rb");
+  if (traceIn == NULL) {
+    fprintf(stderr, "TOSSIM: could not open trace file %s for replay.\n", path);
+    return FALSE;
+  }
+  sim_trace_enabled = 1;
+  return TRUE;
+}
+
+/*
+ * Called before the first event runs. Recording saves the RNG seed;
+ * replay restores the recorded one so the run follows the trace. Either
+ * way RandomUniform() reseeds from it, so its draws repeat as well.
+ */
+void sim_trace_start(int* seed) __attribute__ ((C, spontaneous)) {
+  sim_trace_header_t header;
+  if (traceStarted) {
+    return;
+  }
+  traceStarted = TRUE;
+  if (traceIn != NULL) {
+    if (fread(&header, sizeof(header), 1, traceIn) != 1 ||
+        memcmp(header.magic, SIM_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SIM_TRACE_VERSION) {
+      fprintf(stderr, "TOSSIM: replay file is not a version %i event trace.\n", SIM_TRACE_VERSION);
+      fclose(traceIn);
+      traceIn = NULL;
+    }
+    else {
+      *seed = header.seed;
+    }
+  }
+  if (traceOut != NULL) {
+    memcpy(header.magic, SIM_TRACE_MAGIC, sizeof(header.magic));
+    header.version = SIM_TRACE_VERSION;
+    header.seed = *seed;
+    fwrite(&header, sizeof(header), 1, traceOut);
+  }
+  sim_trace_enabled = (traceIn != NULL || traceOut != NULL);
+  if (sim_trace_enabled) {
+    RandomReseed();
+  }
+}
+
+static uint32_t sim_trace_handler_id(void (*handle)(sim_event_t* e)) {
+  uint32_t i = (uint32_t)(((uintptr_t)handle >> 4) % SIM_TRACE_MAX_HANDLERS);
+  uint32_t probes;
+  if (handle == NULL) {
+    return 0;
+  }
+  for (probes = 0; probes < SIM_TRACE_MAX_HANDLERS; probes++) {
+    if (traceHandlers[i].handle == handle) {
+      return traceHandlers[i].id;
+    }
+    if (traceHandlers[i].handle == NULL) {
+      traceHandlers[i].handle = handle;
+      traceHandlers[i].id = ++traceHandlerCount;
+      return traceHandlers[i].id;
+    }
+    i = (i + 1) % SIM_TRACE_MAX_HANDLERS;
+  }
+  return (uint32_t)-1;
+}
+
+void sim_trace_event(sim_event_t* event, uint32_t draws, bool ran) __attribute__ ((C, spontaneous)) {
+  sim_trace_record_t record;
+  record.time = event->time;
+  record.mote = (uint32_t)event->mote;
+  record.handler = sim_trace_handler_id(event->handle);
+  record.draws = draws;
+  record.flags = ran ? SIM_TRACE_RAN : 0;
+
+  if (traceOut != NULL) {
+    fwrite(&record, sizeof(record), 1, traceOut);
+  }
+  if (traceIn != NULL && !traceDiverged) {
+    sim_trace_record_t expected;
+    if (fread(&expected, sizeof(expected), 1, traceIn) != 1) {
+      fprintf(stderr, "TOSSIM: replay trace ended after %llu events.\n", (unsigned long long)traceEvents);
+      traceDiverged = TRUE;
+    }
+    else if (memcmp(&expected, &record, sizeof(record)) != 0) {
+      fprintf(stderr, "TOSSIM: run diverges from replay trace at event %llu:\n", (unsigned long long)traceEvents);
+      fprintf(stderr, "  trace: time %lld mote %u handler %u draws %u flags %u\n",
+              (long long)expected.time, expected.mote, expected.handler, expected.draws, expected.flags);
+      fprintf(stderr, "  run:   time %lld mote %u handler %u draws %u flags %u\n",
+              (long long)record.time, record.mote, record.handler, record.draws, record.flags);
+      traceDiverged = TRUE;
+    }
+  }
+  traceEvents++;
+}
+
+uint64_t sim_trace_event_count() __attribute__ ((C, spontaneous)) {
+  return traceEvents;
+}
@@ -0,0 +1,55 @@
+#ifndef SIM_TRACE_H_INCLUDED
+#define SIM_TRACE_H_INCLUDED
+
+#include <stdint.h>
+#include <sim_event_queue.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compact binary trace of the events TOSSIM executes, used to check
+ * that a change to the simulator core does not change simulation
+ * results. Setting TOSSIM_TRACE=<file> records one sim_trace_record_t
+ * per event; setting TOSSIM_REPLAY=<file> reseeds the RNG from a
+ * recorded trace and reports the first event that does not match it.
+ * tracediff.py compares two recorded traces.
+ */
+
+#define SIM_TRACE_MAGIC "TOSTRACE"
+
+enum {
+  SIM_TRACE_VERSION = 2,
+  SIM_TRACE_MAX_HANDLERS = 512,
+  SIM_TRACE_RAN = 0x1,   // event handler was run (mote on or forced)
+};
+
+typedef struct sim_trace_header {
+  char magic[8];
+  uint32_t version;
+  int32_t seed;     // RNG seed when the first event ran
+} sim_trace_header_t;
+
+typedef struct sim_trace_record {
+  int64_t time;
+  uint32_t mote;
+  uint32_t handler; // handlers are numbered in order of first use
+  uint32_t draws;   // sim_random() and RandomUniform() calls made while
+                    // handling the event
+  uint32_t flags;
+} sim_trace_record_t;
+
+void sim_trace_init();
+void sim_trace_close();
+bool sim_trace_record(const char* path);
+bool sim_trace_replay(const char* path);
+void sim_trace_start(int* seed);
+void sim_trace_event(sim_event_t* event, uint32_t draws, bool ran);
+uint64_t sim_trace_event_count();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_TRACE_H_INCLUDED
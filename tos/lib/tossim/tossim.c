@@ -53,6 +53,7 @@
 #include <radio.c>
 #include <packet.c>
 #include <sim_noise.h>
+#include <sim_prr.h>
 
 uint16_t TOS_NODE_ID = 1;
 
@@ -282,6 +283,30 @@ void Tossim::randomSeed(int seed) {
   return sim_random_seed(seed);
 }
 
+void Tossim::setPrrMode(int mode) {
+  sim_prr_init(mode);
+}
+
+void Tossim::prrReport(FILE* file) {
+  sim_prr_report(file);
+}
+
+void Tossim::setNoiseDecorrelationHorizon(unsigned long horizon) {
+  sim_noise_set_decorrelation_horizon(horizon);
+}
+
+unsigned long Tossim::noiseDecorrelationHorizon() {
+  return sim_noise_get_decorrelation_horizon();
+}
+
+unsigned long Tossim::noiseResyncCount(unsigned long nodeID) {
+  return sim_noise_resync_count(nodeID);
+}
+
+long long int Tossim::noiseSkippedSamples() {
+  return sim_noise_skipped_samples();
+}
+
 bool Tossim::runNextEvent() {
   return sim_run_next_event();
 }
@@ -131,6 +131,12 @@ class Tossim {
   void addChannel(char* channel, FILE* file);
   bool removeChannel(char* channel, FILE* file);
   void randomSeed(int seed);
+  void setPrrMode(int mode);
+  void prrReport(FILE* file);
+  void setNoiseDecorrelationHorizon(unsigned long horizon);
+  unsigned long noiseDecorrelationHorizon();
+  unsigned long noiseResyncCount(unsigned long nodeID);
+  long long int noiseSkippedSamples();
   
   bool runNextEvent();
 
@@ -0,0 +1,61 @@
+#!/usr/bin/env python
+#
+# Compare two TOSSIM event traces (recorded with TOSSIM_TRACE=<file>,
+# see sim_trace.h) and report the first event at which they differ.
+#
+# usage: tracediff.py trace-a trace-b
+
+import struct
+import sys
+
+MAGIC = b"TOSTRACE"
+VERSION = 2
+HEADER = struct.Struct("=8sIi")
+RECORD = struct.Struct("=qIIII")
+FIELDS = ("time", "mote", "handler", "draws", "flags")
+
+def open_trace(path):
+  f = open(path, "rb")
+  header = f.read(HEADER.size)
+  if len(header) != HEADER.size:
+    sys.exit("%s: empty trace" % path)
+  magic, version, seed = HEADER.unpack(header)
+  if magic != MAGIC or version != VERSION:
+    sys.exit("%s: not a version %d TOSSIM event trace" % (path, VERSION))
+  return f, seed
+
+def records(f):
+  while True:
+    data = f.read(RECORD.size)
+    if len(data) < RECORD.size:
+      return
+    yield RECORD.unpack(data)
+
+def show(name, record):
+  return "%s: " % name + " ".join("%s %d" % (k, v) for k, v in zip(FIELDS, record))
+
+def main(argv):
+  if len(argv) != 3:
+    sys.exit("usage: %s trace-a trace-b" % argv[0])
+  a, seed_a = open_trace(argv[1])
+  b, seed_b = open_trace(argv[2])
+  if seed_a != seed_b:
+    print("seeds differ: %d vs %d" % (seed_a, seed_b))
+  ra = records(a)
+  rb = records(b)
+  n = 0
+  while True:
+    x = next(ra, None)
+    y = next(rb, None)
+    if x is None and y is None:
+      print("traces are identical (%d events)" % n)
+      return 0
+    if x != y:
+      print("first divergence at event %d" % n)
+      print("  " + (show("a", x) if x is not None else "a: end of trace"))
+      print("  " + (show("b", y) if y is not None else "b: end of trace"))
+      return 1
+    n += 1
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))